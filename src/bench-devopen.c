@@ -0,0 +1,314 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+/*
+ * Measures how long it takes to locate the controller among many USB
+ * devices: a full sysfs scan versus the cached device path. The devices
+ * are emulated in a temporary sysfs tree, see BLUSB_SYSFS_ROOT.
+ *
+ * With -real the connected controller is opened instead: libusb
+ * enumerating the bus with libusb_get_device_list() versus the cached
+ * sysfs path wrapped with libusb_wrap_sys_device() and device discovery
+ * turned off. Discovery can't be turned back on, so the enumeration runs
+ * first.
+ *
+ * Usage: bench-devopen [-n devices] [-r runs]
+ *        bench-devopen -real [-r runs]
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <libusb.h>
+
+#include "blusb.h"
+#include "bl_devcache.h"
+
+#define BENCH_DEFAULT_DEVICES 128
+#define BENCH_DEFAULT_RUNS 1000
+
+#define BENCH_VENDOR 0x04b3
+#define BENCH_PRODUCT 0x301c
+
+static double
+bench_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+bench_write(char *root, char *dev, char *attr, char *fmt, int value) {
+    char fname[512];
+    snprintf(fname, sizeof(fname), "%s/bus/usb/devices/%s/%s", root, dev, attr);
+    FILE *f = fopen(fname, "w");
+    if (f != NULL) {
+        fprintf(f, fmt, value);
+        fclose(f);
+    }
+}
+
+/*
+ * Add a device to the emulated sysfs and its node to the emulated /dev
+ */
+static void
+bench_add_device(char *root, char *name, int bus, int devnum, int vendor, int product) {
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/bus/usb/devices/%s", root, name);
+    mkdir(path, 0755);
+    bench_write(root, name, "idVendor", "%04x\n", vendor);
+    bench_write(root, name, "idProduct", "%04x\n", product);
+    bench_write(root, name, "busnum", "%d\n", bus);
+    bench_write(root, name, "devnum", "%d\n", devnum);
+
+    snprintf(path, sizeof(path), "%s/dev/bus/usb/%03d", root, bus);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/dev/bus/usb/%03d/%03d", root, bus, devnum);
+    close(open(path, O_WRONLY | O_CREAT, 0644));
+}
+
+/*
+ * Open and close the controller the way libusb finds it, enumerating the bus
+ */
+static int
+bench_open_libusb() {
+    libusb_device **list;
+    libusb_device_handle *handle = NULL;
+
+    libusb_init(NULL);
+    ssize_t n = libusb_get_device_list(NULL, &list);
+    for (ssize_t i=0; i<n && handle == NULL; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) == 0 &&
+            desc.idVendor == BENCH_VENDOR && desc.idProduct == BENCH_PRODUCT &&
+            libusb_open(list[i], &handle) != 0) {
+            handle = NULL;
+        }
+    }
+    if (n >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    int ok = handle != NULL;
+    if (ok) {
+        libusb_close(handle);
+    }
+    libusb_exit(NULL);
+
+    return ok;
+}
+
+#if defined(__linux__) && defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+#if LIBUSB_API_VERSION < 0x01000108
+#define LIBUSB_OPTION_NO_DEVICE_DISCOVERY LIBUSB_OPTION_WEAK_AUTHORITY
+#endif
+
+/*
+ * Open and close the controller through the cached sysfs path, the way
+ * blusb does, discovery must be turned off already
+ */
+static int
+bench_open_sysfs() {
+    bl_devpath_t path;
+    libusb_device_handle *handle = NULL;
+
+    int cached = bl_devcache_lookup(BENCH_VENDOR, BENCH_PRODUCT, &path);
+    if (!cached && !bl_devcache_scan(BENCH_VENDOR, BENCH_PRODUCT, &path)) {
+        return FALSE;
+    }
+    if (!cached) {
+        bl_devcache_store(&path);
+    }
+    int fd = bl_devcache_open(&path);
+    if (fd < 0) {
+        return FALSE;
+    }
+    libusb_init(NULL);
+    int ok = libusb_wrap_sys_device(NULL, (intptr_t) fd, &handle) == 0;
+    if (ok) {
+        libusb_close(handle);
+    }
+    libusb_exit(NULL);
+    close(fd);
+
+    return ok;
+}
+
+static int
+bench_real(int runs) {
+    int ok = TRUE;
+
+    double start = bench_now_us();
+    for (int i=0; i<runs && ok; i++) {
+        ok = bench_open_libusb();
+    }
+    double libusb_us = (bench_now_us() - start) / runs;
+    if (!ok) {
+        fprintf(stderr, "Could not open the controller with libusb\n");
+        return 1;
+    }
+
+    libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+    // the first run fills the cache
+    ok = bench_open_sysfs();
+    start = bench_now_us();
+    for (int i=0; i<runs && ok; i++) {
+        ok = bench_open_sysfs();
+    }
+    double sysfs_us = (bench_now_us() - start) / runs;
+    if (!ok) {
+        fprintf(stderr, "Could not open the controller through sysfs\n");
+        return 1;
+    }
+
+    printf("%d runs: libusb_get_device_list %.1f us, cached sysfs path %.1f us per open\n",
+           runs, libusb_us, sysfs_us);
+
+    return 0;
+}
+#else
+static int
+bench_real(int runs) {
+    fprintf(stderr, "Opening through sysfs needs Linux and libusb 1.0.23 or later\n");
+    return 1;
+}
+#endif
+
+static int
+bench_rm(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+int
+main(int argc, char **argv) {
+    int ndevices = BENCH_DEFAULT_DEVICES;
+    int runs = BENCH_DEFAULT_RUNS;
+    int real = FALSE;
+
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-real") == 0) {
+            real = TRUE;
+        } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+            ndevices = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            ndevices = 0;
+        }
+    }
+    if (ndevices < 1 || runs < 1) {
+        fprintf(stderr, "Usage: %s [-n devices] [-r runs]\n       %s -real [-r runs]\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (real) {
+        return bench_real(runs);
+    }
+
+    char root[] = "/tmp/bench-devopen-XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/bus", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/bus/usb", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/bus/usb/devices", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/dev", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/dev/bus", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/dev/bus/usb", root);
+    mkdir(path, 0755);
+
+    /*
+     * Hubs with 8 ports on 4 buses, plus a root hub and an interface per
+     * bus like the real sysfs. The controller is the last device.
+     */
+    for (int i=0; i<ndevices-1; i++) {
+        int bus = 1 + i % 4;
+        char name[32];
+        snprintf(name, sizeof(name), "%d-%d.%d", bus, 1 + (i / 4) / 8, 1 + (i / 4) % 8);
+        bench_add_device(root, name, bus, 2 + i / 4, 0x1d6b, 0x0002 + i);
+    }
+    for (int bus=1; bus<=4; bus++) {
+        char name[32];
+        snprintf(name, sizeof(name), "usb%d", bus);
+        bench_add_device(root, name, bus, 1, 0x1d6b, 0x0002);
+        snprintf(name, sizeof(name), "%d-0:1.0", bus);
+        bench_add_device(root, name, bus, 1, 0x1d6b, 0x0002);
+    }
+    bench_add_device(root, "3-9.4", 3, 120, BENCH_VENDOR, BENCH_PRODUCT);
+
+    char cache[512];
+    snprintf(cache, sizeof(cache), "%s/device-cache", root);
+    snprintf(path, sizeof(path), "%s/dev", root);
+    setenv(BL_DEVCACHE_SYSFS_ENV, root, 1);
+    setenv(BL_DEVCACHE_DEV_ENV, path, 1);
+    setenv(BL_DEVCACHE_FILE_ENV, cache, 1);
+
+    bl_devpath_t devpath;
+    int ok = TRUE;
+
+    double start = bench_now_us();
+    for (int i=0; i<runs && ok; i++) {
+        ok = bl_devcache_scan(BENCH_VENDOR, BENCH_PRODUCT, &devpath);
+        close(bl_devcache_open(&devpath));
+    }
+    double scan_us = (bench_now_us() - start) / runs;
+
+    bl_devcache_store(&devpath);
+    start = bench_now_us();
+    for (int i=0; i<runs && ok; i++) {
+        ok = bl_devcache_lookup(BENCH_VENDOR, BENCH_PRODUCT, &devpath);
+        close(bl_devcache_open(&devpath));
+    }
+    double cached_us = (bench_now_us() - start) / runs;
+
+    nftw(root, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+
+    if (!ok) {
+        fprintf(stderr, "The emulated controller was not found\n");
+        return 1;
+    }
+    printf("%d devices, %d runs: scan %.1f us, cached path %.1f us per open (%s)\n",
+           ndevices + 8, runs, scan_us, cached_us, devpath.name);
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+/*
+ * Throughput of the layout kernels in layouts per second, for every
+ * implementation the cpu supports. The layouts are generated, mostly
+ * plain keys with some modifiers and layer keys.
+ *
+ * Usage: bench-kernels [-n layouts] [-r runs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blusb.h"
+#include "layout.h"
+#include "bl_kernel.h"
+
+#define BENCH_DEFAULT_LAYOUTS 10000
+#define BENCH_DEFAULT_RUNS 20
+
+static double
+bench_now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t
+bench_code(unsigned int *seed, int nlayers) {
+    int r = rand_r(seed) % 100;
+    if (r < 80) {
+        return KB_A + rand_r(seed) % (KP_HEXADECIMAL - KB_A);
+    } else if (r < 90) {
+        return KB_NONE;
+    } else if (r < 97) {
+        return (TYPE_MOD << 8) | (1 << (rand_r(seed) % 8));
+    }
+    return ((r % 2 ? TYPE_TOGGLE : TYPE_MOMENTARY) << 8) | (rand_r(seed) % nlayers);
+}
+
+static void
+bench_layouts(bl_layout_t *layouts, int n) {
+    unsigned int seed = 1;
+    for (int i=0; i<n; i++) {
+        layouts[i].nlayers = 1 + rand_r(&seed) % NUMLAYERS_MAX;
+        for (int k=0; k<layouts[i].nlayers * NUMKEYS; k++) {
+            (&layouts[i].matrix[0][0][0])[k] = bench_code(&seed, layouts[i].nlayers);
+        }
+    }
+}
+
+static void
+bench_report(char *kernel, double elapsed, int n, int runs) {
+    printf("  %-10s %12.0f layouts/s\n", kernel, (double) n * runs / elapsed);
+}
+
+int
+main(int argc, char **argv) {
+    int n = BENCH_DEFAULT_LAYOUTS;
+    int runs = BENCH_DEFAULT_RUNS;
+
+    for (int i=1; i<argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+            n = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-r") == 0) {
+            runs = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-n layouts] [-r runs]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n < 1 || runs < 1) {
+        fprintf(stderr, "Usage: %s [-n layouts] [-r runs]\n", argv[0]);
+        return 1;
+    }
+
+    bl_layout_t *layouts = (bl_layout_t *) malloc(n * sizeof(bl_layout_t));
+    bl_layout_t *copies = (bl_layout_t *) malloc(n * sizeof(bl_layout_t));
+    uint64_t *hashes = (uint64_t *) malloc(n * sizeof(uint64_t));
+    bl_kernel_hist_t *hist = (bl_kernel_hist_t *) malloc(sizeof(bl_kernel_hist_t));
+    if (layouts == NULL || copies == NULL || hashes == NULL || hist == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    bench_layouts(layouts, n);
+    memcpy(copies, layouts, n * sizeof(bl_layout_t));
+
+    int mismatch = FALSE;
+    int counted = -1;
+    printf("%d layouts, %d runs\n", n, runs);
+    for (int impl=BL_KERNEL_SCALAR; impl<=BL_KERNEL_AVX2; impl++) {
+        if (!bl_kernel_select(impl)) {
+            printf("%s: not supported\n", bl_kernel_name(impl));
+            continue;
+        }
+        printf("%s:\n", bl_kernel_name(impl));
+
+        double start = bench_now_s();
+        for (int r=0; r<runs; r++) {
+            for (int i=0; i<n; i++) {
+                uint64_t hash = bl_kernel_hash(&layouts[i].matrix[0][0][0], layouts[i].nlayers * NUMKEYS);
+                if (impl == BL_KERNEL_SCALAR) {
+                    hashes[i] = hash;
+                } else if (hash != hashes[i]) {
+                    mismatch = TRUE;
+                }
+            }
+        }
+        bench_report("hash", bench_now_s() - start, n, runs);
+
+        // equal layouts, all codes are compared
+        int nequal = 0;
+        start = bench_now_s();
+        for (int r=0; r<runs; r++) {
+            for (int i=0; i<n; i++) {
+                nequal += bl_layout_equal(&layouts[i], &copies[i]);
+            }
+        }
+        bench_report("equal", bench_now_s() - start, n, runs);
+        mismatch |= nequal != n * runs;
+
+        int count = 0;
+        start = bench_now_s();
+        for (int r=0; r<runs; r++) {
+            for (int i=0; i<n; i++) {
+                count += bl_kernel_count_range(&layouts[i].matrix[0][0][0], layouts[i].nlayers * NUMKEYS,
+                                               KB_A, KP_HEXADECIMAL);
+            }
+        }
+        bench_report("range", bench_now_s() - start, n, runs);
+        mismatch |= counted >= 0 && count != counted;
+        counted = count;
+
+        start = bench_now_s();
+        for (int r=0; r<runs; r++) {
+            for (int i=0; i<n; i++) {
+                bl_kernel_histogram(&layouts[i].matrix[0][0][0], layouts[i].nlayers * NUMKEYS, hist);
+            }
+        }
+        bench_report("histogram", bench_now_s() - start, n, runs);
+    }
+
+    free(layouts);
+    free(copies);
+    free(hashes);
+    free(hist);
+    if (mismatch) {
+        fprintf(stderr, "The implementations do not agree\n");
+        return 1;
+    }
+
+    return 0;
+}
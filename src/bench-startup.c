@@ -0,0 +1,132 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+/*
+ * Measures the startup latency of a command, e.g. blusb -h versus
+ * blusb-ui -h, by running it a number of times with its output discarded.
+ *
+ * Usage: bench-startup [-n runs] command [args...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_RUNS 200
+
+static double
+bench_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+bench_cmp(const void *a, const void *b) {
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/*
+ * Run the command once, returns the wall clock time in microseconds or -1
+ */
+static double
+bench_run(char **cmd) {
+    double start = bench_now_us();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execvp(cmd[0], cmd);
+        _exit(127);
+    } else if (pid < 0) {
+        return -1;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        return -1;
+    }
+
+    return bench_now_us() - start;
+}
+
+int
+main(int argc, char **argv) {
+    int runs = BENCH_DEFAULT_RUNS;
+    int argi = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        runs = atoi(argv[2]);
+        argi = 3;
+    }
+    if (argi >= argc || runs <= 0) {
+        fprintf(stderr, "Usage: %s [-n runs] command [args...]\n", argv[0]);
+        return 1;
+    }
+
+    double *us = malloc(runs * sizeof(double));
+    if (us == NULL) {
+        return 1;
+    }
+
+    /* warm up the page cache */
+    if (bench_run(&argv[argi]) < 0) {
+        fprintf(stderr, "Could not run %s\n", argv[argi]);
+        free(us);
+        return 1;
+    }
+
+    double total = 0;
+    for (int i=0; i<runs; i++) {
+        us[i] = bench_run(&argv[argi]);
+        if (us[i] < 0) {
+            fprintf(stderr, "%s failed\n", argv[argi]);
+            free(us);
+            return 1;
+        }
+        total += us[i];
+    }
+    qsort(us, runs, sizeof(double), bench_cmp);
+
+    printf("%s: %d runs, min %.0f us, median %.0f us, mean %.0f us, max %.0f us\n",
+           argv[argi], runs, us[0], us[runs / 2], total / runs, us[runs - 1]);
+    free(us);
+
+    return 0;
+}
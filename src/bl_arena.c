@@ -0,0 +1,132 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "blusb.h"
+#include "bl_arena.h"
+
+/*
+ * All allocations are rounded up to this alignment
+ */
+#define BL_ARENA_ALIGN _Alignof(max_align_t)
+
+static size_t
+bl_arena_align(size_t size) {
+    return (size + BL_ARENA_ALIGN - 1) & ~(BL_ARENA_ALIGN - 1);
+}
+
+bl_arena_t *
+bl_arena_create(size_t block_size) {
+    bl_arena_t *arena = (bl_arena_t *) malloc(sizeof(bl_arena_t) + block_size);
+    if (arena == NULL) {
+        errmsg_and_abort("bl_arena_create: out of memory");
+    }
+    // the first block is allocated together with the arena
+    bl_arena_init(arena, (char *) arena + bl_arena_align(sizeof(bl_arena_t)),
+                  block_size - (bl_arena_align(sizeof(bl_arena_t)) - sizeof(bl_arena_t)));
+    arena->is_allocated = TRUE;
+
+    return arena;
+}
+
+void
+bl_arena_init(bl_arena_t *arena, void *buf, size_t size) {
+    arena->first.next = NULL;
+    arena->first.size = size;
+    arena->first.used = 0;
+    arena->first.data = (char *) buf;
+    arena->head = &arena->first;
+    arena->block_size = MAX(size, 4096);
+    arena->is_allocated = FALSE;
+
+    /*
+     * Make sure allocations from a caller supplied buffer are aligned
+     */
+    size_t misalign = (size_t) buf % BL_ARENA_ALIGN;
+    if (misalign != 0) {
+        arena->first.used = MIN(size, BL_ARENA_ALIGN - misalign);
+    }
+}
+
+void *
+bl_arena_alloc(bl_arena_t *arena, size_t size) {
+    size = bl_arena_align(size);
+    bl_arena_block_t *block = arena->head;
+    if (block->size - block->used < size) {
+        /*
+         * Add a new block, large enough for this allocation. The block header
+         * and its data are allocated in one go.
+         */
+        size_t block_size = MAX(arena->block_size, size);
+        size_t header_size = bl_arena_align(sizeof(bl_arena_block_t));
+        block = (bl_arena_block_t *) malloc(header_size + block_size);
+        if (block == NULL) {
+            errmsg_and_abort("bl_arena_alloc: out of memory");
+        }
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        block->data = (char *) block + header_size;
+        arena->head = block;
+    }
+    void *p = block->data + block->used;
+    block->used += size;
+
+    return p;
+}
+
+char *
+bl_arena_strdup(bl_arena_t *arena, char *s) {
+    size_t len = strlen(s);
+    char *copy = (char *) bl_arena_alloc(arena, len + 1);
+    memcpy(copy, s, len + 1);
+
+    return copy;
+}
+
+void
+bl_arena_reset(bl_arena_t *arena) {
+    while (arena->head != &arena->first) {
+        bl_arena_block_t *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    size_t misalign = (size_t) arena->first.data % BL_ARENA_ALIGN;
+    arena->first.used = misalign == 0 ? 0 : MIN(arena->first.size, BL_ARENA_ALIGN - misalign);
+}
+
+void
+bl_arena_destroy(bl_arena_t *arena) {
+    bl_arena_reset(arena);
+    if (arena->is_allocated) {
+        free(arena);
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_ARENA_H__
+#define __BL_ARENA_H__ 1
+
+#include <stddef.h>
+
+/*
+ * A simple arena (region) allocator. Memory is handed out from large
+ * blocks and is never freed individually, all of it is released at once
+ * with bl_arena_reset() or bl_arena_destroy().
+ *
+ * The first block can be a buffer supplied by the caller, e.g. on the
+ * stack, so short lived dialogs don't touch the heap at all unless they
+ * need more than the buffer holds.
+ */
+
+typedef struct bl_arena_block_t {
+    struct bl_arena_block_t *next;
+    size_t size;
+    size_t used;
+    char *data;
+} bl_arena_block_t;
+
+typedef struct bl_arena_t {
+    // the block currently allocated from, older blocks follow via next
+    bl_arena_block_t *head;
+    // the first block, kept by bl_arena_reset()
+    bl_arena_block_t first;
+    // size of the blocks that are added when the arena is full
+    size_t block_size;
+    // TRUE if the arena itself was allocated by bl_arena_create()
+    int is_allocated;
+} bl_arena_t;
+
+/**
+ * Create an arena on the heap.
+ *
+ * @param block_size Size of the blocks allocated from the heap.
+ *
+ * @return the arena, must be destroyed with bl_arena_destroy().
+ */
+bl_arena_t *bl_arena_create(size_t block_size);
+
+/**
+ * Initialise an arena that uses buf as its first block. Only when buf is
+ * full blocks of size bytes are allocated on the heap.
+ *
+ * @param arena The arena to initialise
+ * @param buf Buffer for the first block, must outlive the arena.
+ * @param size Size of buf
+ */
+void bl_arena_init(bl_arena_t *arena, void *buf, size_t size);
+
+/**
+ * Allocate size bytes from the arena, suitably aligned for any type.
+ * Aborts if out of memory.
+ */
+void *bl_arena_alloc(bl_arena_t *arena, size_t size);
+
+/**
+ * Copy the string s into the arena.
+ */
+char *bl_arena_strdup(bl_arena_t *arena, char *s);
+
+/**
+ * Release everything that was allocated from the arena, but keep the
+ * first block for reuse. Must also be called for arenas initialised with
+ * bl_arena_init() when they are no longer used.
+ */
+void bl_arena_reset(bl_arena_t *arena);
+
+/**
+ * Release the arena and everything that was allocated from it.
+ */
+void bl_arena_destroy(bl_arena_t *arena);
+
+#endif /* __BL_ARENA_H__ */
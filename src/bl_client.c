@@ -0,0 +1,267 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "blusb.h"
+#include "bl_proto.h"
+#include "bl_client.h"
+
+bl_client_t *
+bl_client_connect(char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        bl_err(FALSE, "Socket path too long: %s\n", path);
+        return NULL;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        bl_err(FALSE, "Could not create socket: %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        bl_err(FALSE, "Could not connect to blusbd at %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    bl_client_t *client = (bl_client_t *) malloc(sizeof(bl_client_t));
+    int out_fd = dup(fd);
+    if (client == NULL || out_fd < 0) {
+        free(client);
+        close(fd);
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        return NULL;
+    }
+    client->in = fdopen(fd, "r");
+    client->out = fdopen(out_fd, "w");
+    if (client->in == NULL || client->out == NULL) {
+        client->in != NULL ? fclose(client->in) : close(fd);
+        client->out != NULL ? fclose(client->out) : close(out_fd);
+        free(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+void
+bl_client_close(bl_client_t *client) {
+    fclose(client->in);
+    fclose(client->out);
+    free(client);
+}
+
+/*
+ * Send the request, which is already written to client->out, and read the
+ * status line of the reply. The arguments after OK are stored in args.
+ *
+ * Returns TRUE if the daemon replied OK.
+ */
+static int
+bl_client_reply(bl_client_t *client, char *args, int argslen) {
+    char line[256];
+
+    fflush(client->out);
+    if (fgets(line, sizeof(line), client->in) == NULL) {
+        bl_err(FALSE, "blusbd closed the connection\n");
+        return FALSE;
+    }
+    line[strcspn(line, "\r\n")] = 0;
+
+    if (strncmp(line, "OK", 2) == 0) {
+        if (args != NULL) {
+            char *reply = line[2] == ' ' ? line + 3 : "";
+            size_t len = strlen(reply);
+            if (len >= (size_t) argslen) {
+                bl_err(FALSE, "blusbd: reply too long: %s\n", line);
+                return FALSE;
+            }
+            memcpy(args, reply, len + 1);
+        }
+        return TRUE;
+    } else if (strncmp(line, "ERR ", 4) == 0) {
+        bl_err(FALSE, "blusbd: %s\n", line + 4);
+    } else {
+        bl_err(FALSE, "blusbd: unexpected reply: %s\n", line);
+    }
+
+    return FALSE;
+}
+
+/*
+ * Read a data line of the reply
+ */
+static int
+bl_client_data_line(bl_client_t *client, char *line, int len) {
+    if (fgets(line, len, client->in) == NULL) {
+        bl_err(FALSE, "blusbd closed the connection\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+int
+bl_client_read_layout(bl_client_t *client, bl_layout_t *layout) {
+    char args[32];
+    char line[BL_PROTO_REQUEST_MAX];
+
+    fprintf(client->out, "READ-LAYOUT\n");
+    if (!bl_client_reply(client, args, sizeof(args))) {
+        return FALSE;
+    }
+
+    memset(layout, 0, sizeof(bl_layout_t));
+    layout->nlayers = atoi(args);
+    if (layout->nlayers < NUMLAYERS_MIN || layout->nlayers > NUMLAYERS_MAX) {
+        bl_err(FALSE, "blusbd: invalid number of layers: %s\n", args);
+        return FALSE;
+    }
+    for (int i=0; i<layout->nlayers; i++) {
+        if (!bl_client_data_line(client, line, sizeof(line))) {
+            return FALSE;
+        }
+        if (!bl_proto_parse_layer(layout, i, line)) {
+            bl_err(FALSE, "blusbd: invalid data for layer %d\n", i);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+int
+bl_client_write_layout(bl_client_t *client, bl_layout_t *layout) {
+    fprintf(client->out, "WRITE-LAYOUT %d\n", layout->nlayers);
+    bl_proto_write_layout(client->out, layout);
+
+    return bl_client_reply(client, NULL, 0);
+}
+
+int
+bl_client_read_macros(bl_client_t *client, bl_macro_t *macros) {
+    char args[32];
+    char line[256];
+
+    fprintf(client->out, "READ-MACROS\n");
+    if (!bl_client_reply(client, args, sizeof(args))) {
+        return FALSE;
+    }
+
+    memset(macros, 0, sizeof(bl_macro_t));
+    macros->nmacros = atoi(args);
+    if (macros->nmacros < 0 || macros->nmacros > NUM_MACROKEYS) {
+        bl_err(FALSE, "blusbd: invalid number of macros: %s\n", args);
+        return FALSE;
+    }
+    for (int i=0; i<macros->nmacros; i++) {
+        if (!bl_client_data_line(client, line, sizeof(line))) {
+            return FALSE;
+        }
+        if (!bl_proto_parse_macro(macros, i, line)) {
+            bl_err(FALSE, "blusbd: invalid data for macro %d\n", i);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+int
+bl_client_write_macros(bl_client_t *client, bl_macro_t *macros) {
+    fprintf(client->out, "WRITE-MACROS %d\n", NUM_MACROKEYS);
+    bl_proto_write_macros(client->out, macros);
+
+    return bl_client_reply(client, NULL, 0);
+}
+
+int
+bl_client_read_pwm(bl_client_t *client, uint8_t *pwm_usb, uint8_t *pwm_bt) {
+    char args[32];
+    int usb, bt;
+
+    fprintf(client->out, "READ-PWM\n");
+    if (!bl_client_reply(client, args, sizeof(args)) || sscanf(args, "%d %d", &usb, &bt) != 2) {
+        return FALSE;
+    }
+    *pwm_usb = usb;
+    *pwm_bt = bt;
+
+    return TRUE;
+}
+
+int
+bl_client_write_pwm(bl_client_t *client, uint8_t pwm_usb, uint8_t pwm_bt) {
+    fprintf(client->out, "WRITE-PWM %d %d\n", pwm_usb, pwm_bt);
+
+    return bl_client_reply(client, NULL, 0);
+}
+
+int
+bl_client_read_debounce(bl_client_t *client, uint8_t *debounce) {
+    char args[32];
+    int value;
+
+    fprintf(client->out, "READ-DEBOUNCE\n");
+    if (!bl_client_reply(client, args, sizeof(args)) || sscanf(args, "%d", &value) != 1) {
+        return FALSE;
+    }
+    *debounce = value;
+
+    return TRUE;
+}
+
+int
+bl_client_write_debounce(bl_client_t *client, uint8_t debounce) {
+    fprintf(client->out, "WRITE-DEBOUNCE %d\n", debounce);
+
+    return bl_client_reply(client, NULL, 0);
+}
+
+int
+bl_client_read_version(bl_client_t *client, int *major, int *minor) {
+    char args[32];
+
+    fprintf(client->out, "READ-VERSION\n");
+
+    return bl_client_reply(client, args, sizeof(args)) && sscanf(args, "%d %d", major, minor) == 2;
+}
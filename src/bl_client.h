@@ -0,0 +1,68 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_CLIENT_H__
+#define __BL_CLIENT_H__ 1
+
+#include <stdio.h>
+
+#include "usb.h"
+
+/*
+ * Connection to blusbd, the calls block until the daemon has answered.
+ * Errors reported by the daemon are passed on to bl_err().
+ */
+typedef struct bl_client_t {
+    FILE *in;
+    FILE *out;
+} bl_client_t;
+
+/**
+ * Connect to the daemon.
+ *
+ * @param path Path of the socket
+ * @return The connection or NULL if the daemon could not be reached
+ */
+bl_client_t *bl_client_connect(char *path);
+void bl_client_close(bl_client_t *client);
+
+/*
+ * Same as the bl_usb_* functions, they return TRUE if successful
+ */
+int bl_client_read_layout(bl_client_t *client, bl_layout_t *layout);
+int bl_client_write_layout(bl_client_t *client, bl_layout_t *layout);
+int bl_client_read_macros(bl_client_t *client, bl_macro_t *macros);
+int bl_client_write_macros(bl_client_t *client, bl_macro_t *macros);
+int bl_client_read_pwm(bl_client_t *client, uint8_t *pwm_usb, uint8_t *pwm_bt);
+int bl_client_write_pwm(bl_client_t *client, uint8_t pwm_usb, uint8_t pwm_bt);
+int bl_client_read_debounce(bl_client_t *client, uint8_t *debounce);
+int bl_client_write_debounce(bl_client_t *client, uint8_t debounce);
+int bl_client_read_version(bl_client_t *client, int *major, int *minor);
+
+#endif /* __BL_CLIENT_H__ */
@@ -0,0 +1,219 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "blusb.h"
+#include "usb.h"
+#include "bl_find.h"
+#include "bl_convert.h"
+
+static char *_bl_convert_names[] = { "text", "binary", "json" };
+static char *_bl_convert_extensions[] = { ".txt", ".blay", ".json" };
+
+typedef struct bl_convert_chunk_t {
+    bl_convert_t *convert;
+    int start;
+    int end;
+} bl_convert_chunk_t;
+
+int
+bl_convert_format(char *name) {
+    for (int i=0; i<3; i++) {
+        if (strcmp(name, _bl_convert_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+char *
+bl_convert_extension(int format) {
+    return _bl_convert_extensions[format];
+}
+
+bl_convert_t *
+bl_convert_create(int format, char *outdir) {
+    bl_convert_t *convert = (bl_convert_t *) calloc(1, sizeof(bl_convert_t));
+    if (convert == NULL) {
+        return NULL;
+    }
+    convert->format = format;
+    convert->outdir = strdup(outdir);
+    atomic_init(&convert->converted, 0);
+    atomic_init(&convert->errors, 0);
+
+    return convert;
+}
+
+void
+bl_convert_destroy(bl_convert_t *convert) {
+    for (int i=0; i<convert->n; i++) {
+        free(convert->inputs[i]);
+        free(convert->outputs[i]);
+    }
+    free(convert->inputs);
+    free(convert->outputs);
+    free(convert->outdir);
+    free(convert);
+}
+
+/*
+ * Add one file, rel is its path relative to the output directory without
+ * the new extension
+ */
+static void
+bl_convert_add_file(bl_convert_t *convert, char *input, char *rel) {
+    if (convert->n == convert->size) {
+        convert->size = MAX(64, 2 * convert->size);
+        convert->inputs = (char **) realloc(convert->inputs, convert->size * sizeof(char *));
+        convert->outputs = (char **) realloc(convert->outputs, convert->size * sizeof(char *));
+        if (convert->inputs == NULL || convert->outputs == NULL) {
+            errmsg_and_abort("bl_convert_add: out of memory");
+        }
+    }
+
+    char *base = strrchr(rel, '/');
+    char *dot = strrchr(base != NULL ? base : rel, '.');
+    int length = dot != NULL && dot != rel && dot[-1] != '/' ? dot - rel : (int) strlen(rel);
+    char *ext = bl_convert_extension(convert->format);
+    char *output = (char *) malloc(length + strlen(ext) + 1);
+    if (output == NULL) {
+        errmsg_and_abort("bl_convert_add: out of memory");
+    }
+    sprintf(output, "%.*s%s", length, rel, ext);
+
+    convert->inputs[convert->n] = strdup(input);
+    convert->outputs[convert->n] = output;
+    convert->n++;
+}
+
+int
+bl_convert_add(bl_convert_t *convert, char *path) {
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        return FALSE;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        char *base = strrchr(path, '/');
+        bl_convert_add_file(convert, path, base != NULL ? base + 1 : path);
+        return TRUE;
+    }
+
+    bl_find_t *find = bl_find_start(path, 0);
+    bl_pool_wait(find->pool);
+    for (int i=0; i<find->n; i++) {
+        char input[PATH_MAX];
+        snprintf(input, sizeof(input), "%s/%s", path, find->paths[i]);
+        bl_convert_add_file(convert, input, find->paths[i]);
+    }
+    bl_find_destroy(find);
+
+    return TRUE;
+}
+
+/*
+ * Create the directories of the output file
+ */
+static void
+bl_convert_mkdirs(char *fname) {
+    char dir[PATH_MAX];
+
+    snprintf(dir, sizeof(dir), "%s", fname);
+    for (char *p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = 0;
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
+
+static void
+bl_convert_chunk(bl_pool_t *pool, int worker, void *arg) {
+    bl_convert_chunk_t *chunk = (bl_convert_chunk_t *) arg;
+    bl_convert_t *convert = chunk->convert;
+    char errmsg[256];
+    char output[PATH_MAX];
+
+    for (int i=chunk->start; i<chunk->end && !bl_pool_is_cancelled(pool); i++) {
+        bl_layout_t *layout = bl_layout_parse_file(convert->inputs[i], errmsg, sizeof(errmsg));
+        if (layout == NULL) {
+            bl_err(FALSE, "%s", errmsg);
+            atomic_fetch_add(&convert->errors, 1);
+            continue;
+        }
+
+        snprintf(output, sizeof(output), "%s/%s", convert->outdir, convert->outputs[i]);
+        bl_convert_mkdirs(output);
+        int ret;
+        switch (convert->format) {
+            case BL_CONVERT_BINARY:
+                ret = bl_layout_save_binary(layout, output);
+                break;
+            case BL_CONVERT_JSON:
+                ret = bl_layout_save_json(layout, output);
+                break;
+            default:
+                ret = bl_layout_save(layout, output);
+                break;
+        }
+        bl_layout_destroy(layout);
+
+        if (ret != 0) {
+            bl_err(FALSE, "Could not write %s: %s\n", output, strerror(errno));
+            atomic_fetch_add(&convert->errors, 1);
+        } else {
+            atomic_fetch_add(&convert->converted, 1);
+        }
+    }
+    free(chunk);
+}
+
+void
+bl_convert_run(bl_convert_t *convert, int nworkers) {
+    bl_pool_t *pool = bl_pool_create(nworkers, convert);
+
+    for (int start=0; start<convert->n; start+=BL_CONVERT_CHUNK) {
+        bl_convert_chunk_t *chunk = (bl_convert_chunk_t *) malloc(sizeof(bl_convert_chunk_t));
+        if (chunk == NULL) {
+            errmsg_and_abort("bl_convert_run: out of memory");
+        }
+        chunk->convert = convert;
+        chunk->start = start;
+        chunk->end = MIN(start + BL_CONVERT_CHUNK, convert->n);
+        bl_pool_submit(pool, -1, bl_convert_chunk, chunk);
+    }
+    bl_pool_wait(pool);
+    bl_pool_destroy(pool);
+}
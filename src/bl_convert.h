@@ -0,0 +1,93 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_CONVERT_H__
+#define __BL_CONVERT_H__ 1
+
+#include <stdatomic.h>
+
+#include "bl_pool.h"
+
+/*
+ * Bulk conversion of layout files between the text, binary and JSON
+ * formats. The files are converted on a thread pool, a worker holds one
+ * layout at a time.
+ */
+#define BL_CONVERT_TEXT     0
+#define BL_CONVERT_BINARY   1
+#define BL_CONVERT_JSON     2
+
+/*
+ * Number of files converted by one task
+ */
+#define BL_CONVERT_CHUNK 16
+
+typedef struct bl_convert_t {
+    int format;
+    char *outdir;
+    // input files and the paths of the output files relative to outdir
+    char **inputs;
+    char **outputs;
+    int n;
+    int size;
+    atomic_int converted;
+    atomic_int errors;
+} bl_convert_t;
+
+/**
+ * @return The BL_CONVERT_* value for a format name (text, binary, json)
+ * or -1
+ */
+int bl_convert_format(char *name);
+
+/**
+ * @return The file name extension of a format, including the dot
+ */
+char *bl_convert_extension(int format);
+
+bl_convert_t *bl_convert_create(int format, char *outdir);
+
+/**
+ * Add a layout file or all files in a directory tree. Files in a directory
+ * keep their path relative to it in the output directory.
+ *
+ * @return FALSE if the path does not exist
+ */
+int bl_convert_add(bl_convert_t *convert, char *path);
+
+/**
+ * Convert all files, errors are reported with bl_err() and counted.
+ *
+ * @param nworkers Number of threads, <= 0 to use one per cpu
+ */
+void bl_convert_run(bl_convert_t *convert, int nworkers);
+
+void bl_convert_destroy(bl_convert_t *convert);
+
+#endif /* __BL_CONVERT_H__ */
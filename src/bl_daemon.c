@@ -0,0 +1,537 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "blusb.h"
+#include "usb.h"
+#include "bl_proto.h"
+#include "bl_snapshot.h"
+#include "bl_daemon.h"
+
+/*
+ * A connected client
+ */
+typedef struct bl_daemon_client_t {
+    int fd;
+    // received data that is not processed yet
+    char in[BL_PROTO_REQUEST_MAX];
+    int in_len;
+    // replies that are not sent yet
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    // BL_CTRL_* parts of the write the client waits for, its next
+    // requests are processed after the write
+    int waiting;
+    // close the connection once the replies are sent
+    int closing;
+} bl_daemon_client_t;
+
+static bl_daemon_client_t *_bl_daemon_clients[BL_DAEMON_CLIENTS_MAX];
+static int _bl_daemon_nclients = 0;
+
+/* state of the controller, reads are answered from the mirror */
+static bl_ctrl_state_t _bl_daemon_mirror;
+/* BL_CTRL_* parts of the mirror that are known */
+static int _bl_daemon_valid = 0;
+
+/* values of the writes in the current batch */
+static bl_ctrl_state_t _bl_daemon_pending;
+/* BL_CTRL_* parts in the current batch */
+static int _bl_daemon_dirty = 0;
+/* time the first write of the batch arrived */
+static double _bl_daemon_batch_ms = 0;
+
+static volatile sig_atomic_t _bl_daemon_running = FALSE;
+
+static double
+bl_daemon_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static void
+bl_daemon_stop(int sig) {
+    _bl_daemon_running = FALSE;
+}
+
+/*
+ * Queue data to be sent to the client
+ */
+static void
+bl_daemon_send(bl_daemon_client_t *client, char *data, size_t len) {
+    if (client->out_len + len > client->out_size) {
+        size_t size = MAX(2 * client->out_size, client->out_len + len);
+        char *out = (char *) realloc(client->out, size);
+        if (out == NULL) {
+            client->closing = TRUE;
+            return;
+        }
+        client->out = out;
+        client->out_size = size;
+    }
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+}
+
+static void
+bl_daemon_reply(bl_daemon_client_t *client, char *fmt, ...) {
+    char line[256];
+    va_list varglist;
+
+    va_start(varglist, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, varglist);
+    va_end(varglist);
+
+    bl_daemon_send(client, line, MIN(len, (int) sizeof(line) - 1));
+}
+
+/*
+ * Reply to a read of the layout or macros, with the data lines
+ */
+static void
+bl_daemon_reply_data(bl_daemon_client_t *client, int what) {
+    char *buf;
+    size_t len;
+    FILE *f = open_memstream(&buf, &len);
+
+    if (f == NULL) {
+        bl_daemon_reply(client, "ERR out of memory\n");
+        return;
+    }
+    if (what == BL_CTRL_LAYOUT) {
+        fprintf(f, "OK %d\n", _bl_daemon_mirror.layout.nlayers);
+        bl_proto_write_layout(f, &_bl_daemon_mirror.layout);
+    } else {
+        fprintf(f, "OK %d\n", NUM_MACROKEYS);
+        bl_proto_write_macros(f, &_bl_daemon_mirror.macros);
+    }
+    fclose(f);
+
+    bl_daemon_send(client, buf, len);
+    free(buf);
+}
+
+/*
+ * Add the write to the current batch, the client is answered when the
+ * batch has been written.
+ */
+static void
+bl_daemon_queue_write(bl_daemon_client_t *client, int what) {
+    if (_bl_daemon_dirty == 0) {
+        _bl_daemon_batch_ms = bl_daemon_now_ms();
+    }
+    _bl_daemon_dirty |= what;
+    client->waiting |= what;
+}
+
+/*
+ * Handle one request, data points to the ndata data lines that follow it.
+ */
+static void
+bl_daemon_request(bl_daemon_client_t *client, char *cmd, int a, int b, int nargs, char **data, int ndata) {
+    if (strcmp(cmd, "READ-LAYOUT") == 0 || strcmp(cmd, "READ-MACROS") == 0) {
+        int what = cmd[5] == 'L' ? BL_CTRL_LAYOUT : BL_CTRL_MACROS;
+        if (_bl_daemon_valid & what) {
+            bl_daemon_reply_data(client, what);
+        } else {
+            bl_daemon_reply(client, "ERR could not read the %s from the controller\n",
+                            bl_snapshot_part_name(what));
+        }
+    } else if (strcmp(cmd, "READ-PWM") == 0) {
+        if (_bl_daemon_valid & BL_CTRL_PWM) {
+            bl_daemon_reply(client, "OK %d %d\n", _bl_daemon_mirror.pwm_usb, _bl_daemon_mirror.pwm_bt);
+        } else {
+            bl_daemon_reply(client, "ERR could not read the pwm values from the controller\n");
+        }
+    } else if (strcmp(cmd, "READ-DEBOUNCE") == 0) {
+        if (_bl_daemon_valid & BL_CTRL_DEBOUNCE) {
+            bl_daemon_reply(client, "OK %d\n", _bl_daemon_mirror.debounce);
+        } else {
+            bl_daemon_reply(client, "ERR could not read the debounce value from the controller\n");
+        }
+    } else if (strcmp(cmd, "READ-VERSION") == 0) {
+        if (_bl_daemon_valid & BL_CTRL_VERSION) {
+            bl_daemon_reply(client, "OK %d %d\n", _bl_daemon_mirror.major, _bl_daemon_mirror.minor);
+        } else {
+            bl_daemon_reply(client, "ERR could not read the version from the controller\n");
+        }
+    } else if (strcmp(cmd, "WRITE-LAYOUT") == 0) {
+        char errmsg[256];
+        bl_layout_t layout;
+        memset(&layout, 0, sizeof(layout));
+        layout.nlayers = ndata;
+        for (int i=0; i<ndata; i++) {
+            if (!bl_proto_parse_layer(&layout, i, data[i])) {
+                bl_daemon_reply(client, "ERR invalid data for layer %d\n", i);
+                return;
+            }
+        }
+        if (!bl_layout_check(&layout, errmsg, sizeof(errmsg))) {
+            bl_daemon_reply(client, "ERR %s\n", errmsg);
+            return;
+        }
+        memcpy(&_bl_daemon_pending.layout, &layout, sizeof(layout));
+        bl_daemon_queue_write(client, BL_CTRL_LAYOUT);
+    } else if (strcmp(cmd, "WRITE-MACROS") == 0) {
+        bl_macro_t macros;
+        memset(&macros, 0, sizeof(macros));
+        macros.nmacros = NUM_MACROKEYS;
+        for (int i=0; i<ndata; i++) {
+            if (!bl_proto_parse_macro(&macros, i, data[i])) {
+                bl_daemon_reply(client, "ERR invalid data for macro %d\n", i);
+                return;
+            }
+        }
+        memcpy(&_bl_daemon_pending.macros, &macros, sizeof(macros));
+        bl_daemon_queue_write(client, BL_CTRL_MACROS);
+    } else if (strcmp(cmd, "WRITE-PWM") == 0 && nargs == 3) {
+        if (a < 0 || a > 255 || b < 0 || b > 255) {
+            bl_daemon_reply(client, "ERR value out of range, valid range is 0-255\n");
+            return;
+        }
+        _bl_daemon_pending.pwm_usb = a;
+        _bl_daemon_pending.pwm_bt = b;
+        bl_daemon_queue_write(client, BL_CTRL_PWM);
+    } else if (strcmp(cmd, "WRITE-DEBOUNCE") == 0 && nargs == 2) {
+        if (a < 1 || a > 255) {
+            bl_daemon_reply(client, "ERR value out of range, valid range is 1-255\n");
+            return;
+        }
+        _bl_daemon_pending.debounce = a;
+        bl_daemon_queue_write(client, BL_CTRL_DEBOUNCE);
+    } else {
+        bl_daemon_reply(client, "ERR unknown request\n");
+    }
+}
+
+/*
+ * Handle the complete requests the client has sent, up to the first write.
+ */
+static void
+bl_daemon_process(bl_daemon_client_t *client) {
+    while (client->waiting == 0 && !client->closing) {
+        char *end = memchr(client->in, '\n', client->in_len);
+        if (end == NULL) {
+            if (client->in_len == sizeof(client->in)) {
+                bl_daemon_reply(client, "ERR request too long\n");
+                client->closing = TRUE;
+            }
+            return;
+        }
+        *end = 0;
+
+        char cmd[32];
+        int a = 0;
+        int b = 0;
+        int nargs = sscanf(client->in, "%31s %d %d", cmd, &a, &b);
+        if (nargs < 1) {
+            cmd[0] = 0;
+        }
+
+        /*
+         * Writes of the layout and the macros are followed by data lines,
+         * wait until all of them have arrived
+         */
+        int ndata = 0;
+        if (strcmp(cmd, "WRITE-LAYOUT") == 0 || strcmp(cmd, "WRITE-MACROS") == 0) {
+            int max = cmd[6] == 'L' ? NUMLAYERS_MAX : NUM_MACROKEYS;
+            if (nargs != 2 || a < 1 || a > max) {
+                bl_daemon_reply(client, "ERR expected 1-%d data lines\n", max);
+                client->closing = TRUE;
+                return;
+            }
+            ndata = a;
+        }
+
+        char *data[NUM_MACROKEYS];
+        char *p = end + 1;
+        char *in_end = client->in + client->in_len;
+        for (int i=0; i<ndata; i++) {
+            char *line_end = memchr(p, '\n', in_end - p);
+            if (line_end == NULL) {
+                // incomplete, restore the request line and wait for more
+                *end = '\n';
+                if (client->in_len == sizeof(client->in)) {
+                    bl_daemon_reply(client, "ERR request too long\n");
+                    client->closing = TRUE;
+                }
+                return;
+            }
+            *line_end = 0;
+            data[i] = p;
+            p = line_end + 1;
+        }
+
+        bl_daemon_request(client, cmd, a, b, nargs, data, ndata);
+
+        client->in_len = in_end - p;
+        memmove(client->in, p, client->in_len);
+    }
+}
+
+/*
+ * Write the parts of the batch to the controller and read them back to
+ * refresh the mirror, then answer the clients that wait for the batch.
+ */
+static void
+bl_daemon_flush() {
+    static bl_ctrl_state_t readback;
+    int dirty = _bl_daemon_dirty;
+    int ok = 0;
+
+    if ((dirty & BL_CTRL_LAYOUT) && bl_layout_write(&_bl_daemon_pending.layout)) {
+        ok |= BL_CTRL_LAYOUT;
+        memcpy(&_bl_daemon_mirror.layout, &_bl_daemon_pending.layout, sizeof(bl_layout_t));
+    }
+    if ((dirty & BL_CTRL_MACROS) && bl_usb_macro_write(&_bl_daemon_pending.macros)) {
+        ok |= BL_CTRL_MACROS;
+        memcpy(&_bl_daemon_mirror.macros, &_bl_daemon_pending.macros, sizeof(bl_macro_t));
+    }
+    if ((dirty & BL_CTRL_PWM) && bl_usb_pwm_write(_bl_daemon_pending.pwm_usb, _bl_daemon_pending.pwm_bt)) {
+        ok |= BL_CTRL_PWM;
+        _bl_daemon_mirror.pwm_usb = _bl_daemon_pending.pwm_usb;
+        _bl_daemon_mirror.pwm_bt = _bl_daemon_pending.pwm_bt;
+    }
+    if ((dirty & BL_CTRL_DEBOUNCE) && bl_usb_debounce_write(_bl_daemon_pending.debounce)) {
+        ok |= BL_CTRL_DEBOUNCE;
+        _bl_daemon_mirror.debounce = _bl_daemon_pending.debounce;
+    }
+    _bl_daemon_valid |= ok;
+
+    /*
+     * Verify what was written. Macros are not read back, the controller
+     * reports empty macros as a bad EEPROM value.
+     */
+    int read = bl_usb_read_state(&readback, ok & ~BL_CTRL_MACROS, NULL, NULL);
+    if ((read & BL_CTRL_LAYOUT) && !bl_layout_equal(&readback.layout, &_bl_daemon_mirror.layout)) {
+        ok &= ~BL_CTRL_LAYOUT;
+        memcpy(&_bl_daemon_mirror.layout, &readback.layout, sizeof(bl_layout_t));
+    }
+    if ((read & BL_CTRL_PWM) && (readback.pwm_usb != _bl_daemon_mirror.pwm_usb ||
+                                 readback.pwm_bt != _bl_daemon_mirror.pwm_bt)) {
+        ok &= ~BL_CTRL_PWM;
+        _bl_daemon_mirror.pwm_usb = readback.pwm_usb;
+        _bl_daemon_mirror.pwm_bt = readback.pwm_bt;
+    }
+    if ((read & BL_CTRL_DEBOUNCE) && readback.debounce != _bl_daemon_mirror.debounce) {
+        ok &= ~BL_CTRL_DEBOUNCE;
+        _bl_daemon_mirror.debounce = readback.debounce;
+    }
+
+    _bl_daemon_dirty = 0;
+    for (int i=0; i<_bl_daemon_nclients; i++) {
+        bl_daemon_client_t *client = _bl_daemon_clients[i];
+        if (client->waiting) {
+            if ((client->waiting & ok) == client->waiting) {
+                bl_daemon_reply(client, "OK\n");
+            } else {
+                bl_daemon_reply(client, "ERR write to the controller failed\n");
+            }
+            client->waiting = 0;
+            bl_daemon_process(client);
+        }
+    }
+}
+
+static void
+bl_daemon_accept(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    bl_daemon_client_t *client = (bl_daemon_client_t *) calloc(1, sizeof(bl_daemon_client_t));
+    if (client == NULL || _bl_daemon_nclients == BL_DAEMON_CLIENTS_MAX) {
+        free(client);
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    client->fd = fd;
+    _bl_daemon_clients[_bl_daemon_nclients++] = client;
+}
+
+static void
+bl_daemon_destroy_client(bl_daemon_client_t *client) {
+    close(client->fd);
+    free(client->out);
+    free(client);
+}
+
+/*
+ * Read from and write to the client, returns FALSE if the connection
+ * must be closed.
+ */
+static int
+bl_daemon_serve(bl_daemon_client_t *client, short revents) {
+    if (revents & POLLOUT) {
+        ssize_t n = write(client->fd, client->out, client->out_len);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return FALSE;
+        }
+        if (n > 0) {
+            client->out_len -= n;
+            memmove(client->out, client->out + n, client->out_len);
+        }
+    }
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t n = read(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            return FALSE;
+        }
+        if (n > 0) {
+            client->in_len += n;
+            bl_daemon_process(client);
+        }
+    }
+
+    return !(client->closing && client->out_len == 0);
+}
+
+int
+bl_daemon_run(char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        bl_err(FALSE, "Socket path too long: %s\n", path);
+        return FALSE;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        bl_err(FALSE, "Could not create socket: %s\n", strerror(errno));
+        return FALSE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /*
+     * Only a stale socket of our own is removed, anything else at the path
+     * is left alone and bind() fails
+     */
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && st.st_uid == geteuid()) {
+        unlink(path);
+    }
+    // the socket can rewrite layouts and macros, so it is for the user only
+    mode_t mask = umask(077);
+    int bound = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || chmod(path, 0600) < 0 || listen(listen_fd, 16) < 0) {
+        bl_err(FALSE, "Could not listen on %s: %s\n", path, strerror(errno));
+        close(listen_fd);
+        return FALSE;
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = bl_daemon_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    _bl_daemon_valid = bl_usb_read_state(&_bl_daemon_mirror, BL_CTRL_ALL, NULL, NULL);
+    _bl_daemon_running = TRUE;
+
+    struct pollfd fds[BL_DAEMON_CLIENTS_MAX + 1];
+    while (_bl_daemon_running) {
+        int timeout = -1;
+        if (_bl_daemon_dirty) {
+            timeout = (int) (_bl_daemon_batch_ms + BL_DAEMON_BATCH_MS - bl_daemon_now_ms());
+            timeout = MAX(timeout, 0);
+        }
+
+        int nfds = _bl_daemon_nclients;
+        for (int i=0; i<nfds; i++) {
+            bl_daemon_client_t *client = _bl_daemon_clients[i];
+            fds[i].fd = client->fd;
+            fds[i].events = (client->waiting || client->closing ? 0 : POLLIN) | (client->out_len > 0 ? POLLOUT : 0);
+            fds[i].revents = 0;
+        }
+        fds[nfds].fd = listen_fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+
+        if (poll(fds, nfds + 1, timeout) < 0 && errno != EINTR) {
+            bl_err(FALSE, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        /*
+         * Serve the clients that were polled, closed connections are
+         * removed afterwards so the indices stay valid.
+         */
+        for (int i=0; i<nfds; i++) {
+            if (fds[i].revents && !bl_daemon_serve(_bl_daemon_clients[i], fds[i].revents)) {
+                bl_daemon_destroy_client(_bl_daemon_clients[i]);
+                _bl_daemon_clients[i] = NULL;
+            }
+        }
+        int n = 0;
+        for (int i=0; i<_bl_daemon_nclients; i++) {
+            if (_bl_daemon_clients[i] != NULL) {
+                _bl_daemon_clients[n++] = _bl_daemon_clients[i];
+            }
+        }
+        _bl_daemon_nclients = n;
+
+        if (fds[nfds].revents & POLLIN) {
+            bl_daemon_accept(listen_fd);
+        }
+
+        if (_bl_daemon_dirty && bl_daemon_now_ms() >= _bl_daemon_batch_ms + BL_DAEMON_BATCH_MS) {
+            bl_daemon_flush();
+        }
+    }
+
+    for (int i=0; i<_bl_daemon_nclients; i++) {
+        bl_daemon_destroy_client(_bl_daemon_clients[i]);
+    }
+    _bl_daemon_nclients = 0;
+    close(listen_fd);
+    unlink(path);
+
+    return TRUE;
+}
@@ -0,0 +1,56 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_DAEMON_H__
+#define __BL_DAEMON_H__ 1
+
+/*
+ * Writes that arrive within this many milliseconds of the first pending
+ * write are sent to the controller together.
+ */
+#define BL_DAEMON_BATCH_MS 20
+
+/*
+ * Maximum number of connected clients
+ */
+#define BL_DAEMON_CLIENTS_MAX 64
+
+/**
+ * Serve the controller, which must be open, on a Unix domain socket until
+ * SIGINT or SIGTERM. Reads are answered from a mirror of the controller
+ * state, writes are collected for BL_DAEMON_BATCH_MS and then sent to the
+ * controller one part at a time, the mirror is refreshed from the
+ * controller afterwards. See bl_proto.h for the protocol.
+ *
+ * @param path Path of the socket, an existing socket is replaced
+ * @return FALSE if the socket could not be created
+ */
+int bl_daemon_run(char *path);
+
+#endif /* __BL_DAEMON_H__ */
@@ -0,0 +1,265 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __APPLE__
+#include <sys/syslimits.h>
+#endif
+
+#include "blusb.h"
+#include "bl_devcache.h"
+
+static char *
+bl_devcache_env(char *name, char *def) {
+    char *value = getenv(name);
+
+    return value != NULL ? value : def;
+}
+
+/*
+ * Path of the cache file, returns FALSE if there is no private place for
+ * it and the cache is not used.
+ */
+static int
+bl_devcache_file(char *fname, int len) {
+    char *cache = getenv(BL_DEVCACHE_FILE_ENV);
+    char *xdg = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    char *runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (cache != NULL) {
+        snprintf(fname, len, "%s", cache);
+    } else if (xdg != NULL) {
+        snprintf(fname, len, "%s/blusb-device", xdg);
+    } else if (home != NULL) {
+        snprintf(fname, len, "%s/.cache/blusb-device", home);
+    } else if (runtime != NULL) {
+        snprintf(fname, len, "%s/blusb-device", runtime);
+    } else {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Create the missing directories of the path of fname like mkdir -p, the
+ * new ones are only accessible by the user. Returns FALSE on failure.
+ */
+static int
+bl_devcache_mkdirs(char *fname) {
+    char dname[PATH_MAX];
+
+    snprintf(dname, sizeof(dname), "%s", fname);
+    for (char *p = strchr(dname + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = 0;
+        if (mkdir(dname, 0700) != 0 && errno != EEXIST) {
+            return FALSE;
+        }
+        *p = '/';
+    }
+
+    return TRUE;
+}
+
+/*
+ * Read a sysfs attribute of the device as a number in the given base,
+ * returns -1 if it cannot be read.
+ */
+static long
+bl_devcache_attr(char *name, char *attr, int base) {
+    char fname[PATH_MAX];
+    char buf[16];
+
+    snprintf(fname, sizeof(fname), "%s/bus/usb/devices/%s/%s",
+             bl_devcache_env(BL_DEVCACHE_SYSFS_ENV, "/sys"), name, attr);
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = 0;
+
+    char *end;
+    long value = strtol(buf, &end, base);
+
+    return end == buf ? -1 : value;
+}
+
+/*
+ * Parse a sysfs device name, <bus>-<port>.<port>..., root hubs (usb1) and
+ * interfaces (1-2:1.0) are rejected.
+ */
+static int
+bl_devcache_parse_name(char *name, bl_devpath_t *path) {
+    char *p = name;
+
+    if (!isdigit((unsigned char) *p) || strlen(name) >= sizeof(path->name)) {
+        return FALSE;
+    }
+    path->bus = strtol(p, &p, 10);
+    if (*p != '-') {
+        return FALSE;
+    }
+    path->nports = 0;
+    do {
+        p++;
+        if (!isdigit((unsigned char) *p) || path->nports == (int) sizeof(path->ports)) {
+            return FALSE;
+        }
+        path->ports[path->nports++] = strtol(p, &p, 10);
+    } while (*p == '.');
+    if (*p != 0) {
+        return FALSE;
+    }
+    strcpy(path->name, name);
+
+    return TRUE;
+}
+
+/*
+ * TRUE if the device in sysfs has the vendor and product id, fills in its
+ * device number
+ */
+static int
+bl_devcache_check(uint16_t vendor, uint16_t product, bl_devpath_t *path) {
+    if (bl_devcache_attr(path->name, "idVendor", 16) != vendor ||
+        bl_devcache_attr(path->name, "idProduct", 16) != product) {
+        return FALSE;
+    }
+    path->devnum = bl_devcache_attr(path->name, "devnum", 10);
+
+    return path->devnum > 0;
+}
+
+void
+bl_devcache_path_name(bl_devpath_t *path) {
+    int len = snprintf(path->name, sizeof(path->name), "%d-", path->bus);
+    for (int i=0; i<path->nports && len < (int) sizeof(path->name); i++) {
+        len += snprintf(path->name + len, sizeof(path->name) - len, i == 0 ? "%d" : ".%d", path->ports[i]);
+    }
+}
+
+int
+bl_devcache_lookup(uint16_t vendor, uint16_t product, bl_devpath_t *path) {
+    char fname[PATH_MAX];
+    char name[64];
+
+    if (!bl_devcache_file(fname, sizeof(fname))) {
+        return FALSE;
+    }
+    int fd = open(fname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    FILE *f = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return FALSE;
+    }
+    int ok = fgets(name, sizeof(name), f) != NULL;
+    fclose(f);
+    if (!ok) {
+        return FALSE;
+    }
+    name[strcspn(name, "\r\n")] = 0;
+
+    return bl_devcache_parse_name(name, path) && bl_devcache_check(vendor, product, path);
+}
+
+int
+bl_devcache_scan(uint16_t vendor, uint16_t product, bl_devpath_t *path) {
+    char dname[PATH_MAX];
+
+    snprintf(dname, sizeof(dname), "%s/bus/usb/devices", bl_devcache_env(BL_DEVCACHE_SYSFS_ENV, "/sys"));
+    DIR *dir = opendir(dname);
+    if (dir == NULL) {
+        return FALSE;
+    }
+
+    int found = FALSE;
+    struct dirent *entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        found = bl_devcache_parse_name(entry->d_name, path) && bl_devcache_check(vendor, product, path);
+    }
+    closedir(dir);
+
+    return found;
+}
+
+void
+bl_devcache_store(bl_devpath_t *path) {
+    char fname[PATH_MAX];
+    char tmpname[PATH_MAX + 8];
+
+    /*
+     * Write a temporary file and rename it, concurrent readers never see
+     * a partial name
+     */
+    if (!bl_devcache_file(fname, sizeof(fname)) || !bl_devcache_mkdirs(fname)) {
+        return;
+    }
+    snprintf(tmpname, sizeof(tmpname), "%s.%d", fname, (int) getpid());
+    // a new file only, never one that is already there or a link
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpname);
+        }
+        return;
+    }
+    fprintf(f, "%s\n", path->name);
+    if (fclose(f) != 0 || rename(tmpname, fname) != 0) {
+        unlink(tmpname);
+    }
+}
+
+int
+bl_devcache_open(bl_devpath_t *path) {
+    char fname[PATH_MAX];
+
+    snprintf(fname, sizeof(fname), "%s/bus/usb/%03d/%03d",
+             bl_devcache_env(BL_DEVCACHE_DEV_ENV, "/dev"), path->bus, path->devnum);
+
+    return open(fname, O_RDWR | O_CLOEXEC);
+}
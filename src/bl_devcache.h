@@ -0,0 +1,97 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_DEVCACHE_H__
+#define __BL_DEVCACHE_H__ 1
+
+#include <stdint.h>
+
+/*
+ * Locate the controller through sysfs instead of enumerating the bus with
+ * libusb. The sysfs name of the controller, e.g. 1-2.3, is cached in a
+ * file, so a later run only checks that this device is still the
+ * controller and opens its device node directly.
+ */
+
+/*
+ * Environment variables for the root of sysfs (default /sys), of the
+ * device nodes (default /dev) and the path of the cache file (default
+ * $XDG_CACHE_HOME/blusb-device, $HOME/.cache/blusb-device or
+ * $XDG_RUNTIME_DIR/blusb-device, without any of them there is no cache).
+ */
+#define BL_DEVCACHE_SYSFS_ENV "BLUSB_SYSFS_ROOT"
+#define BL_DEVCACHE_DEV_ENV "BLUSB_DEV_ROOT"
+#define BL_DEVCACHE_FILE_ENV "BLUSB_DEVICE_CACHE"
+
+/*
+ * Location of a device on the bus
+ */
+typedef struct bl_devpath_t {
+    // sysfs name, <bus>-<port>.<port>...
+    char name[32];
+    int bus;
+    uint8_t ports[7];
+    int nports;
+    // device number on the bus, for the device node
+    int devnum;
+} bl_devpath_t;
+
+/**
+ * Look up the cached device and check in sysfs that it is still there and
+ * has the given vendor and product id.
+ *
+ * @return TRUE if path is valid
+ */
+int bl_devcache_lookup(uint16_t vendor, uint16_t product, bl_devpath_t *path);
+
+/**
+ * Search sysfs for the first device with the given vendor and product id.
+ *
+ * @return TRUE if found
+ */
+int bl_devcache_scan(uint16_t vendor, uint16_t product, bl_devpath_t *path);
+
+/**
+ * Remember the device for bl_devcache_lookup(), errors are ignored.
+ */
+void bl_devcache_store(bl_devpath_t *path);
+
+/**
+ * Fill in the name of path from its bus and port numbers.
+ */
+void bl_devcache_path_name(bl_devpath_t *path);
+
+/**
+ * Open the device node of the device.
+ *
+ * @return The file descriptor or -1
+ */
+int bl_devcache_open(bl_devpath_t *path);
+
+#endif /* __BL_DEVCACHE_H__ */
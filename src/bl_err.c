@@ -0,0 +1,81 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "blusb.h"
+#include "bl_err.h"
+
+static bl_err_handler_t _bl_err_handler = NULL;
+static bl_err_cleanup_t _bl_err_cleanup = NULL;
+
+void
+bl_err_set_handler(bl_err_handler_t handler, bl_err_cleanup_t cleanup) {
+    _bl_err_handler = handler;
+    _bl_err_cleanup = cleanup;
+}
+
+void
+bl_err_cleanup(void) {
+    bl_err_cleanup_t cleanup = _bl_err_cleanup;
+
+    /*
+     * Only once, the cleanup function itself may end up here
+     */
+    _bl_err_cleanup = NULL;
+    if (cleanup != NULL) {
+        cleanup();
+    }
+}
+
+void
+bl_err(int is_fatal, char *msg, ...) {
+    va_list varglist;
+    va_start(varglist, msg);
+
+    if (_bl_err_handler != NULL) {
+        _bl_err_handler(is_fatal, msg, varglist);
+    } else {
+        vfprintf(stderr, msg, varglist);
+        size_t len = strlen(msg);
+        if (len == 0 || msg[len-1] != '\n') {
+            fputc('\n', stderr);
+        }
+    }
+
+    va_end(varglist);
+
+    if (is_fatal) {
+        bl_err_cleanup();
+        exit(1);
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_ERR_H__
+#define __BL_ERR_H__ 1
+
+#include <stdarg.h>
+
+/*
+ * Error reporting for the curses free core (layout parsing, macros, usb).
+ * By default errors are printed on stderr, a front end such as the text ui
+ * installs its own handler to show them in a dialog instead.
+ */
+
+/*
+ * Report an error, the handler must not exit, fatal errors are handled by bl_err
+ */
+typedef void (*bl_err_handler_t)(int is_fatal, char *msg, va_list varglist);
+
+/*
+ * Restore the terminal etc. before the program exits on a fatal error
+ */
+typedef void (*bl_err_cleanup_t)(void);
+
+/**
+ * Install the error handler and the cleanup function.
+ *
+ * @param handler Function that reports the error, NULL restores the default
+ * @param cleanup Function that is called before exiting on a fatal error, may be NULL
+ */
+void bl_err_set_handler(bl_err_handler_t handler, bl_err_cleanup_t cleanup);
+
+/**
+ * Report an error, if it is fatal the program exits after cleaning up.
+ *
+ * @param is_fatal TRUE if the program cannot continue
+ * @param msg printf style format string
+ */
+void bl_err(int is_fatal, char *msg, ...);
+
+/**
+ * Call the installed cleanup function, if any. Used before exiting the
+ * program from places that do not go through bl_err.
+ */
+void bl_err_cleanup(void);
+
+#endif /* __BL_ERR_H__ */
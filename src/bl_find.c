@@ -0,0 +1,270 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "blusb.h"
+#include "bl_find.h"
+
+/*
+ * Number of paths a walker collects before adding them to the list
+ */
+#define BL_FIND_BATCH 64
+
+static void
+bl_find_add_paths(bl_find_t *find, char **paths, int n) {
+    pthread_mutex_lock(&find->lock);
+    if (find->n + n > find->size) {
+        find->size = MAX(2 * find->size, find->n + n);
+        find->paths = (char **) realloc(find->paths, find->size * sizeof(char *));
+    }
+    memcpy(&find->paths[find->n], paths, n * sizeof(char *));
+    find->n += n;
+    pthread_mutex_unlock(&find->lock);
+}
+
+static char *
+bl_find_join(const char *dir, const char *name) {
+    if (dir[0] == 0) {
+        return strdup(name);
+    }
+    char *path = (char *) malloc(strlen(dir) + 1 + strlen(name) + 1);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/*
+ * Walk one directory, arg is the path relative to the root. Sub
+ * directories are submitted as new tasks on the queue of this worker,
+ * other workers steal them when they run out of work.
+ */
+static void
+bl_find_walk(bl_pool_t *pool, int worker, void *arg) {
+    bl_find_t *find = (bl_find_t *) pool->data;
+    char *rel = (char *) arg;
+
+    if (bl_pool_is_cancelled(pool)) {
+        free(rel);
+        return;
+    }
+
+    char *full = rel[0] == 0 ? strdup(find->root) : bl_find_join(find->root, rel);
+    int fd = open(full, O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    free(full);
+    if (dir == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(rel);
+        return;
+    }
+
+    char *batch[BL_FIND_BATCH];
+    int n = 0;
+    struct dirent *dire;
+    while ((dire = readdir(dir)) != NULL) {
+        /* skip '.', '..' and hidden files and directories */
+        if (dire->d_name[0] == '.') {
+            continue;
+        }
+        int is_dir = FALSE;
+        int is_file = FALSE;
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (dire->d_type != DT_UNKNOWN) {
+            is_dir = dire->d_type == DT_DIR;
+            is_file = dire->d_type == DT_REG;
+        } else
+#endif
+        {
+            struct stat st;
+            if (fstatat(dirfd(dir), dire->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_file = S_ISREG(st.st_mode);
+            }
+        }
+        if (is_dir) {
+            bl_pool_submit(pool, worker, bl_find_walk, bl_find_join(rel, dire->d_name));
+        } else if (is_file) {
+            batch[n++] = bl_find_join(rel, dire->d_name);
+            if (n == BL_FIND_BATCH) {
+                bl_find_add_paths(find, batch, n);
+                n = 0;
+            }
+        }
+    }
+    closedir(dir);
+    bl_find_add_paths(find, batch, n);
+    free(rel);
+}
+
+bl_find_t *
+bl_find_start(char *root, int nworkers) {
+    bl_find_t *find = (bl_find_t *) malloc(sizeof(bl_find_t));
+    find->root = strdup(root);
+    find->paths = NULL;
+    find->n = 0;
+    find->size = 0;
+    pthread_mutex_init(&find->lock, NULL);
+    find->pool = bl_pool_create(nworkers, find);
+    bl_pool_submit(find->pool, -1, bl_find_walk, strdup(""));
+
+    return find;
+}
+
+int
+bl_find_is_done(bl_find_t *find) {
+    return bl_pool_is_done(find->pool);
+}
+
+void
+bl_find_wait(bl_find_t *find) {
+    bl_pool_wait(find->pool);
+}
+
+int
+bl_find_count(bl_find_t *find) {
+    pthread_mutex_lock(&find->lock);
+    int n = find->n;
+    pthread_mutex_unlock(&find->lock);
+
+    return n;
+}
+
+void
+bl_find_destroy(bl_find_t *find) {
+    bl_pool_destroy(find->pool);
+    for (int i=0; i<find->n; i++) {
+        free(find->paths[i]);
+    }
+    free(find->paths);
+    free(find->root);
+    pthread_mutex_destroy(&find->lock);
+    free(find);
+}
+
+int
+bl_find_score(const char *query, const char *path) {
+    const char *basename = strrchr(path, '/');
+    basename = basename == NULL ? path : basename + 1;
+
+    int score = 0;
+    int consecutive = FALSE;
+    const char *p = path;
+    for (const char *q = query; *q != 0; q++) {
+        int ch = tolower((unsigned char) *q);
+        if (ch == ' ') {
+            continue;
+        }
+        while (*p != 0 && tolower((unsigned char) *p) != ch) {
+            p++;
+            consecutive = FALSE;
+        }
+        if (*p == 0) {
+            return -1;
+        }
+        score += 1;
+        if (consecutive) {
+            score += 4;
+        }
+        if (p == path || strchr("/_-. ", p[-1]) != NULL) {
+            score += 6;
+        }
+        if (p >= basename) {
+            score += 2;
+        }
+        consecutive = TRUE;
+        p++;
+    }
+
+    /* prefer shorter paths */
+    return score * 16 - (int) MIN(strlen(path), 15);
+}
+
+void
+bl_find_rank_init(bl_find_rank_t *rank) {
+    rank->query[0] = 0;
+    rank->scored = 0;
+    rank->n = 0;
+}
+
+/*
+ * Insert the match in the sorted list of best matches, if it is good
+ * enough. Returns TRUE if it was inserted.
+ */
+static int
+bl_find_rank_insert(bl_find_rank_t *rank, char *path, int score) {
+    if (rank->n == BL_FIND_TOP && score <= rank->top[BL_FIND_TOP - 1].score) {
+        return FALSE;
+    }
+    int i = rank->n < BL_FIND_TOP ? rank->n++ : BL_FIND_TOP - 1;
+    while (i > 0 && rank->top[i - 1].score < score) {
+        rank->top[i] = rank->top[i - 1];
+        i--;
+    }
+    rank->top[i].path = path;
+    rank->top[i].score = score;
+
+    return TRUE;
+}
+
+int
+bl_find_rank_update(bl_find_t *find, bl_find_rank_t *rank, const char *query) {
+    int changed = FALSE;
+    if (strncmp(rank->query, query, BL_FIND_QUERY_MAX - 1) != 0) {
+        strncpy(rank->query, query, BL_FIND_QUERY_MAX - 1);
+        rank->query[BL_FIND_QUERY_MAX - 1] = 0;
+        rank->scored = 0;
+        rank->n = 0;
+        changed = TRUE;
+    }
+
+    /*
+     * The path strings never move, only the array holding them, so the
+     * lock must be held while reading the array.
+     */
+    pthread_mutex_lock(&find->lock);
+    for (; rank->scored < find->n; rank->scored++) {
+        char *path = find->paths[rank->scored];
+        int score = bl_find_score(rank->query, path);
+        if (score >= 0 && bl_find_rank_insert(rank, path, score)) {
+            changed = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&find->lock);
+
+    return changed;
+}
@@ -0,0 +1,124 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_FIND_H__
+#define __BL_FIND_H__ 1
+
+#include "bl_pool.h"
+
+/*
+ * Number of best matches kept by the ranking
+ */
+#define BL_FIND_TOP 64
+#define BL_FIND_QUERY_MAX 128
+
+/*
+ * Recursive search for layout files, the directory tree is walked in
+ * parallel and the paths found are ranked against a fuzzy query.
+ */
+typedef struct bl_find_t {
+    char *root;
+    bl_pool_t *pool;
+    pthread_mutex_t lock;
+    // paths of the files found so far, relative to root
+    char **paths;
+    int n;
+    int size;
+} bl_find_t;
+
+typedef struct bl_find_match_t {
+    char *path;
+    int score;
+} bl_find_match_t;
+
+/*
+ * Incremental ranking, only the paths found since the last update are
+ * scored, unless the query changes.
+ */
+typedef struct bl_find_rank_t {
+    char query[BL_FIND_QUERY_MAX];
+    // number of paths scored so far
+    int scored;
+    // number of matches in top
+    int n;
+    // best matches, best first
+    bl_find_match_t top[BL_FIND_TOP];
+} bl_find_rank_t;
+
+/**
+ * Start walking the directory tree in the background.
+ *
+ * @param root Directory to search
+ * @param nworkers Number of threads, <= 0 to use one per cpu
+ *
+ * @return the search, must be destroyed with bl_find_destroy().
+ */
+bl_find_t *bl_find_start(char *root, int nworkers);
+
+/**
+ * Return TRUE if the directory tree has been walked completely.
+ */
+int bl_find_is_done(bl_find_t *find);
+
+/**
+ * Block until the directory tree has been walked completely.
+ */
+void bl_find_wait(bl_find_t *find);
+
+/**
+ * Return the number of files found so far.
+ */
+int bl_find_count(bl_find_t *find);
+
+/**
+ * Stop the search and free it, paths returned in matches are freed too.
+ */
+void bl_find_destroy(bl_find_t *find);
+
+/**
+ * Fuzzy match the query against the path, all characters of the query
+ * must appear in the path in the same order (case insensitive).
+ * Consecutive characters, characters at the start of a word and
+ * characters in the file name score higher.
+ *
+ * @return the score, higher is better, or -1 if the path does not match.
+ */
+int bl_find_score(const char *query, const char *path);
+
+void bl_find_rank_init(bl_find_rank_t *rank);
+
+/**
+ * Update the ranking with the paths found since the last update, or
+ * rescore all paths if the query has changed.
+ *
+ * @return TRUE if the ranking has changed.
+ */
+int bl_find_rank_update(bl_find_t *find, bl_find_rank_t *rank, const char *query);
+
+#endif /* __BL_FIND_H__ */
@@ -0,0 +1,603 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blusb.h"
+#include "layout.h"
+#include "bl_find.h"
+#include "bl_kernel.h"
+#include "bl_index.h"
+
+/*
+ * Number of files parsed by one task
+ */
+#define BL_INDEX_CHUNK 32
+
+#define BL_INDEX_PRED_LAYERS  0
+#define BL_INDEX_PRED_CODE    1
+#define BL_INDEX_PRED_AT      2
+#define BL_INDEX_PRED_HASH    3
+
+/*
+ * What the index holds about one file, data is in the format of the file
+ */
+typedef struct bl_index_record_t {
+    uint64_t hash;
+    int nlayers;
+    int ncodes;
+    int nspecial;
+    // NULL if the file could not be parsed
+    uint8_t *data;
+    size_t size;
+} bl_index_record_t;
+
+typedef struct bl_index_build_t {
+    bl_find_t *find;
+    bl_index_record_t *records;
+} bl_index_build_t;
+
+typedef struct bl_index_chunk_t {
+    bl_index_build_t *build;
+    int start;
+    int end;
+} bl_index_chunk_t;
+
+static uint32_t
+bl_index_get32(uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void
+bl_index_put32(uint8_t *p, uint32_t value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = value >> 24;
+}
+
+static uint16_t
+bl_index_get16(uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static void
+bl_index_put16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static int
+bl_index_cmp_code(const void *a, const void *b) {
+    return *(uint16_t *) a - *(uint16_t *) b;
+}
+
+static int
+bl_index_is_special(uint16_t code) {
+    int type = code >> 8;
+    return type == TYPE_MACRO || type == TYPE_TOGGLE || type == TYPE_MOMENTARY;
+}
+
+/*
+ * Fill in the record of a layout
+ */
+static int
+bl_index_record(bl_index_record_t *record, bl_layout_t *layout) {
+    bl_kernel_hist_t hist;
+    uint16_t *codes = &layout->matrix[0][0][0];
+    int n = layout->nlayers * NUMKEYS;
+
+    record->hash = bl_kernel_hash(codes, n);
+    record->nlayers = layout->nlayers;
+
+    /*
+     * The special keys are all above the bins of the histogram
+     */
+    bl_kernel_histogram(codes, n, &hist);
+    qsort(hist.other, hist.nother, sizeof(uint16_t), bl_index_cmp_code);
+    record->nspecial = 0;
+    record->ncodes = 0;
+    for (int i=0; i<BL_KERNEL_HIST_BINS; i++) {
+        record->ncodes += hist.bins[i] != 0;
+    }
+    for (int i=0; i<hist.nother; i++) {
+        record->nspecial += bl_index_is_special(hist.other[i]);
+        record->ncodes += i == 0 || hist.other[i] != hist.other[i-1];
+    }
+
+    record->size = 4 * (record->ncodes + record->nspecial) + BL_INDEX_LAYER_SIZE;
+    record->data = (uint8_t *) malloc(MAX(record->size, 1));
+    if (record->data == NULL) {
+        return FALSE;
+    }
+    uint8_t *p = record->data;
+    for (int i=0; i<BL_KERNEL_HIST_BINS; i++) {
+        if (hist.bins[i] != 0) {
+            bl_index_put16(p, i);
+            bl_index_put16(p + 2, hist.bins[i]);
+            p += 4;
+        }
+    }
+    for (int i=0; i<hist.nother; ) {
+        int count = 1;
+        while (i + count < hist.nother && hist.other[i + count] == hist.other[i]) {
+            count++;
+        }
+        bl_index_put16(p, hist.other[i]);
+        bl_index_put16(p + 2, count);
+        p += 4;
+        i += count;
+    }
+    for (int layer=0; layer<layout->nlayers; layer++) {
+        for (int row=0; row<NUMROWS; row++) {
+            for (int col=0; col<NUMCOLS; col++) {
+                uint16_t code = layout->matrix[layer][row][col];
+                if (bl_index_is_special(code)) {
+                    bl_index_put16(p, code);
+                    p[2] = layer;
+                    p[3] = row * NUMCOLS + col;
+                    p += 4;
+                }
+            }
+        }
+    }
+    for (int i=0; i<NUMKEYS; i++) {
+        bl_index_put16(p, codes[i]);
+        p += 2;
+    }
+
+    return TRUE;
+}
+
+static void
+bl_index_parse_chunk(bl_pool_t *pool, int worker, void *arg) {
+    bl_index_chunk_t *chunk = (bl_index_chunk_t *) arg;
+    bl_find_t *find = chunk->build->find;
+    char errmsg[256];
+    char path[PATH_MAX];
+
+    for (int i=chunk->start; i<chunk->end; i++) {
+        snprintf(path, sizeof(path), "%s/%s", find->root, find->paths[i]);
+        bl_layout_t *layout = bl_layout_parse_file(path, errmsg, sizeof(errmsg));
+        if (layout != NULL) {
+            if (!bl_index_record(&chunk->build->records[i], layout)) {
+                chunk->build->records[i].data = NULL;
+            }
+            bl_layout_destroy(layout);
+        }
+    }
+    free(chunk);
+}
+
+int
+bl_index_build(char *root, char *fname, int nworkers, int *nindexed, int *nskipped) {
+    bl_index_build_t build;
+
+    /*
+     * Walk the tree, then parse the files on the same pool
+     */
+    build.find = bl_find_start(root, nworkers);
+    bl_pool_wait(build.find->pool);
+
+    int nfiles = build.find->n;
+    build.records = (bl_index_record_t *) calloc(MAX(nfiles, 1), sizeof(bl_index_record_t));
+    if (build.records == NULL) {
+        bl_find_destroy(build.find);
+        return FALSE;
+    }
+    for (int start=0; start<nfiles; start+=BL_INDEX_CHUNK) {
+        bl_index_chunk_t *chunk = (bl_index_chunk_t *) malloc(sizeof(bl_index_chunk_t));
+        if (chunk == NULL) {
+            errmsg_and_abort("bl_index_build: out of memory");
+        }
+        chunk->build = &build;
+        chunk->start = start;
+        chunk->end = MIN(start + BL_INDEX_CHUNK, nfiles);
+        bl_pool_submit(build.find->pool, -1, bl_index_parse_chunk, chunk);
+    }
+    bl_pool_wait(build.find->pool);
+
+    /*
+     * Lay out the file
+     */
+    uint32_t nlayouts = 0;
+    size_t data_size = 0;
+    size_t paths_size = strlen(root) + 1;
+    for (int i=0; i<nfiles; i++) {
+        if (build.records[i].data != NULL) {
+            nlayouts++;
+            data_size += build.records[i].size;
+            paths_size += strlen(build.find->paths[i]) + 1;
+        }
+    }
+    size_t entries_offset = BL_INDEX_HEADER_SIZE;
+    size_t data_offset = entries_offset + (size_t) nlayouts * BL_INDEX_ENTRY_SIZE;
+    size_t paths_offset = data_offset + data_size;
+    size_t size = paths_offset + paths_size;
+    uint8_t *data = size <= UINT32_MAX ? (uint8_t *) calloc(1, size) : NULL;
+    int ok = data != NULL;
+
+    if (ok) {
+        memcpy(data, BL_INDEX_MAGIC, 4);
+        bl_index_put32(data + 4, BL_INDEX_VERSION);
+        bl_index_put32(data + 8, nlayouts);
+        bl_index_put32(data + 12, entries_offset);
+        bl_index_put32(data + 16, data_offset);
+        bl_index_put32(data + 20, paths_offset);
+
+        strcpy((char *) data + paths_offset, root);
+        uint8_t *entry = data + entries_offset;
+        size_t blob = 0;
+        size_t path = strlen(root) + 1;
+        for (int i=0; i<nfiles; i++) {
+            bl_index_record_t *record = &build.records[i];
+            if (record->data == NULL) {
+                continue;
+            }
+            bl_index_put32(entry, path);
+            bl_index_put32(entry + 4, record->hash & 0xffffffff);
+            bl_index_put32(entry + 8, record->hash >> 32);
+            bl_index_put16(entry + 12, record->nlayers);
+            bl_index_put16(entry + 14, record->ncodes);
+            bl_index_put16(entry + 16, record->nspecial);
+            bl_index_put32(entry + 20, blob);
+            memcpy(data + data_offset + blob, record->data, record->size);
+            strcpy((char *) data + paths_offset + path, build.find->paths[i]);
+            entry += BL_INDEX_ENTRY_SIZE;
+            blob += record->size;
+            path += strlen(build.find->paths[i]) + 1;
+        }
+    } else if (size > UINT32_MAX) {
+        errno = EFBIG;
+    }
+
+    for (int i=0; i<nfiles; i++) {
+        free(build.records[i].data);
+    }
+    free(build.records);
+    bl_find_destroy(build.find);
+    *nindexed = nlayouts;
+    *nskipped = nfiles - nlayouts;
+
+    /*
+     * Written to a temporary file first, the index may be mapped by a
+     * running query
+     */
+    char tmpname[PATH_MAX];
+    snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", fname, (int) getpid());
+    FILE *f = NULL;
+    if (ok) {
+        f = fopen(tmpname, "wb");
+        ok = f != NULL && fwrite(data, 1, size, f) == size;
+        if (f != NULL && fclose(f) != 0) {
+            ok = FALSE;
+        }
+    }
+    free(data);
+    if (ok && rename(tmpname, fname) != 0) {
+        ok = FALSE;
+    }
+    if (!ok && f != NULL) {
+        int saved_errno = errno;
+        unlink(tmpname);
+        errno = saved_errno;
+    }
+
+    return ok;
+}
+
+bl_index_t *
+bl_index_open(char *fname, char *errmsg, int errlen) {
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(errmsg, errlen, "%s: %s", fname, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < BL_INDEX_HEADER_SIZE) {
+        snprintf(errmsg, errlen, "%s: not a layout index", fname);
+        close(fd);
+        return NULL;
+    }
+    uint8_t *data = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        snprintf(errmsg, errlen, "%s: %s", fname, strerror(errno));
+        return NULL;
+    }
+
+    bl_index_t *index = (bl_index_t *) malloc(sizeof(bl_index_t));
+    if (index == NULL) {
+        snprintf(errmsg, errlen, "out of memory");
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    index->data = data;
+    index->size = st.st_size;
+    index->nlayouts = bl_index_get32(data + 8);
+
+    uint32_t entries_offset = bl_index_get32(data + 12);
+    uint32_t data_offset = bl_index_get32(data + 16);
+    uint32_t paths_offset = bl_index_get32(data + 20);
+    int valid = memcmp(data, BL_INDEX_MAGIC, 4) == 0 && bl_index_get32(data + 4) == BL_INDEX_VERSION &&
+        entries_offset + (uint64_t) index->nlayouts * BL_INDEX_ENTRY_SIZE <= data_offset &&
+        data_offset <= paths_offset && paths_offset < index->size && data[index->size - 1] == 0;
+    index->entries = data + entries_offset;
+    index->blobs = data + data_offset;
+    index->paths = data + paths_offset;
+
+    /*
+     * Check the offsets once, so queries don't have to
+     */
+    for (uint32_t i=0; valid && i<index->nlayouts; i++) {
+        uint8_t *entry = index->entries + i * BL_INDEX_ENTRY_SIZE;
+        uint64_t end = data_offset + (uint64_t) bl_index_get32(entry + 20) +
+            4 * (bl_index_get16(entry + 14) + bl_index_get16(entry + 16)) + BL_INDEX_LAYER_SIZE;
+        valid = end <= paths_offset && paths_offset + (uint64_t) bl_index_get32(entry) < index->size;
+    }
+    if (!valid) {
+        snprintf(errmsg, errlen, "%s: not a layout index or damaged", fname);
+        bl_index_close(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void
+bl_index_close(bl_index_t *index) {
+    munmap(index->data, index->size);
+    free(index);
+}
+
+char *
+bl_index_root(bl_index_t *index) {
+    return (char *) index->paths;
+}
+
+char *
+bl_index_path(bl_index_t *index, uint32_t i) {
+    return (char *) index->paths + bl_index_get32(index->entries + i * BL_INDEX_ENTRY_SIZE);
+}
+
+uint64_t
+bl_index_hash(bl_index_t *index, uint32_t i) {
+    uint8_t *entry = index->entries + i * BL_INDEX_ENTRY_SIZE;
+    return bl_index_get32(entry + 4) | ((uint64_t) bl_index_get32(entry + 8) << 32);
+}
+
+/*
+ * Parse a comparison operator followed by a number, returns the number of
+ * characters parsed or 0.
+ */
+static int
+bl_index_parse_op(char *s, bl_index_pred_t *pred) {
+    int n = 0;
+
+    if (strncmp(s, "<=", 2) == 0) {
+        pred->op = 'l';
+        n = 2;
+    } else if (strncmp(s, ">=", 2) == 0) {
+        pred->op = 'g';
+        n = 2;
+    } else if (strncmp(s, "!=", 2) == 0) {
+        pred->op = '!';
+        n = 2;
+    } else if (s[0] == '=' || s[0] == '<' || s[0] == '>') {
+        pred->op = s[0];
+        n = 1;
+    } else {
+        return 0;
+    }
+
+    char *end;
+    pred->value = strtol(s + n, &end, 0);
+    return end == s + n || *end != 0 ? 0 : end - s;
+}
+
+/*
+ * Parse a key code, returns a pointer after it or NULL
+ */
+static char *
+bl_index_parse_code(char *s, uint16_t *code) {
+    char *end;
+    long value = strtol(s, &end, 0);
+
+    if (end == s || value < 0 || value > 0xffff) {
+        return NULL;
+    }
+    *code = value;
+
+    return end;
+}
+
+/*
+ * Parse the number of a macro or layer, 1 <= n <= max, the predicate is
+ * that the key code first + n - 1 is used.
+ */
+static int
+bl_index_parse_number(char *s, int first, int max, bl_index_pred_t *pred) {
+    char *end;
+    int n = strtol(s, &end, 10);
+
+    pred->kind = BL_INDEX_PRED_CODE;
+    pred->op = 'g';
+    pred->value = 1;
+    pred->code = first + n - 1;
+
+    return end != s && *end == 0 && n >= 1 && n <= max;
+}
+
+int
+bl_index_query_parse(bl_index_query_t *query, char **preds, int npreds, char *errmsg, int errlen) {
+    query->n = 0;
+
+    for (int i=0; i<npreds; i++) {
+        bl_index_pred_t *pred = &query->preds[query->n];
+        char *s = preds[i];
+        char *end = NULL;
+        int ok = FALSE;
+
+        if (query->n == BL_INDEX_QUERY_MAX) {
+            snprintf(errmsg, errlen, "too many predicates, at most %d", BL_INDEX_QUERY_MAX);
+            return FALSE;
+        }
+        memset(pred, 0, sizeof(bl_index_pred_t));
+        if (strncmp(s, "layers", 6) == 0) {
+            pred->kind = BL_INDEX_PRED_LAYERS;
+            ok = bl_index_parse_op(s + 6, pred) > 0;
+        } else if (strncmp(s, "code:", 5) == 0) {
+            pred->kind = BL_INDEX_PRED_CODE;
+            ok = (end = bl_index_parse_code(s + 5, &pred->code)) != NULL && bl_index_parse_op(end, pred) > 0;
+        } else if (strncmp(s, "uses:", 5) == 0) {
+            pred->kind = BL_INDEX_PRED_CODE;
+            pred->op = 'g';
+            pred->value = 1;
+            ok = (end = bl_index_parse_code(s + 5, &pred->code)) != NULL && *end == 0;
+        } else if (strncmp(s, "macro:", 6) == 0) {
+            ok = bl_index_parse_number(s + 6, MACRO_1, NUM_MACROKEYS, pred);
+        } else if (strncmp(s, "toggle:", 7) == 0) {
+            ok = bl_index_parse_number(s + 7, TLAYER_0, NUMLAYERS_MAX, pred);
+        } else if (strncmp(s, "momentary:", 10) == 0) {
+            ok = bl_index_parse_number(s + 10, MLAYER_0, NUMLAYERS_MAX, pred);
+        } else if (strncmp(s, "at:", 3) == 0) {
+            int layer, row, col, consumed = 0;
+            pred->kind = BL_INDEX_PRED_AT;
+            if (sscanf(s + 3, "%d.%d.%d=%n", &layer, &row, &col, &consumed) == 3 && consumed > 0 &&
+                layer >= 1 && layer <= NUMLAYERS_MAX && row >= 0 && row < NUMROWS && col >= 0 && col < NUMCOLS) {
+                pred->layer = layer - 1;
+                pred->pos = row * NUMCOLS + col;
+                ok = (end = bl_index_parse_code(s + 3 + consumed, &pred->code)) != NULL && *end == 0;
+                if (ok && layer > 1 && !bl_index_is_special(pred->code)) {
+                    // above layer 1 only the positions of the macro and layer keys are indexed
+                    snprintf(errmsg, errlen, "at: only matches macro and layer keys above layer 1: %s", s);
+                    return FALSE;
+                }
+            }
+        } else if (strncmp(s, "hash:", 5) == 0) {
+            pred->kind = BL_INDEX_PRED_HASH;
+            pred->hash = strtoull(s + 5, &end, 16);
+            ok = end != s + 5 && *end == 0;
+        }
+        if (!ok) {
+            snprintf(errmsg, errlen, "invalid predicate: %s", s);
+            return FALSE;
+        }
+        query->n++;
+    }
+
+    return TRUE;
+}
+
+static int
+bl_index_compare(int a, int op, int b) {
+    switch (op) {
+        case '=': return a == b;
+        case '!': return a != b;
+        case '<': return a < b;
+        case '>': return a > b;
+        case 'l': return a <= b;
+        case 'g': return a >= b;
+        default: return FALSE;
+    }
+}
+
+/*
+ * Number of keys with the code, binary search in the sorted codes
+ */
+static int
+bl_index_count(uint8_t *codes, int ncodes, uint16_t code) {
+    int lo = 0;
+    int hi = ncodes - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        uint16_t c = bl_index_get16(codes + 4 * mid);
+        if (c == code) {
+            return bl_index_get16(codes + 4 * mid + 2);
+        } else if (c < code) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return 0;
+}
+
+int
+bl_index_match(bl_index_t *index, uint32_t i, bl_index_query_t *query) {
+    uint8_t *entry = index->entries + i * BL_INDEX_ENTRY_SIZE;
+    int nlayers = bl_index_get16(entry + 12);
+    int ncodes = bl_index_get16(entry + 14);
+    int nspecial = bl_index_get16(entry + 16);
+    uint8_t *codes = index->blobs + bl_index_get32(entry + 20);
+    uint8_t *special = codes + 4 * ncodes;
+    uint8_t *layer = special + 4 * nspecial;
+
+    for (int n=0; n<query->n; n++) {
+        bl_index_pred_t *pred = &query->preds[n];
+        int ok = FALSE;
+
+        switch (pred->kind) {
+            case BL_INDEX_PRED_LAYERS:
+                ok = bl_index_compare(nlayers, pred->op, pred->value);
+                break;
+            case BL_INDEX_PRED_CODE:
+                ok = bl_index_compare(bl_index_count(codes, ncodes, pred->code), pred->op, pred->value);
+                break;
+            case BL_INDEX_PRED_AT:
+                if (pred->layer == 0) {
+                    ok = bl_index_get16(layer + 2 * pred->pos) == pred->code;
+                    break;
+                }
+                for (int k=0; k<nspecial && !ok; k++) {
+                    uint8_t *p = special + 4 * k;
+                    ok = p[2] == pred->layer && p[3] == pred->pos && bl_index_get16(p) == pred->code;
+                }
+                break;
+            case BL_INDEX_PRED_HASH:
+                ok = bl_index_hash(index, i) == pred->hash;
+                break;
+        }
+        if (!ok) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
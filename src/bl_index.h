@@ -0,0 +1,162 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_INDEX_H__
+#define __BL_INDEX_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "usb.h"
+
+/*
+ * An index over a directory tree of layout files, to answer questions like
+ * "which layouts use Macro 12" without parsing the files. For every layout
+ * the index holds its hash, the number of layers, how often every key code
+ * occurs, the positions of the macro and layer keys and all codes of
+ * layer 1. The index file is mapped into memory when queried.
+ *
+ * File format, all numbers little endian:
+ *
+ *   header    magic "BLIX", version, number of layouts and the offsets of
+ *             the layout table, the data and the paths (4 bytes each)
+ *   layouts   per layout the offset of its path, the 64 bit hash of the
+ *             key codes (see bl_kernel_hash()), the number of layers, the
+ *             number of distinct codes, the number of special keys
+ *             (2 bytes each, then 2 bytes padding) and the offset of its
+ *             data (4 bytes)
+ *   data      per layout the distinct codes in ascending order with their
+ *             count (2 + 2 bytes), then the special keys as code, layer
+ *             and row * NUMCOLS + col (2 + 1 + 1 bytes), then the NUMKEYS
+ *             codes of layer 1 by row and column (2 bytes each)
+ *   paths     the root of the tree, then the paths relative to the root,
+ *             0 terminated
+ */
+#define BL_INDEX_MAGIC "BLIX"
+#define BL_INDEX_VERSION 3
+#define BL_INDEX_HEADER_SIZE 24
+#define BL_INDEX_ENTRY_SIZE 24
+#define BL_INDEX_LAYER_SIZE (2 * NUMKEYS)
+
+/*
+ * Maximum number of predicates in a query
+ */
+#define BL_INDEX_QUERY_MAX 32
+
+typedef struct bl_index_t {
+    uint8_t *data;
+    size_t size;
+    uint32_t nlayouts;
+    uint8_t *entries;
+    uint8_t *blobs;
+    uint8_t *paths;
+} bl_index_t;
+
+/*
+ * A single condition on a layout, see bl_index_query_parse()
+ */
+typedef struct bl_index_pred_t {
+    int kind;
+    // comparison, one of '=', '!', '<', '>', 'l' (<=) and 'g' (>=)
+    int op;
+    int value;
+    uint16_t code;
+    int layer;
+    int pos;
+    uint64_t hash;
+} bl_index_pred_t;
+
+typedef struct bl_index_query_t {
+    int n;
+    bl_index_pred_t preds[BL_INDEX_QUERY_MAX];
+} bl_index_query_t;
+
+/**
+ * Parse the layout files in the directory tree in parallel and write the
+ * index. Files that are not layouts are skipped.
+ *
+ * @param nworkers Number of threads, <= 0 to use one per cpu
+ * @param nindexed Set to the number of layouts in the index
+ * @param nskipped Set to the number of files that could not be parsed
+ *
+ * @return TRUE if successful, FALSE if the index could not be written and
+ * errno is set.
+ */
+int bl_index_build(char *root, char *fname, int nworkers, int *nindexed, int *nskipped);
+
+/**
+ * Map an index file into memory and check its header.
+ *
+ * @return The index or NULL, the reason is stored in errmsg.
+ */
+bl_index_t *bl_index_open(char *fname, char *errmsg, int errlen);
+void bl_index_close(bl_index_t *index);
+
+/**
+ * @return The directory the index was built from
+ */
+char *bl_index_root(bl_index_t *index);
+
+/**
+ * @return The path of layout i relative to the root
+ */
+char *bl_index_path(bl_index_t *index, uint32_t i);
+
+/**
+ * Parse the predicates of a query, a layout matches if all predicates
+ * hold. N is a number, CODE a key code (decimal or 0x hex) and OP one of
+ * = != < > <= >=.
+ *
+ *   layersOPN        number of layers
+ *   code:CODEOPN     number of keys with the code, on all layers
+ *   uses:CODE        the code is used at least once
+ *   macro:N          Macro N (1-24) is used
+ *   toggle:N         a key toggles layer N
+ *   momentary:N      a key switches to layer N while pressed
+ *   at:L.R.C=CODE    the key in layer L (1-6), row R and column C holds
+ *                    CODE, above layer 1 only macro and layer keys are
+ *                    indexed by position
+ *   hash:HEX         the layout has this hash
+ *
+ * @return TRUE if successful, otherwise FALSE and the reason is stored in
+ * errmsg.
+ */
+int bl_index_query_parse(bl_index_query_t *query, char **preds, int npreds, char *errmsg, int errlen);
+
+/**
+ * @return TRUE if layout i matches the query
+ */
+int bl_index_match(bl_index_t *index, uint32_t i, bl_index_query_t *query);
+
+/**
+ * @return The hash of layout i
+ */
+uint64_t bl_index_hash(bl_index_t *index, uint32_t i);
+
+#endif /* __BL_INDEX_H__ */
@@ -27,8 +27,26 @@
  * SUCH DAMAGE. *
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
 #include "bl_io.h"
 
+/*
+ * Directory listing cache, see bl_io_dir_cache_get()
+ */
+static bl_io_dir_t *_bl_io_cache[BL_IO_CACHE_SIZE];
+static unsigned long _bl_io_cache_clock = 0;
+static int _bl_io_inotify_fd = -1;
+
 int
 bl_io_sort_by_fname(const void *s1, const void *s2) {
     bl_io_dirent_t *d1 = (bl_io_dirent_t *) s1;
@@ -41,6 +59,9 @@ bl_io_sort_by_fname(const void *s1, const void *s2) {
  * Sort function that sorts directories first and then normal files.
  * The arguments to the function are of type bl_io_dirent_t *
  *
+ * The '..' entry and directories are recognized by their rank, which is
+ * determined once when the entry is read.
+ *
  * @param s1 first argument
  * @param s2 second argument
  *
@@ -55,66 +76,290 @@ bl_io_sort_by_fname_and_dir(const void *s1, const void *s2) {
     bl_io_dirent_t *d1 = (bl_io_dirent_t *) s1;
     bl_io_dirent_t *d2 = (bl_io_dirent_t *) s2;
 
-    /* .. always on top */
-    if (strcmp(d1->name, "..") == 0) {
-        return -1;
+    if (d1->rank != d2->rank) {
+        return d1->rank < d2->rank ? -1 : 1;
     }
-    if (strcmp(d2->name, "..") == 0) {
-        return 1;
+    return strcmp(d1->name, d2->name);
+}
+
+bl_io_dir_t *
+bl_io_dir_open(char *dname) {
+    /*
+     * Keep a separate descriptor for fstatat, it must stay valid after the
+     * directory stream has been closed.
+     */
+    int fd = open(dname, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return NULL;
     }
-    /* directories first, other files next */
-    if (S_ISDIR(d1->fstatus.st_mode) && S_ISDIR(d2->fstatus.st_mode)) {
-        return strcmp(d1->name, d2->name);
+    DIR *handle = opendir(dname);
+    if (handle == NULL) {
+        close(fd);
+        return NULL;
     }
-    if (S_ISDIR(d1->fstatus.st_mode)) {
-        return -1;
+
+    bl_io_dir_t *dir = (bl_io_dir_t *) malloc(sizeof(bl_io_dir_t));
+    dir->n = 0;
+    dir->size = 0;
+    dir->dirs = NULL;
+    dir->handle = handle;
+    dir->fd = fd;
+    dir->path = NULL;
+    dir->wd = -1;
+    dir->last_used = 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        dir->mtime = st.st_mtim;
+    } else {
+        dir->mtime.tv_sec = 0;
+        dir->mtime.tv_nsec = 0;
     }
-    if (S_ISDIR(d2->fstatus.st_mode)) {
-        return 1;
+
+    return dir;
+}
+
+/*
+ * Determine if the entry is a directory, use d_type if the filesystem
+ * supports it, otherwise fall back on fstatat. Symbolic links are not
+ * followed, just like lstat.
+ */
+static void
+bl_io_dirent_init(bl_io_dir_t *dir, bl_io_dirent_t *dirent, struct dirent *dire) {
+    dirent->name = strdup(dire->d_name);
+    dirent->has_stat = FALSE;
+    dirent->is_dir = FALSE;
+#ifdef _DIRENT_HAVE_D_TYPE
+    if (dire->d_type != DT_UNKNOWN) {
+        dirent->is_dir = dire->d_type == DT_DIR;
+    } else
+#endif
+    {
+        struct stat *st = bl_io_dirent_stat(dir, dirent);
+        dirent->is_dir = st != NULL && S_ISDIR(st->st_mode);
+    }
+
+    if (strcmp(dirent->name, "..") == 0) {
+        dirent->rank = BL_IO_RANK_PARENT;
+    } else if (dirent->is_dir) {
+        dirent->rank = BL_IO_RANK_DIR;
+    } else {
+        dirent->rank = BL_IO_RANK_FILE;
     }
-    return strcmp(d1->name, d2->name);
+}
+
+int
+bl_io_dir_read_page(bl_io_dir_t *dir, int max) {
+    if (dir->handle == NULL || max <= 0) {
+        return 0;
+    }
+
+    /*
+     * Read and sort the new page
+     */
+    int n_page = 0;
+    int size_page = MIN(max, BL_IO_FIRST_PAGE);
+    bl_io_dirent_t *page = (bl_io_dirent_t *) malloc(size_page * sizeof(bl_io_dirent_t));
+    struct dirent *dire;
+    while (n_page < max && (dire = readdir(dir->handle)) != NULL) {
+        /* skip '.' dir */
+        if (dire->d_name[0] == '.' && dire->d_name[1] == 0) {
+            continue;
+        }
+        if (n_page == size_page) {
+            size_page = MIN(2 * size_page, max);
+            page = (bl_io_dirent_t *) realloc(page, size_page * sizeof(bl_io_dirent_t));
+        }
+        bl_io_dirent_init(dir, &page[n_page++], dire);
+    }
+    if (n_page < max) {
+        /* end of directory */
+        closedir(dir->handle);
+        dir->handle = NULL;
+    }
+    qsort(page, n_page, sizeof(bl_io_dirent_t), bl_io_sort_by_fname_and_dir);
+
+    /*
+     * Merge the page with the entries read so far
+     */
+    if (dir->n + n_page > dir->size) {
+        dir->size = MAX(2 * dir->size, dir->n + n_page);
+    }
+    bl_io_dirent_t *merged = (bl_io_dirent_t *) malloc(dir->size * sizeof(bl_io_dirent_t));
+    int i = 0, j = 0, k = 0;
+    while (i < dir->n && j < n_page) {
+        if (bl_io_sort_by_fname_and_dir(&dir->dirs[i], &page[j]) <= 0) {
+            merged[k++] = dir->dirs[i++];
+        } else {
+            merged[k++] = page[j++];
+        }
+    }
+    while (i < dir->n) {
+        merged[k++] = dir->dirs[i++];
+    }
+    while (j < n_page) {
+        merged[k++] = page[j++];
+    }
+    free(dir->dirs);
+    free(page);
+    dir->dirs = merged;
+    dir->n = k;
+
+    return n_page;
+}
+
+int
+bl_io_dir_is_complete(bl_io_dir_t *dir) {
+    return dir->handle == NULL;
 }
 
 bl_io_dir_t *
 bl_io_read_directory(char *dname) {
-    DIR *dir;
-
-    dir = opendir(dname);
+    bl_io_dir_t *dir = bl_io_dir_open(dname);
     if (dir == NULL) {
         errmsg_and_abort("Can't open directory: %s", dname);
         return NULL;
     }
+
     /*
-     * Get nr of dir entries
+     * Let the pages grow with the number of entries, that way the total
+     * cost of merging stays O(n log n).
      */
-    bl_io_dir_t *io_dir = (bl_io_dir_t *) malloc(sizeof(bl_io_dir_t));
-    io_dir->n = 0;
-    while (readdir(dir) != NULL) {
-        io_dir->n++;
+    while (bl_io_dir_read_page(dir, MAX(BL_IO_FIRST_PAGE, dir->n)) > 0)
+        ;
+
+    return dir;
+}
+
+struct stat *
+bl_io_dirent_stat(bl_io_dir_t *dir, bl_io_dirent_t *dirent) {
+    if (!dirent->has_stat) {
+        if (fstatat(dir->fd, dirent->name, &dirent->fstatus, AT_SYMLINK_NOFOLLOW) != 0) {
+            return NULL;
+        }
+        dirent->has_stat = TRUE;
     }
-    rewinddir(dir);
 
+    return &dirent->fstatus;
+}
+
+/*
+ * Remove the cache entry at index i.
+ */
+static void
+bl_io_dir_cache_remove(int i) {
+    bl_io_dir_t *dir = _bl_io_cache[i];
+#ifdef __linux__
+    if (dir->wd >= 0) {
+        inotify_rm_watch(_bl_io_inotify_fd, dir->wd);
+    }
+#endif
+    bl_io_dir_destroy(dir);
+    _bl_io_cache[i] = NULL;
+}
+
+/*
+ * Drop the cache entries that have changed since they were read.
+ */
+static void
+bl_io_dir_cache_invalidate() {
+#ifdef __linux__
+    if (_bl_io_inotify_fd >= 0) {
+        char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(_bl_io_inotify_fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *event = (struct inotify_event *) p;
+                for (int i=0; i<BL_IO_CACHE_SIZE; i++) {
+                    if (_bl_io_cache[i] != NULL && _bl_io_cache[i]->wd == event->wd) {
+                        if (event->mask & IN_IGNORED) {
+                            /* the watch is already gone */
+                            _bl_io_cache[i]->wd = -1;
+                        }
+                        bl_io_dir_cache_remove(i);
+                    }
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+#endif
     /*
-     * Allocate and read all entries
+     * Directories without a watch, e.g. when inotify_add_watch() failed,
+     * are compared by modification time
      */
-    io_dir->dirs = (bl_io_dirent_t *) malloc( io_dir->n * sizeof(bl_io_dirent_t) );
-    int i = 0;
-    while (i<io_dir->n) {
-        struct dirent *dire = readdir(dir);
-        /* skip '.' dir */
-        if (strcmp(dire->d_name, ".") != 0) {
-            io_dir->dirs[i].name = strdup(dire->d_name);
-            lstat(io_dir->dirs[i].name, &io_dir->dirs[i].fstatus);
-            i++;
-        } else {
-            io_dir->n--;
+    for (int i=0; i<BL_IO_CACHE_SIZE; i++) {
+        bl_io_dir_t *dir = _bl_io_cache[i];
+        struct stat st;
+        if (dir != NULL && dir->wd < 0 && (stat(dir->path, &st) != 0 ||
+                                           st.st_mtim.tv_sec != dir->mtime.tv_sec ||
+                                           st.st_mtim.tv_nsec != dir->mtime.tv_nsec)) {
+            bl_io_dir_cache_remove(i);
+        }
+    }
+}
+
+bl_io_dir_t *
+bl_io_dir_cache_get(char *path) {
+#ifdef __linux__
+    if (_bl_io_inotify_fd < 0) {
+        _bl_io_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+#endif
+    bl_io_dir_cache_invalidate();
+
+    int i_free = -1;
+    for (int i=0; i<BL_IO_CACHE_SIZE; i++) {
+        if (_bl_io_cache[i] == NULL) {
+            i_free = i;
+        } else if (strcmp(_bl_io_cache[i]->path, path) == 0) {
+            _bl_io_cache[i]->last_used = ++_bl_io_cache_clock;
+            return _bl_io_cache[i];
+        }
+    }
+
+    if (i_free < 0) {
+        /* evict the least recently used entry */
+        i_free = 0;
+        for (int i=1; i<BL_IO_CACHE_SIZE; i++) {
+            if (_bl_io_cache[i]->last_used < _bl_io_cache[i_free]->last_used) {
+                i_free = i;
+            }
         }
+        bl_io_dir_cache_remove(i_free);
     }
-    closedir(dir);
 
-    qsort(io_dir->dirs, io_dir->n, sizeof(bl_io_dirent_t), bl_io_sort_by_fname_and_dir);
+    bl_io_dir_t *dir = bl_io_dir_open(path);
+    if (dir == NULL) {
+        return NULL;
+    }
+    dir->path = strdup(path);
+    dir->last_used = ++_bl_io_cache_clock;
+#ifdef __linux__
+    if (_bl_io_inotify_fd >= 0) {
+        dir->wd = inotify_add_watch(_bl_io_inotify_fd, path,
+                                    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+#endif
+    _bl_io_cache[i_free] = dir;
 
-    return io_dir;
+    return dir;
+}
+
+void
+bl_io_dir_cache_clear() {
+    for (int i=0; i<BL_IO_CACHE_SIZE; i++) {
+        if (_bl_io_cache[i] != NULL) {
+            bl_io_dir_cache_remove(i);
+        }
+    }
+#ifdef __linux__
+    if (_bl_io_inotify_fd >= 0) {
+        close(_bl_io_inotify_fd);
+        _bl_io_inotify_fd = -1;
+    }
+#endif
 }
 
 void
@@ -122,6 +367,11 @@ bl_io_dir_destroy(bl_io_dir_t *dir) {
     for (int i=0; i<dir->n; i++) {
         bl_io_dirent_destroy(&dir->dirs[i]);
     }
+    if (dir->handle != NULL) {
+        closedir(dir->handle);
+    }
+    close(dir->fd);
+    free(dir->path);
     free(dir->dirs);
     free(dir);
 
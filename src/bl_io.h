@@ -37,17 +37,117 @@
 #ifndef __BL_IO_H__
 #define __BL_IO_H__ 1
 
+/*
+ * Sort rank of a directory entry, entries are ordered by rank first and
+ * then by name.
+ */
+#define BL_IO_RANK_PARENT 0
+#define BL_IO_RANK_DIR    1
+#define BL_IO_RANK_FILE   2
+
+/*
+ * Number of entries read for the first page of a directory, this should
+ * be at least a screenful of rows.
+ */
+#define BL_IO_FIRST_PAGE 64
+
 typedef struct bl_io_dirent_t {
     char *name;
+    /*
+     * Only valid if has_stat is TRUE, see bl_io_dirent_stat()
+     */
     struct stat fstatus;
+    int has_stat;
+    int is_dir;
+    int rank;
 } bl_io_dirent_t;
 
 typedef struct bl_io_dir_t {
     int n;
+    // allocated number of entries in dirs
+    int size;
     bl_io_dirent_t *dirs;
+    // open directory stream, NULL when all entries have been read
+    DIR *handle;
+    // file descriptor of the directory, used for fstatat(), stays open until destroyed
+    int fd;
+    /*
+     * Cache bookkeeping, see bl_io_dir_cache_get()
+     */
+    char *path;
+    // inotify watch descriptor, -1 if not watched
+    int wd;
+    // modification time of the directory when it was opened
+    struct timespec mtime;
+    unsigned long last_used;
 } bl_io_dir_t;
 
+/*
+ * Maximum number of directory listings kept in the cache
+ */
+#define BL_IO_CACHE_SIZE 16
+
+/**
+ * Open a directory for reading, no entries are read yet. Use
+ * bl_io_dir_read_page() to read the entries in pages.
+ *
+ * @param dname Directory name
+ *
+ * @return The directory or NULL if it could not be opened, must be
+ *         destroyed with bl_io_dir_destroy().
+ */
+bl_io_dir_t *bl_io_dir_open(char *dname);
+
+/**
+ * Read at most max entries from the directory and merge them into the
+ * already sorted list of entries, '..' first, then directories, then files.
+ *
+ * @param dir Directory opened with bl_io_dir_open()
+ * @param max Maximum number of entries to read
+ *
+ * @return the number of entries added, 0 if all entries have been read.
+ */
+int bl_io_dir_read_page(bl_io_dir_t *dir, int max);
+
+/**
+ * Return TRUE if all entries of the directory have been read.
+ */
+int bl_io_dir_is_complete(bl_io_dir_t *dir);
+
+/**
+ * Read and sort all entries of the directory in one go.
+ */
 bl_io_dir_t *bl_io_read_directory(char *dname);
+
+/**
+ * Return the status of the directory entry, it is only fetched (using
+ * fstatat) the first time it is needed.
+ *
+ * @return the status or NULL if the entry could not be stat'ed.
+ */
+struct stat *bl_io_dirent_stat(bl_io_dir_t *dir, bl_io_dirent_t *dirent);
+
+/**
+ * Return the listing of the directory from the cache, open it if it is not
+ * cached yet or if the directory has changed since it was cached. Changes
+ * are detected with inotify where available, by comparing the modification
+ * time of the directory elsewhere.
+ *
+ * The least recently used listing is dropped when the cache is full.
+ *
+ * @param path Absolute, canonical path of the directory (see realpath()).
+ *
+ * @return The directory, which may be only partially read, or NULL if it
+ *         could not be opened. The directory is owned by the cache and
+ *         stays valid until the next call, it must not be destroyed.
+ */
+bl_io_dir_t *bl_io_dir_cache_get(char *path);
+
+/**
+ * Drop all cached directory listings and release the inotify watches.
+ */
+void bl_io_dir_cache_clear();
+
 void bl_io_dir_destroy(bl_io_dir_t *dir);
 void bl_io_dirent_destroy(bl_io_dirent_t *dirent);
 
@@ -0,0 +1,358 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "blusb.h"
+#include "bl_kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BL_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+#define BL_KERNEL_FNV32_BASIS 0x811c9dc5u
+#define BL_KERNEL_FNV32_PRIME 0x01000193u
+#define BL_KERNEL_FNV64_BASIS 0xcbf29ce484222325ULL
+#define BL_KERNEL_FNV64_PRIME 0x100000001b3ULL
+
+typedef struct bl_kernel_ops_t {
+    void (*hash)(const uint16_t *codes, int n, uint32_t *lanes);
+    int (*equal)(const uint16_t *a, const uint16_t *b, int n);
+    int (*count_range)(const uint16_t *codes, int n, uint16_t lo, uint16_t hi);
+} bl_kernel_ops_t;
+
+static char *_bl_kernel_names[] = { "scalar", "sse2", "avx2" };
+
+static pthread_once_t _bl_kernel_once = PTHREAD_ONCE_INIT;
+static int _bl_kernel_impl = BL_KERNEL_SCALAR;
+
+/*
+ * Scalar implementations, the reference for the others
+ */
+static void
+bl_kernel_hash_scalar(const uint16_t *codes, int n, uint32_t *lanes) {
+    for (int i=0; i<n; i+=BL_KERNEL_HASH_LANES) {
+        for (int j=0; j<BL_KERNEL_HASH_LANES; j++) {
+            lanes[j] = (lanes[j] ^ codes[i + j]) * BL_KERNEL_FNV32_PRIME;
+        }
+    }
+}
+
+static int
+bl_kernel_equal_scalar(const uint16_t *a, const uint16_t *b, int n) {
+    return memcmp(a, b, n * sizeof(uint16_t)) == 0;
+}
+
+static int
+bl_kernel_count_range_scalar(const uint16_t *codes, int n, uint16_t lo, uint16_t hi) {
+    int count = 0;
+    for (int i=0; i<n; i++) {
+        count += (uint16_t) (codes[i] - lo) <= (uint16_t) (hi - lo);
+    }
+    return count;
+}
+
+#ifdef BL_KERNEL_X86
+
+/*
+ * SSE2 has no 32 bit multiply, multiply the even and odd lanes with
+ * pmuludq and interleave the low halves
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+bl_kernel_mullo32_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static void
+bl_kernel_hash_sse2(const uint16_t *codes, int n, uint32_t *lanes) {
+    __m128i prime = _mm_set1_epi32(BL_KERNEL_FNV32_PRIME);
+    __m128i zero = _mm_setzero_si128();
+    __m128i h[4];
+
+    for (int k=0; k<4; k++) {
+        h[k] = _mm_loadu_si128((__m128i *) (lanes + 4 * k));
+    }
+    for (int i=0; i<n; i+=BL_KERNEL_HASH_LANES) {
+        __m128i lo = _mm_loadu_si128((__m128i *) (codes + i));
+        __m128i hi = _mm_loadu_si128((__m128i *) (codes + i + 8));
+        h[0] = bl_kernel_mullo32_sse2(_mm_xor_si128(h[0], _mm_unpacklo_epi16(lo, zero)), prime);
+        h[1] = bl_kernel_mullo32_sse2(_mm_xor_si128(h[1], _mm_unpackhi_epi16(lo, zero)), prime);
+        h[2] = bl_kernel_mullo32_sse2(_mm_xor_si128(h[2], _mm_unpacklo_epi16(hi, zero)), prime);
+        h[3] = bl_kernel_mullo32_sse2(_mm_xor_si128(h[3], _mm_unpackhi_epi16(hi, zero)), prime);
+    }
+    for (int k=0; k<4; k++) {
+        _mm_storeu_si128((__m128i *) (lanes + 4 * k), h[k]);
+    }
+}
+
+__attribute__((target("sse2")))
+static int
+bl_kernel_equal_sse2(const uint16_t *a, const uint16_t *b, int n) {
+    int i = 0;
+    for (; i + 32 <= n; i+=32) {
+        __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((__m128i *) (a + i)), _mm_loadu_si128((__m128i *) (b + i)));
+        for (int k=8; k<32; k+=8) {
+            eq = _mm_and_si128(eq, _mm_cmpeq_epi16(_mm_loadu_si128((__m128i *) (a + i + k)),
+                                                   _mm_loadu_si128((__m128i *) (b + i + k))));
+        }
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            return FALSE;
+        }
+    }
+    return bl_kernel_equal_scalar(a + i, b + i, n - i);
+}
+
+/*
+ * c - lo <= hi - lo unsigned, with a saturating subtract: the difference
+ * is 0 for the codes in range. A match is -1 in its lane, the lanes are
+ * summed at the end, n is at most NUMLAYERS_MAX * NUMKEYS so the 16 bit
+ * lanes don't overflow.
+ */
+__attribute__((target("sse2")))
+static int
+bl_kernel_count_range_sse2(const uint16_t *codes, int n, uint16_t lo, uint16_t hi) {
+    __m128i vlo = _mm_set1_epi16(lo);
+    __m128i span = _mm_set1_epi16(hi - lo);
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+    uint16_t lanes[8];
+    int count = 0;
+    int i = 0;
+
+    for (; i + 8 <= n; i+=8) {
+        __m128i d = _mm_sub_epi16(_mm_loadu_si128((__m128i *) (codes + i)), vlo);
+        sum = _mm_sub_epi16(sum, _mm_cmpeq_epi16(_mm_subs_epu16(d, span), zero));
+    }
+    _mm_storeu_si128((__m128i *) lanes, sum);
+    for (int k=0; k<8; k++) {
+        count += lanes[k];
+    }
+    return count + bl_kernel_count_range_scalar(codes + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void
+bl_kernel_hash_avx2(const uint16_t *codes, int n, uint32_t *lanes) {
+    __m256i prime = _mm256_set1_epi32(BL_KERNEL_FNV32_PRIME);
+    __m256i h0 = _mm256_loadu_si256((__m256i *) lanes);
+    __m256i h1 = _mm256_loadu_si256((__m256i *) (lanes + 8));
+
+    for (int i=0; i<n; i+=BL_KERNEL_HASH_LANES) {
+        __m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *) (codes + i)));
+        __m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *) (codes + i + 8)));
+        h0 = _mm256_mullo_epi32(_mm256_xor_si256(h0, lo), prime);
+        h1 = _mm256_mullo_epi32(_mm256_xor_si256(h1, hi), prime);
+    }
+    _mm256_storeu_si256((__m256i *) lanes, h0);
+    _mm256_storeu_si256((__m256i *) (lanes + 8), h1);
+}
+
+__attribute__((target("avx2")))
+static int
+bl_kernel_equal_avx2(const uint16_t *a, const uint16_t *b, int n) {
+    int i = 0;
+    for (; i + 32 <= n; i+=32) {
+        __m256i eq = _mm256_and_si256(
+            _mm256_cmpeq_epi16(_mm256_loadu_si256((__m256i *) (a + i)), _mm256_loadu_si256((__m256i *) (b + i))),
+            _mm256_cmpeq_epi16(_mm256_loadu_si256((__m256i *) (a + i + 16)), _mm256_loadu_si256((__m256i *) (b + i + 16))));
+        if (_mm256_movemask_epi8(eq) != -1) {
+            return FALSE;
+        }
+    }
+    return bl_kernel_equal_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int
+bl_kernel_count_range_avx2(const uint16_t *codes, int n, uint16_t lo, uint16_t hi) {
+    __m256i vlo = _mm256_set1_epi16(lo);
+    __m256i span = _mm256_set1_epi16(hi - lo);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sum = _mm256_setzero_si256();
+    uint16_t lanes[16];
+    int count = 0;
+    int i = 0;
+
+    for (; i + 16 <= n; i+=16) {
+        __m256i d = _mm256_sub_epi16(_mm256_loadu_si256((__m256i *) (codes + i)), vlo);
+        sum = _mm256_sub_epi16(sum, _mm256_cmpeq_epi16(_mm256_subs_epu16(d, span), zero));
+    }
+    _mm256_storeu_si256((__m256i *) lanes, sum);
+    for (int k=0; k<16; k++) {
+        count += lanes[k];
+    }
+    return count + bl_kernel_count_range_scalar(codes + i, n - i, lo, hi);
+}
+
+#endif /* BL_KERNEL_X86 */
+
+static const bl_kernel_ops_t _bl_kernel_ops[] = {
+    { bl_kernel_hash_scalar, bl_kernel_equal_scalar, bl_kernel_count_range_scalar },
+#ifdef BL_KERNEL_X86
+    { bl_kernel_hash_sse2, bl_kernel_equal_sse2, bl_kernel_count_range_sse2 },
+    { bl_kernel_hash_avx2, bl_kernel_equal_avx2, bl_kernel_count_range_avx2 },
+#endif
+};
+
+static const bl_kernel_ops_t *_bl_kernel = &_bl_kernel_ops[BL_KERNEL_SCALAR];
+
+int
+bl_kernel_supported(int impl) {
+    switch (impl) {
+        case BL_KERNEL_SCALAR:
+            return TRUE;
+#ifdef BL_KERNEL_X86
+        case BL_KERNEL_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case BL_KERNEL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+static void
+bl_kernel_init() {
+    char *name = getenv(BL_KERNEL_ENV);
+
+    for (int impl=BL_KERNEL_AVX2; impl>=BL_KERNEL_SCALAR; impl--) {
+        if (name != NULL && strcmp(name, _bl_kernel_names[impl]) != 0) {
+            continue;
+        }
+        if (bl_kernel_supported(impl)) {
+            _bl_kernel_impl = impl;
+            _bl_kernel = &_bl_kernel_ops[impl];
+            return;
+        }
+    }
+}
+
+int
+bl_kernel_select(int impl) {
+    pthread_once(&_bl_kernel_once, bl_kernel_init);
+    if (!bl_kernel_supported(impl)) {
+        return FALSE;
+    }
+    _bl_kernel_impl = impl;
+    _bl_kernel = &_bl_kernel_ops[impl];
+
+    return TRUE;
+}
+
+int
+bl_kernel_impl() {
+    pthread_once(&_bl_kernel_once, bl_kernel_init);
+    return _bl_kernel_impl;
+}
+
+char *
+bl_kernel_name(int impl) {
+    return impl >= BL_KERNEL_SCALAR && impl <= BL_KERNEL_AVX2 ? _bl_kernel_names[impl] : "unknown";
+}
+
+uint64_t
+bl_kernel_hash(const uint16_t *codes, int n) {
+    uint32_t lanes[BL_KERNEL_HASH_LANES];
+
+    pthread_once(&_bl_kernel_once, bl_kernel_init);
+    for (int j=0; j<BL_KERNEL_HASH_LANES; j++) {
+        lanes[j] = BL_KERNEL_FNV32_BASIS + j;
+    }
+    _bl_kernel->hash(codes, n, lanes);
+
+    uint64_t hash = BL_KERNEL_FNV64_BASIS ^ n;
+    for (int j=0; j<BL_KERNEL_HASH_LANES; j++) {
+        hash = (hash ^ lanes[j]) * BL_KERNEL_FNV64_PRIME;
+        hash ^= hash >> 32;
+    }
+
+    return hash;
+}
+
+int
+bl_kernel_equal(const uint16_t *a, const uint16_t *b, int n) {
+    pthread_once(&_bl_kernel_once, bl_kernel_init);
+    return _bl_kernel->equal(a, b, n);
+}
+
+int
+bl_kernel_count_range(const uint16_t *codes, int n, uint16_t lo, uint16_t hi) {
+    pthread_once(&_bl_kernel_once, bl_kernel_init);
+    return _bl_kernel->count_range(codes, n, lo, hi);
+}
+
+/*
+ * There is no scatter before AVX-512, so the histogram is scalar in all
+ * implementations. Two sets of bins are counted alternately, so runs of
+ * the same code (e.g. unused keys) don't wait for the previous increment.
+ */
+void
+bl_kernel_histogram(const uint16_t *codes, int n, bl_kernel_hist_t *hist) {
+    uint16_t odd[BL_KERNEL_HIST_BINS];
+
+    memset(hist->bins, 0, sizeof(hist->bins));
+    memset(odd, 0, sizeof(odd));
+    hist->nother = 0;
+    for (int i=0; i+1<n; i+=2) {
+        uint16_t a = codes[i];
+        uint16_t b = codes[i + 1];
+        if (a < BL_KERNEL_HIST_BINS) {
+            hist->bins[a]++;
+        } else {
+            hist->other[hist->nother++] = a;
+        }
+        if (b < BL_KERNEL_HIST_BINS) {
+            odd[b]++;
+        } else {
+            hist->other[hist->nother++] = b;
+        }
+    }
+    if (n % 2 == 1) {
+        uint16_t a = codes[n - 1];
+        if (a < BL_KERNEL_HIST_BINS) {
+            hist->bins[a]++;
+        } else {
+            hist->other[hist->nother++] = a;
+        }
+    }
+    for (int i=0; i<BL_KERNEL_HIST_BINS; i++) {
+        hist->bins[i] += odd[i];
+    }
+}
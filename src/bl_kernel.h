@@ -0,0 +1,113 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_KERNEL_H__
+#define __BL_KERNEL_H__ 1
+
+#include <stdint.h>
+
+#include "usb.h"
+
+/*
+ * Kernels over the key codes of a layout, used by the library operations
+ * (packs, the index, validation). The key codes of the layers in use are
+ * contiguous in bl_matrix_t, so the kernels work on arrays of codes with
+ * n a multiple of NUMKEYS.
+ *
+ * There are scalar, SSE2 and AVX2 implementations of every kernel, the
+ * best one the cpu supports is selected at runtime. All implementations
+ * return the same results, BLUSB_KERNEL=scalar|sse2|avx2 forces one.
+ */
+#define BL_KERNEL_SCALAR  0
+#define BL_KERNEL_SSE2    1
+#define BL_KERNEL_AVX2    2
+
+#define BL_KERNEL_ENV "BLUSB_KERNEL"
+
+/*
+ * Number of lanes of the hash, n must be a multiple of this
+ */
+#define BL_KERNEL_HASH_LANES 16
+
+/*
+ * Codes below this are counted in bins, higher codes (media, layer and
+ * macro keys) are collected in other
+ */
+#define BL_KERNEL_HIST_BINS 512
+
+typedef struct bl_kernel_hist_t {
+    uint16_t bins[BL_KERNEL_HIST_BINS];
+    uint16_t other[NUMLAYERS_MAX * NUMKEYS];
+    int nother;
+} bl_kernel_hist_t;
+
+/**
+ * Hash of the key codes. Every lane hashes every 16th code with 32 bit
+ * FNV-1a, the lanes are then combined into 64 bits.
+ */
+uint64_t bl_kernel_hash(const uint16_t *codes, int n);
+
+/**
+ * @return TRUE if the codes are equal
+ */
+int bl_kernel_equal(const uint16_t *a, const uint16_t *b, int n);
+
+/**
+ * @return The number of codes c with lo <= c <= hi
+ */
+int bl_kernel_count_range(const uint16_t *codes, int n, uint16_t lo, uint16_t hi);
+
+/**
+ * Count the codes below BL_KERNEL_HIST_BINS and collect the others.
+ */
+void bl_kernel_histogram(const uint16_t *codes, int n, bl_kernel_hist_t *hist);
+
+/**
+ * Select the implementation.
+ *
+ * @return FALSE if the cpu does not support it
+ */
+int bl_kernel_select(int impl);
+
+/**
+ * @return The implementation in use
+ */
+int bl_kernel_impl();
+
+/**
+ * @return The name of an implementation
+ */
+char *bl_kernel_name(int impl);
+
+/**
+ * @return TRUE if the cpu supports the implementation
+ */
+int bl_kernel_supported(int impl);
+
+#endif /* __BL_KERNEL_H__ */
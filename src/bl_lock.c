@@ -0,0 +1,396 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "blusb.h"
+#include "bl_lock.h"
+
+static double
+bl_lock_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+int
+bl_lock_wait_ms() {
+    char *wait = getenv(BL_LOCK_WAIT_ENV);
+
+    return wait != NULL ? MAX(atoi(wait), 0) : BL_LOCK_WAIT_DEFAULT_MS;
+}
+
+/*
+ * Directory of the lock files: $BLUSB_LOCK_DIR, else /run/blusb if it
+ * exists or can be created, else $XDG_RUNTIME_DIR. NULL if there is none.
+ */
+static char *
+bl_lock_dir() {
+    struct stat st;
+    char *dir = getenv(BL_LOCK_DIR_ENV);
+
+    if (dir != NULL) {
+        return dir;
+    }
+    if (mkdir(BL_LOCK_DIR_DEFAULT, 01777) == 0) {
+        // shared by all users like /tmp, mkdir applies the umask
+        chmod(BL_LOCK_DIR_DEFAULT, 01777);
+    }
+    if (lstat(BL_LOCK_DIR_DEFAULT, &st) == 0 && S_ISDIR(st.st_mode) && access(BL_LOCK_DIR_DEFAULT, W_OK) == 0) {
+        return BL_LOCK_DIR_DEFAULT;
+    }
+
+    return getenv(BL_LOCK_DIR_FALLBACK_ENV);
+}
+
+/*
+ * Open a lock file, symbolic links and files with other links are refused
+ * so a file planted in a shared directory can't redirect the writes. A
+ * file we own gets the given mode whatever the umask, 0 keeps the mode.
+ */
+static int
+bl_lock_open(char *path, int flags, mode_t mode) {
+    struct stat st;
+
+    int fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    if (mode != 0 && st.st_uid == geteuid() && (st.st_mode & 0777) != mode) {
+        fchmod(fd, mode);
+    }
+
+    return fd;
+}
+
+static void
+bl_lock_ticket_path(bl_lock_t *lock, int pid, char *path, int len) {
+    snprintf(path, len, "%s.%d", lock->base, pid);
+}
+
+/*
+ * TRUE if the process is still queued, i.e. holds the lock on its ticket
+ */
+static int
+bl_lock_ticket_held(bl_lock_t *lock, int pid) {
+    char path[300];
+
+    if (pid == getpid()) {
+        return TRUE;
+    }
+    bl_lock_ticket_path(lock, pid, path, sizeof(path));
+    int fd = bl_lock_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        // a ticket we may not read still belongs to a live process
+        return errno == EACCES;
+    }
+    int held = flock(fd, LOCK_SH | LOCK_NB) < 0 && errno == EWOULDBLOCK;
+    close(fd);
+
+    return held;
+}
+
+/*
+ * Read the queue and drop the processes that are gone, the caller must
+ * hold the lock on the queue file. Returns the number of queued pids.
+ */
+static int
+bl_lock_queue_read(bl_lock_t *lock, int queue_fd, int *pids) {
+    char buf[BL_LOCK_QUEUE_MAX * 12];
+    char path[300];
+
+    ssize_t len = pread(queue_fd, buf, sizeof(buf) - 1, 0);
+    buf[MAX(len, 0)] = 0;
+
+    int n = 0;
+    int pruned = FALSE;
+    char *p = buf;
+    while (*p && n < BL_LOCK_QUEUE_MAX) {
+        char *end;
+        int pid = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        p = end + strspn(end, "\n");
+        if (bl_lock_ticket_held(lock, pid)) {
+            pids[n++] = pid;
+        } else {
+            bl_lock_ticket_path(lock, pid, path, sizeof(path));
+            unlink(path);
+            pruned = TRUE;
+        }
+    }
+
+    if (pruned) {
+        char *q = buf;
+        for (int i=0; i<n; i++) {
+            q += sprintf(q, "%d\n", pids[i]);
+        }
+        if (ftruncate(queue_fd, 0) == 0) {
+            pwrite(queue_fd, buf, q - buf, 0);
+        }
+    }
+
+    return n;
+}
+
+static void
+bl_lock_queue_write(int queue_fd, int *pids, int n) {
+    char buf[BL_LOCK_QUEUE_MAX * 12];
+    char *p = buf;
+
+    for (int i=0; i<n; i++) {
+        p += sprintf(p, "%d\n", pids[i]);
+    }
+    if (ftruncate(queue_fd, 0) == 0) {
+        pwrite(queue_fd, buf, p - buf, 0);
+    }
+}
+
+static int
+bl_lock_queue_open(bl_lock_t *lock) {
+    char path[300];
+
+    snprintf(path, sizeof(path), "%s.queue", lock->base);
+    int fd = bl_lock_open(path, O_RDWR | O_CREAT, BL_LOCK_QUEUE_MODE);
+    if (fd >= 0) {
+        flock(fd, LOCK_EX);
+    }
+
+    return fd;
+}
+
+/*
+ * Leave the queue and give up the ticket
+ */
+static void
+bl_lock_dequeue(bl_lock_t *lock) {
+    int pids[BL_LOCK_QUEUE_MAX];
+    char path[300];
+
+    int queue_fd = bl_lock_queue_open(lock);
+    if (queue_fd >= 0) {
+        int n = bl_lock_queue_read(lock, queue_fd, pids);
+        int m = 0;
+        for (int i=0; i<n; i++) {
+            if (pids[i] != getpid()) {
+                pids[m++] = pids[i];
+            }
+        }
+        bl_lock_queue_write(queue_fd, pids, m);
+    }
+
+    bl_lock_ticket_path(lock, getpid(), path, sizeof(path));
+    unlink(path);
+    close(lock->ticket_fd);
+    lock->ticket_fd = -1;
+
+    if (queue_fd >= 0) {
+        close(queue_fd);
+    }
+}
+
+/*
+ * Waits for a shared lock on the ticket of the process in front, in its
+ * own thread so the wait can be given up without a signal or a timer.
+ */
+typedef struct bl_lock_waiter_t {
+    int fd;
+    int released;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} bl_lock_waiter_t;
+
+static void *
+bl_lock_waiter(void *arg) {
+    bl_lock_waiter_t *waiter = (bl_lock_waiter_t *) arg;
+    int type;
+
+    // flock() is no cancellation point, the thread is cancelled while blocked in it
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &type);
+    flock(waiter->fd, LOCK_SH);
+    pthread_setcanceltype(type, NULL);
+
+    pthread_mutex_lock(&waiter->mutex);
+    waiter->released = TRUE;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->mutex);
+
+    return NULL;
+}
+
+/*
+ * Block until the ticket of the process in front is released or the time
+ * is up. Returns FALSE if the time ran out or the ticket can't be read.
+ */
+static int
+bl_lock_wait_ticket(bl_lock_t *lock, int pid, double wait_ms) {
+    bl_lock_waiter_t waiter;
+    pthread_condattr_t attr;
+    pthread_t thread;
+    struct timespec deadline;
+    char path[300];
+
+    bl_lock_ticket_path(lock, pid, path, sizeof(path));
+    waiter.fd = bl_lock_open(path, O_RDONLY, 0);
+    if (waiter.fd < 0) {
+        return errno != EACCES;
+    }
+    waiter.released = FALSE;
+    pthread_mutex_init(&waiter.mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    long long ns = deadline.tv_nsec + (long long) (wait_ms * 1e6);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+
+    int released = TRUE;
+    if (pthread_create(&thread, NULL, bl_lock_waiter, &waiter) == 0) {
+        int err = 0;
+        pthread_mutex_lock(&waiter.mutex);
+        while (!waiter.released && err == 0) {
+            err = pthread_cond_timedwait(&waiter.cond, &waiter.mutex, &deadline);
+        }
+        released = waiter.released;
+        if (!released) {
+            pthread_cancel(thread);
+        }
+        pthread_mutex_unlock(&waiter.mutex);
+        pthread_join(thread, NULL);
+    } else {
+        // no thread, just check it
+        released = flock(waiter.fd, LOCK_SH | LOCK_NB) == 0 || errno != EWOULDBLOCK;
+    }
+    close(waiter.fd);
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_destroy(&waiter.mutex);
+
+    return released;
+}
+
+int
+bl_lock_acquire(bl_lock_t *lock, int bus, uint8_t *ports, int nports, int wait_ms, int *holder) {
+    int pids[BL_LOCK_QUEUE_MAX];
+    char path[300];
+
+    if (holder != NULL) {
+        *holder = 0;
+    }
+    lock->ticket_fd = -1;
+    char *dir = bl_lock_dir();
+    if (dir == NULL) {
+        bl_err(FALSE, "No directory for the lock files, set %s\n", BL_LOCK_DIR_ENV);
+        return FALSE;
+    }
+    int len = snprintf(lock->base, sizeof(lock->base), "%s/blusb-%d-", dir, bus);
+    for (int i=0; i<nports && len < (int) sizeof(lock->base); i++) {
+        len += snprintf(lock->base + len, sizeof(lock->base) - len, i == 0 ? "%d" : ".%d", ports[i]);
+    }
+
+    int queue_fd = bl_lock_queue_open(lock);
+    if (queue_fd < 0) {
+        bl_err(FALSE, "Could not open the lock %s.queue: %s\n", lock->base, strerror(errno));
+        return FALSE;
+    }
+
+    /*
+     * Take a ticket and get in line, the ticket is created while holding
+     * the queue so no other process can take it for a stale entry
+     */
+    int n = bl_lock_queue_read(lock, queue_fd, pids);
+    bl_lock_ticket_path(lock, getpid(), path, sizeof(path));
+    lock->ticket_fd = bl_lock_open(path, O_RDWR | O_CREAT, BL_LOCK_TICKET_MODE);
+    if (n == BL_LOCK_QUEUE_MAX || lock->ticket_fd < 0 || flock(lock->ticket_fd, LOCK_EX | LOCK_NB) < 0) {
+        bl_err(FALSE, "Could not queue for the lock %s\n", lock->base);
+        if (lock->ticket_fd >= 0) {
+            close(lock->ticket_fd);
+            unlink(path);
+        }
+        close(queue_fd);
+        return FALSE;
+    }
+    pids[n++] = getpid();
+    bl_lock_queue_write(queue_fd, pids, n);
+    flock(queue_fd, LOCK_UN);
+
+    double deadline = bl_lock_now_ms() + wait_ms;
+    while (TRUE) {
+        flock(queue_fd, LOCK_EX);
+        n = bl_lock_queue_read(lock, queue_fd, pids);
+        int pos = 0;
+        while (pos < n && pids[pos] != getpid()) {
+            pos++;
+        }
+        int front = pos > 0 ? pids[pos - 1] : 0;
+        int first = n > 0 ? pids[0] : 0;
+        flock(queue_fd, LOCK_UN);
+
+        if (pos == 0 || pos == n) {
+            // first in line, or the queue file was removed by hand
+            close(queue_fd);
+            return TRUE;
+        }
+
+        double remaining = deadline - bl_lock_now_ms();
+        if (remaining <= 0 || !bl_lock_wait_ticket(lock, front, remaining)) {
+            if (holder != NULL) {
+                *holder = first;
+            }
+            close(queue_fd);
+            bl_lock_dequeue(lock);
+            return FALSE;
+        }
+    }
+}
+
+void
+bl_lock_release(bl_lock_t *lock) {
+    if (lock->ticket_fd >= 0) {
+        bl_lock_dequeue(lock);
+    }
+}
@@ -0,0 +1,99 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_LOCK_H__
+#define __BL_LOCK_H__ 1
+
+#include <stdint.h>
+
+/*
+ * Advisory lock on a controller, shared by all processes on the host. The
+ * waiting processes are queued in arrival order: every process holds a
+ * flock on its own ticket file and waits on the ticket of the process in
+ * front of it, so there is no polling and a crashed process releases its
+ * place automatically.
+ */
+
+/*
+ * Environment variables for the directory of the lock files and the
+ * maximum time to wait for the lock in milliseconds. Without
+ * BLUSB_LOCK_DIR the files are kept in /run/blusb, or in
+ * $XDG_RUNTIME_DIR if /run/blusb can't be used.
+ */
+#define BL_LOCK_DIR_ENV "BLUSB_LOCK_DIR"
+#define BL_LOCK_DIR_DEFAULT "/run/blusb"
+#define BL_LOCK_DIR_FALLBACK_ENV "XDG_RUNTIME_DIR"
+#define BL_LOCK_WAIT_ENV "BLUSB_LOCK_WAIT_MS"
+#define BL_LOCK_WAIT_DEFAULT_MS 10000
+
+/*
+ * Modes of the lock files: every user must be able to queue, and to take
+ * a shared lock on the ticket in front to wait for it
+ */
+#define BL_LOCK_QUEUE_MODE 0666
+#define BL_LOCK_TICKET_MODE 0644
+
+/*
+ * Maximum number of queued processes per controller
+ */
+#define BL_LOCK_QUEUE_MAX 256
+
+typedef struct bl_lock_t {
+    // path without extension, e.g. /run/blusb/blusb-1-2.3
+    char base[256];
+    // own ticket, locked while queued and while holding the lock
+    int ticket_fd;
+} bl_lock_t;
+
+/**
+ * Wait in line for the lock on the controller at bus/ports.
+ *
+ * @param lock Lock to initialise
+ * @param bus USB bus number
+ * @param ports Port numbers from the root hub to the device
+ * @param nports Number of port numbers
+ * @param wait_ms Maximum time to wait, 0 to fail if the lock is taken
+ * @param holder Set to the pid of the process in front if the lock was
+ *          not acquired, 0 if the lock files could not be used, may be NULL
+ * @return TRUE if the lock was acquired, FALSE if the time ran out or the
+ *         lock files could not be used (reported with bl_err())
+ */
+int bl_lock_acquire(bl_lock_t *lock, int bus, uint8_t *ports, int nports, int wait_ms, int *holder);
+
+/**
+ * Release the lock, the next process in line gets it.
+ */
+void bl_lock_release(bl_lock_t *lock);
+
+/**
+ * @return the wait budget from BLUSB_LOCK_WAIT_MS or the default
+ */
+int bl_lock_wait_ms();
+
+#endif /* __BL_LOCK_H__ */
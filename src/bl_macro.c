@@ -5,11 +5,15 @@
 #include <unistd.h>
 
 #include "usb.h"
-#include "bl_tui.h"
+#include "blusb.h"
 
 bl_macro_t *
 bl_macro_parse(char *fname) {
     bl_macro_t *bm = (bl_macro_t *) malloc( sizeof(bl_macro_t) );
+    if (bm == NULL) {
+        return NULL;
+    }
+    bm->nmacros = 0;
     /*
      * Initialize macro array
      */
@@ -23,6 +27,11 @@ bl_macro_parse(char *fname) {
     int IN_WHITESPACE = 1;
 
     FILE *f = fopen(fname, "r");
+    if (f == NULL) {
+        bl_err(FALSE, "Could not open file %s\n", fname);
+        free(bm);
+        return NULL;
+    }
     int buflen = 8;
     char buf[buflen+1];
     memset(buf, 0, buflen+1);
@@ -49,7 +58,8 @@ bl_macro_parse(char *fname) {
                     ch = fgetc(f);
                     col++;
                 } else {
-                    bl_tui_err(FALSE, "buffer overflow while reading macro digits, at line %d, col %d", line, col);
+                    bl_err(FALSE, "buffer overflow while reading macro digits, at line %d, col %d", line, col);
+                    fclose(f);
                     free(bm);
                     return NULL;
                 }
@@ -58,6 +68,13 @@ bl_macro_parse(char *fname) {
                 * Try reading a number from buffer
                 */
                 if (i > 0) {
+                    if (macro_y >= NUM_MACROKEYS || macro_x >= LEN_MACRO) {
+                        bl_err(FALSE, "More than %d macros or more than %d keys in a macro, at line %d\n",
+                               NUM_MACROKEYS, LEN_MACRO, line+1);
+                        fclose(f);
+                        free(bm);
+                        return NULL;
+                    }
                     bm->macros[macro_y][macro_x++] = atoi(buf);
                     bm->nmacros = macro_y+1;
                     memset(buf, 0, buflen+1);
@@ -85,14 +102,66 @@ bl_macro_parse(char *fname) {
                 state = IN_NUMBER;
                 // don't read the next character, we need the current character to be processed as a digit in the IN_NUMBER state.
             } else {
-                bl_tui_err(FALSE, "Unexpected character encountered while skipping whitespace: [%c], at line %d, column %d.\n", ch, line+1, col+1);
+                bl_err(FALSE, "Unexpected character encountered while skipping whitespace: [%c], at line %d, column %d.\n", ch, line+1, col+1);
+                fclose(f);
                 free(bm);
                 return NULL;
             }
 
         }
     }
+    fclose(f);
 
     return bm;
 }
 
+void
+bl_usb_macro_print(bl_macro_t *bm) {
+    uint8_t macro_cnt = 0;
+/*
+    printf("Macro key table\n\n");
+    printf("            Mods%-3cRsvd%-3cKey1%-3cKey2%-3cKey3%-3cKey4%-3cKey5%-3cKey6\n\n", '\0', '\0', '\0', '\0', '\0', '\0', '\0');
+    printf("Macro %-6u", ++macro_cnt);
+
+    for (uint8_t i = 0; i < sizeof(char_ctr_buf); i++)
+    {
+        printf("%-7u", char_ctr_buf[i]);
+        if(i && i != sizeof(char_ctr_buf) - 1)
+            if ((i + 1) % 8 == 0)
+            {
+                printf("\n");
+                printf("Macro %-6u", ++macro_cnt);
+            }
+    }
+    printf("\n");
+*/
+
+    printf("Macro key table\n\n");
+    printf("            Mods%-3cRsvd%-3cKey1%-3cKey2%-3cKey3%-3cKey4%-3cKey5%-3cKey6\n\n", '\0', '\0', '\0', '\0', '\0', '\0', '\0');
+
+    for (int i=0; i<NUM_MACROKEYS; i++) {
+        printf("Marco %-6u", i);
+        for (int j=0; j<LEN_MACRO; j++) {
+            printf("%-7u", bm->macros[i][j]);
+        }
+        printf("\n");
+    }
+
+}
+
+/*
+ * TRUE if the bytes are all 0 or all 255 (erased EEPROM), the controller
+ * reports a macro table like this as a bad EEPROM value when it is read.
+ */
+int
+bl_macro_blank(uint8_t *data, int length) {
+    int zeros = 0;
+    int ones = 0;
+
+    for (int i=0; i<length; i++) {
+        zeros += data[i] == 0;
+        ones += data[i] == 255;
+    }
+
+    return zeros == length || ones == length;
+}
@@ -0,0 +1,493 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blusb.h"
+#include "bl_kernel.h"
+#include "bl_pack.h"
+
+/*
+ * The pack used by bl_pack_load_layout()
+ */
+static pthread_mutex_t _bl_pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static bl_pack_t *_bl_pack_current = NULL;
+static char *_bl_pack_current_path = NULL;
+
+uint64_t
+bl_pack_hash(uint8_t *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i=0; i<length; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint32_t
+bl_pack_get32(uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void
+bl_pack_put32(uint8_t *p, uint32_t value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = value >> 24;
+}
+
+/*
+ * Number of slots of a hash table for n entries, a power of 2 so at
+ * least half of the slots are empty
+ */
+static uint32_t
+bl_pack_slots(uint32_t n) {
+    uint32_t slots = 8;
+    while (slots < 2 * n) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+bl_pack_t *
+bl_pack_open(char *fname, char *errmsg, int errlen) {
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(errmsg, errlen, "%s: %s", fname, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < BL_PACK_HEADER_SIZE) {
+        snprintf(errmsg, errlen, "%s: not a layout pack", fname);
+        close(fd);
+        return NULL;
+    }
+    uint8_t *data = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        snprintf(errmsg, errlen, "%s: %s", fname, strerror(errno));
+        return NULL;
+    }
+
+    bl_pack_t *pack = (bl_pack_t *) malloc(sizeof(bl_pack_t));
+    if (pack == NULL) {
+        snprintf(errmsg, errlen, "out of memory");
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    pack->data = data;
+    pack->size = st.st_size;
+    pack->nlayers = bl_pack_get32(data + 8);
+    pack->nlayouts = bl_pack_get32(data + 12);
+    pack->nslots = bl_pack_get32(data + 16);
+
+    uint32_t layers_offset = bl_pack_get32(data + 20);
+    uint32_t layouts_offset = bl_pack_get32(data + 24);
+    uint32_t index_offset = bl_pack_get32(data + 28);
+    uint32_t names_offset = bl_pack_get32(data + 32);
+    if (memcmp(data, BL_PACK_MAGIC, 4) != 0 || bl_pack_get32(data + 4) != BL_PACK_VERSION ||
+        (pack->nslots & (pack->nslots - 1)) != 0 || pack->nslots < pack->nlayouts ||
+        layers_offset + (uint64_t) pack->nlayers * BL_PACK_LAYER_SIZE > pack->size ||
+        layouts_offset + (uint64_t) pack->nlayouts * BL_PACK_LAYOUT_SIZE > pack->size ||
+        index_offset + (uint64_t) pack->nslots * 4 > pack->size ||
+        names_offset > pack->size || pack->data[pack->size - 1] != 0) {
+        snprintf(errmsg, errlen, "%s: not a layout pack or damaged", fname);
+        bl_pack_close(pack);
+        return NULL;
+    }
+    pack->layers = data + layers_offset;
+    pack->layouts = data + layouts_offset;
+    pack->index = data + index_offset;
+    pack->names = data + names_offset;
+
+    return pack;
+}
+
+void
+bl_pack_close(bl_pack_t *pack) {
+    munmap(pack->data, pack->size);
+    free(pack);
+}
+
+char *
+bl_pack_name(bl_pack_t *pack, uint32_t i) {
+    uint32_t offset = bl_pack_get32(pack->layouts + i * BL_PACK_LAYOUT_SIZE);
+    uint8_t *name = pack->names + offset;
+
+    return name < pack->data + pack->size ? (char *) name : "";
+}
+
+int
+bl_pack_get(bl_pack_t *pack, char *name, bl_layout_t *layout) {
+    uint64_t hash = bl_pack_hash((uint8_t *) name, strlen(name));
+
+    for (uint32_t n=0; n<pack->nslots; n++) {
+        uint32_t slot = (hash + n) & (pack->nslots - 1);
+        uint32_t entry = bl_pack_get32(pack->index + 4 * slot);
+        if (entry == 0) {
+            return FALSE;
+        }
+        if (entry > pack->nlayouts || strcmp(bl_pack_name(pack, entry - 1), name) != 0) {
+            continue;
+        }
+
+        uint8_t *p = pack->layouts + (entry - 1) * BL_PACK_LAYOUT_SIZE;
+        int nlayers = bl_pack_get32(p + 4);
+        if (nlayers < 0 || nlayers > NUMLAYERS_MAX) {
+            return FALSE;
+        }
+        memset(layout, 0, sizeof(bl_layout_t));
+        layout->nlayers = nlayers;
+        for (int layer=0; layer<nlayers; layer++) {
+            uint32_t number = bl_pack_get32(p + 8 + 4 * layer);
+            if (number >= pack->nlayers) {
+                return FALSE;
+            }
+            uint8_t *keys = pack->layers + number * BL_PACK_LAYER_SIZE + 8;
+            uint16_t *codes = &layout->matrix[layer][0][0];
+            for (int i=0; i<NUMKEYS; i++) {
+                codes[i] = keys[2 * i] | (keys[2 * i + 1] << 8);
+            }
+        }
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+bl_layout_t *
+bl_pack_load_layout(char *name, char *errmsg, int errlen) {
+    char *path = getenv(BL_PACK_ENV);
+    if (path == NULL) {
+        snprintf(errmsg, errlen, "%s%s: %s is not set\n", BL_PACK_PREFIX, name, BL_PACK_ENV);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_bl_pack_lock);
+    if (_bl_pack_current == NULL || strcmp(_bl_pack_current_path, path) != 0) {
+        /*
+         * A pack that was opened before stays mapped, another thread may
+         * still be reading from it
+         */
+        bl_pack_t *pack = bl_pack_open(path, errmsg, errlen);
+        if (pack == NULL) {
+            pthread_mutex_unlock(&_bl_pack_lock);
+            return NULL;
+        }
+        free(_bl_pack_current_path);
+        _bl_pack_current = pack;
+        _bl_pack_current_path = strdup(path);
+    }
+    bl_pack_t *pack = _bl_pack_current;
+    pthread_mutex_unlock(&_bl_pack_lock);
+
+    bl_layout_t *layout = (bl_layout_t *) malloc(sizeof(bl_layout_t));
+    if (layout == NULL) {
+        snprintf(errmsg, errlen, "out of memory\n");
+        return NULL;
+    }
+    if (!bl_pack_get(pack, name, layout)) {
+        snprintf(errmsg, errlen, "%s%s: not found in %s\n", BL_PACK_PREFIX, name, path);
+        free(layout);
+        return NULL;
+    }
+
+    return layout;
+}
+
+bl_pack_builder_t *
+bl_pack_builder_create() {
+    return (bl_pack_builder_t *) calloc(1, sizeof(bl_pack_builder_t));
+}
+
+void
+bl_pack_builder_destroy(bl_pack_builder_t *builder) {
+    for (uint32_t i=0; i<builder->nlayouts; i++) {
+        free(builder->names[i]);
+    }
+    free(builder->names);
+    free(builder->layouts);
+    free(builder->layers);
+    free(builder->hashes);
+    free(builder->lookup);
+    free(builder->name_lookup);
+    free(builder);
+}
+
+/*
+ * Put layer number i in the layer lookup table
+ */
+static void
+bl_pack_builder_insert(bl_pack_builder_t *builder, uint32_t i) {
+    uint32_t mask = builder->lookup_size - 1;
+    uint32_t slot = builder->hashes[i] & mask;
+
+    while (builder->lookup[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    builder->lookup[slot] = i + 1;
+}
+
+/*
+ * Put layout number i in the name lookup table
+ */
+static void
+bl_pack_builder_insert_name(bl_pack_builder_t *builder, uint32_t i, uint64_t hash) {
+    uint32_t mask = builder->name_lookup_size - 1;
+    uint32_t slot = hash & mask;
+
+    while (builder->name_lookup[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    builder->name_lookup[slot] = i + 1;
+}
+
+/*
+ * Find the layer or add it, returns the layer number or -1 if out of memory
+ */
+static int64_t
+bl_pack_builder_layer(bl_pack_builder_t *builder, uint16_t *codes) {
+    uint64_t hash = bl_kernel_hash(codes, NUMKEYS);
+
+    if (builder->lookup_size > 0) {
+        uint32_t mask = builder->lookup_size - 1;
+        for (uint32_t slot=hash & mask; builder->lookup[slot] != 0; slot=(slot + 1) & mask) {
+            uint32_t i = builder->lookup[slot] - 1;
+            if (builder->hashes[i] == hash &&
+                bl_kernel_equal(&builder->layers[i * NUMKEYS], codes, NUMKEYS)) {
+                return i;
+            }
+        }
+    }
+
+    if (builder->nlayers == builder->layers_size) {
+        uint32_t size = builder->layers_size == 0 ? 64 : 2 * builder->layers_size;
+        uint16_t *layers = (uint16_t *) realloc(builder->layers, size * NUMKEYS * sizeof(uint16_t));
+        if (layers == NULL) {
+            return -1;
+        }
+        builder->layers = layers;
+        uint64_t *hashes = (uint64_t *) realloc(builder->hashes, size * sizeof(uint64_t));
+        if (hashes == NULL) {
+            return -1;
+        }
+        builder->hashes = hashes;
+        builder->layers_size = size;
+    }
+    if (2 * (builder->nlayers + 1) > builder->lookup_size) {
+        uint32_t size = bl_pack_slots(builder->nlayers + 1);
+        uint32_t *lookup = (uint32_t *) calloc(size, sizeof(uint32_t));
+        if (lookup == NULL) {
+            return -1;
+        }
+        free(builder->lookup);
+        builder->lookup = lookup;
+        builder->lookup_size = size;
+        for (uint32_t i=0; i<builder->nlayers; i++) {
+            bl_pack_builder_insert(builder, i);
+        }
+    }
+
+    uint32_t i = builder->nlayers++;
+    memcpy(&builder->layers[i * NUMKEYS], codes, NUMKEYS * sizeof(uint16_t));
+    builder->hashes[i] = hash;
+    bl_pack_builder_insert(builder, i);
+
+    return i;
+}
+
+int
+bl_pack_builder_add(bl_pack_builder_t *builder, char *name, bl_layout_t *layout) {
+    uint64_t hash = bl_pack_hash((uint8_t *) name, strlen(name));
+
+    if (builder->name_lookup_size > 0) {
+        uint32_t mask = builder->name_lookup_size - 1;
+        for (uint32_t slot=hash & mask; builder->name_lookup[slot] != 0; slot=(slot + 1) & mask) {
+            if (strcmp(builder->names[builder->name_lookup[slot] - 1], name) == 0) {
+                return FALSE;
+            }
+        }
+    }
+    if (layout->nlayers < 0 || layout->nlayers > NUMLAYERS_MAX) {
+        return FALSE;
+    }
+    if (2 * (builder->nlayouts + 1) > builder->name_lookup_size) {
+        uint32_t size = bl_pack_slots(builder->nlayouts + 1);
+        uint32_t *lookup = (uint32_t *) calloc(size, sizeof(uint32_t));
+        if (lookup == NULL) {
+            return FALSE;
+        }
+        free(builder->name_lookup);
+        builder->name_lookup = lookup;
+        builder->name_lookup_size = size;
+        for (uint32_t i=0; i<builder->nlayouts; i++) {
+            bl_pack_builder_insert_name(builder, i,
+                                        bl_pack_hash((uint8_t *) builder->names[i], strlen(builder->names[i])));
+        }
+    }
+
+    if (builder->nlayouts == builder->layouts_size) {
+        uint32_t size = builder->layouts_size == 0 ? 64 : 2 * builder->layouts_size;
+        uint32_t *layouts = (uint32_t *) realloc(builder->layouts, size * (1 + NUMLAYERS_MAX) * sizeof(uint32_t));
+        if (layouts == NULL) {
+            return FALSE;
+        }
+        builder->layouts = layouts;
+        char **names = (char **) realloc(builder->names, size * sizeof(char *));
+        if (names == NULL) {
+            return FALSE;
+        }
+        builder->names = names;
+        builder->layouts_size = size;
+    }
+
+    uint32_t *entry = &builder->layouts[builder->nlayouts * (1 + NUMLAYERS_MAX)];
+    memset(entry, 0, (1 + NUMLAYERS_MAX) * sizeof(uint32_t));
+    entry[0] = layout->nlayers;
+    for (int layer=0; layer<layout->nlayers; layer++) {
+        int64_t number = bl_pack_builder_layer(builder, &layout->matrix[layer][0][0]);
+        if (number < 0) {
+            return FALSE;
+        }
+        entry[1 + layer] = number;
+    }
+    if ((builder->names[builder->nlayouts] = strdup(name)) == NULL) {
+        return FALSE;
+    }
+    bl_pack_builder_insert_name(builder, builder->nlayouts, hash);
+    builder->nlayouts++;
+    builder->layers_total += layout->nlayers;
+
+    return TRUE;
+}
+
+int
+bl_pack_builder_write(bl_pack_builder_t *builder, char *fname) {
+    uint32_t nslots = bl_pack_slots(builder->nlayouts);
+    size_t names_size = 0;
+    for (uint32_t i=0; i<builder->nlayouts; i++) {
+        names_size += strlen(builder->names[i]) + 1;
+    }
+
+    size_t layers_offset = BL_PACK_HEADER_SIZE;
+    size_t layouts_offset = layers_offset + (size_t) builder->nlayers * BL_PACK_LAYER_SIZE;
+    size_t index_offset = layouts_offset + (size_t) builder->nlayouts * BL_PACK_LAYOUT_SIZE;
+    size_t names_offset = index_offset + (size_t) nslots * 4;
+    // a pack ends with a 0 byte, also when it is empty
+    size_t size = names_offset + names_size + 1;
+    if (size > UINT32_MAX) {
+        errno = EFBIG;
+        return FALSE;
+    }
+    uint8_t *data = (uint8_t *) calloc(1, size);
+    if (data == NULL) {
+        return FALSE;
+    }
+
+    memcpy(data, BL_PACK_MAGIC, 4);
+    bl_pack_put32(data + 4, BL_PACK_VERSION);
+    bl_pack_put32(data + 8, builder->nlayers);
+    bl_pack_put32(data + 12, builder->nlayouts);
+    bl_pack_put32(data + 16, nslots);
+    bl_pack_put32(data + 20, layers_offset);
+    bl_pack_put32(data + 24, layouts_offset);
+    bl_pack_put32(data + 28, index_offset);
+    bl_pack_put32(data + 32, names_offset);
+
+    for (uint32_t i=0; i<builder->nlayers; i++) {
+        uint8_t *p = data + layers_offset + i * BL_PACK_LAYER_SIZE;
+        bl_pack_put32(p, builder->hashes[i] & 0xffffffff);
+        bl_pack_put32(p + 4, builder->hashes[i] >> 32);
+        for (int key=0; key<NUMKEYS; key++) {
+            uint16_t code = builder->layers[i * NUMKEYS + key];
+            p[8 + 2 * key] = code & 0xff;
+            p[8 + 2 * key + 1] = code >> 8;
+        }
+    }
+
+    uint32_t name_offset = 0;
+    for (uint32_t i=0; i<builder->nlayouts; i++) {
+        uint8_t *p = data + layouts_offset + i * BL_PACK_LAYOUT_SIZE;
+        uint32_t *entry = &builder->layouts[i * (1 + NUMLAYERS_MAX)];
+        bl_pack_put32(p, name_offset);
+        for (int n=0; n<1 + NUMLAYERS_MAX; n++) {
+            bl_pack_put32(p + 4 + 4 * n, entry[n]);
+        }
+
+        size_t length = strlen(builder->names[i]) + 1;
+        memcpy(data + names_offset + name_offset, builder->names[i], length);
+        name_offset += length;
+
+        uint64_t hash = bl_pack_hash((uint8_t *) builder->names[i], length - 1);
+        uint32_t slot = hash & (nslots - 1);
+        while (bl_pack_get32(data + index_offset + 4 * slot) != 0) {
+            slot = (slot + 1) & (nslots - 1);
+        }
+        bl_pack_put32(data + index_offset + 4 * slot, i + 1);
+    }
+
+    /*
+     * Written to a temporary file first, the pack may be mapped by a
+     * running process
+     */
+    char tmpname[PATH_MAX];
+    snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", fname, (int) getpid());
+    FILE *f = fopen(tmpname, "wb");
+    if (f == NULL) {
+        free(data);
+        return FALSE;
+    }
+    int ok = fwrite(data, 1, size, f) == size;
+    if (fclose(f) != 0) {
+        ok = FALSE;
+    }
+    free(data);
+    if (ok && rename(tmpname, fname) != 0) {
+        ok = FALSE;
+    }
+    if (!ok) {
+        int saved_errno = errno;
+        unlink(tmpname);
+        errno = saved_errno;
+    }
+
+    return ok;
+}
@@ -0,0 +1,161 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_PACK_H__
+#define __BL_PACK_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "usb.h"
+
+/*
+ * A pack stores many named layouts in one file. Every distinct layer is
+ * stored once and found by the hash of its key codes, a layout is a list
+ * of layer numbers. The file is mapped into memory and a layout is found
+ * through a hash table of the names, so loading one layout does not depend
+ * on the size of the pack.
+ *
+ * File format, all numbers little endian:
+ *
+ *   header    magic "BLPK", version, number of layers, number of layouts,
+ *             number of index slots and the offsets of the layer table,
+ *             layout table, index and names (4 bytes each)
+ *   layers    per layer the 64 bit hash (see bl_kernel_hash()) and NUMKEYS
+ *             key codes (2 bytes)
+ *   layouts   per layout the offset of its name, the number of layers and
+ *             NUMLAYERS_MAX layer numbers (4 bytes each)
+ *   index     open addressing hash table of the names, a slot holds the
+ *             layout number + 1 or 0 if empty
+ *   names     the names of the layouts, 0 terminated
+ */
+#define BL_PACK_MAGIC "BLPK"
+#define BL_PACK_VERSION 2
+#define BL_PACK_HEADER_SIZE 36
+#define BL_PACK_LAYER_SIZE (8 + 2 * NUMKEYS)
+#define BL_PACK_LAYOUT_SIZE (8 + 4 * NUMLAYERS_MAX)
+
+/*
+ * Layouts in a pack are loaded by bl_layout_load_file() as pack:<name>,
+ * from the pack named by this environment variable
+ */
+#define BL_PACK_PREFIX "pack:"
+#define BL_PACK_ENV "BLUSB_PACK"
+
+typedef struct bl_pack_t {
+    uint8_t *data;
+    size_t size;
+    uint32_t nlayers;
+    uint32_t nlayouts;
+    uint32_t nslots;
+    uint8_t *layers;
+    uint8_t *layouts;
+    uint8_t *index;
+    uint8_t *names;
+} bl_pack_t;
+
+/*
+ * Collects layouts and writes them as a pack
+ */
+typedef struct bl_pack_builder_t {
+    // distinct layers, NUMKEYS key codes each, and their hashes
+    uint16_t *layers;
+    uint64_t *hashes;
+    uint32_t nlayers;
+    uint32_t layers_size;
+    // hash table of the layers, layer number + 1 or 0 if empty
+    uint32_t *lookup;
+    uint32_t lookup_size;
+    // layouts: number of layers and layer numbers
+    uint32_t *layouts;
+    char **names;
+    uint32_t nlayouts;
+    uint32_t layouts_size;
+    // hash table of the names, layout number + 1 or 0 if empty
+    uint32_t *name_lookup;
+    uint32_t name_lookup_size;
+    // layers of all layouts before deduplication
+    uint32_t layers_total;
+} bl_pack_builder_t;
+
+/**
+ * Map a pack file into memory and check its header.
+ *
+ * @return The pack or NULL, the reason is stored in errmsg.
+ */
+bl_pack_t *bl_pack_open(char *fname, char *errmsg, int errlen);
+void bl_pack_close(bl_pack_t *pack);
+
+/**
+ * Copy the layout with the given name out of the pack.
+ *
+ * @return TRUE if found
+ */
+int bl_pack_get(bl_pack_t *pack, char *name, bl_layout_t *layout);
+
+/**
+ * @return The name of layout number i, 0 <= i < pack->nlayouts
+ */
+char *bl_pack_name(bl_pack_t *pack, uint32_t i);
+
+/**
+ * Load pack:<name> from the pack in $BLUSB_PACK, used by
+ * bl_layout_parse_file(). The pack is mapped once per process. Safe to
+ * call from any thread.
+ *
+ * @param name The name without the pack: prefix
+ *
+ * @return A newly allocated layout or NULL, the reason is stored in errmsg.
+ */
+bl_layout_t *bl_pack_load_layout(char *name, char *errmsg, int errlen);
+
+bl_pack_builder_t *bl_pack_builder_create();
+
+/**
+ * Add a layout to the pack.
+ *
+ * @return FALSE if a layout with this name was already added or out of
+ * memory.
+ */
+int bl_pack_builder_add(bl_pack_builder_t *builder, char *name, bl_layout_t *layout);
+
+/**
+ * Write the pack file.
+ *
+ * @return TRUE if successful, FALSE if not and errno is set.
+ */
+int bl_pack_builder_write(bl_pack_builder_t *builder, char *fname);
+void bl_pack_builder_destroy(bl_pack_builder_t *builder);
+
+/**
+ * 64 bit FNV-1a hash of the data
+ */
+uint64_t bl_pack_hash(uint8_t *data, size_t length);
+
+#endif /* __BL_PACK_H__ */
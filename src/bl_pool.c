@@ -0,0 +1,242 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "blusb.h"
+#include "bl_pool.h"
+
+#define BL_POOL_QUEUE_SIZE 64
+
+typedef struct bl_pool_worker_arg_t {
+    bl_pool_t *pool;
+    int worker;
+} bl_pool_worker_arg_t;
+
+/*
+ * Take a task from the back of the queue (the owner) or from the front
+ * (thieves). The queue must be locked. Returns FALSE if the queue is empty.
+ */
+static int
+bl_pool_queue_take(bl_pool_queue_t *q, int from_back, bl_pool_task_t *task) {
+    if (q->n == 0) {
+        return FALSE;
+    }
+    if (from_back) {
+        *task = q->tasks[(q->head + q->n - 1) % q->size];
+    } else {
+        *task = q->tasks[q->head];
+        q->head = (q->head + 1) % q->size;
+    }
+    q->n--;
+    return TRUE;
+}
+
+/*
+ * Find the next task for the worker, first from its own queue, then steal
+ * from the others.
+ */
+static int
+bl_pool_next_task(bl_pool_t *pool, int worker, bl_pool_task_t *task) {
+    for (int i=0; i<pool->nworkers; i++) {
+        bl_pool_queue_t *q = &pool->queues[(worker + i) % pool->nworkers];
+        pthread_mutex_lock(&q->lock);
+        int found = bl_pool_queue_take(q, i == 0, task);
+        pthread_mutex_unlock(&q->lock);
+        if (found) {
+            atomic_fetch_sub(&pool->queued, 1);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Mark a task as finished, wake up the waiters if it was the last one.
+ */
+static void
+bl_pool_task_done(bl_pool_t *pool) {
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+static void *
+bl_pool_worker(void *arg) {
+    bl_pool_worker_arg_t *wa = (bl_pool_worker_arg_t *) arg;
+    bl_pool_t *pool = wa->pool;
+    int worker = wa->worker;
+    free(wa);
+
+    for (;;) {
+        bl_pool_task_t task;
+        if (bl_pool_next_task(pool, worker, &task)) {
+            task.fn(pool, worker, task.arg);
+            bl_pool_task_done(pool);
+        } else {
+            pthread_mutex_lock(&pool->idle_lock);
+            while (!pool->shutdown && atomic_load(&pool->queued) == 0) {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            }
+            int shutdown = pool->shutdown;
+            pthread_mutex_unlock(&pool->idle_lock);
+            if (shutdown) {
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+bl_pool_t *
+bl_pool_create(int nworkers, void *data) {
+    if (nworkers <= 0) {
+        nworkers = MAX(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    bl_pool_t *pool = (bl_pool_t *) malloc(sizeof(bl_pool_t));
+    pool->nworkers = nworkers;
+    pool->threads = (pthread_t *) malloc(nworkers * sizeof(pthread_t));
+    pool->queues = (bl_pool_queue_t *) malloc(nworkers * sizeof(bl_pool_queue_t));
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->cancelled, FALSE);
+    atomic_init(&pool->next, 0);
+    pool->shutdown = FALSE;
+    pool->data = data;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (int i=0; i<nworkers; i++) {
+        bl_pool_queue_t *q = &pool->queues[i];
+        pthread_mutex_init(&q->lock, NULL);
+        q->size = BL_POOL_QUEUE_SIZE;
+        q->tasks = (bl_pool_task_t *) malloc(q->size * sizeof(bl_pool_task_t));
+        q->head = 0;
+        q->n = 0;
+    }
+    for (int i=0; i<nworkers; i++) {
+        bl_pool_worker_arg_t *wa = (bl_pool_worker_arg_t *) malloc(sizeof(bl_pool_worker_arg_t));
+        wa->pool = pool;
+        wa->worker = i;
+        pthread_create(&pool->threads[i], NULL, bl_pool_worker, wa);
+    }
+
+    return pool;
+}
+
+void
+bl_pool_submit(bl_pool_t *pool, int worker, bl_pool_fn_t fn, void *arg) {
+    if (worker < 0) {
+        worker = atomic_fetch_add(&pool->next, 1) % pool->nworkers;
+    }
+
+    atomic_fetch_add(&pool->pending, 1);
+
+    bl_pool_queue_t *q = &pool->queues[worker];
+    pthread_mutex_lock(&q->lock);
+    if (q->n == q->size) {
+        /* grow the ring buffer, unwrapping it in the process */
+        bl_pool_task_t *tasks = (bl_pool_task_t *) malloc(2 * q->size * sizeof(bl_pool_task_t));
+        for (int i=0; i<q->n; i++) {
+            tasks[i] = q->tasks[(q->head + i) % q->size];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->head = 0;
+        q->size *= 2;
+    }
+    q->tasks[(q->head + q->n) % q->size].fn = fn;
+    q->tasks[(q->head + q->n) % q->size].arg = arg;
+    q->n++;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+int
+bl_pool_is_done(bl_pool_t *pool) {
+    return atomic_load(&pool->pending) == 0;
+}
+
+void
+bl_pool_wait(bl_pool_t *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    while (atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->idle_lock);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+void
+bl_pool_cancel(bl_pool_t *pool) {
+    atomic_store(&pool->cancelled, TRUE);
+}
+
+int
+bl_pool_is_cancelled(bl_pool_t *pool) {
+    return atomic_load(&pool->cancelled);
+}
+
+void
+bl_pool_destroy(bl_pool_t *pool) {
+    /*
+     * Let the workers drain the queues, the remaining tasks see that the
+     * pool is cancelled and only release their arguments.
+     */
+    bl_pool_cancel(pool);
+    bl_pool_wait(pool);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->shutdown = TRUE;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int i=0; i<pool->nworkers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i=0; i<pool->nworkers; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,125 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_POOL_H__
+#define __BL_POOL_H__ 1
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * A small work stealing thread pool. Every worker has its own queue of
+ * tasks, tasks submitted by a worker go to its own queue and are taken
+ * from the back (newest first), idle workers steal from the front of the
+ * other queues (oldest first).
+ */
+
+struct bl_pool_t;
+
+typedef void (*bl_pool_fn_t)(struct bl_pool_t *pool, int worker, void *arg);
+
+typedef struct bl_pool_task_t {
+    bl_pool_fn_t fn;
+    void *arg;
+} bl_pool_task_t;
+
+typedef struct bl_pool_queue_t {
+    pthread_mutex_t lock;
+    // ring buffer of tasks
+    bl_pool_task_t *tasks;
+    int head;
+    int n;
+    int size;
+} bl_pool_queue_t;
+
+typedef struct bl_pool_t {
+    int nworkers;
+    pthread_t *threads;
+    bl_pool_queue_t *queues;
+    // tasks submitted and not yet finished
+    atomic_int pending;
+    // tasks waiting in a queue
+    atomic_int queued;
+    atomic_int cancelled;
+    int shutdown;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    pthread_cond_t done_cond;
+    // next queue for tasks submitted from outside the pool
+    atomic_uint next;
+    // user data, not used by the pool
+    void *data;
+} bl_pool_t;
+
+/**
+ * Create the pool and start the worker threads.
+ *
+ * @param nworkers Number of worker threads, if <= 0 use the number of
+ *                 online cpus.
+ * @param data User data, available as pool->data in the tasks.
+ *
+ * @return the pool, must be destroyed with bl_pool_destroy().
+ */
+bl_pool_t *bl_pool_create(int nworkers, void *data);
+
+/**
+ * Add a task to the pool.
+ *
+ * @param pool The pool
+ * @param worker Index of the calling worker (the worker argument of the task
+ *               function), or -1 when called from outside the pool.
+ * @param fn Function to execute
+ * @param arg Argument passed to the function
+ */
+void bl_pool_submit(bl_pool_t *pool, int worker, bl_pool_fn_t fn, void *arg);
+
+/**
+ * Return TRUE if all submitted tasks have finished.
+ */
+int bl_pool_is_done(bl_pool_t *pool);
+
+/**
+ * Wait until all submitted tasks have finished.
+ */
+void bl_pool_wait(bl_pool_t *pool);
+
+/**
+ * Cancel the pool. Queued tasks are still called, but they must check
+ * bl_pool_is_cancelled() and return early, releasing their argument.
+ */
+void bl_pool_cancel(bl_pool_t *pool);
+
+int bl_pool_is_cancelled(bl_pool_t *pool);
+
+/**
+ * Cancel the remaining tasks, stop the workers and free the pool.
+ */
+void bl_pool_destroy(bl_pool_t *pool);
+
+#endif /* __BL_POOL_H__ */
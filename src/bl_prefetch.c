@@ -0,0 +1,128 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "blusb.h"
+#include "bl_prefetch.h"
+
+static double
+bl_prefetch_ms_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void
+bl_prefetch_arrived(bl_ctrl_state_t *state, int what, int ok, void *data) {
+    bl_prefetch_t *p = (bl_prefetch_t *) data;
+
+    for (int bit=0; bit<8; bit++) {
+        if (what == (1 << bit)) {
+            p->arrived_ms[bit] = bl_prefetch_ms_since(&p->start);
+        }
+    }
+    /*
+     * The part is complete in state now, publishing it in ready makes it
+     * visible to the UI thread.
+     */
+    if (ok) {
+        atomic_fetch_or(&p->ready, what);
+    } else {
+        atomic_fetch_or(&p->failed, what);
+    }
+}
+
+static void *
+bl_prefetch_worker(void *arg) {
+    bl_prefetch_t *p = (bl_prefetch_t *) arg;
+
+    /*
+     * wait until key has been released and then enable service mode.
+     * If we don't do this and you use the IBM keyboard to start the program
+     * the last key pressed will keep repeating (most likely the enter key).
+     */
+    usleep(100000);
+    bl_usb_enable_service_mode();
+
+    bl_usb_read_state(&p->state, p->what, bl_prefetch_arrived, p);
+    atomic_store(&p->is_done, TRUE);
+
+    return NULL;
+}
+
+bl_prefetch_t *
+bl_prefetch_start(int what) {
+    bl_prefetch_t *p = (bl_prefetch_t *) calloc(1, sizeof(bl_prefetch_t));
+    if (p == NULL) {
+        errmsg_and_abort("bl_prefetch_start: out of memory");
+    }
+    p->what = what;
+    atomic_init(&p->ready, 0);
+    atomic_init(&p->failed, 0);
+    atomic_init(&p->is_done, FALSE);
+    p->first_frame_ms = -1;
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+
+    if (pthread_create(&p->thread, NULL, bl_prefetch_worker, p) != 0) {
+        errmsg_and_abort("bl_prefetch_start: can't create thread");
+    }
+
+    return p;
+}
+
+int
+bl_prefetch_ready(bl_prefetch_t *p) {
+    return atomic_load(&p->ready);
+}
+
+int
+bl_prefetch_is_done(bl_prefetch_t *p) {
+    return atomic_load(&p->is_done);
+}
+
+double
+bl_prefetch_elapsed_ms(bl_prefetch_t *p) {
+    return bl_prefetch_ms_since(&p->start);
+}
+
+void
+bl_prefetch_first_frame(bl_prefetch_t *p) {
+    if (p->first_frame_ms < 0) {
+        p->first_frame_ms = bl_prefetch_ms_since(&p->start);
+    }
+}
+
+void
+bl_prefetch_destroy(bl_prefetch_t *p) {
+    pthread_join(p->thread, NULL);
+    free(p);
+}
@@ -0,0 +1,98 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_PREFETCH_H__
+#define __BL_PREFETCH_H__ 1
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "usb.h"
+
+/*
+ * Read the controller state in a worker thread while the UI starts up.
+ * The parts become available one by one, check them with
+ * bl_prefetch_ready() and copy them out of state once they are ready.
+ */
+typedef struct bl_prefetch_t {
+    pthread_t thread;
+    // parts that must be read, BL_CTRL_* bitmask
+    int what;
+    // written by the worker, only read the parts that are ready
+    bl_ctrl_state_t state;
+    // parts that were read successfully
+    atomic_int ready;
+    // parts that could not be read
+    atomic_int failed;
+    atomic_int is_done;
+    struct timespec start;
+    // milliseconds since start when the part arrived, indexed by bit number
+    double arrived_ms[8];
+    // milliseconds since start when the UI was first drawn, < 0 if not yet
+    double first_frame_ms;
+} bl_prefetch_t;
+
+/**
+ * Start reading the controller state. The worker first enables service
+ * mode, then submits all transfers at once.
+ *
+ * @param what Bitmask of the BL_CTRL_* parts to read
+ *
+ * @return the prefetch, must be destroyed with bl_prefetch_destroy()
+ */
+bl_prefetch_t *bl_prefetch_start(int what);
+
+/**
+ * Return the bitmask of parts that have been read successfully.
+ */
+int bl_prefetch_ready(bl_prefetch_t *p);
+
+/**
+ * Return TRUE when the worker is finished, i.e. all parts have either
+ * arrived or failed and service mode is enabled.
+ */
+int bl_prefetch_is_done(bl_prefetch_t *p);
+
+/**
+ * Milliseconds since bl_prefetch_start() was called.
+ */
+double bl_prefetch_elapsed_ms(bl_prefetch_t *p);
+
+/**
+ * Record the time to the first frame of the UI, only the first call counts.
+ */
+void bl_prefetch_first_frame(bl_prefetch_t *p);
+
+/**
+ * Wait for the worker to finish and free the prefetch.
+ */
+void bl_prefetch_destroy(bl_prefetch_t *p);
+
+#endif /* __BL_PREFETCH_H__ */
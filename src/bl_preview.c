@@ -0,0 +1,225 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "blusb.h"
+#include "bl_preview.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static size_t
+bl_preview_entry_bytes(bl_preview_entry_t *entry) {
+    return sizeof(bl_preview_entry_t) + strlen(entry->path) + 1 +
+        (entry->layout != NULL ? sizeof(bl_layout_t) : 0);
+}
+
+static void
+bl_preview_entry_destroy(bl_preview_entry_t *entry) {
+    free(entry->path);
+    if (entry->layout != NULL) {
+        bl_layout_destroy(entry->layout);
+    }
+    free(entry);
+}
+
+/*
+ * Find the entry for the path, drop it if the file has changed.
+ * Must be called with the lock held.
+ */
+static bl_preview_entry_t *
+bl_preview_lookup(bl_preview_t *preview, char *path, struct stat *st) {
+    for (bl_preview_entry_t **p = &preview->entries; *p != NULL; p = &(*p)->next) {
+        bl_preview_entry_t *entry = *p;
+        if (strcmp(entry->path, path) == 0) {
+            if (entry->size == st->st_size &&
+                entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+                entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+                return entry;
+            }
+            *p = entry->next;
+            preview->bytes -= bl_preview_entry_bytes(entry);
+            bl_preview_entry_destroy(entry);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add the entry and evict the least recently used entries until the cache
+ * fits. Must be called with the lock held.
+ */
+static void
+bl_preview_insert(bl_preview_t *preview, bl_preview_entry_t *entry) {
+    entry->last_used = ++preview->clock;
+    entry->next = preview->entries;
+    preview->entries = entry;
+    preview->bytes += bl_preview_entry_bytes(entry);
+
+    while (preview->bytes > preview->max_bytes && preview->entries->next != NULL) {
+        bl_preview_entry_t **lru = &preview->entries;
+        for (bl_preview_entry_t **p = &preview->entries; *p != NULL; p = &(*p)->next) {
+            if ((*p)->last_used < (*lru)->last_used) {
+                lru = p;
+            }
+        }
+        bl_preview_entry_t *evicted = *lru;
+        *lru = evicted->next;
+        preview->bytes -= bl_preview_entry_bytes(evicted);
+        bl_preview_entry_destroy(evicted);
+    }
+}
+
+static void *
+bl_preview_worker(void *arg) {
+    bl_preview_t *preview = (bl_preview_t *) arg;
+
+    pthread_mutex_lock(&preview->lock);
+    for (;;) {
+        while (!preview->shutdown && preview->request == NULL) {
+            pthread_cond_wait(&preview->cond, &preview->lock);
+        }
+        if (preview->shutdown) {
+            break;
+        }
+        char *path = preview->request;
+        preview->request = NULL;
+        pthread_mutex_unlock(&preview->lock);
+
+        /*
+         * Parse without holding the lock
+         */
+        struct stat st;
+        bl_preview_entry_t *entry = NULL;
+        if (stat(path, &st) == 0) {
+            char errmsg[256];
+            entry = (bl_preview_entry_t *) malloc(sizeof(bl_preview_entry_t));
+            entry->path = path;
+            entry->mtime = st.st_mtim;
+            entry->size = st.st_size;
+            entry->layout = S_ISREG(st.st_mode) ? bl_layout_parse_file(path, errmsg, sizeof(errmsg)) : NULL;
+        } else {
+            free(path);
+        }
+
+        pthread_mutex_lock(&preview->lock);
+        if (entry != NULL) {
+            if (bl_preview_lookup(preview, entry->path, &st) == NULL) {
+                bl_preview_insert(preview, entry);
+            } else {
+                bl_preview_entry_destroy(entry);
+            }
+        }
+        preview->generation++;
+    }
+    pthread_mutex_unlock(&preview->lock);
+
+    return NULL;
+}
+
+bl_preview_t *
+bl_preview_create(size_t max_bytes) {
+    bl_preview_t *preview = (bl_preview_t *) malloc(sizeof(bl_preview_t));
+    pthread_mutex_init(&preview->lock, NULL);
+    pthread_cond_init(&preview->cond, NULL);
+    preview->request = NULL;
+    preview->shutdown = FALSE;
+    preview->entries = NULL;
+    preview->bytes = 0;
+    preview->max_bytes = max_bytes;
+    preview->clock = 0;
+    preview->generation = 0;
+    pthread_create(&preview->thread, NULL, bl_preview_worker, preview);
+
+    return preview;
+}
+
+void
+bl_preview_destroy(bl_preview_t *preview) {
+    pthread_mutex_lock(&preview->lock);
+    preview->shutdown = TRUE;
+    pthread_cond_signal(&preview->cond);
+    pthread_mutex_unlock(&preview->lock);
+    pthread_join(preview->thread, NULL);
+
+    while (preview->entries != NULL) {
+        bl_preview_entry_t *entry = preview->entries;
+        preview->entries = entry->next;
+        bl_preview_entry_destroy(entry);
+    }
+    free(preview->request);
+    pthread_mutex_destroy(&preview->lock);
+    pthread_cond_destroy(&preview->cond);
+    free(preview);
+}
+
+int
+bl_preview_get(bl_preview_t *preview, char *path, bl_layout_t *layout) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return BL_PREVIEW_ERROR;
+    }
+
+    int ret;
+    pthread_mutex_lock(&preview->lock);
+    bl_preview_entry_t *entry = bl_preview_lookup(preview, path, &st);
+    if (entry != NULL) {
+        entry->last_used = ++preview->clock;
+        if (entry->layout != NULL) {
+            *layout = *entry->layout;
+            ret = BL_PREVIEW_READY;
+        } else {
+            ret = BL_PREVIEW_ERROR;
+        }
+    } else {
+        if (preview->request == NULL || strcmp(preview->request, path) != 0) {
+            free(preview->request);
+            preview->request = strdup(path);
+            pthread_cond_signal(&preview->cond);
+        }
+        ret = BL_PREVIEW_PENDING;
+    }
+    pthread_mutex_unlock(&preview->lock);
+
+    return ret;
+}
+
+unsigned int
+bl_preview_generation(bl_preview_t *preview) {
+    pthread_mutex_lock(&preview->lock);
+    unsigned int generation = preview->generation;
+    pthread_mutex_unlock(&preview->lock);
+
+    return generation;
+}
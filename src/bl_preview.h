@@ -0,0 +1,109 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_PREVIEW_H__
+#define __BL_PREVIEW_H__ 1
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "usb.h"
+
+/*
+ * Maximum memory used by the parsed layouts in the cache
+ */
+#define BL_PREVIEW_CACHE_BYTES (256 * 1024)
+
+#define BL_PREVIEW_PENDING 0
+#define BL_PREVIEW_READY   1
+#define BL_PREVIEW_ERROR   2
+
+/*
+ * Layout files are parsed on a worker thread and kept in an LRU cache,
+ * keyed by path, modification time and size.
+ */
+typedef struct bl_preview_entry_t {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    // parsed layout, NULL if the file could not be parsed
+    bl_layout_t *layout;
+    unsigned long last_used;
+    struct bl_preview_entry_t *next;
+} bl_preview_entry_t;
+
+typedef struct bl_preview_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // path to parse next, NULL if nothing to do. Only the last request is kept.
+    char *request;
+    int shutdown;
+    bl_preview_entry_t *entries;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned long clock;
+    // incremented every time the worker adds an entry
+    unsigned int generation;
+} bl_preview_t;
+
+/**
+ * Create the cache and start the worker thread.
+ *
+ * @param max_bytes Maximum memory used by the cached layouts
+ */
+bl_preview_t *bl_preview_create(size_t max_bytes);
+
+/**
+ * Stop the worker thread and free the cache.
+ */
+void bl_preview_destroy(bl_preview_t *preview);
+
+/**
+ * Get the layout of the file from the cache. If it is not cached, or the
+ * file has changed since, ask the worker to parse it. Earlier requests that
+ * have not been started yet are dropped.
+ *
+ * @param preview The cache
+ * @param path Path of the layout file
+ * @param layout If BL_PREVIEW_READY is returned, the layout is copied here.
+ *
+ * @return BL_PREVIEW_READY, BL_PREVIEW_PENDING or BL_PREVIEW_ERROR if the
+ *         file can't be parsed.
+ */
+int bl_preview_get(bl_preview_t *preview, char *path, bl_layout_t *layout);
+
+/**
+ * Return a number that changes every time the worker has added an entry,
+ * there is no need to call bl_preview_get() again while it is the same.
+ */
+unsigned int bl_preview_generation(bl_preview_t *preview);
+
+#endif /* __BL_PREVIEW_H__ */
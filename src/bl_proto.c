@@ -0,0 +1,125 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "blusb.h"
+#include "bl_proto.h"
+
+/*
+ * Parse n numbers separated by commas and/or whitespace, the line must
+ * hold exactly n numbers no larger than max.
+ */
+static int
+bl_proto_parse_numbers(char *line, long *values, int n, long max) {
+    char *p = line;
+
+    for (int i=0; i<n; i++) {
+        while (*p == ' ' || *p == ',' || *p == '\t') {
+            p++;
+        }
+        if (!isdigit((unsigned char) *p)) {
+            return FALSE;
+        }
+        char *end;
+        values[i] = strtol(p, &end, 10);
+        if (values[i] > max) {
+            return FALSE;
+        }
+        p = end;
+    }
+    while (*p == ' ' || *p == ',' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+
+    return *p == 0;
+}
+
+/**
+ * Write a line per layer in use.
+ */
+void
+bl_proto_write_layout(FILE *f, bl_layout_t *layout) {
+    uint8_t *buffer = bl_layout_convert(layout);
+    bl_usb_raw_print_layout((uint16_t *) buffer, layout->nlayers, f);
+    free(buffer);
+}
+
+/**
+ * Parse the line with the keys of one layer.
+ *
+ * @return TRUE if the line holds NUMKEYS key codes
+ */
+int
+bl_proto_parse_layer(bl_layout_t *layout, int layer, char *line) {
+    long values[NUMKEYS];
+
+    if (layer < 0 || layer >= NUMLAYERS_MAX || !bl_proto_parse_numbers(line, values, NUMKEYS, 0xffff)) {
+        return FALSE;
+    }
+    for (int i=0; i<NUMKEYS; i++) {
+        layout->matrix[layer][i / NUMCOLS][i % NUMCOLS] = values[i];
+    }
+
+    return TRUE;
+}
+
+/**
+ * Write a line per macro, always NUM_MACROKEYS lines.
+ */
+void
+bl_proto_write_macros(FILE *f, bl_macro_t *macros) {
+    for (int i=0; i<NUM_MACROKEYS; i++) {
+        for (int j=0; j<LEN_MACRO; j++) {
+            fprintf(f, j == LEN_MACRO - 1 ? "%u\n" : "%u, ", macros->macros[i][j]);
+        }
+    }
+}
+
+/**
+ * Parse the line with the LEN_MACRO bytes of one macro.
+ *
+ * @return TRUE if the line is valid
+ */
+int
+bl_proto_parse_macro(bl_macro_t *macros, int macro, char *line) {
+    long values[LEN_MACRO];
+
+    if (macro < 0 || macro >= NUM_MACROKEYS || !bl_proto_parse_numbers(line, values, LEN_MACRO, 0xff)) {
+        return FALSE;
+    }
+    for (int i=0; i<LEN_MACRO; i++) {
+        macros->macros[macro][i] = values[i];
+    }
+
+    return TRUE;
+}
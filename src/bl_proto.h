@@ -0,0 +1,78 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_PROTO_H__
+#define __BL_PROTO_H__ 1
+
+#include <stdio.h>
+
+#include "usb.h"
+
+/*
+ * Text protocol between blusbd and its clients over a Unix domain socket.
+ *
+ * Every request is one line, WRITE-LAYOUT and WRITE-MACROS are followed by
+ * the given number of data lines:
+ *
+ *   READ-LAYOUT               OK <nlayers>, followed by a line per layer
+ *   READ-MACROS               OK 24, followed by a line per macro
+ *   READ-PWM                  OK <usb> <bt>
+ *   READ-DEBOUNCE             OK <debounce>
+ *   READ-VERSION              OK <major> <minor>
+ *   WRITE-LAYOUT <nlayers>    OK
+ *   WRITE-MACROS <nmacros>    OK
+ *   WRITE-PWM <usb> <bt>      OK
+ *   WRITE-DEBOUNCE <value>    OK
+ *
+ * A failed request is answered with ERR <message>. A layer line holds the
+ * NUMKEYS key codes in row order and a macro line the LEN_MACRO bytes of a
+ * macro, separated by ", ", the format of blusb -read-layout.
+ */
+
+/*
+ * Environment variable with the path of the socket, blusb talks to the
+ * daemon instead of the controller when it is set. blusbd puts the socket
+ * in $XDG_RUNTIME_DIR by default, or in /tmp if that is not set.
+ */
+#define BL_PROTO_SOCKET_ENV "BLUSB_SOCKET"
+#define BL_PROTO_SOCKET_NAME "blusbd.sock"
+#define BL_PROTO_SOCKET_DEFAULT "/tmp/" BL_PROTO_SOCKET_NAME
+
+/*
+ * Longest request including its data lines, a layout with 6 layers
+ * takes about 6.5 kB
+ */
+#define BL_PROTO_REQUEST_MAX 16384
+
+void bl_proto_write_layout(FILE *f, bl_layout_t *layout);
+int bl_proto_parse_layer(bl_layout_t *layout, int layer, char *line);
+void bl_proto_write_macros(FILE *f, bl_macro_t *macros);
+int bl_proto_parse_macro(bl_macro_t *macros, int macro, char *line);
+
+#endif /* __BL_PROTO_H__ */
@@ -0,0 +1,215 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "blusb.h"
+#include "bl_snapshot.h"
+
+int
+bl_snapshot_take(bl_ctrl_state_t *state) {
+    memset(state, 0, sizeof(bl_ctrl_state_t));
+    return bl_usb_read_state(state, BL_CTRL_ALL, NULL, NULL);
+}
+
+int
+bl_snapshot_restore(bl_ctrl_state_t *state, int parts) {
+    return bl_usb_write_state(state, parts & BL_SNAPSHOT_WRITABLE, NULL, NULL);
+}
+
+char *
+bl_snapshot_part_name(int what) {
+    switch (what) {
+        case BL_CTRL_LAYOUT: return "layout";
+        case BL_CTRL_MACROS: return "macros";
+        case BL_CTRL_PWM: return "pwm values";
+        case BL_CTRL_DEBOUNCE: return "debounce value";
+        case BL_CTRL_VERSION: return "firmware version";
+        default: return "unknown";
+    }
+}
+
+uint32_t
+bl_snapshot_crc32(uint8_t *data, size_t length) {
+    static uint32_t table[256];
+    static int table_ready = FALSE;
+
+    if (!table_ready) {
+        for (uint32_t i=0; i<256; i++) {
+            uint32_t c = i;
+            for (int k=0; k<8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = TRUE;
+    }
+
+    uint32_t crc = 0xffffffff;
+    for (size_t i=0; i<length; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xffffffff;
+}
+
+size_t
+bl_snapshot_encode(bl_ctrl_state_t *state, int parts, uint8_t *buffer) {
+    uint8_t *p = buffer + BL_SNAPSHOT_HEADER_SIZE;
+    int nlayers = parts & BL_CTRL_LAYOUT ? state->layout.nlayers : 0;
+
+    *p++ = nlayers;
+    for (int layer=0; layer<nlayers; layer++) {
+        for (int row=0; row<NUMROWS; row++) {
+            for (int col=0; col<NUMCOLS; col++) {
+                *p++ = state->layout.matrix[layer][row][col] & 0xff;
+                *p++ = state->layout.matrix[layer][row][col] >> 8;
+            }
+        }
+    }
+    if (parts & BL_CTRL_MACROS) {
+        memcpy(p, state->macros.macros, NUM_MACROKEYS * LEN_MACRO);
+    } else {
+        memset(p, 0, NUM_MACROKEYS * LEN_MACRO);
+    }
+    p += NUM_MACROKEYS * LEN_MACRO;
+    *p++ = state->pwm_usb;
+    *p++ = state->pwm_bt;
+    *p++ = state->debounce;
+    *p++ = state->major;
+    *p++ = state->minor;
+
+    size_t length = p - buffer - BL_SNAPSHOT_HEADER_SIZE;
+    uint32_t crc = bl_snapshot_crc32(buffer + BL_SNAPSHOT_HEADER_SIZE, length);
+
+    memcpy(buffer, BL_SNAPSHOT_MAGIC, 4);
+    buffer[4] = BL_SNAPSHOT_VERSION;
+    buffer[5] = parts & BL_CTRL_ALL;
+    buffer[6] = length & 0xff;
+    buffer[7] = length >> 8;
+    for (int i=0; i<4; i++) {
+        buffer[8 + i] = (crc >> (8 * i)) & 0xff;
+    }
+
+    return BL_SNAPSHOT_HEADER_SIZE + length;
+}
+
+int
+bl_snapshot_decode(uint8_t *buffer, size_t length, bl_ctrl_state_t *state, int *parts,
+                   char *errmsg, int errlen) {
+    if (length < BL_SNAPSHOT_HEADER_SIZE || memcmp(buffer, BL_SNAPSHOT_MAGIC, 4) != 0) {
+        snprintf(errmsg, errlen, "not a snapshot");
+        return FALSE;
+    }
+    if (buffer[4] != BL_SNAPSHOT_VERSION) {
+        snprintf(errmsg, errlen, "unsupported snapshot version %d", buffer[4]);
+        return FALSE;
+    }
+
+    size_t payload = buffer[6] | (buffer[7] << 8);
+    uint32_t crc = 0;
+    for (int i=0; i<4; i++) {
+        crc |= (uint32_t) buffer[8 + i] << (8 * i);
+    }
+    if (length != BL_SNAPSHOT_HEADER_SIZE + payload) {
+        snprintf(errmsg, errlen, "snapshot has the wrong size");
+        return FALSE;
+    }
+    uint8_t *p = buffer + BL_SNAPSHOT_HEADER_SIZE;
+    if (bl_snapshot_crc32(p, payload) != crc) {
+        snprintf(errmsg, errlen, "checksum mismatch, the snapshot is damaged");
+        return FALSE;
+    }
+
+    int nlayers = p[0];
+    *parts = buffer[5] & BL_CTRL_ALL;
+    if (((*parts & BL_CTRL_LAYOUT) && (nlayers < NUMLAYERS_MIN || nlayers > NUMLAYERS_MAX)) ||
+        payload != 1 + 2 * nlayers * NUMKEYS + NUM_MACROKEYS * LEN_MACRO + 5) {
+        snprintf(errmsg, errlen, "invalid snapshot layout");
+        return FALSE;
+    }
+
+    memset(state, 0, sizeof(bl_ctrl_state_t));
+    p++;
+    state->layout.nlayers = nlayers;
+    for (int layer=0; layer<nlayers; layer++) {
+        for (int row=0; row<NUMROWS; row++) {
+            for (int col=0; col<NUMCOLS; col++) {
+                state->layout.matrix[layer][row][col] = p[0] | (p[1] << 8);
+                p += 2;
+            }
+        }
+    }
+    state->macros.nmacros = *parts & BL_CTRL_MACROS ? NUM_MACROKEYS : 0;
+    memcpy(state->macros.macros, p, NUM_MACROKEYS * LEN_MACRO);
+    p += NUM_MACROKEYS * LEN_MACRO;
+    state->pwm_usb = *p++;
+    state->pwm_bt = *p++;
+    state->debounce = *p++;
+    state->major = *p++;
+    state->minor = *p++;
+
+    return TRUE;
+}
+
+int
+bl_snapshot_save(bl_ctrl_state_t *state, int parts, char *fname) {
+    uint8_t buffer[BL_SNAPSHOT_SIZE_MAX];
+    size_t length = bl_snapshot_encode(state, parts, buffer);
+
+    FILE *f = fopen(fname, "wb");
+    if (f == NULL) {
+        return FALSE;
+    }
+    int ok = fwrite(buffer, 1, length, f) == length;
+    if (fclose(f) != 0) {
+        ok = FALSE;
+    }
+
+    return ok;
+}
+
+int
+bl_snapshot_load(char *fname, bl_ctrl_state_t *state, int *parts, char *errmsg, int errlen) {
+    // one byte more than the largest image, to detect trailing data
+    uint8_t buffer[BL_SNAPSHOT_SIZE_MAX + 1];
+
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL) {
+        snprintf(errmsg, errlen, "%s: %s", fname, strerror(errno));
+        return FALSE;
+    }
+    size_t length = fread(buffer, 1, sizeof(buffer), f);
+    fclose(f);
+
+    return bl_snapshot_decode(buffer, length, state, parts, errmsg, errlen);
+}
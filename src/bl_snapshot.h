@@ -0,0 +1,121 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_SNAPSHOT_H__
+#define __BL_SNAPSHOT_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "usb.h"
+
+/*
+ * A snapshot holds the complete controller state in one binary image, so
+ * a controller can be backed up and restored, or replaced, in one go.
+ *
+ * Image format, all numbers little endian:
+ *
+ *   0  magic "BLSS"
+ *   4  format version, 1 byte
+ *   5  BL_CTRL_* parts present in the image, 1 byte
+ *   6  length of the payload, 2 bytes
+ *   8  CRC-32 of the payload, 4 bytes
+ *  12  payload: number of layers (1 byte), the key codes of the layers
+ *      (2 bytes each), the macros, pwm usb, pwm bt, debounce and the
+ *      firmware version major and minor (1 byte each)
+ */
+#define BL_SNAPSHOT_MAGIC "BLSS"
+#define BL_SNAPSHOT_VERSION 1
+#define BL_SNAPSHOT_HEADER_SIZE 12
+#define BL_SNAPSHOT_SIZE_MAX (BL_SNAPSHOT_HEADER_SIZE + 1 + NUMLAYERS_MAX * NUMKEYS * 2 + \
+                              NUM_MACROKEYS * LEN_MACRO + 5)
+
+/*
+ * The parts that are restored, the version is only informative
+ */
+#define BL_SNAPSHOT_WRITABLE (BL_CTRL_LAYOUT | BL_CTRL_MACROS | BL_CTRL_PWM | BL_CTRL_DEBOUNCE)
+
+/**
+ * Read the complete state from the open controller, all parts are read in
+ * one batch of transfers.
+ *
+ * @return Bitmask of the BL_CTRL_* parts that were read
+ */
+int bl_snapshot_take(bl_ctrl_state_t *state);
+
+/**
+ * Write the parts of state to the open controller in one batch.
+ *
+ * @return Bitmask of the BL_CTRL_* parts that were written
+ */
+int bl_snapshot_restore(bl_ctrl_state_t *state, int parts);
+
+/**
+ * Encode the parts of state as an image.
+ *
+ * @param buffer At least BL_SNAPSHOT_SIZE_MAX bytes
+ *
+ * @return The length of the image
+ */
+size_t bl_snapshot_encode(bl_ctrl_state_t *state, int parts, uint8_t *buffer);
+
+/**
+ * Decode an image, the header and checksum are checked.
+ *
+ * @param parts Set to the parts present in the image
+ *
+ * @return TRUE if successful, otherwise FALSE and the reason is stored in
+ * errmsg.
+ */
+int bl_snapshot_decode(uint8_t *buffer, size_t length, bl_ctrl_state_t *state, int *parts,
+                       char *errmsg, int errlen);
+
+/**
+ * Save the parts of state as an image file.
+ *
+ * @return TRUE if successful, FALSE if not and errno is set.
+ */
+int bl_snapshot_save(bl_ctrl_state_t *state, int parts, char *fname);
+
+/**
+ * Load an image file, see bl_snapshot_decode().
+ */
+int bl_snapshot_load(char *fname, bl_ctrl_state_t *state, int *parts, char *errmsg, int errlen);
+
+/**
+ * @return The name of a BL_CTRL_* part for messages
+ */
+char *bl_snapshot_part_name(int what);
+
+/**
+ * CRC-32 (IEEE 802.3) of the data.
+ */
+uint32_t bl_snapshot_crc32(uint8_t *data, size_t length);
+
+#endif /* __BL_SNAPSHOT_H__ */
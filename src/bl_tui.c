@@ -28,29 +28,66 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #ifdef __APPLE__
 #include <sys/syslimits.h>
 #endif
 
-#ifdef __CYGWIN__
-#include <windows.h>
-#endif
-
 #include "blusb.h"
 #include "bl_tui.h"
 #include "bl_io.h"
 
 /* global state for ui init */
 static int _bl_tui_initialised = FALSE;
+/* the thread that owns curses, set by bl_tui_init() */
+static pthread_t _bl_tui_thread;
+
+/*
+ * Errors reported by other threads (bl_err in the prefetch or writer
+ * workers) are queued and shown by bl_tui_poll() on the curses thread.
+ */
+#define BL_TUI_ERR_QUEUE_MAX 8
+#define BL_TUI_ERR_LEN 256
+
+static pthread_mutex_t _bl_tui_err_lock = PTHREAD_MUTEX_INITIALIZER;
+static char _bl_tui_err_queue[BL_TUI_ERR_QUEUE_MAX][BL_TUI_ERR_LEN];
+static int _bl_tui_err_n = 0;
+
+static void _bl_tui_err_handler(int is_fatal, char *msg, va_list varglist);
+
+/*
+ * Take the oldest queued error, returns FALSE if there is none
+ */
+static int
+bl_tui_err_dequeue(char *msg) {
+    pthread_mutex_lock(&_bl_tui_err_lock);
+    int n = _bl_tui_err_n;
+    if (n > 0) {
+        memcpy(msg, _bl_tui_err_queue[0], BL_TUI_ERR_LEN);
+        memmove(_bl_tui_err_queue[0], _bl_tui_err_queue[1], (n - 1) * BL_TUI_ERR_LEN);
+        _bl_tui_err_n--;
+    }
+    pthread_mutex_unlock(&_bl_tui_err_lock);
+
+    return n > 0;
+}
 
 void
 bl_tui_exit() {
+    char msg[BL_TUI_ERR_LEN];
+
     if (_bl_tui_initialised) {
         endwin();
         _bl_tui_initialised = FALSE;
+        bl_err_set_handler(NULL, NULL);
+        // errors that were not shown yet
+        while (bl_tui_err_dequeue(msg)) {
+            fputs(msg, stderr);
+        }
     }
 }
 
@@ -79,15 +116,96 @@ bl_tui_init() {
     }
 
     _bl_tui_initialised = TRUE;
+    _bl_tui_thread = pthread_self();
+    bl_err_set_handler(_bl_tui_err_handler, bl_tui_exit);
     return TRUE;
 }
 
+typedef struct bl_tui_idle_t {
+    bl_tui_idle_hook_t hook;
+    void *data;
+} bl_tui_idle_t;
+
+static bl_tui_idle_t _bl_tui_idle_hooks[BL_TUI_IDLE_HOOKS_MAX] = { { NULL, NULL } };
+/* TRUE while the hooks run, a hook that shows a dialog must not run them again */
+static int _bl_tui_in_idle = FALSE;
+
+int
+bl_tui_idle_add(bl_tui_idle_hook_t hook, void *data) {
+    for (int i=0; i<BL_TUI_IDLE_HOOKS_MAX; i++) {
+        if (_bl_tui_idle_hooks[i].hook == NULL) {
+            _bl_tui_idle_hooks[i].hook = hook;
+            _bl_tui_idle_hooks[i].data = data;
+            return i;
+        }
+    }
+    errmsg_and_abort("too many idle hooks");
+
+    return -1;
+}
+
+void
+bl_tui_idle_remove(int id) {
+    if (id >= 0 && id < BL_TUI_IDLE_HOOKS_MAX) {
+        _bl_tui_idle_hooks[id].hook = NULL;
+        _bl_tui_idle_hooks[id].data = NULL;
+    }
+}
+
+int
+bl_tui_poll() {
+    if (!_bl_tui_in_idle) {
+        char msg[BL_TUI_ERR_LEN];
+
+        _bl_tui_in_idle = TRUE;
+        while (bl_tui_err_dequeue(msg)) {
+            bl_tui_msg(60, 4, "Error", "%s", msg);
+        }
+        for (int i=0; i<BL_TUI_IDLE_HOOKS_MAX; i++) {
+            if (_bl_tui_idle_hooks[i].hook != NULL) {
+                _bl_tui_idle_hooks[i].hook(_bl_tui_idle_hooks[i].data);
+            }
+        }
+        _bl_tui_in_idle = FALSE;
+    }
+
+    return getch();
+}
+
+void
+bl_tui_dialog_run(bl_tui_dialog_t *dialog) {
+    while (dialog->step(dialog, bl_tui_poll()) == BL_TUI_RUNNING) {
+        // don't hog the cpu too much
+        usleep(50);
+    }
+}
+
+/*
+ * Size of the arena on the stack used by the dialogs, large enough for
+ * their widgets so they normally don't allocate anything on the heap.
+ */
+#define BL_TUI_DIALOG_ARENA_SIZE 1024
+
+static void *
+bl_tui_alloc(bl_arena_t *arena, size_t size) {
+    if (arena != NULL) {
+        return bl_arena_alloc(arena, size);
+    }
+    void *p = malloc(size);
+    if (p == NULL) {
+        errmsg_and_abort("out of memory");
+    }
+    return p;
+}
+
 bl_tui_textbox_t *
-bl_tui_textbox_create(WINDOW *parent_win, char *label, char *value, int x, int y, int width, int maxlength) {
-    bl_tui_textbox_t *textbox = (bl_tui_textbox_t *) malloc( sizeof(bl_tui_textbox_t) );
+bl_tui_textbox_create(bl_arena_t *arena, WINDOW *parent_win, char *label, char *value,
+                      int x, int y, int width, int maxlength) {
+    bl_tui_textbox_t *textbox = (bl_tui_textbox_t *) bl_tui_alloc(arena, sizeof(bl_tui_textbox_t));
+    textbox->arena = arena;
     textbox->win = newwin(2, width, y, x);
     textbox->label = label;
-    textbox->text = (char *) malloc(maxlength + 1);
+    textbox->text = (char *) bl_tui_alloc(arena, maxlength + 1);
     textbox->text[0] = 0;
     textbox->pos = 0;
     textbox->scroll = 0;
@@ -109,14 +227,17 @@ void
 bl_tui_textbox_destroy(bl_tui_textbox_t *textbox) {
     werase(textbox->win);
     delwin(textbox->win);
-    free(textbox->text);
+    if (textbox->arena == NULL) {
+        free(textbox->text);
+        free(textbox);
+    }
 
     return;
 }
 
 bl_tui_button_t *
-bl_tui_buttons_create(int x, int y, char *labels[], int n) {
-    bl_tui_button_t *buttons = (bl_tui_button_t *) malloc(n * sizeof(bl_tui_button_t));
+bl_tui_buttons_create(bl_arena_t *arena, int x, int y, char *labels[], int n) {
+    bl_tui_button_t *buttons = (bl_tui_button_t *) bl_tui_alloc(arena, n * sizeof(bl_tui_button_t));
     int x_offset = 0;
 
     for (int i=0; i<n; i++) {
@@ -124,8 +245,9 @@ bl_tui_buttons_create(int x, int y, char *labels[], int n) {
         buttons[i].label = labels[i];
         buttons[i].x = x;
         buttons[i].y = y;
+        buttons[i].arena = arena;
         box(buttons[i].win, 0, 0);
-        mvwprintw(buttons[i].win, 1, 1, labels[i]);
+        mvwprintw(buttons[i].win, 1, 1, "%s", labels[i]);
         wrefresh(buttons[i].win);
         x_offset += strlen(labels[i]) + 3;
     }
@@ -139,61 +261,96 @@ bl_tui_buttons_destroy(bl_tui_button_t *buttons, int n) {
         werase(buttons[i].win);
         delwin(buttons[i].win);
     }
-    free(buttons);
+    if (n > 0 && buttons[0].arena == NULL) {
+        free(buttons);
+    }
 }
 
 void
 bl_tui_buttons_select(bl_tui_button_t button) {
     wattron(button.win, A_REVERSE);
-    mvwprintw(button.win, 1, 1, button.label);
+    mvwprintw(button.win, 1, 1, "%s", button.label);
     wrefresh(button.win);
 }
 
 void
 bl_tui_buttons_deselect(bl_tui_button_t button) {
     wattroff(button.win, A_REVERSE);
-    mvwprintw(button.win, 1, 1, button.label);
+    mvwprintw(button.win, 1, 1, "%s", button.label);
     wrefresh(button.win);
 }
 
-int
-bl_tui_buttons(int x, int y, char *labels[], int n) {
-    bl_tui_button_t *buttons = bl_tui_buttons_create(x, y, labels, n);
-
-    int done = FALSE;
-    int selected = 0;
-    int old_selected = -1;
-    while (!done) {
-        int ch = getch();
-        if (ch == '\n' || ch == '\r') {
-            // select button
-            done = TRUE;
-        } else if (ch == '\t' || ch == KEY_RIGHT) {
-            // move to next button
-            selected = (selected + 1) % n;
-        } else if (ch == KEY_BTAB || ch == KEY_LEFT) {
-            // move to previous button
-            selected = (selected + n - 1) % n;
-        }
-        if (selected != old_selected) {
-            /*
-            * redraw labels
-            */
-            for (int i=0; i<n; i++) {
-                if (i == selected) {
-                    bl_tui_buttons_select(buttons[i]);
-                } else {
-                    bl_tui_buttons_deselect(buttons[i]);
-                }
+/*
+ * State of a row of buttons while it is shown
+ */
+typedef struct bl_tui_buttons_dialog_t {
+    bl_tui_dialog_t dialog;
+    bl_tui_button_t *buttons;
+    int n;
+    int selected;
+    int old_selected;
+} bl_tui_buttons_dialog_t;
+
+static void
+bl_tui_buttons_redraw(bl_tui_buttons_dialog_t *bd) {
+    if (bd->selected != bd->old_selected) {
+        /*
+        * redraw labels
+        */
+        for (int i=0; i<bd->n; i++) {
+            if (i == bd->selected) {
+                bl_tui_buttons_select(bd->buttons[i]);
+            } else {
+                bl_tui_buttons_deselect(bd->buttons[i]);
             }
-            old_selected = selected;
         }
-        usleep(50);
+        bd->old_selected = bd->selected;
+    }
+}
+
+static int
+bl_tui_buttons_step(bl_tui_dialog_t *dialog, int ch) {
+    bl_tui_buttons_dialog_t *bd = (bl_tui_buttons_dialog_t *) dialog;
+    int done = FALSE;
+
+    if (ch == '\n' || ch == '\r') {
+        // select button
+        done = TRUE;
+    } else if (ch == '\t' || ch == KEY_RIGHT) {
+        // move to next button
+        bd->selected = (bd->selected + 1) % bd->n;
+    } else if (ch == KEY_BTAB || ch == KEY_LEFT) {
+        // move to previous button
+        bd->selected = (bd->selected + bd->n - 1) % bd->n;
     }
+    bl_tui_buttons_redraw(bd);
+
+    return done ? BL_TUI_DONE : BL_TUI_RUNNING;
+}
+
+static void
+bl_tui_buttons_begin(bl_tui_buttons_dialog_t *bd, bl_tui_button_t *buttons, int n) {
+    bd->dialog.step = bl_tui_buttons_step;
+    bd->buttons = buttons;
+    bd->n = n;
+    bd->selected = 0;
+    bd->old_selected = -1;
+}
+
+int
+bl_tui_buttons(int x, int y, char *labels[], int n) {
+    char arena_buf[BL_TUI_DIALOG_ARENA_SIZE];
+    bl_arena_t arena;
+    bl_arena_init(&arena, arena_buf, sizeof(arena_buf));
+
+    bl_tui_buttons_dialog_t bd;
+    bl_tui_buttons_begin(&bd, bl_tui_buttons_create(&arena, x, y, labels, n), n);
+    bl_tui_dialog_run(&bd.dialog);
 
-    bl_tui_buttons_destroy(buttons, n);
+    bl_tui_buttons_destroy(bd.buttons, n);
+    bl_arena_reset(&arena);
 
-    return selected;
+    return bd.selected;
 }
 
 int
@@ -221,16 +378,8 @@ _bl_tui_confirm_or_msg(int width, int height, int is_confirm, char *title, char
     char **buttons = is_confirm ? buttons_confirm : buttons_ok;
     int n_buttons = is_confirm ? 2 : 1;
 
-    int answer = -1;
-    while (answer != FALSE && answer != TRUE) {
-        int button = bl_tui_buttons(x+1, y+2+height+1, buttons, n_buttons);
-        if (button == 0) {
-            answer = TRUE;
-        } else if (button == 1) {
-            answer = FALSE;
-        }
-        usleep(50);
-    }
+    int answer = bl_tui_buttons(x+1, y+2+height+1, buttons, n_buttons) == 0;
+
     wclear(win);
     wrefresh(win);
     delwin(win);
@@ -272,16 +421,31 @@ bl_tui_msg(int width, int height, char *title, char *msg, ...) {
     return ret;
 }
 
+/*
+ * Shows the errors reported by the core (bl_err) in a dialog
+ */
+static void
+_bl_tui_err_handler(int is_fatal, char *msg, va_list varglist) {
+    if (!_bl_tui_initialised) {
+        vfprintf(stderr, msg, varglist);
+    } else if (pthread_equal(pthread_self(), _bl_tui_thread)) {
+        _bl_tui_confirm_or_msg(60, 4, FALSE, "Error", msg, varglist);
+    } else {
+        // curses is not thread safe, a full queue drops the error
+        pthread_mutex_lock(&_bl_tui_err_lock);
+        if (_bl_tui_err_n < BL_TUI_ERR_QUEUE_MAX) {
+            vsnprintf(_bl_tui_err_queue[_bl_tui_err_n++], BL_TUI_ERR_LEN, msg, varglist);
+        }
+        pthread_mutex_unlock(&_bl_tui_err_lock);
+    }
+}
+
 void
 bl_tui_err(int is_fatal, char *msg, ...) {
     va_list varglist;
     va_start(varglist, msg);
 
-    if (_bl_tui_initialised) {
-        _bl_tui_confirm_or_msg(60, 4, FALSE, "Error", msg, varglist);
-    } else {
-        vfprintf(stderr, msg, varglist);
-    }
+    _bl_tui_err_handler(is_fatal, msg, varglist);
 
     if (is_fatal) {
         bl_tui_exit();
@@ -291,148 +455,176 @@ bl_tui_err(int is_fatal, char *msg, ...) {
     va_end(varglist);
 }
 
-char *
-bl_tui_textbox(char *title, char *label, char *value, int x, int y, int width, int maxlength) {
-    int total_width = 1 + strlen(label) + 3 + width + 1;
-    WINDOW *win = newwin(7, total_width, y, x);
-    box(win, 0, 0);
-    mvwprintw(win, 0, total_width / 2 - strlen(title) / 2 - 1, " %s ", title);
-    touchwin(win);
-    wrefresh(win);
+/*
+ * Where the focus of the textbox dialog is
+ */
+#define BL_TUI_IN_BUTTONS 0
+#define BL_TUI_IN_TEXT 1
 
-    char *labels[] = { "Ok", "Cancel" };
-    int n = 2;
-    bl_tui_button_t *buttons = bl_tui_buttons_create(x+1, y+3, labels, n);
-    int done = FALSE;
-    int selected = 0;
-    int old_selected = -1;
+/*
+ * State of the textbox dialog while it is shown
+ */
+typedef struct bl_tui_textbox_dialog_t {
+    bl_tui_dialog_t dialog;
+    bl_tui_buttons_dialog_t buttons;
+    bl_tui_textbox_t *textbox;
+    // width of the visible part of the text
+    int width;
+    int state;
+    int canceled;
+} bl_tui_textbox_dialog_t;
+
+static void
+bl_tui_textbox_redraw(bl_tui_textbox_dialog_t *td) {
+    bl_tui_textbox_t *textbox = td->textbox;
 
-    bl_tui_textbox_t *textbox = bl_tui_textbox_create(win, label, value, x+1, y+1, total_width-2, maxlength);
-    mvwprintw(textbox->win, 0, 0, "%s: %s", textbox->label, textbox->text);
+    werase(textbox->win);
+    mvwprintw(textbox->win, 0, 0, "%s: %.*s", textbox->label, td->width, &textbox->text[textbox->scroll]);
+    /*
+     * Draw the cursor
+     */
+    if (td->state == BL_TUI_IN_TEXT) {
+        wattron(textbox->win, A_REVERSE);
+    }
+    if (textbox->pos < strlen(textbox->text)) {
+        mvwprintw(textbox->win, 0, strlen(textbox->label) + 2 + textbox->pos - textbox->scroll, "%c", textbox->text[textbox->pos]);
+    } else {
+        mvwprintw(textbox->win, 0, strlen(textbox->label) + 2 + textbox->pos - textbox->scroll, " ");
+    }
+    if (td->state == BL_TUI_IN_TEXT) {
+        wattroff(textbox->win, A_REVERSE);
+    }
     wrefresh(textbox->win);
+}
 
-    const int IN_BUTTONS = 0;
-    const int IN_TEXT = 1;
-    int state = IN_TEXT;
-    int ch;
-    while (!done) {
-        ch = getch();
-        if (state == IN_BUTTONS) {
-            if (ch == '\n' || ch == '\r') {
-                // select button
-                done = TRUE;
-            } else if (ch == '\t') {
-                if (selected < n-1) {
-                    selected = selected + 1;
-                } else {
-                    bl_tui_buttons_deselect(buttons[selected]);
-                    state = IN_TEXT;
-                }
-            } else if (ch == 27) {
-                selected = 1;
-                done = TRUE;
-            } else if (ch == '\t' || ch == KEY_RIGHT) {
-                // move to next button
-                selected = (selected + 1) % n;
-            } else if (ch == KEY_BTAB || ch == KEY_LEFT) {
-                // move to previous button
-                selected = (selected + n - 1) % n;
-            } else if (ch == KEY_UP || ch == KEY_DOWN) {
-                bl_tui_buttons_deselect(buttons[selected]);
-                state = IN_TEXT;
-            }
-            if (selected != old_selected) {
-                /*
-                * redraw labels
-                */
-                for (int i=0; i<n; i++) {
-                    if (i == selected) {
-                        bl_tui_buttons_select(buttons[i]);
-                    } else {
-                        bl_tui_buttons_deselect(buttons[i]);
-                    }
-                }
-                old_selected = selected;
+static int
+bl_tui_textbox_step(bl_tui_dialog_t *dialog, int ch) {
+    bl_tui_textbox_dialog_t *td = (bl_tui_textbox_dialog_t *) dialog;
+    bl_tui_buttons_dialog_t *bd = &td->buttons;
+    bl_tui_textbox_t *textbox = td->textbox;
+    int done = FALSE;
+
+    if (td->state == BL_TUI_IN_BUTTONS) {
+        if (ch == '\n' || ch == '\r') {
+            // select button
+            done = TRUE;
+        } else if (ch == '\t') {
+            if (bd->selected < bd->n-1) {
+                bd->selected = bd->selected + 1;
+            } else {
+                bl_tui_buttons_deselect(bd->buttons[bd->selected]);
+                td->state = BL_TUI_IN_TEXT;
             }
-        } else if (state == IN_TEXT) {
-            // edit text
-            if (ch == '\n' || ch == '\r') {
-                // select button
-                done = TRUE;
-            } else if (ch == '\t') {
-                selected = 0;
-                bl_tui_buttons_select(buttons[selected]);
-                state = IN_BUTTONS;
-            } else if (ch == 27) {
-                selected = 1;
-                done = TRUE;
-            } else if (ch == KEY_UP || ch == KEY_DOWN) {
-                bl_tui_buttons_select(buttons[selected]);
-                state = IN_BUTTONS;
-            } else if (ch == KEY_RIGHT) {
-                if (textbox->pos < strlen(textbox->text)) {
-                    textbox->pos++;
-                }
-            } else if (ch == KEY_LEFT) {
-                if (textbox->pos > 0) {
-                    textbox->pos--;
-                }
-            } else if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
-                if (textbox->pos > 0) {
-                    textbox->pos--;
-                    strcpy(&textbox->text[textbox->pos], &textbox->text[textbox->pos+1]);
-                }
-            } else if (ch == KEY_DC /* DEL key */) {
-                strcpy(&textbox->text[textbox->pos], &textbox->text[textbox->pos+1]);
-                textbox->text[strlen(textbox->text)] = 0;
-            } else if (ch == 1 /* ctrl-a */ || ch == KEY_HOME) {
-                textbox->pos = 0;
-            } else if (ch == 5 /* ctrl-e */ || ch == KEY_END) {
-                textbox->pos = strlen(textbox->text);
-            } else if (isprint(ch)) {
-                if (strlen(textbox->text) < textbox->maxlength) {
-                    strcpy(&textbox->text[textbox->pos+1], &textbox->text[textbox->pos]);
-                    textbox->text[textbox->pos] = ch;
-                    textbox->pos++;
-                }
+        } else if (ch == 27) {
+            bd->selected = 1;
+            td->canceled = TRUE;
+            done = TRUE;
+        } else if (ch == KEY_RIGHT) {
+            // move to next button
+            bd->selected = (bd->selected + 1) % bd->n;
+        } else if (ch == KEY_BTAB || ch == KEY_LEFT) {
+            // move to previous button
+            bd->selected = (bd->selected + bd->n - 1) % bd->n;
+        } else if (ch == KEY_UP || ch == KEY_DOWN) {
+            bl_tui_buttons_deselect(bd->buttons[bd->selected]);
+            td->state = BL_TUI_IN_TEXT;
+        }
+        bl_tui_buttons_redraw(bd);
+    } else if (td->state == BL_TUI_IN_TEXT) {
+        // edit text
+        if (ch == '\n' || ch == '\r') {
+            // select button
+            done = TRUE;
+        } else if (ch == '\t') {
+            bd->selected = 0;
+            bl_tui_buttons_select(bd->buttons[bd->selected]);
+            td->state = BL_TUI_IN_BUTTONS;
+        } else if (ch == 27) {
+            bd->selected = 1;
+            td->canceled = TRUE;
+            done = TRUE;
+        } else if (ch == KEY_UP || ch == KEY_DOWN) {
+            bl_tui_buttons_select(bd->buttons[bd->selected]);
+            td->state = BL_TUI_IN_BUTTONS;
+        } else if (ch == KEY_RIGHT) {
+            if (textbox->pos < strlen(textbox->text)) {
+                textbox->pos++;
             }
-            /*
-             * Check if we need to scroll the text left or right
-             */
-            if (textbox->pos < textbox->scroll) {
-                textbox->scroll--;
-            } else if (textbox->pos >= textbox->scroll + width) {
-                textbox->scroll++;
+        } else if (ch == KEY_LEFT) {
+            if (textbox->pos > 0) {
+                textbox->pos--;
             }
-            werase(textbox->win);
-            char fmt[10];
-            sprintf(fmt, "%%s: %%.%ds", width);
-            mvwprintw(textbox->win, 0, 0, fmt, textbox->label, &textbox->text[textbox->scroll]);
-            /*
-             * Draw the cursor
-             */
-            if (state == IN_TEXT) {
-                wattron(textbox->win, A_REVERSE);
+        } else if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
+            if (textbox->pos > 0) {
+                textbox->pos--;
+                memmove(&textbox->text[textbox->pos], &textbox->text[textbox->pos+1],
+                        strlen(&textbox->text[textbox->pos+1]) + 1);
             }
+        } else if (ch == KEY_DC /* DEL key */) {
             if (textbox->pos < strlen(textbox->text)) {
-                mvwprintw(textbox->win, 0, strlen(label) + 2 + textbox->pos - textbox->scroll, "%c", textbox->text[textbox->pos]);
-            } else {
-                mvwprintw(textbox->win, 0, strlen(label) + 2 + textbox->pos - textbox->scroll, " ");
+                memmove(&textbox->text[textbox->pos], &textbox->text[textbox->pos+1],
+                        strlen(&textbox->text[textbox->pos+1]) + 1);
             }
-            if (state == IN_TEXT) {
-                wattroff(textbox->win, A_REVERSE);
+        } else if (ch == 1 /* ctrl-a */ || ch == KEY_HOME) {
+            textbox->pos = 0;
+        } else if (ch == 5 /* ctrl-e */ || ch == KEY_END) {
+            textbox->pos = strlen(textbox->text);
+        } else if (ch != ERR && isprint(ch)) {
+            if (strlen(textbox->text) < textbox->maxlength) {
+                memmove(&textbox->text[textbox->pos+1], &textbox->text[textbox->pos],
+                        strlen(&textbox->text[textbox->pos]) + 1);
+                textbox->text[textbox->pos] = ch;
+                textbox->pos++;
             }
-            wrefresh(textbox->win);
-        } else {
-            bl_tui_err(FALSE, "Invalid state: %d\n", state);
         }
-        usleep(50);
+        /*
+         * Check if we need to scroll the text left or right
+         */
+        if (textbox->pos < textbox->scroll) {
+            textbox->scroll--;
+        } else if (textbox->pos >= textbox->scroll + td->width) {
+            textbox->scroll++;
+        }
+        bl_tui_textbox_redraw(td);
+    } else {
+        bl_tui_err(FALSE, "Invalid state: %d\n", td->state);
     }
 
+    return done ? BL_TUI_DONE : BL_TUI_RUNNING;
+}
+
+char *
+bl_tui_textbox(char *title, char *label, char *value, int x, int y, int width, int maxlength) {
+    int total_width = 1 + strlen(label) + 3 + width + 1;
+    WINDOW *win = newwin(7, total_width, y, x);
+    box(win, 0, 0);
+    mvwprintw(win, 0, total_width / 2 - strlen(title) / 2 - 1, " %s ", title);
+    touchwin(win);
+    wrefresh(win);
+
+    char arena_buf[BL_TUI_DIALOG_ARENA_SIZE];
+    bl_arena_t arena;
+    bl_arena_init(&arena, arena_buf, sizeof(arena_buf));
+
+    char *labels[] = { "Ok", "Cancel" };
+    int n = 2;
+    bl_tui_textbox_dialog_t td;
+    td.dialog.step = bl_tui_textbox_step;
+    bl_tui_buttons_begin(&td.buttons, bl_tui_buttons_create(&arena, x+1, y+3, labels, n), n);
+    td.textbox = bl_tui_textbox_create(&arena, win, label, value, x+1, y+1, total_width-2, maxlength);
+    td.width = width;
+    td.state = BL_TUI_IN_TEXT;
+    td.canceled = FALSE;
+    mvwprintw(td.textbox->win, 0, 0, "%s: %s", td.textbox->label, td.textbox->text);
+    wrefresh(td.textbox->win);
+
+    bl_tui_dialog_run(&td.dialog);
+
     // If Ok clicked copy text, If Cancel clicked or ESC pressed return NULL
-    char *text = (selected == 0  && ch != 27) ? strdup(textbox->text) : NULL;
-    bl_tui_buttons_destroy(buttons, n);
-    bl_tui_textbox_destroy(textbox);
+    char *text = (td.buttons.selected == 0 && !td.canceled) ? strdup(td.textbox->text) : NULL;
+    bl_tui_buttons_destroy(td.buttons.buttons, n);
+    bl_tui_textbox_destroy(td.textbox);
+    bl_arena_reset(&arena);
     wclear(win);
     wrefresh(win);
     delwin(win);
@@ -441,8 +633,9 @@ bl_tui_textbox(char *title, char *label, char *value, int x, int y, int width, i
 }
 
 bl_tui_select_box_t *
-bl_tui_select_box_create(char *title, bl_tui_select_box_value_t *items, int n, int width, int popup_width) {
-    bl_tui_select_box_t *sb = (bl_tui_select_box_t *) malloc(sizeof(bl_tui_select_box_t));
+bl_tui_select_box_create(bl_arena_t *arena, char *title, bl_tui_select_box_value_t *items, int n,
+                         int width, int popup_width) {
+    bl_tui_select_box_t *sb = (bl_tui_select_box_t *) bl_tui_alloc(arena, sizeof(bl_tui_select_box_t));
     if (sb == NULL) {
         errmsg_and_abort("select_box");
     } else {
@@ -457,13 +650,18 @@ bl_tui_select_box_create(char *title, bl_tui_select_box_value_t *items, int n, i
         sb->width = width;
         sb->popup_width = popup_width + 2;
         sb->items = items;
+        sb->idle = NULL;
+        sb->idle_data = NULL;
+        sb->arena = arena;
     }
     return sb;
 }
 
 void
 bl_tui_select_box_destroy(bl_tui_select_box_t* sb) {
-    free(sb);
+    if (sb->arena == NULL) {
+        free(sb);
+    }
 }
 
 
@@ -477,23 +675,19 @@ bl_tui_select_box_draw(WINDOW *win, bl_tui_select_box_t *sb, int x, int y, int i
         errmsg_and_abort("selected index out of range: %d", sb->selected_item_index);
     }
 
-    char *template = (char*) malloc(20 + strlen(selected_item->label));
-    sprintf(template, "%%.%ds", sb->width);
-
     if (inversed) {
         wattron(win, A_REVERSE);
     }
-    mvwprintw(win, y, x, template, selected_item->label);
+    mvwprintw(win, y, x, "%.*s", sb->width, selected_item->label);
     if (inversed) {
         wattroff(win, A_REVERSE);
     }
-
-    free(template);
 }
 
 void
 bl_tui_select_box_redraw_list(WINDOW *win, bl_tui_select_box_t *sb,
                                  int cursor_i, int item_start, int item_end) {
+    int w = getmaxx(win) - 2;
     werase(win);
     box(win, 0, 0);
     if (sb->title != NULL) {
@@ -505,16 +699,98 @@ bl_tui_select_box_redraw_list(WINDOW *win, bl_tui_select_box_t *sb,
         }
         if (i == cursor_i) {
             wattron(win, A_REVERSE);
-            mvwprintw(win, i-item_start+1, 1, "%s", sb->items[i].label);
+            mvwprintw(win, i-item_start+1, 1, "%.*s", w, sb->items[i].label);
             wattroff(win, A_REVERSE);
         } else {
-            mvwprintw(win, i-item_start+1, 1, "%s", sb->items[i].label);
+            mvwprintw(win, i-item_start+1, 1, "%.*s", w, sb->items[i].label);
         }
         wattroff(win, A_BOLD);
     }
     wrefresh(win);
 }
 
+/*
+ * State of the select box popup while it is shown
+ */
+typedef struct bl_tui_select_box_dialog_t {
+    bl_tui_dialog_t dialog;
+    bl_tui_select_box_t *sb;
+    WINDOW *win;
+    // number of items that fit in the popup
+    int n_items;
+    int old_selected_item_index;
+    int cursor_i;
+    int item_start;
+    int item_end;
+    int last_ch;
+    int canceled;
+} bl_tui_select_box_dialog_t;
+
+static int
+bl_tui_select_box_step(bl_tui_dialog_t *dialog, int ch) {
+    bl_tui_select_box_dialog_t *sd = (bl_tui_select_box_dialog_t *) dialog;
+    bl_tui_select_box_t *sb = sd->sb;
+    int n_items = sd->n_items;
+    int selecting = TRUE;
+
+    if (ch == ERR && sb->idle != NULL && sb->idle(sb, &sd->cursor_i)) {
+        /*
+         * The list was changed, restore the invariant
+         */
+        sd->item_end = MIN(sd->item_start + n_items, sb->n);
+        if (sd->cursor_i < sd->item_start) {
+            sd->item_start = sd->cursor_i;
+            sd->item_end = MIN(sd->item_start + n_items, sb->n);
+        } else if (sd->cursor_i >= sd->item_end) {
+            sd->item_end = sd->cursor_i + 1;
+            sd->item_start = MAX(0, sd->item_end - n_items);
+        }
+        bl_tui_select_box_redraw_list(sd->win, sb, sd->cursor_i, sd->item_start, sd->item_end);
+    }
+    if (ch != sd->last_ch) {
+        if (ch == 27 /* ESC */) {
+            sb->selected_item_index = sd->old_selected_item_index;
+            selecting = FALSE;
+            sd->canceled = TRUE;
+        } else if (ch == '\n' || ch == '\r' /* ENTER */) {
+            sb->selected_item_index = sd->cursor_i;
+            selecting = FALSE;
+        } else if (ch == KEY_UP && sd->cursor_i > 0) {
+            sd->cursor_i--;
+            if (sd->cursor_i < sd->item_start) {
+                sd->item_start--;
+                sd->item_end--;
+            }
+        } else if (ch == KEY_DOWN && sd->cursor_i < sb->n - 1) {
+            sd->cursor_i++;
+            if (sd->cursor_i >= sd->item_end) {
+                sd->item_start++;
+                sd->item_end++;
+            }
+        } else if (ch == KEY_NPAGE && sd->cursor_i < sb->n - 1) {
+            sd->cursor_i = MIN(sd->cursor_i + n_items, sb->n - 1);
+            sd->item_start = MAX(0, MIN(sd->item_start + n_items, sb->n - n_items));
+            sd->item_end = MIN(sd->item_start + n_items, sb->n);
+        } else if (ch == KEY_PPAGE && sd->cursor_i > 0) {
+            sd->cursor_i = MAX(sd->cursor_i - n_items, 0);
+            sd->item_start = MAX(sd->item_start - n_items, 0);
+            sd->item_end = MIN(sd->item_start + n_items, sb->n);
+        } else if (ch == KEY_HOME) {
+            sd->cursor_i = 0;
+            sd->item_start = 0;
+            sd->item_end = sb->n > sd->item_start + n_items ? sd->item_start + n_items : sb->n;
+        } else if (ch == KEY_END) {
+            sd->cursor_i = MAX(sb->n - 1, 0);
+            sd->item_start = MAX(sb->n - n_items, 0);
+            sd->item_end = MAX(sb->n, 0);
+        }
+        sd->last_ch = ch;
+        bl_tui_select_box_redraw_list(sd->win, sb, sd->cursor_i, sd->item_start, sd->item_end);
+    }
+
+    return selecting ? BL_TUI_RUNNING : BL_TUI_DONE;
+}
+
 int
 bl_tui_select_box(bl_tui_select_box_t *sb, int x, int y) {
 
@@ -540,10 +816,13 @@ bl_tui_select_box(bl_tui_select_box_t *sb, int x, int y) {
     } else {
         y = y + 1;
     }
-    WINDOW *win = newwin(h, w, y, x);
-    box(win, 0, 0);
-    touchwin(win);
-    wrefresh(win);
+    bl_tui_select_box_dialog_t sd;
+    sd.dialog.step = bl_tui_select_box_step;
+    sd.sb = sb;
+    sd.win = newwin(h, w, y, x);
+    box(sd.win, 0, 0);
+    touchwin(sd.win);
+    wrefresh(sd.win);
 
     /*
      * The cursor in the select box always points to an element sb->items
@@ -562,115 +841,299 @@ bl_tui_select_box(bl_tui_select_box_t *sb, int x, int y) {
     /*
      * substract top and bottom line of box
      */
-    int n_items = h - 2;
-    int old_selected_item_index = sb->selected_item_index;
-    int cursor_i = sb->selected_item_index;
-    int item_start = sb->selected_item_index;
-    int item_end = sb->n > item_start + n_items ? item_start + n_items : sb->n;
-    int ch = getch();
-    int last_ch = ch;
-    int selecting = TRUE;
-    int canceled = FALSE;
-    bl_tui_select_box_redraw_list(win, sb, cursor_i, item_start, item_end);
-    while (selecting) {
-        ch = getch();
-        if (ch != last_ch) {
-            if (ch == 27 /* ESC */) {
-                sb->selected_item_index = old_selected_item_index;
-                selecting = FALSE;
-                canceled = TRUE;
-            } else if (ch == '\n' || ch == '\r' /* ENTER */) {
-                sb->selected_item_index = cursor_i;
-                selecting = FALSE;
-            } else if (ch == KEY_UP && cursor_i > 0) {
-                cursor_i--;
-                if (cursor_i < item_start) {
-                    item_start--;
-                    item_end--;
-                }
-            } else if (ch == KEY_DOWN && cursor_i < sb->n - 1) {
-                cursor_i++;
-                if (cursor_i >= item_end) {
-                    item_start++;
-                    item_end++;
-                }
-            } else if (ch == KEY_NPAGE && cursor_i < sb->n - 1) {
-                cursor_i = MIN(cursor_i + n_items, sb->n - 1);
-                item_start = MAX(0, MIN(item_start + n_items, sb->n - n_items));
-                item_end = MIN(item_start + n_items, sb->n);
-            } else if (ch == KEY_PPAGE && cursor_i > 0) {
-                cursor_i = MAX(cursor_i - n_items, 0);
-                item_start = MAX(item_start - n_items, 0);
-                item_end = MIN(item_start + n_items, sb->n);
-            } else if (ch == KEY_HOME) {
-                cursor_i = 0;
-                item_start = 0;
-                item_end = sb->n > item_start + n_items ? item_start + n_items : sb->n;
-            } else if (ch == KEY_END) {
-                cursor_i = MAX(sb->n - 1, 0);
-                item_start = MAX(sb->n - n_items, 0);
-                item_end = MAX(sb->n, 0);
-            }
-            last_ch = ch;
-            bl_tui_select_box_redraw_list(win, sb, cursor_i, item_start, item_end);
+    sd.n_items = h - 2;
+    sd.old_selected_item_index = sb->selected_item_index;
+    sd.cursor_i = sb->selected_item_index;
+    sd.item_start = sb->selected_item_index;
+    sd.item_end = sb->n > sd.item_start + sd.n_items ? sd.item_start + sd.n_items : sb->n;
+    sd.last_ch = getch();
+    sd.canceled = FALSE;
+    bl_tui_select_box_redraw_list(sd.win, sb, sd.cursor_i, sd.item_start, sd.item_end);
+    bl_tui_dialog_run(&sd.dialog);
+    delwin(sd.win);
+
+    return !sd.canceled;
+}
+
+/*
+ * Width of the file selector popup, labels that are longer are cut off.
+ */
+#define BL_TUI_FSELECT_WIDTH 30
+
+/*
+ * State of the file selector, passed to the idle handler
+ */
+typedef struct bl_tui_fselect_t {
+    bl_io_dir_t *dir;
+    char *path;
+    bl_tui_fselect_preview_t preview;
+    void *preview_data;
+    // full path of the file under the cursor
+    char fname[PATH_MAX];
+} bl_tui_fselect_t;
+
+/*
+ * (Re)build the list of select box items from the entries read so far.
+ */
+static bl_tui_select_box_value_t *
+bl_tui_fselect_items(bl_io_dir_t *dir, bl_tui_select_box_value_t *sb_values) {
+    sb_values = (bl_tui_select_box_value_t *) realloc(sb_values,
+        MAX(dir->n, 1) * sizeof(bl_tui_select_box_value_t) );
+    for (int i=0; i<dir->n; i++) {
+        sb_values[i].label = dir->dirs[i].name;
+        sb_values[i].is_bold = dir->dirs[i].is_dir;
+        sb_values[i].data = &dir->dirs[i];
+    }
+
+    return sb_values;
+}
+
+/*
+ * Let the preview callback show the file under the cursor.
+ */
+static void
+bl_tui_fselect_preview(bl_tui_fselect_t *fs, bl_tui_select_box_t *sb, int cursor_i) {
+    if (fs->preview == NULL) {
+        return;
+    }
+    bl_io_dirent_t *de = sb->n > 0 ? (bl_io_dirent_t *) sb->items[cursor_i].data : NULL;
+    if (de == NULL || de->is_dir) {
+        fs->preview(NULL, fs->preview_data);
+    } else {
+        char *sep = fs->path[strlen(fs->path) - 1] == '/' ? "" : "/";
+        snprintf(fs->fname, sizeof(fs->fname), "%s%s%s", fs->path, sep, de->name);
+        fs->preview(fs->fname, fs->preview_data);
+    }
+}
+
+/*
+ * Idle handler for the file selector, reads the next page of entries
+ * and keeps the cursor on the same entry.
+ */
+static int
+bl_tui_fselect_idle(bl_tui_select_box_t *sb, int *cursor_i) {
+    bl_tui_fselect_t *fs = (bl_tui_fselect_t *) sb->idle_data;
+    bl_io_dir_t *dir = fs->dir;
+    bl_tui_fselect_preview(fs, sb, *cursor_i);
+    if (bl_io_dir_is_complete(dir)) {
+        return FALSE;
+    }
+
+    char *cursor_name = sb->n > 0 ? sb->items[*cursor_i].label : NULL;
+    if (bl_io_dir_read_page(dir, MAX(BL_IO_FIRST_PAGE, dir->n)) == 0) {
+        return FALSE;
+    }
+    sb->items = bl_tui_fselect_items(dir, sb->items);
+    sb->n = dir->n;
+    for (int i=0; i<dir->n; i++) {
+        if (dir->dirs[i].name == cursor_name) {
+            *cursor_i = i;
+            break;
         }
-        usleep(50);
     }
-    delwin(win);
 
-    return !canceled;
+    return TRUE;
 }
 
 bl_io_dirent_t *
 bl_tui_fselect(char *dname) {
-    char curdir[PATH_MAX];
+    return bl_tui_fselect_with_preview(dname, NULL, NULL);
+}
 
-#ifdef __CYGWIN__
-    GetCurrentDirectory(PATH_MAX, curdir);
-#else
-    getcwd(curdir, PATH_MAX);
-#endif
+bl_io_dirent_t *
+bl_tui_fselect_with_preview(char *dname, bl_tui_fselect_preview_t preview, void *data) {
+    char path[PATH_MAX];
 
-    if (chdir(dname) != 0) {
-        errmsg_and_abort("Could not change directory: %s", dname);
+    if (realpath(dname, path) == NULL) {
+        errmsg_and_abort("Could not find directory: %s", dname);
         return NULL;
-    } else {
-        bl_io_dir_t *dir = bl_io_read_directory(".");
-        bl_tui_select_box_value_t *sb_values = (bl_tui_select_box_value_t *) malloc(
-            dir->n * sizeof(bl_tui_select_box_value_t) );
-        for (int i=0; i<dir->n; i++) {
-            sb_values[i].label = dir->dirs[i].name;
-            sb_values[i].is_bold = S_ISDIR(dir->dirs[i].fstatus.st_mode);
-            sb_values[i].data = &dir->dirs[i];
+    }
+
+    /*
+     * Show the directory, if a directory is selected go into that
+     * directory and repeat.
+     */
+    bl_tui_select_box_value_t *sb_values = NULL;
+    bl_io_dirent_t *de_copy = NULL;
+    int done = FALSE;
+    while (!done) {
+        bl_io_dir_t *dir = bl_io_dir_cache_get(path);
+        if (dir == NULL) {
+            errmsg_and_abort("Can't open directory: %s", path);
+        }
+        if (dir->n == 0) {
+            bl_io_dir_read_page(dir, BL_IO_FIRST_PAGE);
         }
-        bl_tui_select_box_t *sb = bl_tui_select_box_create("Select File", sb_values, dir->n, 30, 0);
-        bl_io_dirent_t *de_copy;
-        if (bl_tui_select_box(sb, 5, 5)) {
+        sb_values = bl_tui_fselect_items(dir, sb_values);
+        bl_tui_select_box_t *sb = bl_tui_select_box_create(NULL, "Select File", sb_values, dir->n, 30,
+                                                           BL_TUI_FSELECT_WIDTH);
+        bl_tui_fselect_t fs = { dir, path, preview, data };
+        sb->idle = bl_tui_fselect_idle;
+        sb->idle_data = &fs;
+        if (bl_tui_select_box(sb, 5, 5) && sb->n > 0) {
             bl_io_dirent_t *de_selected = (bl_io_dirent_t *) sb->items[sb->selected_item_index].data;
-            if (de_selected == NULL) {
-                /* ESC was pressed */
-                de_copy = NULL;
-            } else if (S_ISDIR(de_selected->fstatus.st_mode)) {
-                return bl_tui_fselect(de_selected->name);
+            char *sep = path[strlen(path) - 1] == '/' ? "" : "/";
+            char *fname = (char *) malloc(strlen(path) + 1 + strlen(de_selected->name) + 1);
+            sprintf(fname, "%s%s%s", path, sep, de_selected->name);
+            if (de_selected->is_dir) {
+                if (realpath(fname, path) == NULL) {
+                    bl_tui_err(FALSE, "Could not open directory: %s", fname);
+                    done = TRUE;
+                }
+                free(fname);
             } else {
                 de_copy = (bl_io_dirent_t *) malloc(sizeof(bl_io_dirent_t));
-                de_copy->name = (char *) malloc(strlen(curdir) + 1 + strlen(dname) + 1 + strlen(de_selected->name) + 1);
-#ifdef __CYGWIN__
-                sprintf(de_copy->name, "%s\\%s\\%s", curdir, dname, de_selected->name);
-#else
-                sprintf(de_copy->name, "%s/%s/%s", curdir, dname, de_selected->name);
-#endif
+                de_copy->name = fname;
+                bl_io_dirent_stat(dir, de_selected);
                 de_copy->fstatus = de_selected->fstatus;
+                de_copy->has_stat = de_selected->has_stat;
+                de_copy->is_dir = de_selected->is_dir;
+                de_copy->rank = de_selected->rank;
+                done = TRUE;
             }
         } else {
-            de_copy = NULL;
+            /* ESC was pressed */
+            done = TRUE;
         }
-
-        bl_io_dir_destroy(dir);
+        /* the items may have been reallocated by the idle handler */
+        sb_values = sb->items;
         bl_tui_select_box_destroy(sb);
-        chdir(curdir);
+    }
+    free(sb_values);
 
-        return de_copy;
+    return de_copy;
+}
+
+static void
+bl_tui_find_redraw(WINDOW *win, char *title, bl_find_t *find, bl_find_rank_t *rank,
+                   char *query, int cursor_i, int item_start, int n_items) {
+    int w = getmaxx(win) - 2;
+
+    werase(win);
+    box(win, 0, 0);
+    mvwprintw(win, 0, getmaxx(win) / 2 - strlen(title) / 2 - 1, " %s ", title);
+    mvwprintw(win, 1, 1, "> %.*s", w - 2, query);
+    wattron(win, A_BOLD);
+    mvwprintw(win, 2, 1, "%d of %d files%s", rank->n, bl_find_count(find),
+              bl_find_is_done(find) ? "" : ", searching...");
+    wattroff(win, A_BOLD);
+    for (int i=item_start; i<rank->n && i<item_start+n_items; i++) {
+        if (i == cursor_i) {
+            wattron(win, A_REVERSE);
+        }
+        mvwprintw(win, i - item_start + 3, 1, "%.*s", w, rank->top[i].path);
+        wattroff(win, A_REVERSE);
+    }
+    wrefresh(win);
+}
+
+/*
+ * State of the find popup while it is shown
+ */
+typedef struct bl_tui_find_dialog_t {
+    bl_tui_dialog_t dialog;
+    WINDOW *win;
+    char *title;
+    int n_items;
+    bl_find_t *find;
+    bl_find_rank_t rank;
+    char query[BL_FIND_QUERY_MAX];
+    int cursor_i;
+    int item_start;
+    int count_shown;
+    int done_shown;
+    int redraw;
+    int canceled;
+} bl_tui_find_dialog_t;
+
+static int
+bl_tui_find_step(bl_tui_dialog_t *dialog, int ch) {
+    bl_tui_find_dialog_t *fd = (bl_tui_find_dialog_t *) dialog;
+    int selecting = TRUE;
+    int len = strlen(fd->query);
+
+    if (ch == 27 /* ESC */) {
+        selecting = FALSE;
+        fd->canceled = TRUE;
+    } else if (ch == '\n' || ch == '\r' /* ENTER */) {
+        selecting = fd->rank.n == 0;
+    } else if (ch == KEY_UP && fd->cursor_i > 0) {
+        fd->cursor_i--;
+    } else if (ch == KEY_DOWN && fd->cursor_i < fd->rank.n - 1) {
+        fd->cursor_i++;
+    } else if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
+        if (len > 0) {
+            fd->query[len - 1] = 0;
+        }
+    } else if (ch != ERR && isprint(ch) && len < BL_FIND_QUERY_MAX - 1) {
+        fd->query[len] = ch;
+        fd->query[len + 1] = 0;
     }
+    if (ch != ERR) {
+        fd->redraw = TRUE;
+    }
+
+    /*
+     * Rank the files found since the last time, and update the status
+     * line every now and then.
+     */
+    if (bl_find_rank_update(fd->find, &fd->rank, fd->query)) {
+        fd->redraw = TRUE;
+    }
+    int count = bl_find_count(fd->find);
+    int is_done = bl_find_is_done(fd->find);
+    if (count - fd->count_shown > 256 || (is_done && !fd->done_shown)) {
+        fd->count_shown = count;
+        fd->done_shown = is_done;
+        fd->redraw = TRUE;
+    }
+    if (fd->redraw) {
+        fd->cursor_i = MAX(0, MIN(fd->cursor_i, fd->rank.n - 1));
+        if (fd->cursor_i < fd->item_start) {
+            fd->item_start = fd->cursor_i;
+        } else if (fd->cursor_i >= fd->item_start + fd->n_items) {
+            fd->item_start = fd->cursor_i - fd->n_items + 1;
+        }
+        bl_tui_find_redraw(fd->win, fd->title, fd->find, &fd->rank, fd->query,
+                           fd->cursor_i, fd->item_start, fd->n_items);
+        fd->redraw = FALSE;
+    }
+
+    return selecting ? BL_TUI_RUNNING : BL_TUI_DONE;
 }
 
+char *
+bl_tui_find(char *title, char *root) {
+    int maxx, maxy;
+    getmaxyx(stdscr, maxy, maxx);
+
+    bl_tui_find_dialog_t fd;
+    fd.dialog.step = bl_tui_find_step;
+    fd.win = newwin(maxy - 6, maxx - 10, 3, 5);
+    fd.title = title;
+    fd.n_items = getmaxy(fd.win) - 4;
+    fd.find = bl_find_start(root, 0);
+    bl_find_rank_init(&fd.rank);
+    fd.query[0] = 0;
+    fd.cursor_i = 0;
+    fd.item_start = 0;
+    fd.count_shown = -1;
+    fd.done_shown = FALSE;
+    fd.redraw = TRUE;
+    fd.canceled = FALSE;
+    bl_tui_dialog_run(&fd.dialog);
+
+    char *path = NULL;
+    if (!fd.canceled) {
+        char *match = fd.rank.top[fd.cursor_i].path;
+        path = (char *) malloc(strlen(root) + 1 + strlen(match) + 1);
+        sprintf(path, "%s/%s", root, match);
+    }
+
+    bl_find_destroy(fd.find);
+    werase(fd.win);
+    wrefresh(fd.win);
+    delwin(fd.win);
+
+    return path;
+}
@@ -38,13 +38,17 @@
 
 #include <ctype.h>
 
+#include "bl_arena.h"
 #include "bl_io.h"
+#include "bl_find.h"
 
 typedef struct bl_tui_button_t {
     WINDOW *win;
     char *label;
     int x;
     int y;
+    // arena the row of buttons was allocated from, NULL if malloc'd
+    bl_arena_t *arena;
 } bl_tui_button_t;
 
 typedef struct bl_tui_textbox_t {
@@ -60,6 +64,8 @@ typedef struct bl_tui_textbox_t {
      */
     int scroll;
     int maxlength;
+    // arena the textbox was allocated from, NULL if malloc'd
+    bl_arena_t *arena;
 } bl_tui_textbox_t;
 
 typedef struct  {
@@ -80,8 +86,67 @@ typedef struct bl_tui_select_box_t {
      */
     int popup_width;
     bl_tui_select_box_value_t *items;
+    /*
+     * Called while the popup is shown and no key is pressed, NULL if not
+     * used. It can be used to add items to the list in the background, if
+     * the items are reordered it must adjust cursor_i so it points to the
+     * same item. Returns TRUE if the list must be redrawn.
+     */
+    int (*idle)(struct bl_tui_select_box_t *sb, int *cursor_i);
+    void *idle_data;
+    // arena the select box was allocated from, NULL if malloc'd
+    bl_arena_t *arena;
 } bl_tui_select_box_t;
 
+/*
+ * Return values of the step function of a dialog
+ */
+#define BL_TUI_RUNNING 0
+#define BL_TUI_DONE 1
+
+/*
+ * A dialog is a state machine that is fed one key at a time, or ERR if no
+ * key was pressed. It never waits for input itself, so the idle hooks
+ * keep running while it is shown. Dialog types embed this struct as their
+ * first member.
+ */
+typedef struct bl_tui_dialog_t {
+    /*
+     * Handle the key ch, returns BL_TUI_DONE when the dialog is finished
+     * and BL_TUI_RUNNING otherwise.
+     */
+    int (*step)(struct bl_tui_dialog_t *dialog, int ch);
+} bl_tui_dialog_t;
+
+/*
+ * Background work that must keep running while the TUI waits for input,
+ * e.g. sampling the keyboard matrix.
+ */
+typedef void (*bl_tui_idle_hook_t)(void *data);
+
+#define BL_TUI_IDLE_HOOKS_MAX 8
+
+/**
+ * Register a hook that is called every time the TUI polls for input,
+ * in the main screens as well as in all dialogs.
+ *
+ * @return an id to pass to bl_tui_idle_remove()
+ */
+int bl_tui_idle_add(bl_tui_idle_hook_t hook, void *data);
+
+void bl_tui_idle_remove(int id);
+
+/**
+ * Run the idle hooks and return the key pressed, or ERR if no key was
+ * pressed. Use this instead of getch().
+ */
+int bl_tui_poll();
+
+/**
+ * Feed keys to the dialog until it is finished, running the idle hooks
+ * in between.
+ */
+void bl_tui_dialog_run(bl_tui_dialog_t *dialog);
 
 /**
  * Exit the TUI system, restoring the terminal
@@ -93,12 +158,26 @@ void bl_tui_exit();
  */
 int bl_tui_init();
 
-bl_tui_textbox_t *bl_tui_textbox_create(WINDOW *parent_win, char *label, char *value, int x, int y, int width, int maxlength);
+/**
+ * Create a textbox. If arena is not NULL the textbox and its text are
+ * allocated from the arena, otherwise from the heap. In both cases it must
+ * be destroyed with bl_tui_textbox_destroy().
+ */
+bl_tui_textbox_t *bl_tui_textbox_create(bl_arena_t *arena, WINDOW *parent_win, char *label, char *value,
+                                        int x, int y, int width, int maxlength);
 
 void bl_tui_textbox_destroy(bl_tui_textbox_t *textbox);
 
-bl_tui_button_t *bl_tui_buttons_create(int x, int y, char *labels[], int n);
+/**
+ * Create and draw a row of buttons, allocated from arena, or from the heap
+ * if arena is NULL. Destroy with bl_tui_buttons_destroy().
+ */
+bl_tui_button_t *bl_tui_buttons_create(bl_arena_t *arena, int x, int y, char *labels[], int n);
 
+/**
+ * Destroy the buttons, the memory is only freed if they were allocated from
+ * the heap.
+ */
 void bl_tui_buttons_destroy(bl_tui_button_t *buttons, int n);
 
 void bl_tui_buttons_select(bl_tui_button_t button);
@@ -162,6 +241,9 @@ char *bl_tui_textbox(char *title, char *label, char *value, int x, int y, int wi
 /**
  * Create a select box and return it. The select box must be freed after use.
  *
+ * @param arena Arena to allocate the select box from, if NULL it is
+ *              allocated on the heap. Either way it must be destroyed with
+ *              bl_tui_select_box_destroy().
  * @param title Title of the popup, if NULL not used.
  * @param items List of items to be shown in the select box.
  * @param n Number of items
@@ -171,7 +253,7 @@ char *bl_tui_textbox(char *title, char *label, char *value, int x, int y, int wi
  *
  * @return The select box, must be freed after used.
  */
-bl_tui_select_box_t *bl_tui_select_box_create(char *title, bl_tui_select_box_value_t *items, int n, int width, int popup_width);
+bl_tui_select_box_t *bl_tui_select_box_create(bl_arena_t *arena, char *title, bl_tui_select_box_value_t *items, int n, int width, int popup_width);
 
 void bl_tui_select_box_destroy(bl_tui_select_box_t *sb);
 
@@ -207,6 +289,10 @@ int bl_tui_select_box(bl_tui_select_box_t *sb, int x, int y);
  * If enter is pressed over a file, that filename is returned, if ESC
  * is pressed NULL is returned.
  *
+ * The first page of the directory is shown immediately, the rest of the
+ * entries are read while the selector waits for input. Listings are
+ * cached between calls, see bl_io_dir_cache_get().
+ *
  * @param dname Directory name where to start listing files.
  *
  * @return Filename that was selected or NULL if ESC was pressed. If not NULL,
@@ -214,4 +300,30 @@ int bl_tui_select_box(bl_tui_select_box_t *sb, int x, int y);
  */
 bl_io_dirent_t *bl_tui_fselect(char *dname);
 
+/**
+ * Called by the file selector while it waits for input, with the name of
+ * the file under the cursor, or NULL if the cursor is on a directory.
+ * It is called often, the callback must check itself if anything changed.
+ */
+typedef void (*bl_tui_fselect_preview_t)(char *fname, void *data);
+
+/**
+ * Same as bl_tui_fselect(), but call preview for the file under the
+ * cursor, so it can be shown next to the selector.
+ */
+bl_io_dirent_t *bl_tui_fselect_with_preview(char *dname, bl_tui_fselect_preview_t preview, void *data);
+
+/**
+ * Show a popup to find a file anywhere below the directory root. The tree
+ * is searched in the background, the files found are ranked against the
+ * query typed so far and the list is updated while typing.
+ *
+ * @param title Title of the popup
+ * @param root Directory to search
+ *
+ * @return The path of the file selected or NULL if ESC was pressed. If not
+ *         NULL, the string must be freed after use.
+ */
+char *bl_tui_find(char *title, char *root);
+
 #endif /* __BL_TUI_H_ */
@@ -0,0 +1,170 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <string.h>
+
+#include "blusb.h"
+#include "bl_snapshot.h"
+#include "bl_txn.h"
+
+void
+bl_txn_begin(bl_txn_t *txn) {
+    memset(txn, 0, sizeof(bl_txn_t));
+}
+
+void
+bl_txn_set_layout(bl_txn_t *txn, bl_layout_t *layout) {
+    memcpy(&txn->state.layout, layout, sizeof(bl_layout_t));
+    txn->parts |= BL_CTRL_LAYOUT;
+}
+
+void
+bl_txn_set_macros(bl_txn_t *txn, bl_macro_t *macros) {
+    memcpy(&txn->state.macros, macros, sizeof(bl_macro_t));
+    txn->parts |= BL_CTRL_MACROS;
+}
+
+void
+bl_txn_set_pwm(bl_txn_t *txn, uint8_t pwm_usb, uint8_t pwm_bt) {
+    txn->state.pwm_usb = pwm_usb;
+    txn->state.pwm_bt = pwm_bt;
+    txn->parts |= BL_CTRL_PWM;
+}
+
+void
+bl_txn_set_debounce(bl_txn_t *txn, uint8_t debounce) {
+    txn->state.debounce = debounce;
+    txn->parts |= BL_CTRL_DEBOUNCE;
+}
+
+void
+bl_txn_set_state(bl_txn_t *txn, bl_ctrl_state_t *state, int parts) {
+    if (parts & BL_CTRL_LAYOUT) {
+        bl_txn_set_layout(txn, &state->layout);
+    }
+    if (parts & BL_CTRL_MACROS) {
+        bl_txn_set_macros(txn, &state->macros);
+    }
+    if (parts & BL_CTRL_PWM) {
+        bl_txn_set_pwm(txn, state->pwm_usb, state->pwm_bt);
+    }
+    if (parts & BL_CTRL_DEBOUNCE) {
+        bl_txn_set_debounce(txn, state->debounce);
+    }
+}
+
+/*
+ * Read the parts back and compare them with state, returns the parts
+ * that are equal.
+ */
+static int
+bl_txn_verify(bl_txn_t *txn, bl_ctrl_state_t *state, int parts) {
+    bl_ctrl_state_t *readback = &txn->readback;
+    int read = bl_usb_read_state(readback, parts, NULL, NULL);
+    int equal = 0;
+
+    if ((read & BL_CTRL_LAYOUT) && bl_layout_equal(&readback->layout, &state->layout)) {
+        equal |= BL_CTRL_LAYOUT;
+    }
+    if (read & BL_CTRL_MACROS) {
+        if (memcmp(readback->macros.macros, state->macros.macros, sizeof(bl_macro_keylist_t)) == 0) {
+            equal |= BL_CTRL_MACROS;
+        }
+    } else if ((parts & BL_CTRL_MACROS) && bl_macro_blank(&state->macros.macros[0][0], NUM_MACROKEYS * LEN_MACRO)) {
+        equal |= BL_CTRL_MACROS;
+    }
+    if ((read & BL_CTRL_PWM) && readback->pwm_usb == state->pwm_usb && readback->pwm_bt == state->pwm_bt) {
+        equal |= BL_CTRL_PWM;
+    }
+    if ((read & BL_CTRL_DEBOUNCE) && readback->debounce == state->debounce) {
+        equal |= BL_CTRL_DEBOUNCE;
+    }
+
+    return equal;
+}
+
+/*
+ * Write the parts of state in one batch and verify them, returns the parts
+ * that were written and verified.
+ */
+static int
+bl_txn_apply(bl_txn_t *txn, bl_ctrl_state_t *state, int parts) {
+    int written = bl_usb_write_state(state, parts, NULL, NULL);
+    if (written == 0) {
+        return 0;
+    }
+
+    return written & bl_txn_verify(txn, state, written);
+}
+
+int
+bl_txn_commit(bl_txn_t *txn, char *errmsg, int errlen) {
+    int parts = txn->parts & BL_SNAPSHOT_WRITABLE;
+
+    txn->failed = 0;
+    if (parts == 0) {
+        return BL_TXN_OK;
+    }
+
+    txn->saved_parts = bl_usb_read_state(&txn->saved, parts, NULL, NULL);
+    int missing = parts & ~txn->saved_parts & ~BL_CTRL_MACROS;
+    if (missing) {
+        txn->failed = parts;
+        snprintf(errmsg, errlen, "could not read the current %s, nothing was written",
+                 bl_snapshot_part_name(missing & -missing));
+        return BL_TXN_ABORTED;
+    }
+
+    int ok = bl_txn_apply(txn, &txn->state, parts);
+    if (ok == parts) {
+        return BL_TXN_OK;
+    }
+    txn->failed = parts & ~ok;
+    char *failed = bl_snapshot_part_name(txn->failed & -txn->failed);
+
+    /*
+     * A failed part may have been written partially, so everything that
+     * was saved is written back
+     */
+    int restore = parts & txn->saved_parts;
+    if (bl_txn_apply(txn, &txn->saved, restore) != restore) {
+        snprintf(errmsg, errlen, "could not write the %s and the previous settings could not be restored",
+                 failed);
+        return BL_TXN_FAILED;
+    }
+    if (restore != parts) {
+        // the macros were written but there was nothing valid to restore
+        snprintf(errmsg, errlen, "could not write the %s and the previous macros could not be restored",
+                 failed);
+        return BL_TXN_FAILED;
+    }
+    snprintf(errmsg, errlen, "could not write the %s, the previous settings were restored", failed);
+
+    return BL_TXN_ROLLED_BACK;
+}
@@ -0,0 +1,90 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_TXN_H__
+#define __BL_TXN_H__ 1
+
+#include "usb.h"
+
+/*
+ * Transactions write several parts of the controller state at once. The
+ * current state is saved first, then all parts are written in one batch
+ * and read back. If a part fails the saved state is written back, so the
+ * controller either has the complete new configuration or the old one.
+ *
+ *   bl_txn_t txn;
+ *   bl_txn_begin(&txn);
+ *   bl_txn_set_layout(&txn, layout);
+ *   bl_txn_set_debounce(&txn, 15);
+ *   if (bl_txn_commit(&txn, errmsg, sizeof(errmsg)) != BL_TXN_OK) ...
+ */
+
+/*
+ * Results of bl_txn_commit()
+ */
+#define BL_TXN_OK           0   /* all parts written and verified */
+#define BL_TXN_ABORTED      1   /* the current state could not be read, nothing was written */
+#define BL_TXN_ROLLED_BACK  2   /* a part failed, the previous state was restored */
+#define BL_TXN_FAILED       3   /* a part failed and the previous state could not be restored */
+
+typedef struct bl_txn_t {
+    // the new state and the BL_CTRL_* parts of it to write
+    bl_ctrl_state_t state;
+    int parts;
+    // the state before the commit and the parts that could be read
+    bl_ctrl_state_t saved;
+    int saved_parts;
+    // parts that were not written or verified, set by bl_txn_commit()
+    int failed;
+    bl_ctrl_state_t readback;
+} bl_txn_t;
+
+void bl_txn_begin(bl_txn_t *txn);
+void bl_txn_set_layout(bl_txn_t *txn, bl_layout_t *layout);
+void bl_txn_set_macros(bl_txn_t *txn, bl_macro_t *macros);
+void bl_txn_set_pwm(bl_txn_t *txn, uint8_t pwm_usb, uint8_t pwm_bt);
+void bl_txn_set_debounce(bl_txn_t *txn, uint8_t debounce);
+
+/**
+ * Add the given parts of state to the transaction, e.g. from a snapshot.
+ */
+void bl_txn_set_state(bl_txn_t *txn, bl_ctrl_state_t *state, int parts);
+
+/**
+ * Write the parts of the transaction to the open controller, verify them
+ * and restore the previous state if a part fails. Macros that can't be
+ * read before the commit (never written) can't be restored, a failed
+ * commit that wrote them returns BL_TXN_FAILED.
+ *
+ * @return One of the BL_TXN_* values, if not BL_TXN_OK the reason is
+ * stored in errmsg.
+ */
+int bl_txn_commit(bl_txn_t *txn, char *errmsg, int errlen);
+
+#endif /* __BL_TXN_H__ */
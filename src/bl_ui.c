@@ -10,6 +10,7 @@
 #include "usb.h"
 #include "bl_tui.h"
 #include "bl_ui.h"
+#include "bl_prefetch.h"
 
 typedef struct bl_ui_windows_t {
     WINDOW *menu_win;
@@ -23,7 +24,9 @@ static bl_ui_menu_t menu[] =
         (bl_ui_menu_t[]) {
             { "Open layout file", 0, 'o', BL_UI_MENU_OPEN_LAYOUT_FILE, NULL },
             { "Save layout file", 0, 's', BL_UI_MENU_SAVE_LAYOUT_FILE, NULL },
-            { "Write layout to controller", 0, 'w', BL_UI_MENU_WRITE_LAYOUT_TO_CTRL, NULL }
+            { "Write layout to controller", 0, 'w', BL_UI_MENU_WRITE_LAYOUT_TO_CTRL, NULL },
+            { "Find layout file", -1, '/', BL_UI_MENU_FIND_LAYOUT_FILE, NULL },
+            { "Live apply", 0, 'a', BL_UI_MENU_TOGGLE_LIVE, NULL }
         }
     },
     { "Layer", 0, 'l', BL_UI_MENU_UNDEFINED,
@@ -109,18 +112,24 @@ bl_ui_menu_draw(WINDOW *menu_win) {
 }
 
 
-void
+/*
+ * Returns the layout that was loaded, NULL if none
+ */
+bl_layout_t *
 bl_ui_do_file_menu(bl_layout_t *layout) {
+    bl_layout_t *loaded = NULL;
     bl_tui_select_box_value_t items[] = {
         { "Open layout file (O)", FALSE, (void*)0 },
         { "Save layout file (S)", FALSE, (void*)1 },
-        { "Write layout to controller (W)", FALSE, (void*)2 }
+        { "Write layout to controller (W)", FALSE, (void*)2 },
+        { "Find layout file (/)", FALSE, (void*)3 },
+        { "Live apply on/off (A)", FALSE, (void*)4 }
     };
-    bl_tui_select_box_t *sb = bl_tui_select_box_create(NULL, items, 3, 8, 0);
+    bl_tui_select_box_t *sb = bl_tui_select_box_create(NULL, NULL, items, 5, 8, 0);
     if (bl_tui_select_box(sb, 0, 0)) {
         switch (sb->selected_item_index) {
             case 0:
-                bl_layout_select_and_load_file();
+                loaded = bl_layout_select_and_load_file();
                 break;
             case 1:
                 bl_layout_save_to_file(layout);
@@ -128,32 +137,72 @@ bl_ui_do_file_menu(bl_layout_t *layout) {
             case 2:
                 bl_layout_write_to_controller(layout);
                 break;
+            case 3:
+                loaded = bl_layout_find_and_load_file();
+                break;
+            case 4:
+                bl_layout_toggle_live();
+                break;
             default:
                 bl_tui_err(TRUE, "unsupported menu item, should not happen: %d", sb->selected_item_index);
                 break;
         }
     }
     bl_tui_select_box_destroy(sb);
+
+    return loaded;
 }
 
+/*
+ * Returns the bit mask of the layers changed by a bulk operation
+ */
 int
 bl_ui_do_layer_menu(bl_layout_t *layout, int *layer) {
     bl_tui_select_box_value_t items[] = {
         { "Show layers", FALSE, (void*)0 },
-        { "Number of layers", FALSE, (void*)1 }
+        { "Number of layers", FALSE, (void*)1 },
+        { "Copy layer to", FALSE, (void*)2 },
+        { "Swap layers", FALSE, (void*)3 },
+        { "Clear layer", FALSE, (void*)4 },
+        { "Fill layer", FALSE, (void*)5 },
+        { "Copy block", FALSE, (void*)6 },
+        { "Remap key code", FALSE, (void*)7 }
     };
-    bl_tui_select_box_t *sb = bl_tui_select_box_create(NULL, items, 2, 8, 0);
+    int layers = 0;
+    bl_tui_select_box_t *sb = bl_tui_select_box_create(NULL, NULL, items, 8, 8, 0);
     if (bl_tui_select_box(sb, 9, 0)) {
         switch (sb->selected_item_index) {
+            case 0:
+                break;
             case 1:
                 bl_layout_manage_layers(layout, layer);
                 break;
+            case 2:
+                layers = bl_layout_bulk_edit(layout, BL_LAYOUT_BULK_COPY, *layer);
+                break;
+            case 3:
+                layers = bl_layout_bulk_edit(layout, BL_LAYOUT_BULK_SWAP, *layer);
+                break;
+            case 4:
+                layers = bl_layout_bulk_edit(layout, BL_LAYOUT_BULK_CLEAR, *layer);
+                break;
+            case 5:
+                layers = bl_layout_bulk_edit(layout, BL_LAYOUT_BULK_FILL, *layer);
+                break;
+            case 6:
+                layers = bl_layout_bulk_edit(layout, BL_LAYOUT_BULK_BLOCK, *layer);
+                break;
+            case 7:
+                layers = bl_layout_bulk_edit(layout, BL_LAYOUT_BULK_REMAP, *layer);
+                break;
             default:
                 bl_tui_err(TRUE, "unsupported menu item, should not happen: %d", sb->selected_item_index);
                 break;
         }
     }
     bl_tui_select_box_destroy(sb);
+
+    return layers;
 }
 
 int
@@ -161,7 +210,7 @@ bl_ui_do_macro_menu() {
     bl_tui_select_box_value_t items[] = {
         { "Show macros", FALSE, (void*)0 }
     };
-    bl_tui_select_box_t *sb = bl_tui_select_box_create(NULL, items, 1, 8, 0);
+    bl_tui_select_box_t *sb = bl_tui_select_box_create(NULL, NULL, items, 1, 8, 0);
     if (bl_tui_select_box(sb, 18, 0)) {
         switch (sb->selected_item_index) {
             case 0:
@@ -205,6 +254,7 @@ bl_ui_footer_draw(WINDOW *footer_win) {
     wmove(footer_win, 0, 0);
     wclrtoeol(footer_win);
     wprintw(footer_win, "Enter: select key, ");
+    wprintw(footer_win, "u/r: undo/redo, ");
     wprintw(footer_win, "Select layer: ");
     attron(A_UNDERLINE); printw("1"); attroff(A_UNDERLINE);
     wprintw(footer_win, " - ");
@@ -252,22 +302,23 @@ bl_ui_loop(bl_layout_t *layout) {
         bl_matrix_ui_t matrix;
 
         /*
-         * wait until key has been released and then enable service mode.
-         * If we don't do this and you use the IBM keyboard to start the program
-         * the last key pressed will keep repeating (most likely the enter key).
+         * Read the controller state in the background, the matrix is drawn
+         * right away and its cells are filled in when the layout arrives.
+         *
+         * The worker first waits until the key has been released and then
+         * enables service mode. If we don't do this and you use the IBM
+         * keyboard to start the program the last key pressed will keep
+         * repeating (most likely the enter key).
          *
          * It would be better if we could detect key up and key down
          * events, but that doesn't work in terminal mode, so we hack around
          * it with a short sleep.
          */
-        usleep(100000);
-        bl_usb_enable_service_mode();
+        bl_prefetch_t *prefetch = bl_prefetch_start(layout == NULL ? BL_CTRL_ALL : BL_CTRL_ALL & ~BL_CTRL_LAYOUT);
+        bl_layout_set_prefetch(prefetch);
 
         if (layout == NULL) {
-            fprintf(stderr, "reading from controller\n");
             layout = bl_layout_create(0);
-            bl_layout_init_layout(layout);
-            bl_layout_read(layout);
         } else {
             printf("using existing layout\n");
             bl_layout_print(layout);
@@ -279,7 +330,6 @@ bl_ui_loop(bl_layout_t *layout) {
         while (ch != 'q' && ch != 'Q') {
             bl_ui_menu_draw(windows.menu_win);
             if (show_layers) {
-                bl_layout_draw_keyboard_matrix(windows.content_win, matrix, 0, layout->nlayers);
                 ch = bl_layout_navigate_matrix(windows.content_win, matrix, layout, 0, bl_key_mapping_items, _n_key_mappings+1);
                 show_layers = FALSE;
             } else {
@@ -288,6 +338,9 @@ bl_ui_loop(bl_layout_t *layout) {
             }
         }
         bl_tui_exit();
+        bl_layout_cleanup();
+        bl_layout_set_prefetch(NULL);
+        bl_prefetch_destroy(prefetch);
         bl_usb_disable_service_mode();
     }
 }
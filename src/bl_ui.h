@@ -2,6 +2,8 @@
 #ifndef __BL_UI_H__
 #define __BL_UI_H__ 1
 
+#include "bl_tui.h"
+
 /*
  * key mappings, values are defined in bl_ui_layout.c
  */
@@ -21,6 +23,8 @@ typedef enum {
     BL_UI_MENU_OPEN_LAYOUT_FILE,
     BL_UI_MENU_SAVE_LAYOUT_FILE,
     BL_UI_MENU_WRITE_LAYOUT_TO_CTRL,
+    BL_UI_MENU_FIND_LAYOUT_FILE,
+    BL_UI_MENU_TOGGLE_LIVE,
     BL_UI_MENU_EDIT_LAYERS,
     BL_UI_MENU_MANAGE_LAYERS,
     BL_UI_MENU_EDIT_MACROS,
@@ -44,25 +48,53 @@ typedef struct bl_ui_menu_t {
 
 #define SELECT_BOX_WIDTH 8
 
+/*
+ * Left edge of the preview pane shown next to the file selector
+ */
+#define BL_UI_PREVIEW_X 38
+
+/*
+ * Bulk operations of the layer menu, see bl_layout_bulk_edit()
+ */
+#define BL_LAYOUT_BULK_COPY   0
+#define BL_LAYOUT_BULK_SWAP   1
+#define BL_LAYOUT_BULK_CLEAR  2
+#define BL_LAYOUT_BULK_FILL   3
+#define BL_LAYOUT_BULK_BLOCK  4
+#define BL_LAYOUT_BULK_REMAP  5
+
 typedef bl_tui_select_box_t *bl_matrix_ui_t[NUMLAYERS_MAX][NUMROWS][NUMCOLS];
 
 /*
  * prototypes
  */
 void bl_layout_read(bl_layout_t *layout);
+struct bl_prefetch_t;
+void bl_layout_set_prefetch(struct bl_prefetch_t *prefetch);
 void bl_layout_init_matrix(bl_matrix_ui_t matrix, bl_layout_t *layout,
                            bl_tui_select_box_value_t *bl_key_mapping_items, int n_items);
 void bl_layout_draw_keyboard_matrix(WINDOW *win, bl_matrix_ui_t matrix, int layer, int nlayers);
+void bl_layout_pads_render(WINDOW *win, bl_matrix_ui_t matrix, int nlayers);
+void bl_layout_pads_draw_cell(bl_matrix_ui_t matrix, int layer, int row, int col, int inversed);
+void bl_layout_pads_show(WINDOW *win, int layer);
 int bl_layout_navigate_matrix(WINDOW *win, bl_matrix_ui_t matrix, bl_layout_t *layout, int layer,
 							  bl_tui_select_box_value_t *bl_key_mapping_items, int n_key_mappings);
 
 bl_layout_t *bl_layout_select_and_load_file();
+bl_layout_t *bl_layout_find_and_load_file();
+char *bl_layout_key_name(uint16_t hid);
+void bl_layout_toggle_live();
+void bl_layout_cleanup();
 void bl_layout_save_to_file(bl_layout_t *layout);
 void bl_layout_write_to_controller(bl_layout_t *layout);
 int bl_layout_manage_layers(bl_layout_t *layout, int *layer);
+int bl_layout_bulk_edit(bl_layout_t *layout, int op, int layer);
 
 int bl_macro_navigate();
 
+bl_layout_t *bl_ui_do_file_menu(bl_layout_t *layout);
+int bl_ui_do_layer_menu(bl_layout_t *layout, int *layer);
+int bl_ui_do_macro_menu();
 void bl_ui_loop(bl_layout_t *layout);
 
 #endif
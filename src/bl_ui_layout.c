@@ -44,6 +44,11 @@
 #include "usb.h"
 #include "bl_tui.h"
 #include "bl_ui.h"
+#include "bl_preview.h"
+#include "bl_prefetch.h"
+#include "bl_writer.h"
+#include "bl_undo.h"
+#include "bl_validate.h"
 
 key_mapping_t bl_key_mapping[] = {
     { VK_APPS, "Win Menu", KB_APP },
@@ -220,20 +225,34 @@ bl_layout_get_selected_item(int layer, int row, int col,
   return 0;
 }
 
+/*
+ * The select boxes of the matrix are allocated from this arena, it is reset
+ * every time the matrix is initialised for a new layout.
+ */
+static bl_arena_t *_bl_layout_matrix_arena = NULL;
+
 /**
- * Initialize the matrix with select boxes.
+ * Initialize the matrix with select boxes. The select boxes of a previous
+ * call are released.
  */
 void
 bl_layout_init_matrix(bl_matrix_ui_t matrix, bl_layout_t *layout,
                       bl_tui_select_box_value_t *bl_key_mapping_items, int n_items) {
 
+    if (_bl_layout_matrix_arena == NULL) {
+        _bl_layout_matrix_arena = bl_arena_create(NUMLAYERS_MAX * NUMROWS * NUMCOLS * sizeof(bl_tui_select_box_t));
+    } else {
+        bl_arena_reset(_bl_layout_matrix_arena);
+    }
+
     /*
      * Create list boxes for each cell.
      */
     for (int layer=0; layer<NUMLAYERS_MAX; layer++) {
         for (int r=0; r<NUMROWS; r++) {
             for (int c=0; c<NUMCOLS; c++) {
-                matrix[layer][r][c] = bl_tui_select_box_create(NULL, bl_key_mapping_items, n_items,
+                matrix[layer][r][c] = bl_tui_select_box_create(_bl_layout_matrix_arena, NULL,
+                                                               bl_key_mapping_items, n_items,
                                                                SELECT_BOX_WIDTH, 0);
                 matrix[layer][r][c]->selected_item_index = bl_layout_get_selected_item(layer, r, c, layout,
                                                                                        bl_key_mapping_items, n_items);
@@ -242,6 +261,26 @@ bl_layout_init_matrix(bl_matrix_ui_t matrix, bl_layout_t *layout,
     }
 }
 
+/*
+ * Select the codes of layout in the select boxes of the given layers, e.g.
+ * after an undo.
+ */
+static void
+bl_layout_sync_matrix(bl_matrix_ui_t matrix, bl_layout_t *layout, int layers,
+                      bl_tui_select_box_value_t *bl_key_mapping_items, int n_items) {
+    for (int layer=0; layer<NUMLAYERS_MAX; layer++) {
+        if (!(layers & (1 << layer))) {
+            continue;
+        }
+        for (int r=0; r<NUMROWS; r++) {
+            for (int c=0; c<NUMCOLS; c++) {
+                matrix[layer][r][c]->selected_item_index = bl_layout_get_selected_item(layer, r, c, layout,
+                                                                                       bl_key_mapping_items, n_items);
+            }
+        }
+    }
+}
+
 /*
  * Draw the keyboard matrix. The matrix consists of many more columns than rows. At the time
  * of writing 20 rows, and 8 columns.
@@ -309,12 +348,141 @@ bl_layout_draw_keyboard_matrix(WINDOW *content_win, bl_matrix_ui_t matrix, int l
 
 }
 
+/**
+ * Return the name of the key code as shown in the select boxes, or NULL if
+ * the code is unknown.
+ */
+char *
+bl_layout_key_name(uint16_t hid) {
+    for (int i=0; i<_n_key_mappings; i++) {
+        if (bl_key_mapping[i].hid == hid) {
+            return bl_key_mapping[i].name;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Cache of parsed layouts for the preview pane of the file selector, it
+ * lives as long as the UI.
+ */
+static bl_preview_t *_bl_layout_preview = NULL;
+
+typedef struct bl_layout_preview_pane_t {
+    WINDOW *win;
+    // file shown, empty if none
+    char fname[PATH_MAX];
+    // state of the preview shown
+    int state;
+    unsigned int generation;
+} bl_layout_preview_pane_t;
+
+/*
+ * Draw layer 1 of the layout in the preview pane, in the same orientation
+ * as the keyboard matrix, with the labels cut off to fit.
+ */
+static void
+bl_layout_preview_draw(bl_layout_preview_pane_t *pane, bl_layout_t *layout) {
+    WINDOW *win = pane->win;
+    int cw = (getmaxx(win) - 5) / NUMROWS;
+
+    werase(win);
+    box(win, 0, 0);
+    mvwprintw(win, 0, 2, " Preview ");
+    if (pane->state == BL_PREVIEW_READY) {
+        mvwprintw(win, 1, 1, "Layer 1 of %d", layout->nlayers);
+        for (int c=0; c<NUMCOLS && c+2<getmaxy(win)-1; c++) {
+            mvwprintw(win, c + 2, 1, "C%-2d", c);
+            for (int r=0; r<NUMROWS; r++) {
+                uint16_t hid = layout->matrix[0][r][c];
+                char *name = hid == 0 ? "--" : bl_layout_key_name(hid);
+                char hex[8];
+                if (name == NULL) {
+                    sprintf(hex, "%x", hid);
+                    name = hex;
+                }
+                mvwprintw(win, c + 2, 4 + r * cw, "%.*s", cw - 1, name);
+            }
+        }
+    } else if (pane->state == BL_PREVIEW_PENDING) {
+        mvwprintw(win, 1, 1, "Loading...");
+    } else if (pane->state == BL_PREVIEW_ERROR) {
+        mvwprintw(win, 1, 1, "Not a layout file");
+    }
+    wrefresh(win);
+}
+
+/*
+ * Preview callback for the file selector, only redraws if the file under
+ * the cursor changed or the worker finished parsing.
+ */
+static void
+bl_layout_preview(char *fname, void *data) {
+    bl_layout_preview_pane_t *pane = (bl_layout_preview_pane_t *) data;
+    unsigned int generation = bl_preview_generation(_bl_layout_preview);
+
+    if (fname == NULL) {
+        if (pane->fname[0] != 0) {
+            pane->fname[0] = 0;
+            pane->state = -1;
+            bl_layout_preview_draw(pane, NULL);
+        }
+        return;
+    }
+    if (strcmp(fname, pane->fname) == 0 &&
+        (pane->state != BL_PREVIEW_PENDING || generation == pane->generation)) {
+        return;
+    }
+
+    bl_layout_t layout;
+    snprintf(pane->fname, sizeof(pane->fname), "%s", fname);
+    pane->generation = generation;
+    pane->state = bl_preview_get(_bl_layout_preview, fname, &layout);
+    bl_layout_preview_draw(pane, &layout);
+}
+
 bl_layout_t *
 bl_layout_select_and_load_file() {
-    bl_io_dirent_t *de = bl_tui_fselect(".");
+    if (_bl_layout_preview == NULL) {
+        _bl_layout_preview = bl_preview_create(BL_PREVIEW_CACHE_BYTES);
+    }
+
+    /*
+     * The preview pane goes to the right of the file selector
+     */
+    int maxx, maxy;
+    getmaxyx(stdscr, maxy, maxx);
+    bl_layout_preview_pane_t pane;
+    pane.win = newwin(maxy - 2, maxx - BL_UI_PREVIEW_X, 1, BL_UI_PREVIEW_X);
+    pane.fname[0] = 0;
+    pane.state = -1;
+    pane.generation = 0;
+    bl_layout_preview_draw(&pane, NULL);
+
+    bl_io_dirent_t *de = bl_tui_fselect_with_preview(".", bl_layout_preview, &pane);
+    werase(pane.win);
+    wrefresh(pane.win);
+    delwin(pane.win);
+
     if (de != NULL) {
         bl_layout_t *layout = bl_layout_load_file(de->name);
         bl_io_dirent_destroy(de);
+        free(de);
+        return layout;
+    } else {
+        return NULL;
+    }
+}
+
+/*
+ * Find a layout file below the current directory and load it.
+ */
+bl_layout_t *
+bl_layout_find_and_load_file() {
+    char *fname = bl_tui_find("Find Layout", ".");
+    if (fname != NULL) {
+        bl_layout_t *layout = bl_layout_load_file(fname);
+        free(fname);
         return layout;
     } else {
         return NULL;
@@ -333,14 +501,214 @@ bl_layout_save_to_file(bl_layout_t *layout) {
     }
 }
 
+/*
+ * Width of the write status in the top right corner of the screen
+ */
+#define BL_LAYOUT_WRITER_STATUS_WIDTH 28
+
+/*
+ * The write that is in progress, or the last one that finished, NULL if
+ * nothing was written yet.
+ */
+static bl_writer_t *_bl_layout_writer = NULL;
+/* idle hook that shows the progress of the write, -1 if not registered */
+static int _bl_layout_writer_hook = -1;
+
+/*
+ * Idle hook that shows the progress of the write, it keeps running while
+ * dialogs are open and removes itself when the write has finished.
+ */
+static void
+bl_layout_writer_status(void *data) {
+    static char shown[BL_LAYOUT_WRITER_STATUS_WIDTH + 1] = "";
+    static const char spinner[] = "|/-\\";
+    bl_writer_t *w = _bl_layout_writer;
+    char status[BL_LAYOUT_WRITER_STATUS_WIDTH + 1];
+    double ms = bl_writer_elapsed_ms(w);
+
+    switch (bl_writer_state(w)) {
+        case BL_WRITER_WRITING:
+            snprintf(status, sizeof(status), "%c writing %.1fs", spinner[(int) (ms / 100) % 4], ms / 1000);
+            break;
+        case BL_WRITER_VERIFYING:
+            snprintf(status, sizeof(status), "%c verifying %.1fs", spinner[(int) (ms / 100) % 4], ms / 1000);
+            break;
+        case BL_WRITER_DONE:
+            snprintf(status, sizeof(status), "written, verified %.0fms", w->ms);
+            break;
+        case BL_WRITER_FAILED:
+            snprintf(status, sizeof(status), "write FAILED");
+            break;
+        default:
+            snprintf(status, sizeof(status), "verify FAILED, check layout");
+            break;
+    }
+    /*
+     * Only touch the screen when the text changed
+     */
+    if (strcmp(status, shown) != 0) {
+        strcpy(shown, status);
+        attron(A_REVERSE);
+        mvprintw(0, getmaxx(stdscr) - BL_LAYOUT_WRITER_STATUS_WIDTH, "%*s", BL_LAYOUT_WRITER_STATUS_WIDTH, status);
+        attroff(A_REVERSE);
+        refresh();
+    }
+    if (bl_writer_is_done(w)) {
+        shown[0] = 0;
+        bl_tui_idle_remove(_bl_layout_writer_hook);
+        _bl_layout_writer_hook = -1;
+    }
+}
+
+/*
+ * Start writing layout in the background and show the progress, the
+ * previous write must have finished.
+ */
+static void
+bl_layout_writer_start(bl_layout_t *layout) {
+    if (_bl_layout_writer != NULL) {
+        bl_writer_destroy(_bl_layout_writer);
+    }
+    _bl_layout_writer = bl_writer_start(layout);
+    if (_bl_layout_writer_hook < 0) {
+        _bl_layout_writer_hook = bl_tui_idle_add(bl_layout_writer_status, NULL);
+    }
+}
+
+/**
+ * Ask for confirmation and start writing the layout to the controller in
+ * the background. The progress is shown in the top right corner of the
+ * screen, the user can keep editing meanwhile.
+ */
 void
 bl_layout_write_to_controller(bl_layout_t *layout) {
+    if (_bl_layout_writer != NULL && !bl_writer_is_done(_bl_layout_writer)) {
+        bl_tui_msg(61, 1, "Write to Controller", "The previous write is still in progress.");
+        return;
+    }
     if (bl_tui_confirm(61, 1, "Write to Controller",
                        "Do you wish to write the new configuration to the controller?")) {
-        bl_layout_write(layout);
+        bl_layout_writer_start(layout);
+    }
+}
+
+/*
+ * Edits in live mode are written this long after the last edit, so a
+ * burst of edits results in a single write.
+ */
+#define BL_LAYOUT_LIVE_DELAY_MS 300
+
+/* TRUE if edits are written to the controller automatically */
+static int _bl_layout_live = FALSE;
+/* layout with edits that have not been written yet, NULL if none */
+static bl_layout_t *_bl_layout_live_pending = NULL;
+static struct timespec _bl_layout_live_last_edit;
+/* idle hook that writes the pending edits, -1 if not registered */
+static int _bl_layout_live_hook = -1;
+
+static void
+bl_layout_live_draw() {
+    attron(A_REVERSE);
+    mvprintw(0, getmaxx(stdscr) - BL_LAYOUT_WRITER_STATUS_WIDTH - 6, "%s", _bl_layout_live ? " LIVE " : "      ");
+    attroff(A_REVERSE);
+    refresh();
+}
+
+/*
+ * Idle hook that writes the pending edits once no edits were made for
+ * BL_LAYOUT_LIVE_DELAY_MS, and no other write is in flight.
+ */
+static void
+bl_layout_live_flush(void *data) {
+    if (_bl_layout_live_pending == NULL) {
+        return;
+    }
+    if (_bl_layout_writer != NULL && !bl_writer_is_done(_bl_layout_writer)) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = (now.tv_sec - _bl_layout_live_last_edit.tv_sec) * 1000.0 +
+        (now.tv_nsec - _bl_layout_live_last_edit.tv_nsec) / 1e6;
+    if (ms >= BL_LAYOUT_LIVE_DELAY_MS) {
+        bl_layout_writer_start(_bl_layout_live_pending);
+        _bl_layout_live_pending = NULL;
     }
 }
 
+/**
+ * Switch live mode on or off. In live mode cell edits are written to the
+ * controller automatically.
+ */
+void
+bl_layout_toggle_live() {
+    _bl_layout_live = !_bl_layout_live;
+    if (_bl_layout_live && _bl_layout_live_hook < 0) {
+        _bl_layout_live_hook = bl_tui_idle_add(bl_layout_live_flush, NULL);
+    } else if (!_bl_layout_live && _bl_layout_live_hook >= 0) {
+        bl_tui_idle_remove(_bl_layout_live_hook);
+        _bl_layout_live_hook = -1;
+        _bl_layout_live_pending = NULL;
+    }
+    bl_layout_live_draw();
+}
+
+/*
+ * Called after a cell of layout was changed, in live mode the write is
+ * (re)scheduled.
+ */
+static void
+bl_layout_live_edit(bl_layout_t *layout) {
+    if (_bl_layout_live) {
+        _bl_layout_live_pending = layout;
+        clock_gettime(CLOCK_MONOTONIC, &_bl_layout_live_last_edit);
+    }
+}
+
+/*
+ * Drop the pending edits of layout, e.g. because it is about to be freed.
+ */
+static void
+bl_layout_live_forget(bl_layout_t *layout) {
+    if (_bl_layout_live_pending == layout) {
+        _bl_layout_live_pending = NULL;
+    }
+}
+
+/*
+ * Undo history of the layout being edited, created when the matrix is
+ * first shown.
+ */
+static bl_undo_t *_bl_layout_undo = NULL;
+
+/*
+ * Start a new history, e.g. because another layout was loaded.
+ */
+static void
+bl_layout_undo_reset(bl_layout_t *layout) {
+    if (_bl_layout_undo == NULL) {
+        _bl_layout_undo = bl_undo_create(layout, BL_UNDO_STEPS);
+    } else {
+        bl_undo_reset(_bl_layout_undo, layout);
+    }
+}
+
+/*
+ * Undo (or redo) the last edit and update the select boxes of the layers
+ * that changed. Returns FALSE if there was nothing to undo.
+ */
+static int
+bl_layout_undo(bl_matrix_ui_t matrix, bl_layout_t *layout, int redo,
+               bl_tui_select_box_value_t *bl_key_mapping_items, int n_items) {
+    int layers = 0;
+    int done = redo ? bl_undo_redo(_bl_layout_undo, layout, &layers) : bl_undo_undo(_bl_layout_undo, layout, &layers);
+    if (done) {
+        bl_layout_sync_matrix(matrix, layout, layers, bl_key_mapping_items, n_items);
+        bl_layout_live_edit(layout);
+    }
+    return done;
+}
+
 /**
  * Get a number between 1 and 6 to store in the parameter nlayers
  *
@@ -389,6 +757,89 @@ bl_layout_manage_layers(bl_layout_t *layout, int *layer) {
     }
 }
 
+/**
+ * Ask for the arguments of a bulk operation on the current layer and apply
+ * it to the layout, see bl_layout_edit().
+ *
+ * @param layout Layout to be modified
+ * @param op One of BL_LAYOUT_BULK_*
+ * @param layer The currently selected layer
+ * @return The bit mask of the layers that changed, 0 if cancelled or not valid.
+ */
+int
+bl_layout_bulk_edit(bl_layout_t *layout, int op, int layer) {
+    char title[32];
+    char value[48];
+    char line[96];
+    char *input = NULL;
+    int n = layer + 1;
+
+    switch (op) {
+        case BL_LAYOUT_BULK_COPY:
+            snprintf(title, sizeof(title), "Copy layer %d", n);
+            snprintf(value, sizeof(value), "%d", n % layout->nlayers + 1);
+            input = bl_tui_textbox(title, "To layer", value, 10, 10, 30, 2);
+            snprintf(line, sizeof(line), "copy %d %s", n, input != NULL ? input : "");
+            break;
+        case BL_LAYOUT_BULK_SWAP:
+            snprintf(title, sizeof(title), "Swap layer %d", n);
+            snprintf(value, sizeof(value), "%d", n % layout->nlayers + 1);
+            input = bl_tui_textbox(title, "With layer", value, 10, 10, 30, 2);
+            snprintf(line, sizeof(line), "swap %d %s", n, input != NULL ? input : "");
+            break;
+        case BL_LAYOUT_BULK_CLEAR:
+            if (bl_tui_confirm(35, 5, "Clear layer", "Clear all keys of layer %d?", n)) {
+                input = strdup("");
+            }
+            snprintf(line, sizeof(line), "clear %d", n);
+            break;
+        case BL_LAYOUT_BULK_FILL:
+            snprintf(title, sizeof(title), "Fill layer %d", n);
+            input = bl_tui_textbox(title, "Key code", "0", 10, 10, 30, 6);
+            snprintf(line, sizeof(line), "fill %d %s", n, input != NULL ? input : "");
+            break;
+        case BL_LAYOUT_BULK_BLOCK:
+            snprintf(value, sizeof(value), "%d.0.0 1 1 %d.0.0", n, n % layout->nlayers + 1);
+            input = bl_tui_textbox("Copy block", "L.R.C ROWS COLS L.R.C", value, 10, 10, 50, 24);
+            snprintf(line, sizeof(line), "block %s", input != NULL ? input : "");
+            break;
+        case BL_LAYOUT_BULK_REMAP:
+            input = bl_tui_textbox("Remap key code", "FROM TO [LAYER]", NULL, 10, 10, 40, 20);
+            snprintf(line, sizeof(line), "remap %s", input != NULL ? input : "");
+            break;
+    }
+    if (input == NULL) {
+        return 0;
+    }
+    free(input);
+
+    char *args[8];
+    int nargs = 0;
+    for (char *arg = strtok(line, " "); arg != NULL && nargs < 8; arg = strtok(NULL, " ")) {
+        args[nargs++] = arg;
+    }
+    /*
+     * The select boxes can only show the known key codes, so the code that
+     * is written to the layer must be one of them
+     */
+    if ((op == BL_LAYOUT_BULK_FILL || op == BL_LAYOUT_BULK_REMAP) && nargs >= 3) {
+        char *end;
+        long code = strtol(args[2], &end, 0);
+        if (end != args[2] && *end == 0 && (code < 0 || code > 0xffff || !bl_validate_code(code))) {
+            bl_tui_err(FALSE, "unknown key code: %s", args[2]);
+            return 0;
+        }
+    }
+    char errmsg[128];
+    int layers = bl_layout_edit(layout, args, nargs, errmsg, sizeof(errmsg));
+    if (layers < 0) {
+        bl_tui_err(FALSE, "%s", errmsg);
+        return 0;
+    }
+
+    return layers;
+}
+
 /**
  * Display macros (24 x 8 keys) in two columns,
  * each column is 12 lines high, and 20 characters wide.
@@ -404,6 +855,155 @@ bl_layout_manage_macros() {
     bl_tui_msg(40, 1, "Manage macros", "Not implemented yet!");
 }
 
+/*
+ * Every layer is rendered once in its own off-screen pad, the pads are kept
+ * up to date when cells change and switching layers copies a pad to the
+ * screen.
+ */
+static WINDOW *_bl_layout_pads[NUMLAYERS_MAX] = { NULL };
+
+/**
+ * (Re)render all layers in their pads, needed after the matrix or the
+ * number of layers changed.
+ *
+ * @param win Window the pads are shown in, determines the size of the pads.
+ * @param matrix Select boxes of all layers
+ * @param nlayers Number of layers in the layout
+ */
+void
+bl_layout_pads_render(WINDOW *win, bl_matrix_ui_t matrix, int nlayers) {
+    for (int layer=0; layer<NUMLAYERS_MAX; layer++) {
+        if (_bl_layout_pads[layer] == NULL) {
+            _bl_layout_pads[layer] = newpad(getmaxy(win), getmaxx(win));
+        }
+        werase(_bl_layout_pads[layer]);
+        bl_layout_draw_keyboard_matrix(_bl_layout_pads[layer], matrix, layer, nlayers);
+    }
+}
+
+/**
+ * Draw a single cell in the pad of its layer.
+ */
+void
+bl_layout_pads_draw_cell(bl_matrix_ui_t matrix, int layer, int row, int col, int inversed) {
+    draw_matrix_cell(_bl_layout_pads[layer], matrix[layer][row][col], col, row, inversed);
+}
+
+/**
+ * Copy the pad of the layer to the screen, at the position of win. Only
+ * the cells that differ from what is on the screen are sent to the terminal.
+ */
+void
+bl_layout_pads_show(WINDOW *win, int layer) {
+    int y = getbegy(win);
+    int x = getbegx(win);
+    pnoutrefresh(_bl_layout_pads[layer], 0, 0, y, x, y + getmaxy(win) - 1, x + getmaxx(win) - 1);
+    doupdate();
+}
+
+/*
+ * Position of the last key pressed on the keyboard itself. It is sampled by
+ * an idle hook, so key presses are not lost while a dialog is open.
+ */
+typedef struct bl_layout_matrix_pos_t {
+    int pressed;
+    int row;
+    int col;
+} bl_layout_matrix_pos_t;
+
+/*
+ * Controller state that is read while the layout screen is shown, NULL
+ * if nothing is read.
+ */
+static bl_prefetch_t *_bl_layout_prefetch = NULL;
+/* parts of the prefetched state that have been shown */
+static int _bl_layout_prefetch_shown = 0;
+
+void
+bl_layout_set_prefetch(bl_prefetch_t *prefetch) {
+    _bl_layout_prefetch = prefetch;
+    _bl_layout_prefetch_shown = 0;
+}
+
+/*
+ * Show the controller state that arrived since the last call. Returns
+ * TRUE if the layout arrived and was copied to layout, a layout that
+ * arrives after the user edited or replaced the one on the screen is
+ * dropped.
+ */
+static int
+bl_layout_prefetch_update(bl_layout_t *layout) {
+    bl_prefetch_t *p = _bl_layout_prefetch;
+    if (p == NULL) {
+        return FALSE;
+    }
+    int ready = bl_prefetch_ready(p);
+    int failed = atomic_load(&p->failed);
+    int arrived = (ready | failed) & ~_bl_layout_prefetch_shown;
+    if (arrived == 0) {
+        return FALSE;
+    }
+    _bl_layout_prefetch_shown |= arrived;
+
+    int maxy = getmaxy(stdscr);
+    attron(A_REVERSE);
+    mvprintw(maxy-1, 0, "fw ");
+    if (ready & BL_CTRL_VERSION) {
+        printw("%d.%d", p->state.major, p->state.minor);
+    } else {
+        printw("-");
+    }
+    printw(" pwm ");
+    if (ready & BL_CTRL_PWM) {
+        printw("%d/%d", p->state.pwm_usb, p->state.pwm_bt);
+    } else {
+        printw("-");
+    }
+    printw(" deb ");
+    if (ready & BL_CTRL_DEBOUNCE) {
+        printw("%d", p->state.debounce);
+    } else {
+        printw("-");
+    }
+    if (p->first_frame_ms >= 0) {
+        printw(" | 1st frame %.1fms", p->first_frame_ms);
+    }
+    if (bl_prefetch_is_done(p)) {
+        printw(" all %.0fms ", bl_prefetch_elapsed_ms(p));
+    }
+    attroff(A_REVERSE);
+
+    if (failed & arrived & BL_CTRL_LAYOUT) {
+        bl_tui_err(FALSE, "Could not read the layout from the controller");
+    }
+    int edited = _bl_layout_undo != NULL &&
+        (bl_undo_nundo(_bl_layout_undo) > 0 || bl_undo_nredo(_bl_layout_undo) > 0);
+    if ((ready & arrived & BL_CTRL_LAYOUT) && !edited) {
+        layout->nlayers = p->state.layout.nlayers;
+        memcpy(layout->matrix, p->state.layout.matrix, sizeof(layout->matrix));
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+bl_layout_sample_matrix(void *data) {
+    bl_layout_matrix_pos_t *pos = (bl_layout_matrix_pos_t *) data;
+    int row, col;
+    /*
+     * Service mode is enabled by the prefetch worker, wait for it
+     */
+    if (_bl_layout_prefetch != NULL && !bl_prefetch_is_done(_bl_layout_prefetch)) {
+        return;
+    }
+    if (bl_usb_read_matrix_pos(&row, &col)) {
+        pos->row = row;
+        pos->col = col;
+        pos->pressed = TRUE;
+    }
+}
+
 int
 bl_layout_navigate_matrix(WINDOW *win, bl_matrix_ui_t matrix, bl_layout_t *layout, int layer, bl_tui_select_box_value_t *bl_key_mapping_items, int n_key_mappings) {
     int col = 0;
@@ -413,23 +1013,40 @@ bl_layout_navigate_matrix(WINDOW *win, bl_matrix_ui_t matrix, bl_layout_t *layou
     int maxy = getmaxy(stdscr);
 
     int show_layers = TRUE;
-    int ch = getch();
+    bl_layout_matrix_pos_t pos = { FALSE, 0, 0 };
+    int hook = bl_tui_idle_add(bl_layout_sample_matrix, &pos);
+    int ch = bl_tui_poll();
     int redraw = FALSE;
-    draw_matrix_cell(win, matrix[layer][row][col], col, row, TRUE);
+    int rerender = FALSE;
+    if (_bl_layout_pads[0] == NULL) {
+        bl_layout_pads_render(win, matrix, layout->nlayers);
+    }
+    if (_bl_layout_undo == NULL) {
+        bl_layout_undo_reset(layout);
+    }
+    bl_layout_pads_draw_cell(matrix, layer, row, col, TRUE);
+    touchwin(_bl_layout_pads[layer]);
+    bl_layout_pads_show(win, layer);
+    if (_bl_layout_prefetch != NULL) {
+        bl_prefetch_first_frame(_bl_layout_prefetch);
+    }
+    if (_bl_layout_live) {
+        bl_layout_live_draw();
+    }
     while (ch != 'q' && ch != 'Q' && show_layers) {
+        ch = bl_tui_poll();
         /*
          * See if key was pressed on the IBM model m keyboard and get
          * its position if so.
          */
-        int m_row, m_col;
-        if (bl_usb_read_matrix_pos(&m_row, &m_col)) {
-            col = m_col;
-            row = m_row;
+        if (pos.pressed) {
+            col = pos.col;
+            row = pos.row;
+            pos.pressed = FALSE;
         }
         /*
          * Check the key presses on the alternate keyboard
          */
-        ch = getch();
         if (ch == KEY_DOWN && col < NUMCOLS-1) {
             col++;
         } else if (ch == KEY_UP && col > 0) {
@@ -441,19 +1058,32 @@ bl_layout_navigate_matrix(WINDOW *win, bl_matrix_ui_t matrix, bl_layout_t *layou
         } else if (ch == '\n' || ch == '\r') {
             bl_tui_select_box_t *sb = matrix[layer][row][col];
             bl_tui_select_box(sb, row  * (SELECT_BOX_WIDTH + 1) + 4, col + 4);
-            mvprintw(1, 0, "sel=%d\n",  *((uint16_t*) sb->items[sb->selected_item_index].data));
-            layout->matrix[layer][row][col] = *((uint16_t*) sb->items[sb->selected_item_index].data);
-            erase();
-            redraw = TRUE;
-        } else if (ch == 'f' || ch == 'F') {
-            bl_ui_do_file_menu(layout);
+            uint16_t code = *((uint16_t*) sb->items[sb->selected_item_index].data);
+            if (code != layout->matrix[layer][row][col]) {
+                layout->matrix[layer][row][col] = code;
+                bl_undo_record(_bl_layout_undo, layout, 1 << layer);
+                bl_layout_live_edit(layout);
+            }
+            bl_layout_pads_draw_cell(matrix, layer, row, col, TRUE);
             redraw = TRUE;
-        } else if (ch == 'o' || ch == 'O') {
-            bl_layout_t *layout_new = bl_layout_select_and_load_file();
+        } else if (ch == 'f' || ch == 'F' || ch == 'o' || ch == 'O' || ch == '/') {
+            bl_layout_t *layout_new;
+            if (ch == 'f' || ch == 'F') {
+                layout_new = bl_ui_do_file_menu(layout);
+            } else if (ch == '/') {
+                layout_new = bl_layout_find_and_load_file();
+            } else {
+                layout_new = bl_layout_select_and_load_file();
+            }
             if (layout_new != NULL) {
+                bl_layout_live_forget(layout);
                 bl_layout_destroy(layout);
                 layout = layout_new;
                 bl_layout_init_matrix(matrix, layout, bl_key_mapping_items, n_key_mappings);
+                bl_layout_undo_reset(layout);
+                // the prefetched layout would replace the loaded one
+                _bl_layout_prefetch_shown |= BL_CTRL_LAYOUT;
+                rerender = TRUE;
             }
             redraw = TRUE;
         } else if (ch == 's' || ch == 'S') {
@@ -463,24 +1093,66 @@ bl_layout_navigate_matrix(WINDOW *win, bl_matrix_ui_t matrix, bl_layout_t *layou
             bl_layout_write_to_controller(layout);
             redraw = TRUE;
         } else if (ch == 'l' || ch == 'L') {
-            bl_ui_do_layer_menu(layout, &layer);
+            int layers = bl_ui_do_layer_menu(layout, &layer);
+            if (bl_undo_record(_bl_layout_undo, layout, BL_UNDO_ALL_LAYERS)) {
+                bl_layout_sync_matrix(matrix, layout, layers, bl_key_mapping_items, n_key_mappings);
+                bl_layout_live_edit(layout);
+            }
+            rerender = TRUE;
             redraw = TRUE;
         } else if (ch == 'm' || ch == 'M') {
             bl_ui_do_macro_menu(&show_layers);
             redraw = TRUE;
+        } else if (ch == 'a' || ch == 'A') {
+            bl_layout_toggle_live();
+        } else if (ch == 'u' || ch == 'U' || ch == 'r' || ch == 'R') {
+            if (bl_layout_undo(matrix, layout, ch == 'r' || ch == 'R', bl_key_mapping_items, n_key_mappings)) {
+                if (layer >= layout->nlayers) {
+                    layer = layout->nlayers - 1;
+                }
+                rerender = TRUE;
+                redraw = TRUE;
+            }
         } else if (ch - (int)'0' >= 1 && ch - (int)'0' <= layout->nlayers) {
+            /*
+             * Move the cursor to the pad of the new layer and show it
+             */
+            bl_layout_pads_draw_cell(matrix, layer, row_last, col_last, FALSE);
             layer = ch - (int)'0' - 1;
+            bl_layout_pads_draw_cell(matrix, layer, row_last, col_last, TRUE);
+            // only the changed cells would be copied, the whole pad is new
+            touchwin(_bl_layout_pads[layer]);
+            bl_layout_pads_show(win, layer);
+        }
+        if (bl_layout_prefetch_update(layout)) {
+            /*
+             * The layout arrived from the controller, fill in the cells
+             */
+            bl_layout_init_matrix(matrix, layout, bl_key_mapping_items, n_key_mappings);
+            bl_layout_undo_reset(layout);
+            if (layer >= layout->nlayers) {
+                layer = 0;
+            }
+            rerender = TRUE;
             redraw = TRUE;
         }
+        if (rerender) {
+            bl_layout_pads_render(win, matrix, layout->nlayers);
+            bl_layout_pads_draw_cell(matrix, layer, row_last, col_last, TRUE);
+            rerender = FALSE;
+        }
         if (redraw) {
-            clear();
-            bl_layout_draw_keyboard_matrix(win, matrix, layer, layout->nlayers);
-            draw_matrix_cell(win, matrix[layer][row][col], col, row, TRUE);
+            /*
+             * A popup may have covered the matrix, repaint it from the pad
+             */
+            touchwin(_bl_layout_pads[layer]);
+            bl_layout_pads_show(win, layer);
             redraw = FALSE;
         }
         if (row != row_last || col != col_last) {
-            draw_matrix_cell(win, matrix[layer][row_last][col_last], col_last, row_last, FALSE);
-            draw_matrix_cell(win, matrix[layer][row][col], col, row, TRUE);
+            bl_layout_pads_draw_cell(matrix, layer, row_last, col_last, FALSE);
+            bl_layout_pads_draw_cell(matrix, layer, row, col, TRUE);
+            bl_layout_pads_show(win, layer);
             col_last = col;
             row_last = row;
         }
@@ -491,10 +1163,57 @@ bl_layout_navigate_matrix(WINDOW *win, bl_matrix_ui_t matrix, bl_layout_t *layou
         // don't hog the cpu too much
         usleep(50);
     }
+    bl_tui_idle_remove(hook);
 
     return ch;
 }
 
+/**
+ * Free the resources used by the layout screens.
+ */
+void
+bl_layout_cleanup() {
+    for (int layer=0; layer<NUMLAYERS_MAX; layer++) {
+        if (_bl_layout_pads[layer] != NULL) {
+            delwin(_bl_layout_pads[layer]);
+            _bl_layout_pads[layer] = NULL;
+        }
+    }
+    if (_bl_layout_preview != NULL) {
+        bl_preview_destroy(_bl_layout_preview);
+        _bl_layout_preview = NULL;
+    }
+    if (_bl_layout_matrix_arena != NULL) {
+        bl_arena_destroy(_bl_layout_matrix_arena);
+        _bl_layout_matrix_arena = NULL;
+    }
+    if (_bl_layout_undo != NULL) {
+        bl_undo_destroy(_bl_layout_undo);
+        _bl_layout_undo = NULL;
+    }
+    if (_bl_layout_live_hook >= 0) {
+        bl_tui_idle_remove(_bl_layout_live_hook);
+        _bl_layout_live_hook = -1;
+    }
+    if (_bl_layout_live_pending != NULL) {
+        // write the last edits before leaving
+        if (_bl_layout_writer != NULL) {
+            bl_writer_destroy(_bl_layout_writer);
+        }
+        _bl_layout_writer = bl_writer_start(_bl_layout_live_pending);
+        _bl_layout_live_pending = NULL;
+    }
+    if (_bl_layout_writer_hook >= 0) {
+        bl_tui_idle_remove(_bl_layout_writer_hook);
+        _bl_layout_writer_hook = -1;
+    }
+    if (_bl_layout_writer != NULL) {
+        // don't leave the controller with a partial write
+        bl_writer_destroy(_bl_layout_writer);
+        _bl_layout_writer = NULL;
+    }
+}
+
 /**
  * Read the existing keyboard layout and return it.
  *
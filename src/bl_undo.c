@@ -0,0 +1,209 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "blusb.h"
+#include "bl_kernel.h"
+#include "bl_undo.h"
+
+static bl_undo_version_t *
+bl_undo_version(bl_undo_t *undo, int i) {
+    return &undo->versions[(undo->first + i) % undo->size];
+}
+
+static bl_undo_layer_t *
+bl_undo_layer_copy(bl_undo_t *undo, uint16_t *codes) {
+    bl_undo_layer_t *layer = (bl_undo_layer_t *) malloc(sizeof(bl_undo_layer_t));
+    if (layer == NULL) {
+        errmsg_and_abort("bl_undo_record: out of memory");
+    }
+    layer->refs = 1;
+    memcpy(layer->codes, codes, sizeof(layer->codes));
+    undo->nallocated++;
+
+    return layer;
+}
+
+static void
+bl_undo_layer_release(bl_undo_t *undo, bl_undo_layer_t *layer) {
+    if (--layer->refs == 0) {
+        free(layer);
+        undo->nallocated--;
+    }
+}
+
+static void
+bl_undo_version_release(bl_undo_t *undo, bl_undo_version_t *version) {
+    for (int i=0; i<NUMLAYERS_MAX; i++) {
+        bl_undo_layer_release(undo, version->layers[i]);
+    }
+}
+
+bl_undo_t *
+bl_undo_create(bl_layout_t *layout, int nsteps) {
+    bl_undo_t *undo = (bl_undo_t *) malloc(sizeof(bl_undo_t));
+    if (undo == NULL) {
+        errmsg_and_abort("bl_undo_create: out of memory");
+    }
+    undo->size = MAX(nsteps, 0) + 1;
+    undo->versions = (bl_undo_version_t *) malloc(undo->size * sizeof(bl_undo_version_t));
+    if (undo->versions == NULL) {
+        errmsg_and_abort("bl_undo_create: out of memory");
+    }
+    undo->first = 0;
+    undo->n = 0;
+    undo->cur = 0;
+    undo->nallocated = 0;
+    bl_undo_reset(undo, layout);
+
+    return undo;
+}
+
+void
+bl_undo_destroy(bl_undo_t *undo) {
+    for (int i=0; i<undo->n; i++) {
+        bl_undo_version_release(undo, bl_undo_version(undo, i));
+    }
+    free(undo->versions);
+    free(undo);
+}
+
+void
+bl_undo_reset(bl_undo_t *undo, bl_layout_t *layout) {
+    for (int i=0; i<undo->n; i++) {
+        bl_undo_version_release(undo, bl_undo_version(undo, i));
+    }
+    bl_undo_version_t *version = &undo->versions[0];
+    version->nlayers = layout->nlayers;
+    for (int i=0; i<NUMLAYERS_MAX; i++) {
+        version->layers[i] = bl_undo_layer_copy(undo, &layout->matrix[i][0][0]);
+    }
+    undo->first = 0;
+    undo->n = 1;
+    undo->cur = 0;
+}
+
+int
+bl_undo_record(bl_undo_t *undo, bl_layout_t *layout, int layers) {
+    bl_undo_version_t *cur = bl_undo_version(undo, undo->cur);
+    bl_undo_version_t next;
+    int changed = layout->nlayers != cur->nlayers;
+
+    next.nlayers = layout->nlayers;
+    for (int i=0; i<NUMLAYERS_MAX; i++) {
+        uint16_t *codes = &layout->matrix[i][0][0];
+        if ((layers & (1 << i)) && !bl_kernel_equal(cur->layers[i]->codes, codes, NUMKEYS)) {
+            next.layers[i] = bl_undo_layer_copy(undo, codes);
+            changed = TRUE;
+        } else {
+            next.layers[i] = cur->layers[i];
+            next.layers[i]->refs++;
+        }
+    }
+    if (!changed) {
+        bl_undo_version_release(undo, &next);
+        return FALSE;
+    }
+
+    /*
+     * Drop the steps that were undone, and the oldest step if the ring is
+     * full
+     */
+    while (undo->n > undo->cur + 1) {
+        bl_undo_version_release(undo, bl_undo_version(undo, --undo->n));
+    }
+    if (undo->n == undo->size) {
+        bl_undo_version_release(undo, bl_undo_version(undo, 0));
+        undo->first = (undo->first + 1) % undo->size;
+        undo->n--;
+        undo->cur--;
+    }
+    *bl_undo_version(undo, undo->n) = next;
+    undo->cur = undo->n++;
+
+    return TRUE;
+}
+
+/*
+ * Make version i the current one, only the layers that differ from the
+ * current version are copied
+ */
+static void
+bl_undo_restore(bl_undo_t *undo, int i, bl_layout_t *layout, int *layers) {
+    bl_undo_version_t *from = bl_undo_version(undo, undo->cur);
+    bl_undo_version_t *to = bl_undo_version(undo, i);
+
+    *layers = 0;
+    for (int layer=0; layer<NUMLAYERS_MAX; layer++) {
+        if (to->layers[layer] != from->layers[layer]) {
+            memcpy(layout->matrix[layer], to->layers[layer]->codes, sizeof(layout->matrix[layer]));
+            *layers |= 1 << layer;
+        }
+    }
+    layout->nlayers = to->nlayers;
+    undo->cur = i;
+}
+
+int
+bl_undo_undo(bl_undo_t *undo, bl_layout_t *layout, int *layers) {
+    if (undo->cur == 0) {
+        return FALSE;
+    }
+    bl_undo_restore(undo, undo->cur - 1, layout, layers);
+
+    return TRUE;
+}
+
+int
+bl_undo_redo(bl_undo_t *undo, bl_layout_t *layout, int *layers) {
+    if (undo->cur + 1 >= undo->n) {
+        return FALSE;
+    }
+    bl_undo_restore(undo, undo->cur + 1, layout, layers);
+
+    return TRUE;
+}
+
+int
+bl_undo_nundo(bl_undo_t *undo) {
+    return undo->cur;
+}
+
+int
+bl_undo_nredo(bl_undo_t *undo) {
+    return undo->n - undo->cur - 1;
+}
+
+size_t
+bl_undo_bytes(bl_undo_t *undo) {
+    return sizeof(bl_undo_t) + undo->size * sizeof(bl_undo_version_t) +
+        undo->nallocated * sizeof(bl_undo_layer_t);
+}
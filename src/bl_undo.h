@@ -0,0 +1,136 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_UNDO_H__
+#define __BL_UNDO_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usb.h"
+
+/*
+ * Undo history of a layout. Every step holds a version of the layout as
+ * pointers to immutable layers, a step shares the layers that did not
+ * change with the previous step and copies only the changed ones. The
+ * layers are reference counted and freed when no step uses them.
+ *
+ * The steps are kept in a ring, when it is full the oldest step is
+ * dropped. Undo and redo copy at most the layers that differ between two
+ * steps.
+ */
+
+/*
+ * Number of steps the editor keeps
+ */
+#define BL_UNDO_STEPS 256
+
+/*
+ * All layers may have changed
+ */
+#define BL_UNDO_ALL_LAYERS ((1 << NUMLAYERS_MAX) - 1)
+
+typedef struct bl_undo_layer_t {
+    int refs;
+    uint16_t codes[NUMKEYS];
+} bl_undo_layer_t;
+
+typedef struct bl_undo_version_t {
+    int nlayers;
+    bl_undo_layer_t *layers[NUMLAYERS_MAX];
+} bl_undo_version_t;
+
+typedef struct bl_undo_t {
+    // ring of size versions, starting at first
+    bl_undo_version_t *versions;
+    int size;
+    int first;
+    int n;
+    // current version, counted from first
+    int cur;
+    // number of layers allocated
+    int nallocated;
+} bl_undo_t;
+
+/**
+ * Create a history with layout as its first version.
+ *
+ * @param nsteps Number of steps that can be undone
+ */
+bl_undo_t *bl_undo_create(bl_layout_t *layout, int nsteps);
+
+void bl_undo_destroy(bl_undo_t *undo);
+
+/**
+ * Forget all steps, layout becomes the first version.
+ */
+void bl_undo_reset(bl_undo_t *undo, bl_layout_t *layout);
+
+/**
+ * Record layout after an edit as a new step, the steps that were undone
+ * can no longer be redone.
+ *
+ * @param layers Bit mask of the layers the edit may have changed, only
+ *               these are compared with the previous step
+ * @return TRUE if a step was recorded, FALSE if layout did not change
+ */
+int bl_undo_record(bl_undo_t *undo, bl_layout_t *layout, int layers);
+
+/**
+ * Restore the previous step into layout.
+ *
+ * @param layers Set to the bit mask of the layers that changed
+ * @return FALSE if there is nothing to undo
+ */
+int bl_undo_undo(bl_undo_t *undo, bl_layout_t *layout, int *layers);
+
+/**
+ * Restore the next step into layout.
+ *
+ * @param layers Set to the bit mask of the layers that changed
+ * @return FALSE if there is nothing to redo
+ */
+int bl_undo_redo(bl_undo_t *undo, bl_layout_t *layout, int *layers);
+
+/**
+ * @return The number of steps that can be undone
+ */
+int bl_undo_nundo(bl_undo_t *undo);
+
+/**
+ * @return The number of steps that can be redone
+ */
+int bl_undo_nredo(bl_undo_t *undo);
+
+/**
+ * @return The memory used by the history in bytes
+ */
+size_t bl_undo_bytes(bl_undo_t *undo);
+
+#endif /* __BL_UNDO_H__ */
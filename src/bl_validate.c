@@ -0,0 +1,209 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "blusb.h"
+#include "layout.h"
+#include "bl_kernel.h"
+#include "bl_validate.h"
+
+/*
+ * Highest code of the types with a contiguous range, -1 if the type is
+ * not valid
+ */
+static const int _bl_validate_type_max[] = {
+    [TYPE_KEY] = KP_HEXADECIMAL,
+    [TYPE_MOD] = 0xff,
+    [TYPE_MEDIA] = MEDIA_REFRESH & 0xff,
+    [TYPE_MOUSE] = -1,
+    [TYPE_MOMENTARY] = MLAYER_7 & 0xff,
+    [TYPE_TOGGLE] = TLAYER_7 & 0xff,
+    [TYPE_SYSTEM] = SYSCTRL_WAKEUP & 0xff,
+    [TYPE_MACRO] = NUM_MACROKEYS - 1,
+};
+
+int
+bl_validate_code(uint16_t code) {
+    int type = code >> 8;
+    int value = code & 0xff;
+
+    if (type == TYPE_MISC) {
+        return value <= CODE_BR_DOWN;
+    }
+    if (type > TYPE_MACRO || value > _bl_validate_type_max[type]) {
+        return FALSE;
+    }
+    switch (type) {
+        case TYPE_KEY:
+            // 1-3 are error codes, 165-175 are reserved
+            return value == KB_NONE || (value >= KB_A && (value < 165 || value > 175));
+        case TYPE_MOD:
+            return value != 0;
+        default:
+            return TRUE;
+    }
+}
+
+static void
+bl_validate_add(bl_validate_t *result, int kind, int severity, int layer, int row, int col, uint16_t code) {
+    if (severity == BL_VALIDATE_ERROR) {
+        result->nerrors++;
+    } else {
+        result->nwarnings++;
+    }
+    if (result->n < BL_VALIDATE_ISSUES_MAX) {
+        bl_validate_issue_t *issue = &result->issues[result->n++];
+        issue->kind = kind;
+        issue->severity = severity;
+        issue->layer = layer;
+        issue->row = row;
+        issue->col = col;
+        issue->code = code;
+    }
+}
+
+/*
+ * TRUE if all codes are valid keys or modifiers, these need no further
+ * checks
+ */
+static int
+bl_validate_plain(uint16_t *codes, int n) {
+    int plain = bl_kernel_count_range(codes, n, KB_NONE, KB_NONE) +
+        bl_kernel_count_range(codes, n, KB_A, 164) +
+        bl_kernel_count_range(codes, n, 176, KP_HEXADECIMAL) +
+        bl_kernel_count_range(codes, n, (TYPE_MOD << 8) + 1, (TYPE_MOD << 8) + 0xff);
+    return plain == n;
+}
+
+int
+bl_validate_layout(bl_layout_t *layout, bl_macro_t *macros, bl_validate_t *result) {
+    // bit j of toggles[i] and moments[i] is set if layer i has a key to layer j
+    int toggles[NUMLAYERS_MAX] = { 0 };
+    int moments[NUMLAYERS_MAX] = { 0 };
+    int nlayers = layout->nlayers;
+
+    memset(result, 0, sizeof(bl_validate_t));
+    if (nlayers < NUMLAYERS_MIN || nlayers > NUMLAYERS_MAX) {
+        bl_validate_add(result, BL_VALIDATE_NLAYERS, BL_VALIDATE_ERROR, nlayers, 0, 0, 0);
+        return FALSE;
+    }
+
+    for (int layer=0; layer<nlayers; layer++) {
+        if (bl_validate_plain(&layout->matrix[layer][0][0], NUMKEYS)) {
+            continue;
+        }
+        for (int row=0; row<NUMROWS; row++) {
+            for (int col=0; col<NUMCOLS; col++) {
+                uint16_t code = layout->matrix[layer][row][col];
+                int type = code >> 8;
+                int value = code & 0xff;
+
+                if (!bl_validate_code(code)) {
+                    bl_validate_add(result, BL_VALIDATE_UNKNOWN_CODE, BL_VALIDATE_ERROR, layer, row, col, code);
+                } else if (type == TYPE_TOGGLE || type == TYPE_MOMENTARY) {
+                    if (value >= nlayers) {
+                        bl_validate_add(result, BL_VALIDATE_LAYER_RANGE, BL_VALIDATE_ERROR, layer, row, col, code);
+                    } else if (type == TYPE_TOGGLE) {
+                        toggles[layer] |= 1 << value;
+                    } else {
+                        moments[layer] |= 1 << value;
+                    }
+                } else if (type == TYPE_MACRO && macros != NULL && bl_macro_blank(macros->macros[value], LEN_MACRO)) {
+                    bl_validate_add(result, BL_VALIDATE_NO_MACRO, BL_VALIDATE_WARNING, layer, row, col, code);
+                }
+            }
+        }
+    }
+
+    /*
+     * Layers reachable from layer 1, and the layers entered with a toggle
+     */
+    int reachable = 1;
+    int toggled = 0;
+    for (int changed=TRUE; changed; ) {
+        changed = FALSE;
+        for (int layer=0; layer<nlayers; layer++) {
+            if (reachable & (1 << layer)) {
+                int next = reachable | toggles[layer] | moments[layer];
+                toggled |= toggles[layer] & ~(1 << layer);
+                if (next != reachable) {
+                    reachable = next;
+                    changed = TRUE;
+                }
+            }
+        }
+    }
+    result->reachable = reachable;
+
+    for (int layer=1; layer<nlayers; layer++) {
+        if (!(reachable & (1 << layer))) {
+            bl_validate_add(result, BL_VALIDATE_UNREACHABLE, BL_VALIDATE_WARNING, layer, 0, 0, 0);
+        } else if ((toggled & (1 << layer)) && (toggles[layer] & ~(1 << layer)) == 0) {
+            bl_validate_add(result, BL_VALIDATE_NO_EXIT, BL_VALIDATE_WARNING, layer, 0, 0, 0);
+        }
+    }
+
+    return result->nerrors == 0;
+}
+
+void
+bl_validate_describe(bl_validate_issue_t *issue, char *buffer, int length) {
+    int layer = issue->layer + 1;
+    int row = issue->row + 1;
+    int col = issue->col + 1;
+
+    switch (issue->kind) {
+        case BL_VALIDATE_NLAYERS:
+            snprintf(buffer, length, "invalid number of layers: %d", issue->layer);
+            break;
+        case BL_VALIDATE_UNKNOWN_CODE:
+            snprintf(buffer, length, "invalid key code 0x%04x in layer %d, row %d, column %d",
+                     issue->code, layer, row, col);
+            break;
+        case BL_VALIDATE_LAYER_RANGE:
+            snprintf(buffer, length, "key 0x%04x in layer %d, row %d, column %d switches to layer %d, "
+                     "the layout has fewer layers", issue->code, layer, row, col, (issue->code & 0xff) + 1);
+            break;
+        case BL_VALIDATE_NO_MACRO:
+            snprintf(buffer, length, "macro %d in layer %d, row %d, column %d is not defined",
+                     (issue->code & 0xff) + 1, layer, row, col);
+            break;
+        case BL_VALIDATE_UNREACHABLE:
+            snprintf(buffer, length, "layer %d can't be reached, no layer key leads to it", layer);
+            break;
+        case BL_VALIDATE_NO_EXIT:
+            snprintf(buffer, length, "layer %d has no toggle key to leave it", layer);
+            break;
+        default:
+            snprintf(buffer, length, "unknown issue");
+            break;
+    }
+}
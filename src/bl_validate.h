@@ -0,0 +1,104 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_VALIDATE_H__
+#define __BL_VALIDATE_H__ 1
+
+#include <stdint.h>
+
+#include "usb.h"
+
+/*
+ * Validation of a layout before it is written: every key code must be
+ * known (see layout.h), layer keys must refer to a layer of the layout and
+ * macro keys to a defined macro. The layer keys form a graph, layers that
+ * can't be reached from layer 1 and layers that are entered with a toggle
+ * key but have no toggle key to another layer are reported too.
+ *
+ * Errors make the layout unusable, warnings are reported only.
+ */
+#define BL_VALIDATE_ERROR    0
+#define BL_VALIDATE_WARNING  1
+
+/*
+ * Kinds of issues
+ */
+#define BL_VALIDATE_NLAYERS        0   /* number of layers out of range */
+#define BL_VALIDATE_UNKNOWN_CODE   1   /* key code not in layout.h */
+#define BL_VALIDATE_LAYER_RANGE    2   /* layer key to a layer beyond nlayers */
+#define BL_VALIDATE_NO_MACRO       3   /* macro key for an empty macro */
+#define BL_VALIDATE_UNREACHABLE    4   /* no layer key leads to the layer */
+#define BL_VALIDATE_NO_EXIT        5   /* toggled layer without a toggle key back */
+
+/*
+ * Number of issues kept, the counts include all issues
+ */
+#define BL_VALIDATE_ISSUES_MAX 16
+
+typedef struct bl_validate_issue_t {
+    int kind;
+    int severity;
+    int layer;
+    int row;
+    int col;
+    uint16_t code;
+} bl_validate_issue_t;
+
+typedef struct bl_validate_t {
+    int nerrors;
+    int nwarnings;
+    int n;
+    bl_validate_issue_t issues[BL_VALIDATE_ISSUES_MAX];
+    // bit i is set if layer i can be reached from layer 1
+    int reachable;
+} bl_validate_t;
+
+/**
+ * Validate the layout.
+ *
+ * @param macros The macros on the controller, NULL if unknown, then macro
+ *               keys are only checked against NUM_MACROKEYS
+ * @param result Filled with the issues found
+ *
+ * @return TRUE if there are no errors
+ */
+int bl_validate_layout(bl_layout_t *layout, bl_macro_t *macros, bl_validate_t *result);
+
+/**
+ * @return TRUE if the key code is defined in layout.h, layer keys are not
+ * checked against the number of layers
+ */
+int bl_validate_code(uint16_t code);
+
+/**
+ * Describe an issue, e.g. "unknown key code 0x0310 in layer 1, row 2, column 5"
+ */
+void bl_validate_describe(bl_validate_issue_t *issue, char *buffer, int length);
+
+#endif /* __BL_VALIDATE_H__ */
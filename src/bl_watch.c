@@ -0,0 +1,232 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifdef __linux__
+// ppoll()
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef __APPLE__
+#include <sys/syslimits.h>
+#define st_mtim st_mtimespec
+#endif
+
+#include "blusb.h"
+#include "usb.h"
+#include "bl_watch.h"
+
+/*
+ * Without inotify, how often the modification time of the file is checked
+ */
+#define BL_WATCH_POLL_MS 100
+
+/* cleared by SIGINT and SIGTERM to end the watch */
+static volatile sig_atomic_t _bl_watch_running = FALSE;
+
+static void
+bl_watch_stop(int sig) {
+    _bl_watch_running = FALSE;
+}
+
+static double
+bl_watch_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+/*
+ * Parse the file, check it and write it if it differs from the layout on
+ * the controller. Reports the result and the time since the file was saved.
+ */
+static void
+bl_watch_update(char *fname, double saved_ms) {
+    char errmsg[256];
+    double start_ms = bl_watch_now_ms();
+
+    bl_layout_t *layout = bl_layout_load_file(fname);
+    if (layout == NULL) {
+        // bl_layout_load_file() reported the error
+        return;
+    }
+    if (!bl_layout_check(layout, errmsg, sizeof(errmsg))) {
+        fprintf(stderr, "%s: %s, not written\n", fname, errmsg);
+        bl_layout_destroy(layout);
+        return;
+    }
+    double parsed_ms = bl_watch_now_ms();
+
+    bl_ctrl_state_t *state = (bl_ctrl_state_t *) malloc(sizeof(bl_ctrl_state_t));
+    if ((bl_usb_read_state(state, BL_CTRL_LAYOUT, NULL, NULL) & BL_CTRL_LAYOUT) &&
+        bl_layout_equal(layout, &state->layout)) {
+        printf("%s: unchanged, not written (%.1f ms)\n", fname, bl_watch_now_ms() - saved_ms);
+    } else if (!bl_layout_write(layout)) {
+        fprintf(stderr, "%s: write to the controller failed\n", fname);
+    } else {
+        int verified = bl_layout_verify(layout);
+        double done_ms = bl_watch_now_ms();
+        printf("%s: %d layers written%s, latency %.1f ms (debounce %.1f, parse %.1f, usb %.1f)\n",
+               fname, layout->nlayers, verified ? " and verified" : ", VERIFY FAILED",
+               done_ms - saved_ms, start_ms - saved_ms, parsed_ms - start_ms, done_ms - parsed_ms);
+    }
+    fflush(stdout);
+    free(state);
+    bl_layout_destroy(layout);
+}
+
+int
+bl_watch_layout(char *fname, int debounce_ms) {
+    struct stat st;
+    if (stat(fname, &st) != 0) {
+        fprintf(stderr, "Could not find file %s\n", fname);
+        return FALSE;
+    }
+
+    /*
+     * Editors often save by writing a new file and renaming it, so watch
+     * the directory for the name instead of the file itself.
+     */
+    char dname_buf[PATH_MAX];
+    char bname_buf[PATH_MAX];
+    strncpy(dname_buf, fname, PATH_MAX - 1);
+    dname_buf[PATH_MAX - 1] = 0;
+    strncpy(bname_buf, fname, PATH_MAX - 1);
+    bname_buf[PATH_MAX - 1] = 0;
+    char *dname = dirname(dname_buf);
+    char *bname = basename(bname_buf);
+
+    int fd = -1;
+#ifdef __linux__
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, dname, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        close(fd);
+        fd = -1;
+    }
+#endif
+    struct timespec mtime = st.st_mtim;
+    off_t size = st.st_size;
+
+    /*
+     * No SA_RESTART, so the signal also ends the wait in ppoll() or
+     * usleep(). With inotify the signals are only delivered in ppoll(), a
+     * signal just before it would otherwise leave it waiting for a save.
+     */
+    struct sigaction sa, old_int, old_term;
+    sigset_t stop_mask, old_mask;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = bl_watch_stop;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    sigemptyset(&stop_mask);
+    sigaddset(&stop_mask, SIGINT);
+    sigaddset(&stop_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, fd >= 0 ? &stop_mask : NULL, &old_mask);
+    _bl_watch_running = TRUE;
+
+    printf("watching %s\n", fname);
+    bl_watch_update(fname, bl_watch_now_ms());
+
+    // time of the first and the last change that was not written yet, < 0 if none
+    double first_change_ms = -1;
+    double last_change_ms = -1;
+    while (_bl_watch_running) {
+        int timeout = BL_WATCH_POLL_MS;
+        if (last_change_ms >= 0) {
+            timeout = MAX(0, (int) (last_change_ms + debounce_ms - bl_watch_now_ms()));
+        }
+
+        int changed = FALSE;
+        if (fd >= 0) {
+#ifdef __linux__
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+            if (ppoll(&pfd, 1, last_change_ms >= 0 ? &ts : NULL, &old_mask) > 0) {
+                char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+                ssize_t len;
+                while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                    for (char *p = buf; p < buf + len; ) {
+                        struct inotify_event *event = (struct inotify_event *) p;
+                        if (event->len > 0 && strcmp(event->name, bname) == 0) {
+                            changed = TRUE;
+                        }
+                        p += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+            }
+#endif
+        } else {
+            usleep(MIN(timeout, BL_WATCH_POLL_MS) * 1000);
+            if (stat(fname, &st) == 0 &&
+                (st.st_mtim.tv_sec != mtime.tv_sec || st.st_mtim.tv_nsec != mtime.tv_nsec ||
+                 st.st_size != size)) {
+                mtime = st.st_mtim;
+                size = st.st_size;
+                changed = TRUE;
+            }
+        }
+
+        double now_ms = bl_watch_now_ms();
+        if (changed) {
+            if (first_change_ms < 0) {
+                first_change_ms = now_ms;
+            }
+            last_change_ms = now_ms;
+        } else if (last_change_ms >= 0 && now_ms - last_change_ms >= debounce_ms) {
+            bl_watch_update(fname, first_change_ms);
+            first_change_ms = -1;
+            last_change_ms = -1;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    printf("stopped watching %s\n", fname);
+
+    return TRUE;
+}
@@ -0,0 +1,93 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "blusb.h"
+#include "bl_writer.h"
+
+static void *
+bl_writer_worker(void *arg) {
+    bl_writer_t *w = (bl_writer_t *) arg;
+
+    if (!bl_layout_write(&w->layout)) {
+        w->ms = bl_writer_elapsed_ms(w);
+        atomic_store(&w->state, BL_WRITER_FAILED);
+        return NULL;
+    }
+    atomic_store(&w->state, BL_WRITER_VERIFYING);
+    int ok = bl_layout_verify(&w->layout);
+    w->ms = bl_writer_elapsed_ms(w);
+    atomic_store(&w->state, ok ? BL_WRITER_DONE : BL_WRITER_MISMATCH);
+
+    return NULL;
+}
+
+bl_writer_t *
+bl_writer_start(bl_layout_t *layout) {
+    bl_writer_t *w = (bl_writer_t *) malloc(sizeof(bl_writer_t));
+    if (w == NULL) {
+        errmsg_and_abort("bl_writer_start: out of memory");
+    }
+    memcpy(&w->layout, layout, sizeof(bl_layout_t));
+    atomic_init(&w->state, BL_WRITER_WRITING);
+    w->ms = 0;
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+
+    if (pthread_create(&w->thread, NULL, bl_writer_worker, w) != 0) {
+        errmsg_and_abort("bl_writer_start: can't create thread");
+    }
+
+    return w;
+}
+
+int
+bl_writer_state(bl_writer_t *w) {
+    return atomic_load(&w->state);
+}
+
+int
+bl_writer_is_done(bl_writer_t *w) {
+    return atomic_load(&w->state) >= BL_WRITER_DONE;
+}
+
+double
+bl_writer_elapsed_ms(bl_writer_t *w) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - w->start.tv_sec) * 1000.0 + (now.tv_nsec - w->start.tv_nsec) / 1e6;
+}
+
+void
+bl_writer_destroy(bl_writer_t *w) {
+    pthread_join(w->thread, NULL);
+    free(w);
+}
@@ -0,0 +1,91 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __BL_WRITER_H__
+#define __BL_WRITER_H__ 1
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "usb.h"
+
+/*
+ * States of a write, in the order they normally occur
+ */
+#define BL_WRITER_WRITING   0
+#define BL_WRITER_VERIFYING 1
+#define BL_WRITER_DONE      2
+// the write transfer failed
+#define BL_WRITER_FAILED    3
+// the write succeeded, but the controller returned a different layout
+#define BL_WRITER_MISMATCH  4
+
+/*
+ * Write a layout to the controller in a worker thread and read it back
+ * to verify it. The UI polls the state with bl_writer_state().
+ */
+typedef struct bl_writer_t {
+    pthread_t thread;
+    // copy of the layout, the caller may change its own while writing
+    bl_layout_t layout;
+    atomic_int state;
+    struct timespec start;
+    // duration in milliseconds, valid when the write has finished
+    double ms;
+} bl_writer_t;
+
+/**
+ * Start writing a copy of layout to the controller.
+ *
+ * @return the writer, must be destroyed with bl_writer_destroy()
+ */
+bl_writer_t *bl_writer_start(bl_layout_t *layout);
+
+/**
+ * Return the current state, one of the BL_WRITER_* values.
+ */
+int bl_writer_state(bl_writer_t *w);
+
+/**
+ * Return TRUE if the write has finished, successfully or not.
+ */
+int bl_writer_is_done(bl_writer_t *w);
+
+/**
+ * Milliseconds since the write was started.
+ */
+double bl_writer_elapsed_ms(bl_writer_t *w);
+
+/**
+ * Wait until the write has finished and free the writer.
+ */
+void bl_writer_destroy(bl_writer_t *w);
+
+#endif /* __BL_WRITER_H__ */
@@ -0,0 +1,77 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blusb.h"
+#include "usb.h"
+#include "layout.h"
+#include "bl_ui.h"
+
+/*
+ * Start the interactive text ui to configure the keyboard layout, macros, etc.
+ */
+void
+bl_ui() {
+    bl_ui_loop(NULL);
+}
+
+/*
+ * Load the file and start the text ui
+ */
+void
+bl_ui_load_file(char *fname) {
+    bl_layout_t *layout = bl_layout_load_file(fname);
+    bl_ui_loop(layout);
+}
+
+void
+bl_print_usage(char **argv) {
+    printf("\n");
+    printf("Usage: %s [filename]\n", argv[0]);
+    printf("\n");
+    printf("Interactive UI to configure the controller, if a layout filename is\n");
+    printf("supplied it is read first. Changes are not yet written to the controller.\n");
+    printf("See blusb -h for the command line options.\n");
+}
+
+int
+main(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "-h") == 0) {
+        bl_print_usage(argv);
+    } else if (argc == 2) {
+        BL_EXEC(bl_ui_load_file(argv[1]));
+    } else if (argc == 1) {
+        BL_EXEC(bl_ui());
+    } else {
+        bl_print_usage(argv);
+    }
+}
@@ -30,28 +30,97 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#include <sys/syslimits.h>
+#endif
 
 #include "blusb.h"
 #include "usb.h"
 #include "layout.h"
 #include "vkeycodes.h"
-#include "bl_ui.h"
+#include "bl_find.h"
+#include "bl_watch.h"
+#include "bl_proto.h"
+#include "bl_client.h"
+#include "bl_snapshot.h"
+#include "bl_txn.h"
+#include "bl_pack.h"
+#include "bl_index.h"
+#include "bl_convert.h"
+#include "bl_validate.h"
 
 /*
- * Start the interactive text ui to configure the keyboard layout, macros, etc.
+ * Number of matches printed by -find-layout
  */
-void
-bl_ui() {
-    bl_ui_loop(NULL);
+#define BL_FIND_CLI_MATCHES 20
+
+/*
+ * Name of the text ui executable started by -ui
+ */
+#define BL_UI_EXECUTABLE "blusb-ui"
+
+/*
+ * Connection to blusbd if BLUSB_SOCKET is set, otherwise the controller
+ * is opened directly
+ */
+static bl_client_t *_bl_client = NULL;
+
+#define BL_EXEC_CLIENT(stmt) {\
+    char *socket_path = getenv(BL_PROTO_SOCKET_ENV);\
+    if (socket_path != NULL) {\
+        if ((_bl_client = bl_client_connect(socket_path)) != NULL) {\
+            stmt;\
+            bl_client_close(_bl_client);\
+            _bl_client = NULL;\
+        }\
+    } else BL_EXEC(stmt)\
 }
 
 /*
- * Load the file and start the text ui
+ * Start the interactive text ui, it lives in its own executable so the
+ * command line tool does not have to load curses. It is looked up next to
+ * this executable first and then in the PATH.
  */
 void
-bl_ui_load_file(char *fname) {
-    bl_layout_t *layout = bl_layout_load_file(fname);
-    bl_ui_loop(layout);
+bl_ui(char **argv) {
+    char path[PATH_MAX];
+    char *ui_argv[] = { BL_UI_EXECUTABLE, argv[2], NULL };
+
+    char *slash = strrchr(argv[0], '/');
+    if (slash != NULL && (size_t) (slash - argv[0]) + sizeof("/" BL_UI_EXECUTABLE) <= sizeof(path)) {
+        snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - argv[0]), argv[0], BL_UI_EXECUTABLE);
+        execv(path, ui_argv);
+    }
+    execvp(BL_UI_EXECUTABLE, ui_argv);
+
+    fprintf(stderr, "Could not start %s: %s\n", BL_UI_EXECUTABLE, strerror(errno));
+    exit(1);
+}
+
+/*
+ * Read the layout from the daemon or the controller, buffer holds the key
+ * codes as returned by bl_usb_read_layout().
+ */
+static int
+bl_cli_read_layout(uint8_t **buffer, int *nlayers) {
+    if (_bl_client != NULL) {
+        bl_layout_t layout;
+        if (!bl_client_read_layout(_bl_client, &layout)) {
+            return FALSE;
+        }
+        *buffer = bl_layout_convert(&layout);
+        *nlayers = layout.nlayers;
+        return TRUE;
+    }
+
+    return bl_usb_read_layout(buffer, nlayers);
 }
 
 /*
@@ -61,9 +130,10 @@ void
 bl_read_layout() {
     unsigned char *buffer;
     int nlayers;
-    bl_usb_read_layout(&buffer, &nlayers);
-    bl_usb_raw_print_layout((uint16_t *)buffer, nlayers, stdout);
-    free(buffer);
+    if (bl_cli_read_layout(&buffer, &nlayers)) {
+        bl_usb_raw_print_layout((uint16_t *)buffer, nlayers, stdout);
+        free(buffer);
+    }
 }
 
 /*
@@ -73,14 +143,60 @@ void
 bl_print_layout() {
     unsigned char *buffer;
     int nlayers;
-    bl_usb_read_layout(&buffer, &nlayers);
-    bl_usb_print_layout(buffer, nlayers);
-    free(buffer);
+    if (bl_cli_read_layout(&buffer, &nlayers)) {
+        bl_usb_print_layout(buffer, nlayers);
+        free(buffer);
+    }
 }
 
-void
+/*
+ * Print the issues found by the validator, prefixed by the file name
+ */
+static void
+bl_cli_print_issues(char *fname, bl_validate_t *result) {
+    char msg[256];
+
+    for (int i=0; i<result->n; i++) {
+        bl_validate_describe(&result->issues[i], msg, sizeof(msg));
+        printf("%s: %s: %s\n", fname, result->issues[i].severity == BL_VALIDATE_ERROR ? "error" : "warning", msg);
+    }
+    if (result->nerrors + result->nwarnings > result->n) {
+        printf("%s: %d more issues\n", fname, result->nerrors + result->nwarnings - result->n);
+    }
+}
+
+/*
+ * Write the layout file to the controller, layouts with errors are not
+ * written. Macro keys are checked against the macros on the controller.
+ */
+/*
+ * Check the layout file and write it, returns FALSE if it was not written
+ */
+int
 bl_write_layout(char *fname) {
-    bl_layout_write_from_file(fname);
+    bl_layout_t *layout = bl_layout_load_file(fname);
+    if (layout == NULL) {
+        return FALSE;
+    }
+
+    static bl_ctrl_state_t state;
+    int has_macros = _bl_client != NULL ? bl_client_read_macros(_bl_client, &state.macros) :
+        (bl_usb_read_state(&state, BL_CTRL_MACROS, NULL, NULL) & BL_CTRL_MACROS) != 0;
+    bl_validate_t result;
+    int valid = bl_validate_layout(layout, has_macros ? &state.macros : NULL, &result);
+    bl_cli_print_issues(fname, &result);
+
+    int written = FALSE;
+    if (!valid) {
+        printf("Layout not written\n");
+    } else if (_bl_client != NULL ? !bl_client_write_layout(_bl_client, layout) : !bl_layout_write(layout)) {
+        printf("Could not write the layout\n");
+    } else {
+        written = TRUE;
+    }
+    bl_layout_destroy(layout);
+
+    return written;
 }
 
 /*
@@ -95,8 +211,13 @@ void
 bl_read_pwm() {
     uint8_t pwm_usb;
     uint8_t pwm_bt;
-    bl_usb_pwm_read(&pwm_usb, &pwm_bt);
-    printf("%d, %d\n", pwm_usb, pwm_bt);
+    int ok = _bl_client != NULL ? bl_client_read_pwm(_bl_client, &pwm_usb, &pwm_bt) :
+        bl_usb_pwm_read(&pwm_usb, &pwm_bt);
+    if (ok) {
+        printf("%d, %d\n", pwm_usb, pwm_bt);
+    } else {
+        printf("Could not read the pwm values\n");
+    }
 }
 
 void
@@ -104,7 +225,12 @@ bl_write_pwm(char *usb_val, char *bt_val) {
     int pwm_usb = atoi(usb_val);
     int pwm_bt = atoi(bt_val);
 
-    bl_usb_pwm_write(pwm_usb, pwm_bt);
+    if (pwm_usb < 0 || pwm_usb > 255 || pwm_bt < 0 || pwm_bt > 255) {
+        printf("Value out of range, no changes applied. Valid range is between 0 and 255 (inclusive).\n");
+    } else if (_bl_client != NULL ? !bl_client_write_pwm(_bl_client, pwm_usb, pwm_bt) :
+               !bl_usb_pwm_write(pwm_usb, pwm_bt)) {
+        printf("Could not write the pwm values\n");
+    }
 }
 
 /*
@@ -114,7 +240,14 @@ bl_write_pwm(char *usb_val, char *bt_val) {
  */
 void
 bl_read_debounce() {
-    printf("%d\n", bl_usb_debounce_read());
+    uint8_t debounce;
+    int ok = _bl_client != NULL ? bl_client_read_debounce(_bl_client, &debounce) :
+        bl_usb_debounce_read(&debounce);
+    if (ok) {
+        printf("%d\n", debounce);
+    } else {
+        printf("Could not read the debounce value\n");
+    }
 }
 
 /*
@@ -122,7 +255,14 @@ bl_read_debounce() {
  */
 void
 bl_write_debounce(char *debounce) {
-    bl_usb_debounce_write(atoi(debounce));
+    int value = atoi(debounce);
+
+    if (value < 1 || value > 255) {
+        printf("Value out of range, no changes applied. Valid range is between 1 and 255 (inclusive).\n");
+    } else if (_bl_client != NULL ? !bl_client_write_debounce(_bl_client, value) :
+               !bl_usb_debounce_write(value)) {
+        printf("Could not write the debounce value\n");
+    }
 }
 
 /*
@@ -130,8 +270,20 @@ bl_write_debounce(char *debounce) {
  */
 void
 bl_read_macros() {
-    bl_macro_t *macros = bl_usb_macro_read();
-    bl_usb_macro_print(macros);
+    bl_macro_t *macros;
+    if (_bl_client != NULL) {
+        macros = (bl_macro_t *) malloc(sizeof(bl_macro_t));
+        if (macros != NULL && !bl_client_read_macros(_bl_client, macros)) {
+            free(macros);
+            macros = NULL;
+        }
+    } else {
+        macros = bl_usb_macro_read();
+    }
+    if (macros != NULL) {
+        bl_usb_macro_print(macros);
+        free(macros);
+    }
 }
 
 void
@@ -145,10 +297,435 @@ bl_write_macros(char *fname) {
             }
             printf("\n");
         }
+        if (_bl_client != NULL ? !bl_client_write_macros(_bl_client, bm) : !bl_usb_macro_write(bm)) {
+            printf("Could not write the macros\n");
+        }
+        free(bm);
     } else {
         printf("Error reading macro file\n");
     }
-    bl_usb_macro_write(bm);
+}
+
+/*
+ * Read the complete state from the daemon or the controller, returns the
+ * BL_CTRL_* parts that were read.
+ */
+static int
+bl_cli_read_state(bl_ctrl_state_t *state) {
+    if (_bl_client == NULL) {
+        return bl_snapshot_take(state);
+    }
+
+    int parts = 0;
+    memset(state, 0, sizeof(bl_ctrl_state_t));
+    if (bl_client_read_layout(_bl_client, &state->layout)) {
+        parts |= BL_CTRL_LAYOUT;
+    }
+    if (bl_client_read_macros(_bl_client, &state->macros)) {
+        parts |= BL_CTRL_MACROS;
+    }
+    if (bl_client_read_pwm(_bl_client, &state->pwm_usb, &state->pwm_bt)) {
+        parts |= BL_CTRL_PWM;
+    }
+    if (bl_client_read_debounce(_bl_client, &state->debounce)) {
+        parts |= BL_CTRL_DEBOUNCE;
+    }
+    if (bl_client_read_version(_bl_client, &state->major, &state->minor)) {
+        parts |= BL_CTRL_VERSION;
+    }
+
+    return parts;
+}
+
+/*
+ * Write the parts of the state to the daemon, returns the parts that were
+ * written.
+ */
+static int
+bl_cli_write_state(bl_ctrl_state_t *state, int parts) {
+    int written = 0;
+    if ((parts & BL_CTRL_LAYOUT) && bl_client_write_layout(_bl_client, &state->layout)) {
+        written |= BL_CTRL_LAYOUT;
+    }
+    if ((parts & BL_CTRL_MACROS) && bl_client_write_macros(_bl_client, &state->macros)) {
+        written |= BL_CTRL_MACROS;
+    }
+    if ((parts & BL_CTRL_PWM) && bl_client_write_pwm(_bl_client, state->pwm_usb, state->pwm_bt)) {
+        written |= BL_CTRL_PWM;
+    }
+    if ((parts & BL_CTRL_DEBOUNCE) && bl_client_write_debounce(_bl_client, state->debounce)) {
+        written |= BL_CTRL_DEBOUNCE;
+    }
+
+    return written;
+}
+
+/*
+ * Save layout, macros, pwm and debounce values of the controller in one
+ * snapshot file. Macros that can't be read (never written) are left out.
+ */
+void
+bl_snapshot(char *fname) {
+    bl_ctrl_state_t state;
+    int parts = bl_cli_read_state(&state);
+
+    if (!(parts & BL_CTRL_LAYOUT)) {
+        printf("Could not read the layout, no snapshot written\n");
+        return;
+    }
+    for (int bit=BL_CTRL_MACROS; bit<BL_CTRL_ALL; bit <<= 1) {
+        if (!(parts & bit)) {
+            printf("Could not read the %s, left out of the snapshot\n", bl_snapshot_part_name(bit));
+        }
+    }
+    if (!bl_snapshot_save(&state, parts, fname)) {
+        printf("Could not write %s: %s\n", fname, strerror(errno));
+    }
+}
+
+/*
+ * Write a snapshot file to the controller. The controller is written in a
+ * transaction, if a part fails the previous settings are restored.
+ */
+void
+bl_restore(char *fname) {
+    static bl_txn_t txn;
+    bl_ctrl_state_t state;
+    char errmsg[256];
+    int parts;
+
+    if (!bl_snapshot_load(fname, &state, &parts, errmsg, sizeof(errmsg))) {
+        printf("%s\n", errmsg);
+        return;
+    }
+    parts &= BL_SNAPSHOT_WRITABLE;
+    if (_bl_client != NULL) {
+        int written = bl_cli_write_state(&state, parts);
+        for (int bit=1; bit<BL_CTRL_ALL; bit <<= 1) {
+            if ((parts & bit) && !(written & bit)) {
+                printf("Could not write the %s\n", bl_snapshot_part_name(bit));
+            }
+        }
+        return;
+    }
+
+    bl_txn_begin(&txn);
+    bl_txn_set_state(&txn, &state, parts);
+    if (bl_txn_commit(&txn, errmsg, sizeof(errmsg)) != BL_TXN_OK) {
+        printf("Restore failed: %s\n", errmsg);
+    }
+}
+
+/*
+ * Add a layout file, or the layout files in a directory tree, to the pack.
+ * Files in a directory are named by their path relative to the directory.
+ * Returns the number of files that could not be added.
+ */
+static int
+bl_pack_add_path(bl_pack_builder_t *builder, char *path, char *name) {
+    struct stat st;
+    char errmsg[256];
+    int errors = 0;
+
+    if (stat(path, &st) != 0) {
+        printf("%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            printf("%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            char child[PATH_MAX];
+            char child_name[PATH_MAX];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            if (name[0] == 0) {
+                snprintf(child_name, sizeof(child_name), "%s", entry->d_name);
+            } else {
+                snprintf(child_name, sizeof(child_name), "%s/%s", name, entry->d_name);
+            }
+            // a symlinked directory may lead back up the tree, skip it
+            struct stat lst;
+            if (lstat(child, &lst) == 0 && S_ISLNK(lst.st_mode) && stat(child, &lst) == 0 &&
+                S_ISDIR(lst.st_mode)) {
+                continue;
+            }
+            errors += bl_pack_add_path(builder, child, child_name);
+        }
+        closedir(dir);
+        return errors;
+    }
+
+    bl_layout_t *layout = bl_layout_parse_file(path, errmsg, sizeof(errmsg));
+    if (layout == NULL) {
+        printf("%s: %s", path, errmsg);
+        return 1;
+    }
+    if (!bl_pack_builder_add(builder, name, layout)) {
+        printf("%s: could not add %s to the pack, duplicate name?\n", path, name);
+        errors++;
+    }
+    bl_layout_destroy(layout);
+
+    return errors;
+}
+
+/*
+ * Build a layout pack from layout files and directories
+ */
+void
+bl_pack_create(char *fname, char **paths, int npaths) {
+    bl_pack_builder_t *builder = bl_pack_builder_create();
+    int errors = 0;
+
+    if (builder == NULL) {
+        printf("Out of memory\n");
+        return;
+    }
+    for (int i=0; i<npaths; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            errors += bl_pack_add_path(builder, paths[i], "");
+        } else {
+            char *base = strrchr(paths[i], '/');
+            errors += bl_pack_add_path(builder, paths[i], base != NULL ? base + 1 : paths[i]);
+        }
+    }
+    if (!bl_pack_builder_write(builder, fname)) {
+        printf("Could not write %s: %s\n", fname, strerror(errno));
+    } else {
+        printf("%u layouts, %u distinct layers of %u", builder->nlayouts, builder->nlayers,
+               builder->layers_total);
+        printf(errors > 0 ? ", %d files skipped\n" : "\n", errors);
+    }
+    bl_pack_builder_destroy(builder);
+}
+
+/*
+ * Print the names of the layouts in a pack
+ */
+void
+bl_pack_list(char *fname) {
+    char errmsg[256];
+    bl_pack_t *pack = bl_pack_open(fname, errmsg, sizeof(errmsg));
+
+    if (pack == NULL) {
+        printf("%s\n", errmsg);
+        return;
+    }
+    for (uint32_t i=0; i<pack->nlayouts; i++) {
+        printf("%s%s\n", BL_PACK_PREFIX, bl_pack_name(pack, i));
+    }
+    bl_pack_close(pack);
+}
+
+/*
+ * Index the layout files in a directory tree
+ */
+void
+bl_index_create(char *dname, char *fname) {
+    int nindexed, nskipped;
+
+    if (!bl_index_build(dname, fname, 0, &nindexed, &nskipped)) {
+        printf("Could not write %s: %s\n", fname, strerror(errno));
+    } else {
+        printf("%d layouts indexed", nindexed);
+        printf(nskipped > 0 ? ", %d files are not layouts\n" : "\n", nskipped);
+    }
+}
+
+/*
+ * Print the layouts in the index that match all predicates
+ */
+void
+bl_index_query(char *fname, char **preds, int npreds) {
+    static bl_index_query_t query;
+    char errmsg[256];
+    struct timespec start, end;
+
+    if (!bl_index_query_parse(&query, preds, npreds, errmsg, sizeof(errmsg))) {
+        printf("%s\n", errmsg);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bl_index_t *index = bl_index_open(fname, errmsg, sizeof(errmsg));
+    if (index == NULL) {
+        printf("%s\n", errmsg);
+        return;
+    }
+    int matches = 0;
+    for (uint32_t i=0; i<index->nlayouts; i++) {
+        if (bl_index_match(index, i, &query)) {
+            printf("%s/%s\n", bl_index_root(index), bl_index_path(index, i));
+            matches++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "%d of %u layouts match (%.1f ms)\n", matches, index->nlayouts,
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    bl_index_close(index);
+}
+
+/*
+ * Convert layout files and directory trees to the given format
+ */
+void
+bl_convert(char *format, char *outdir, char **paths, int npaths) {
+    struct timespec start, end;
+    int fmt = bl_convert_format(format);
+
+    if (fmt < 0) {
+        printf("Unknown format %s, valid formats are text, binary and json\n", format);
+        return;
+    }
+    bl_convert_t *convert = bl_convert_create(fmt, outdir);
+    if (convert == NULL) {
+        printf("Out of memory\n");
+        return;
+    }
+    int errors = 0;
+    for (int i=0; i<npaths; i++) {
+        if (!bl_convert_add(convert, paths[i])) {
+            printf("%s: %s\n", paths[i], strerror(errno));
+            errors++;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bl_convert_run(convert, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int converted = atomic_load(&convert->converted);
+    printf("%d files converted, %d errors, %.0f files/sec\n", converted, errors + atomic_load(&convert->errors),
+           seconds > 0 ? converted / seconds : 0.0);
+    bl_convert_destroy(convert);
+}
+
+/*
+ * Apply a bulk operation to a layout file and save it in the format its
+ * name ends in (.blay binary, .json JSON, otherwise text)
+ */
+void
+bl_edit_layout(char *fname, char **args, int nargs) {
+    char errmsg[256];
+    bl_validate_t result;
+
+    if (strncmp(fname, BL_PACK_PREFIX, strlen(BL_PACK_PREFIX)) == 0) {
+        printf("%s: layouts in a pack can't be edited\n", fname);
+        return;
+    }
+    bl_layout_t *layout = bl_layout_parse_file(fname, errmsg, sizeof(errmsg));
+    if (layout == NULL) {
+        printf("%s: error: %s", fname, errmsg);
+        return;
+    }
+    if (bl_layout_edit(layout, args, nargs, errmsg, sizeof(errmsg)) < 0) {
+        printf("%s: %s\n", fname, errmsg);
+        bl_layout_destroy(layout);
+        return;
+    }
+
+    size_t length = strlen(fname);
+    char *binary = bl_convert_extension(BL_CONVERT_BINARY);
+    char *json = bl_convert_extension(BL_CONVERT_JSON);
+    int ret;
+    if (length > strlen(binary) && strcmp(fname + length - strlen(binary), binary) == 0) {
+        ret = bl_layout_save_binary(layout, fname);
+    } else if (length > strlen(json) && strcmp(fname + length - strlen(json), json) == 0) {
+        ret = bl_layout_save_json(layout, fname);
+    } else {
+        ret = bl_layout_save(layout, fname);
+    }
+    if (ret != 0) {
+        printf("Could not write %s: %s\n", fname, strerror(errno));
+    } else {
+        // e.g. a swap can leave layer keys pointing to the wrong layer
+        bl_validate_layout(layout, NULL, &result);
+        bl_cli_print_issues(fname, &result);
+    }
+    bl_layout_destroy(layout);
+}
+
+/*
+ * Validate one layout file, returns 0 if valid, 1 if it has warnings and
+ * 2 if it has errors or can't be parsed
+ */
+static int
+bl_validate_file(char *fname) {
+    char errmsg[256];
+    bl_validate_t result;
+
+    bl_layout_t *layout = bl_layout_parse_file(fname, errmsg, sizeof(errmsg));
+    if (layout == NULL) {
+        printf("%s: error: %s", fname, errmsg);
+        return 2;
+    }
+    bl_validate_layout(layout, NULL, &result);
+    bl_layout_destroy(layout);
+    bl_cli_print_issues(fname, &result);
+
+    return result.nerrors > 0 ? 2 : result.nwarnings > 0 ? 1 : 0;
+}
+
+/*
+ * Validate layout files and all files in directory trees
+ */
+void
+bl_validate(char **paths, int npaths) {
+    struct timespec start, end;
+    int counts[3] = { 0, 0, 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<npaths; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) != 0) {
+            printf("%s: %s\n", paths[i], strerror(errno));
+            counts[2]++;
+        } else if (S_ISDIR(st.st_mode)) {
+            bl_find_t *find = bl_find_start(paths[i], 0);
+            bl_pool_wait(find->pool);
+            for (int n=0; n<find->n; n++) {
+                char fname[PATH_MAX];
+                snprintf(fname, sizeof(fname), "%s/%s", paths[i], find->paths[n]);
+                counts[bl_validate_file(fname)]++;
+            }
+            bl_find_destroy(find);
+        } else {
+            counts[bl_validate_file(paths[i])]++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int total = counts[0] + counts[1] + counts[2];
+    printf("%d layouts, %d with errors, %d with warnings, %.0f layouts/sec\n", total, counts[2], counts[1],
+           seconds > 0 ? total / seconds : 0.0);
+}
+
+/*
+ * Search the directory tree for layout files matching the (fuzzy) query and
+ * print the best matches, best match first.
+ */
+void
+bl_find_layout(char *dname, char *query) {
+    bl_find_t *find = bl_find_start(dname, 0);
+    bl_find_rank_t rank;
+
+    bl_find_rank_init(&rank);
+    bl_find_wait(find);
+    bl_find_rank_update(find, &rank, query);
+
+    for (int i=0; i<rank.n && i<BL_FIND_CLI_MATCHES; i++) {
+        printf("%s/%s\n", dname, rank.top[i].path);
+    }
+    bl_find_destroy(find);
 }
 
 /*
@@ -158,9 +735,14 @@ void
 bl_print_version() {
     int major, minor;
 
-    bl_usb_read_version(&major, &minor);
-    // TODO print software version
-    printf("Firmware Version: %d.%d\n", major, minor);
+    printf("Software Version: %s\n", BL_SOFTWARE_VERSION);
+    int ok = _bl_client != NULL ? bl_client_read_version(_bl_client, &major, &minor) :
+        bl_usb_read_version(&major, &minor);
+    if (ok) {
+        printf("Firmware Version: %d.%d\n", major, minor);
+    } else {
+        printf("Could not read the firmware version\n");
+    }
 }
 
 void
@@ -185,71 +767,169 @@ bl_print_usage(char **argv) {
     printf("  -write-macros [filename]         Write the macros to the controller.\n");
     printf("  -print-layout                    Pretty print the layout.\n");
     printf("  -read-layout                     Print the layout in parseable format\n");
-    printf("  -write-layout [filename]         Write the layout to the controller.\n");
+    printf("  -write-layout [filename]         Write the layout to the controller, layouts\n");
+    printf("                                   that don't pass -validate are refused.\n");
+    printf("  -find-layout [dir query]         Search dir recursively for layout files\n");
+    printf("                                   matching the (fuzzy) query.\n");
+    printf("  -watch [filename]                Write the layout to the controller every time\n");
+    printf("                                   the file is saved and differs from the\n");
+    printf("                                   controller's layout.\n");
+    printf("  -snapshot [filename]             Save layout, macros, pwm and debounce values\n");
+    printf("                                   in one binary file.\n");
+    printf("  -restore [filename]              Write a snapshot to the controller.\n");
+    printf("  -pack [pack file dir|file ...]   Store the layouts in one pack file, layers that\n");
+    printf("                                   occur in several layouts are stored once.\n");
+    printf("  -pack-list [pack file]           Print the names of the layouts in a pack.\n");
+    printf("  -index [dir index]               Index the layout files below dir for -query.\n");
+    printf("  -query [index predicate ...]     Print the layouts in the index that match all\n");
+    printf("                                   predicates: layers>N, code:CODE=N, uses:CODE,\n");
+    printf("                                   macro:N, toggle:N, momentary:N, at:L.R.C=CODE,\n");
+    printf("                                   hash:HEX (=, !=, <, >, <= and >= compare).\n");
+    printf("  -convert [format outdir path ...]\n");
+    printf("                                   Convert layout files and directories to text,\n");
+    printf("                                   binary or json, the files are written to outdir.\n");
+    printf("  -validate [file|dir ...]         Check layouts for unknown key codes, layer keys\n");
+    printf("                                   to missing layers and unreachable layers.\n");
+    printf("  -edit [file operation ...]       Change a layout file with one bulk operation:\n");
+    printf("                                   copy FROM TO, swap A B, clear LAYER,\n");
+    printf("                                   fill LAYER CODE, block L.R.C ROWS COLS L.R.C,\n");
+    printf("                                   remap CODE CODE [LAYER] (layers count from 1).\n");
     printf("  -v                               Print the version.\n");
     printf("  -h                               This help text.\n");
+    printf("\n");
+    printf("If %s is set to the socket of blusbd, the read and write options\n", BL_PROTO_SOCKET_ENV);
+    printf("go through the daemon instead of opening the controller.\n");
+    printf("Layouts in the pack named by %s can be used as %s<name> wherever\n", BL_PACK_ENV, BL_PACK_PREFIX);
+    printf("a layout file is expected.\n");
 }
 
-/*
- * Open a controller connection and execute the statement
- */
- #define BL_EXEC(stmt) {\
-    if (bl_usb_openctrl()) {\
-        stmt;\
-        bl_usb_closectrl();\
-    }\
-}\
-
 int
 main(int argc, char **argv) {
+    int status = 0;
+
     if (argc >= 2) {
         if (strcmp(argv[1], "-read-layout") == 0) {
-            BL_EXEC(bl_read_layout());
+            BL_EXEC_CLIENT(bl_read_layout());
         } else if (strcmp(argv[1], "-print-layout") == 0) {
-            BL_EXEC(bl_print_layout());
+            BL_EXEC_CLIENT(bl_print_layout());
         } else if (strcmp(argv[1], "-write-layout") == 0) {
             if (argc == 3) {
-                BL_EXEC(bl_write_layout(argv[2]));
+                // a failed write is the exit status, e.g. for scripts
+                status = 1;
+                BL_EXEC_CLIENT(status = bl_write_layout(argv[2]) ? 0 : 1);
+            } else {
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-watch") == 0) {
+            if (argc == 3) {
+                BL_EXEC(bl_watch_layout(argv[2], BL_WATCH_DEBOUNCE_MS));
             } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-find-layout") == 0) {
+            if (argc == 4) {
+                bl_find_layout(argv[2], argv[3]);
+            } else {
+                printf("missing parameter\n");
                 bl_print_usage(argv);
             }
         } else if (strcmp(argv[1], "-read-pwm") == 0) {
-            BL_EXEC(bl_read_pwm());
+            BL_EXEC_CLIENT(bl_read_pwm());
         } else if (strcmp(argv[1], "-write-pwm") == 0) {
             if (argc == 4) {
-                BL_EXEC(bl_write_pwm(argv[2], argv[3]));
+                BL_EXEC_CLIENT(bl_write_pwm(argv[2], argv[3]));
             } else {
                 printf("missing parameter\n");
                 bl_print_usage(argv);
             }
         } else if (strcmp(argv[1], "-read-debounce") == 0) {
-            BL_EXEC(bl_read_debounce());
+            BL_EXEC_CLIENT(bl_read_debounce());
         } else if (strcmp(argv[1], "-write-debounce") == 0) {
             if (argc == 3) {
-                BL_EXEC(bl_write_debounce(argv[2]));
+                BL_EXEC_CLIENT(bl_write_debounce(argv[2]));
             } else {
                 printf("missing parameter\n");
                 bl_print_usage(argv);
             }
         } else if (strcmp(argv[1], "-read-macros") == 0) {
-            BL_EXEC(bl_read_macros());
+            BL_EXEC_CLIENT(bl_read_macros());
         } else if (strcmp(argv[1], "-write-macros") == 0) {
             if (argc == 3) {
-                BL_EXEC(bl_write_macros(argv[2]));
+                BL_EXEC_CLIENT(bl_write_macros(argv[2]));
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-snapshot") == 0) {
+            if (argc == 3) {
+                BL_EXEC_CLIENT(bl_snapshot(argv[2]));
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-restore") == 0) {
+            if (argc == 3) {
+                BL_EXEC_CLIENT(bl_restore(argv[2]));
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-pack") == 0) {
+            if (argc >= 4) {
+                bl_pack_create(argv[2], &argv[3], argc - 3);
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-pack-list") == 0) {
+            if (argc == 3) {
+                bl_pack_list(argv[2]);
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-index") == 0) {
+            if (argc == 4) {
+                bl_index_create(argv[2], argv[3]);
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-query") == 0) {
+            if (argc >= 3) {
+                bl_index_query(argv[2], &argv[3], argc - 3);
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-convert") == 0) {
+            if (argc >= 5) {
+                bl_convert(argv[2], argv[3], &argv[4], argc - 4);
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-edit") == 0) {
+            if (argc >= 4) {
+                bl_edit_layout(argv[2], &argv[3], argc - 3);
+            } else {
+                printf("missing parameter\n");
+                bl_print_usage(argv);
+            }
+        } else if (strcmp(argv[1], "-validate") == 0) {
+            if (argc >= 3) {
+                bl_validate(&argv[2], argc - 2);
             } else {
                 printf("missing parameter\n");
                 bl_print_usage(argv);
             }
         } else if (strcmp(argv[1], "-v") == 0) {
-            BL_EXEC(bl_print_version());
+            BL_EXEC_CLIENT(bl_print_version());
         } else if (strcmp(argv[1], "-h") == 0) {
             bl_print_usage(argv);
         } else if (strcmp(argv[1], "-ui") == 0) {
-            if (argc == 3) {
-                BL_EXEC(bl_ui_load_file(argv[2]));
-            } else {
-                BL_EXEC(bl_ui());
-            }
+            bl_ui(argv);
         } else {
             printf("unknown option\n");
             bl_print_usage(argv);
@@ -257,5 +937,7 @@ main(int argc, char **argv) {
     } else {
         bl_print_usage(argv);
     }
+
+    return status;
 }
 
@@ -31,9 +31,10 @@
 #define __MBLUSB_H_ 1
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdint.h>
 
-#include "bl_tui.h"
+#include "bl_err.h"
 
 #define BL_SOFTWARE_VERSION "1.0"
 
@@ -53,7 +54,7 @@
 
 
 #define errmsg_and_abort(...) do { \
-    bl_tui_exit(); \
+    bl_err_cleanup(); \
     printf ("@ %s (%d): ", __FILE__, __LINE__); \
     printf (__VA_ARGS__); \
     printf("\n"); \
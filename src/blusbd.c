@@ -0,0 +1,80 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "blusb.h"
+#include "usb.h"
+#include "bl_proto.h"
+#include "bl_daemon.h"
+
+void
+bl_print_usage(char **argv) {
+    printf("\n");
+    printf("Usage: %s [-s socket]\n", argv[0]);
+    printf("\n");
+    printf("Keep the controller open and serve blusb clients on a Unix domain socket.\n");
+    printf("The socket defaults to $%s, $XDG_RUNTIME_DIR/%s or %s, set %s\n",
+           BL_PROTO_SOCKET_ENV, BL_PROTO_SOCKET_NAME, BL_PROTO_SOCKET_DEFAULT, BL_PROTO_SOCKET_ENV);
+    printf("for blusb to the same path to use the daemon. Only the user running the\n");
+    printf("daemon can connect.\n");
+}
+
+int
+main(int argc, char **argv) {
+    char runtime_path[PATH_MAX];
+    char *path = getenv(BL_PROTO_SOCKET_ENV);
+    char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (path == NULL && runtime != NULL) {
+        snprintf(runtime_path, sizeof(runtime_path), "%s/%s", runtime, BL_PROTO_SOCKET_NAME);
+        path = runtime_path;
+    } else if (path == NULL) {
+        path = BL_PROTO_SOCKET_DEFAULT;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        path = argv[2];
+    } else if (argc != 1) {
+        bl_print_usage(argv);
+        return 1;
+    }
+
+    int ret = FALSE;
+    if (bl_usb_openctrl()) {
+        printf("Serving the controller on %s\n", path);
+        fflush(stdout);
+        ret = bl_daemon_run(path);
+        bl_usb_closectrl();
+    }
+
+    return ret ? 0 : 1;
+}
@@ -31,10 +31,14 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <errno.h>
 #include <libusb.h>
 #include "blusb.h"
 #include "layout.h"
 #include "usb.h"
+#include "bl_kernel.h"
+#include "bl_pack.h"
+#include "bl_validate.h"
 
 /**
  * Layout is a type for an object that represents the keyboard layout in
@@ -55,6 +59,9 @@
 uint8_t *
 bl_layout_convert(bl_layout_t *layout) {
     uint8_t *data = (uint8_t *) malloc(sizeof(uint16_t) * (1 + layout->nlayers * NUMCOLS * NUMROWS));
+    if (data == NULL) {
+        return NULL;
+    }
     ((uint16_t *)data)[0] = layout->nlayers;
     for (int layer=0; layer<layout->nlayers; layer++) {
         for (int row=0; row<NUMROWS; row++) {
@@ -107,18 +114,278 @@ bl_layout_init_layout(bl_layout_t *layout) {
     }
 }
 
+/*
+ * Bulk operations on the layers in use. Layers are numbered from 0, a
+ * layer is one block of NUMKEYS codes, so copying, swapping and filling a
+ * layer are single memory operations.
+ */
+static int
+bl_layout_has_layer(bl_layout_t *layout, int layer) {
+    return layer >= 0 && layer < layout->nlayers;
+}
+
+/**
+ * Copy the keys of layer from to layer to.
+ *
+ * returns FALSE if a layer is not in use.
+ */
+int
+bl_layout_copy_layer(bl_layout_t *layout, int from, int to) {
+    if (!bl_layout_has_layer(layout, from) || !bl_layout_has_layer(layout, to)) {
+        return FALSE;
+    }
+    memmove(layout->matrix[to], layout->matrix[from], sizeof(layout->matrix[0]));
+
+    return TRUE;
+}
+
+/**
+ * Swap the keys of layers a and b. Layer keys are not changed, a key to
+ * layer a still leads to the layer at position a.
+ *
+ * returns FALSE if a layer is not in use.
+ */
+int
+bl_layout_swap_layers(bl_layout_t *layout, int a, int b) {
+    uint16_t tmp[NUMROWS][NUMCOLS];
+
+    if (!bl_layout_has_layer(layout, a) || !bl_layout_has_layer(layout, b)) {
+        return FALSE;
+    }
+    memcpy(tmp, layout->matrix[a], sizeof(tmp));
+    memmove(layout->matrix[a], layout->matrix[b], sizeof(tmp));
+    memcpy(layout->matrix[b], tmp, sizeof(tmp));
+
+    return TRUE;
+}
+
+/**
+ * Set every key of the layer to code, 0 (KB_NONE) clears the layer.
+ *
+ * returns FALSE if the layer is not in use.
+ */
+int
+bl_layout_fill_layer(bl_layout_t *layout, int layer, uint16_t code) {
+    if (!bl_layout_has_layer(layout, layer)) {
+        return FALSE;
+    }
+    if (code == KB_NONE) {
+        memset(layout->matrix[layer], 0, sizeof(layout->matrix[0]));
+    } else {
+        uint16_t *codes = &layout->matrix[layer][0][0];
+        for (int i=0; i<NUMKEYS; i++) {
+            codes[i] = code;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Copy the block of nrows x ncols keys at row, col of layer from to
+ * to_row, to_col of layer to. The blocks may overlap.
+ *
+ * returns FALSE if a layer is not in use or a block does not fit.
+ */
+int
+bl_layout_copy_block(bl_layout_t *layout, int from, int row, int col, int nrows, int ncols,
+                     int to, int to_row, int to_col) {
+    uint16_t tmp[NUMROWS][NUMCOLS];
+
+    if (!bl_layout_has_layer(layout, from) || !bl_layout_has_layer(layout, to) || nrows < 1 || ncols < 1 ||
+        row < 0 || col < 0 || row + nrows > NUMROWS || col + ncols > NUMCOLS ||
+        to_row < 0 || to_col < 0 || to_row + nrows > NUMROWS || to_col + ncols > NUMCOLS) {
+        return FALSE;
+    }
+    // the columns of a row are contiguous, copy a row at a time
+    for (int r=0; r<nrows; r++) {
+        memcpy(tmp[r], &layout->matrix[from][row + r][col], ncols * sizeof(uint16_t));
+    }
+    for (int r=0; r<nrows; r++) {
+        memcpy(&layout->matrix[to][to_row + r][to_col], tmp[r], ncols * sizeof(uint16_t));
+    }
+
+    return TRUE;
+}
+
+/**
+ * Replace every occurrence of code from by code to in the given layers.
+ *
+ * @param layers Bit mask of the layers, layers not in use are skipped
+ * @param changed Set to the bit mask of the layers that changed, may be NULL
+ * @return The number of keys changed
+ */
+int
+bl_layout_remap(bl_layout_t *layout, int layers, uint16_t from, uint16_t to, int *changed) {
+    int count = 0;
+
+    if (changed != NULL) {
+        *changed = 0;
+    }
+    for (int layer=0; layer<layout->nlayers; layer++) {
+        uint16_t *codes = &layout->matrix[layer][0][0];
+        if (!(layers & (1 << layer)) || bl_kernel_count_range(codes, NUMKEYS, from, from) == 0) {
+            continue;
+        }
+        for (int i=0; i<NUMKEYS; i++) {
+            count += codes[i] == from;
+            codes[i] = codes[i] == from ? to : codes[i];
+        }
+        if (changed != NULL) {
+            *changed |= 1 << layer;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Parse a layer number counted from 1, returns it counted from 0 or -1
+ */
+static int
+bl_layout_edit_layer(bl_layout_t *layout, char *s) {
+    char *end;
+    long layer = strtol(s, &end, 10);
+    return end != s && *end == 0 && layer >= 1 && layer <= layout->nlayers ? layer - 1 : -1;
+}
+
+static int
+bl_layout_edit_code(char *s, uint16_t *code) {
+    char *end;
+    long value = strtol(s, &end, 0);
+    if (end == s || *end != 0 || value < 0 || value > 0xffff) {
+        return FALSE;
+    }
+    *code = value;
+
+    return TRUE;
+}
+
+/*
+ * Parse a position L.R.C, the layer counted from 1
+ */
+static int
+bl_layout_edit_pos(bl_layout_t *layout, char *s, int *layer, int *row, int *col) {
+    int consumed = 0;
+    if (sscanf(s, "%d.%d.%d%n", layer, row, col, &consumed) != 3 || s[consumed] != 0 ||
+        *layer < 1 || *layer > layout->nlayers) {
+        return FALSE;
+    }
+    (*layer)--;
+
+    return TRUE;
+}
+
+/**
+ * Apply one bulk operation given as words, layers are counted from 1 and
+ * rows and columns from 0:
+ *
+ *   copy FROM TO, swap A B, clear LAYER, fill LAYER CODE,
+ *   block L.R.C ROWS COLS L.R.C, remap CODE CODE [LAYER]
+ *
+ * @param args The operation and its arguments
+ * @param nargs Number of words
+ * @param errmsg Buffer for the error message
+ * @param errlen Size of the buffer
+ * @return The bit mask of the layers that may have changed, or -1 if the
+ *         operation is not valid
+ */
+int
+bl_layout_edit(bl_layout_t *layout, char **args, int nargs, char *errmsg, int errlen) {
+    char *op = nargs > 0 ? args[0] : "";
+    int a, b;
+    uint16_t code, to;
+
+    if (strcmp(op, "copy") == 0 && nargs == 3) {
+        a = bl_layout_edit_layer(layout, args[1]);
+        b = bl_layout_edit_layer(layout, args[2]);
+        if (a >= 0 && b >= 0 && bl_layout_copy_layer(layout, a, b)) {
+            return 1 << b;
+        }
+    } else if (strcmp(op, "swap") == 0 && nargs == 3) {
+        a = bl_layout_edit_layer(layout, args[1]);
+        b = bl_layout_edit_layer(layout, args[2]);
+        if (a >= 0 && b >= 0 && bl_layout_swap_layers(layout, a, b)) {
+            return (1 << a) | (1 << b);
+        }
+    } else if ((strcmp(op, "clear") == 0 && nargs == 2) || (strcmp(op, "fill") == 0 && nargs == 3)) {
+        a = bl_layout_edit_layer(layout, args[1]);
+        code = KB_NONE;
+        if (a >= 0 && (nargs == 2 || bl_layout_edit_code(args[2], &code)) &&
+            bl_layout_fill_layer(layout, a, code)) {
+            return 1 << a;
+        }
+    } else if (strcmp(op, "block") == 0 && nargs == 5) {
+        int row, col, to_row, to_col;
+        char *end1, *end2;
+        int nrows = strtol(args[2], &end1, 10);
+        int ncols = strtol(args[3], &end2, 10);
+        int ok = bl_layout_edit_pos(layout, args[1], &a, &row, &col) &&
+            bl_layout_edit_pos(layout, args[4], &b, &to_row, &to_col) &&
+            end1 != args[2] && *end1 == 0 && end2 != args[3] && *end2 == 0;
+        if (ok && bl_layout_copy_block(layout, a, row, col, nrows, ncols, b, to_row, to_col)) {
+            return 1 << b;
+        }
+    } else if (strcmp(op, "remap") == 0 && (nargs == 3 || nargs == 4)) {
+        int layers = (1 << NUMLAYERS_MAX) - 1;
+        if (nargs == 4) {
+            a = bl_layout_edit_layer(layout, args[3]);
+            layers = a >= 0 ? 1 << a : 0;
+        }
+        if (layers != 0 && bl_layout_edit_code(args[1], &code) && bl_layout_edit_code(args[2], &to)) {
+            int changed;
+            bl_layout_remap(layout, layers, code, to, &changed);
+            return changed;
+        }
+    } else {
+        snprintf(errmsg, errlen, "unknown operation or wrong number of arguments: %s", op);
+        return -1;
+    }
+    snprintf(errmsg, errlen, "invalid arguments for %s, the layout has %d layers", op, layout->nlayers);
+
+    return -1;
+}
+
 /**
  * Parse the file and return a layout struct. The memory for the layout is allocated and
- * must be freed after use.
+ * must be freed after use. Nothing is printed, if the file can't be parsed the
+ * reason is stored in errmsg. This function is safe to call from any thread.
+ * A name pack:<name> is loaded from the layout pack in $BLUSB_PACK, see
+ * bl_pack.h. Binary and JSON layouts are recognized and parsed too.
+ *
+ * @param fname Name of the file
+ * @param errmsg Buffer for the error message
+ * @param errlen Size of the buffer
+ *
+ * @return the layout or NULL if the file could not be parsed.
  */
 bl_layout_t*
-bl_layout_load_file(char *fname) {
+bl_layout_parse_file(char *fname, char *errmsg, int errlen) {
+    if (strncmp(fname, BL_PACK_PREFIX, strlen(BL_PACK_PREFIX)) == 0) {
+        return bl_pack_load_layout(fname + strlen(BL_PACK_PREFIX), errmsg, errlen);
+    }
+
     FILE *f = fopen(fname, "r");
     if (f == NULL) {
-        bl_tui_err(FALSE, "Could not open file %s\n", fname);
+        snprintf(errmsg, errlen, "Could not open file %s\n", fname);
         return NULL;
     }
 
+    /*
+     * Binary and JSON layouts are recognized by their first character
+     */
+    int first;
+    while ((first = fgetc(f)) == ' ' || first == '\t' || first == '\n' || first == '\r')
+        ;
+    if (first == BL_LAYOUT_BINARY_MAGIC[0]) {
+        fclose(f);
+        return bl_layout_parse_binary(fname, errmsg, errlen);
+    } else if (first == '{') {
+        fclose(f);
+        return bl_layout_parse_json(fname, errmsg, errlen);
+    }
+    rewind(f);
+
     /*
      * Format to be parsed is:
      *
@@ -145,7 +412,8 @@ bl_layout_load_file(char *fname) {
         if (state == BL_STATE_DIGIT) {
             if (isdigit(ch)) {
                 if (strlen(parse_buffer) >= sizeof(parse_buffer) -1) {
-                    printf("Error: ran out of buffer space for parsing, comma missing? Line %d, key %d, (byte position=%ld)\n", layer+1, col+1, ftell(f));
+                    snprintf(errmsg, errlen, "Error: ran out of buffer space for parsing, comma missing? Line %d, key %d, (byte position=%ld)\n", layer+1, col+1, ftell(f));
+                    fclose(f);
                     free(layout);
                     return NULL;
                 } else {
@@ -169,20 +437,35 @@ bl_layout_load_file(char *fname) {
                 parse_buffer[0] = 0;
                 state = BL_STATE_WHITESPACE;
                 if (col < NUMCOLS-1) {
-                    printf("Invalid number of keys in row, actually %d, expected %d at line %d, key %d (byte position=%ld)\n", col+1, NUMCOLS, layer+1, col+1, ftell(f));
+                    snprintf(errmsg, errlen, "Invalid number of keys in row, actually %d, expected %d at line %d, key %d (byte position=%ld)\n", col+1, NUMCOLS, layer+1, col+1, ftell(f));
+                    fclose(f);
                     free(layout);
                     return NULL;
                 }
                 if (row < NUMROWS-1) {
-                    printf("Invalid number of rows in layer, actually %d, expected %d at line %d, key %d (byte position=%ld)\n", row+1, NUMROWS, layer+1, col+1, ftell(f));
+                    snprintf(errmsg, errlen, "Invalid number of rows in layer, actually %d, expected %d at line %d, key %d (byte position=%ld)\n", row+1, NUMROWS, layer+1, col+1, ftell(f));
+                    fclose(f);
                     free(layout);
                     return NULL;
                 }
                 layer++;
                 col = 0;
                 row = 0;
+                if (layer == NUMLAYERS_MAX) {
+                    /* anything but trailing whitespace means too many layers */
+                    while ((ch = fgetc(f)) == '\n' || ch == '\r' || ch == ' ' || ch == '\t')
+                        ;
+                    if (!feof(f)) {
+                        snprintf(errmsg, errlen, "Too many layers, at most %d layers are supported\n", NUMLAYERS_MAX);
+                        fclose(f);
+                        free(layout);
+                        return NULL;
+                    }
+                    break;
+                }
             } else {
-                printf("Unexpected character encountered while parsing digits: %c, at line %d, key %d (position=%ld)\n", ch, layer+1, col+1, ftell(f));
+                snprintf(errmsg, errlen, "Unexpected character encountered while parsing digits: %c, at line %d, key %d (position=%ld)\n", ch, layer+1, col+1, ftell(f));
+                fclose(f);
                 free(layout);
                 return NULL;
             }
@@ -195,7 +478,8 @@ bl_layout_load_file(char *fname) {
                 state = BL_STATE_DIGIT;
                 // don't read the next character, we need the current character to be processed as a digit in the BL_STATE_DIGIT state.
             } else {
-                printf("Unexpected character encountered while skipping whitespace: %c, at line %d, key %d (position=%ld)\n", ch, layer, col+row*col, ftell(f));
+                snprintf(errmsg, errlen, "Unexpected character encountered while skipping whitespace: %c, at line %d, key %d (position=%ld)\n", ch, layer, col+row*col, ftell(f));
+                fclose(f);
                 free(layout);
                 return NULL;
             }
@@ -210,7 +494,7 @@ bl_layout_load_file(char *fname) {
     layout->nlayers = layer;
 
     if ((row > 0 && row < NUMROWS-1) || (col > 0 && col < NUMCOLS-1)) {
-        printf("Invalid layout file, not enough key entries for layer %d, actually %d, expected %d at line=%d\n",
+        snprintf(errmsg, errlen, "Invalid layout file, not enough key entries for layer %d, actually %d, expected %d at line=%d\n",
                layer+1, 1+col+row*col, NUMROWS*NUMCOLS, layer+1);
         free(layout);
         fclose(f);
@@ -221,6 +505,22 @@ bl_layout_load_file(char *fname) {
     }
 }
 
+/**
+ * Parse the file and return a layout struct. The memory for the layout is allocated and
+ * must be freed after use. Errors are reported to the user.
+ */
+bl_layout_t*
+bl_layout_load_file(char *fname) {
+    char errmsg[256];
+
+    bl_layout_t *layout = bl_layout_parse_file(fname, errmsg, sizeof(errmsg));
+    if (layout == NULL) {
+        bl_err(FALSE, "%s", errmsg);
+    }
+
+    return layout;
+}
+
 /**
  * Pretty print the layout file
  */
@@ -251,11 +551,68 @@ bl_layout_print(bl_layout_t *layout) {
 int
 bl_layout_write(bl_layout_t *layout) {
     uint8_t *data = bl_layout_convert(layout);
+    if (data == NULL) {
+        return FALSE;
+    }
     int ret = bl_usb_write_layout(data, layout->nlayers);
     free(data);
     return ret;
 }
 
+/**
+ * Check that the layout can be written to the controller, see
+ * bl_validate_layout(). Warnings are ignored.
+ *
+ * returns TRUE if the layout is valid, otherwise FALSE and the first error
+ * is stored in errmsg.
+ */
+int
+bl_layout_check(bl_layout_t *layout, char *errmsg, int errlen) {
+    bl_validate_t result;
+
+    if (bl_validate_layout(layout, NULL, &result)) {
+        return TRUE;
+    }
+    for (int i=0; i<result.n; i++) {
+        if (result.issues[i].severity == BL_VALIDATE_ERROR) {
+            bl_validate_describe(&result.issues[i], errmsg, errlen);
+            break;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Read the layout back from the controller and compare it with layout.
+ *
+ * returns TRUE if the controller has the same layout, FALSE if not or if
+ * it could not be read.
+ */
+int
+bl_layout_verify(bl_layout_t *layout) {
+    bl_ctrl_state_t *state = (bl_ctrl_state_t *) malloc(sizeof(bl_ctrl_state_t));
+    if (state == NULL) {
+        return FALSE;
+    }
+    int ret = (bl_usb_read_state(state, BL_CTRL_LAYOUT, NULL, NULL) & BL_CTRL_LAYOUT) &&
+        bl_layout_equal(layout, &state->layout);
+    free(state);
+
+    return ret;
+}
+
+/**
+ * Compare the number of layers and the keys of the layers in use.
+ *
+ * returns TRUE if the layouts are equal.
+ */
+int
+bl_layout_equal(bl_layout_t *a, bl_layout_t *b) {
+    return a->nlayers == b->nlayers &&
+        bl_kernel_equal(&a->matrix[0][0][0], &b->matrix[0][0][0], a->nlayers * NUMKEYS);
+}
+
 /**
  * Write the layout in the given file to the controller.
  *
@@ -264,22 +621,294 @@ bl_layout_write(bl_layout_t *layout) {
 int
 bl_layout_write_from_file(char *fname) {
     bl_layout_t *layout = bl_layout_load_file(fname);
+    if (layout == NULL) {
+        return FALSE;
+    }
     int ret = bl_layout_write(layout);
     free(layout);
 
     return ret;
 }
 
+/**
+ * Save the layout in the text format.
+ *
+ * @return 0 if successful, -1 if not and errno is set
+ */
 int
 bl_layout_save(bl_layout_t *layout, char *fname) {
+    uint8_t *buffer = bl_layout_convert(layout);
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
     FILE *f = fopen(fname, "w");
     if (f == NULL) {
+        free(buffer);
         return -1;
     }
-    uint8_t *buffer = bl_layout_convert(layout);
+    errno = 0;
     bl_usb_raw_print_layout((uint16_t *)buffer, layout->nlayers, f);
+    free(buffer);
+    int ret = ferror(f) ? -1 : 0;
+    int saved_errno = errno != 0 ? errno : EIO;
+    if (fclose(f) != 0) {
+        ret = -1;
+    } else if (ret != 0) {
+        errno = saved_errno;
+    }
+
+    return ret;
+}
+
+/*
+ * Read a whole file, returns the data (0 terminated) or NULL.
+ */
+static char *
+bl_layout_read_all(char *fname, size_t *length, char *errmsg, int errlen) {
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL) {
+        snprintf(errmsg, errlen, "Could not open file %s\n", fname);
+        return NULL;
+    }
+    size_t size = 4096;
+    size_t n = 0;
+    char *data = (char *) malloc(size);
+    while (data != NULL) {
+        n += fread(data + n, 1, size - n - 1, f);
+        if (n < size - 1 || size >= BL_LAYOUT_FILE_MAX) {
+            break;
+        }
+        size *= 2;
+        char *grown = (char *) realloc(data, size);
+        if (grown == NULL) {
+            free(data);
+        }
+        data = grown;
+    }
     fclose(f);
+    if (data == NULL) {
+        snprintf(errmsg, errlen, "Out of memory reading %s\n", fname);
+        return NULL;
+    }
+    data[n] = 0;
+    *length = n;
+
+    return data;
+}
+
+/**
+ * Parse a binary layout file: the magic BL_LAYOUT_BINARY_MAGIC, the format
+ * version, the number of layers, 2 bytes reserved and the key codes of the
+ * layers as 16 bit little endian numbers, layer by layer and row by row.
+ *
+ * @return the layout or NULL and the reason is stored in errmsg.
+ */
+bl_layout_t *
+bl_layout_parse_binary(char *fname, char *errmsg, int errlen) {
+    size_t length;
+    uint8_t *data = (uint8_t *) bl_layout_read_all(fname, &length, errmsg, errlen);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    int nlayers = length >= 8 ? data[5] : 0;
+    if (length < 8 || memcmp(data, BL_LAYOUT_BINARY_MAGIC, 4) != 0 || data[4] != BL_LAYOUT_BINARY_VERSION) {
+        snprintf(errmsg, errlen, "Not a binary layout file: %s\n", fname);
+        free(data);
+        return NULL;
+    }
+    if (nlayers < NUMLAYERS_MIN || nlayers > NUMLAYERS_MAX || length != 8 + 2 * nlayers * NUMKEYS) {
+        snprintf(errmsg, errlen, "Invalid binary layout file %s, %d layers in %zu bytes\n",
+                 fname, nlayers, length);
+        free(data);
+        return NULL;
+    }
+
+    bl_layout_t *layout = bl_layout_create(nlayers);
+    uint16_t *codes = &layout->matrix[0][0][0];
+    for (int i=0; i<nlayers * NUMKEYS; i++) {
+        codes[i] = data[8 + 2 * i] | (data[8 + 2 * i + 1] << 8);
+    }
+    free(data);
 
-    return 0;
+    return layout;
 }
 
+/*
+ * Parse a JSON array of numbers or arrays, depth is the number of nested
+ * arrays expected, the numbers are stored in codes. An array at depth d
+ * must have exactly shape[d] elements, unless shape[d] is negative.
+ * Returns a pointer after the array or NULL.
+ */
+static char *
+bl_layout_json_array(char *p, int depth, const int *shape, uint16_t *codes, int *n, int max) {
+    int count = 0;
+
+    while (isspace((unsigned char) *p)) p++;
+    if (*p++ != '[') {
+        return NULL;
+    }
+    while (isspace((unsigned char) *p)) p++;
+    if (*p == ']') {
+        return shape[depth] <= 0 ? p + 1 : NULL;
+    }
+    for (;;) {
+        if (depth > 1) {
+            if ((p = bl_layout_json_array(p, depth - 1, shape, codes, n, max)) == NULL) {
+                return NULL;
+            }
+        } else {
+            char *end;
+            long code = strtol(p, &end, 10);
+            if (end == p || code < 0 || code > 0xffff || *n == max) {
+                return NULL;
+            }
+            codes[(*n)++] = code;
+            p = end;
+        }
+        count++;
+        while (isspace((unsigned char) *p)) p++;
+        if (*p == ']') {
+            return shape[depth] < 0 || count == shape[depth] ? p + 1 : NULL;
+        } else if (*p++ != ',') {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Parse a JSON layout file as written by bl_layout_save_json(): an object
+ * with "nlayers" and "layers", an array of layers, a layer is an array of
+ * NUMROWS rows and a row an array of NUMCOLS key codes.
+ *
+ * @return the layout or NULL and the reason is stored in errmsg.
+ */
+bl_layout_t *
+bl_layout_parse_json(char *fname, char *errmsg, int errlen) {
+    size_t length;
+    char *data = bl_layout_read_all(fname, &length, errmsg, errlen);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    uint16_t codes[NUMLAYERS_MAX * NUMKEYS];
+    int ncodes = -1;
+    int nlayers = -1;
+    char *p = data;
+    int ok = FALSE;
+
+    while (isspace((unsigned char) *p)) p++;
+    if (*p++ == '{') {
+        for (;;) {
+            while (isspace((unsigned char) *p)) p++;
+            if (*p == '}') {
+                ok = TRUE;
+                break;
+            }
+            char *key = p;
+            if (*key != '"' || (p = strchr(key + 1, '"')) == NULL) {
+                break;
+            }
+            p++;
+            while (isspace((unsigned char) *p)) p++;
+            if (*p++ != ':') {
+                break;
+            }
+            if (strncmp(key, "\"layers\"", 8) == 0) {
+                // any number of layers of NUMROWS rows of NUMCOLS keys
+                static const int shape[] = { 0, NUMCOLS, NUMROWS, -1 };
+                ncodes = 0;
+                p = bl_layout_json_array(p, 3, shape, codes, &ncodes, NUMLAYERS_MAX * NUMKEYS);
+            } else if (strncmp(key, "\"nlayers\"", 9) == 0) {
+                nlayers = strtol(p, &p, 10);
+            } else {
+                break;
+            }
+            if (p == NULL) {
+                break;
+            }
+            while (isspace((unsigned char) *p)) p++;
+            if (*p == ',') {
+                p++;
+            }
+        }
+    }
+    free(data);
+
+    if (!ok || ncodes < 0) {
+        snprintf(errmsg, errlen, "Invalid JSON layout file %s\n", fname);
+        return NULL;
+    }
+    if (ncodes % NUMKEYS != 0 || ncodes / NUMKEYS < NUMLAYERS_MIN ||
+        (nlayers >= 0 && nlayers != ncodes / NUMKEYS)) {
+        snprintf(errmsg, errlen, "Invalid JSON layout file %s, %d keys for %d layers\n",
+                 fname, ncodes, nlayers);
+        return NULL;
+    }
+
+    bl_layout_t *layout = bl_layout_create(ncodes / NUMKEYS);
+    memcpy(&layout->matrix[0][0][0], codes, ncodes * sizeof(uint16_t));
+
+    return layout;
+}
+
+/**
+ * Save the layout in the binary format, see bl_layout_parse_binary().
+ *
+ * @return 0 if successful, -1 if not
+ */
+int
+bl_layout_save_binary(bl_layout_t *layout, char *fname) {
+    uint8_t data[8 + 2 * NUMLAYERS_MAX * NUMKEYS] = { 0 };
+    uint16_t *codes = &layout->matrix[0][0][0];
+    size_t length = 8 + 2 * layout->nlayers * NUMKEYS;
+
+    memcpy(data, BL_LAYOUT_BINARY_MAGIC, 4);
+    data[4] = BL_LAYOUT_BINARY_VERSION;
+    data[5] = layout->nlayers;
+    for (int i=0; i<layout->nlayers * NUMKEYS; i++) {
+        data[8 + 2 * i] = codes[i] & 0xff;
+        data[8 + 2 * i + 1] = codes[i] >> 8;
+    }
+
+    FILE *f = fopen(fname, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    int ret = fwrite(data, 1, length, f) == length ? 0 : -1;
+    if (fclose(f) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * Save the layout as JSON, see bl_layout_parse_json().
+ *
+ * @return 0 if successful, -1 if not
+ */
+int
+bl_layout_save_json(bl_layout_t *layout, char *fname) {
+    FILE *f = fopen(fname, "w");
+    if (f == NULL) {
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"nlayers\": %d,\n  \"layers\": [\n", layout->nlayers);
+    for (int layer=0; layer<layout->nlayers; layer++) {
+        fprintf(f, "    [\n");
+        for (int row=0; row<NUMROWS; row++) {
+            fprintf(f, "      [");
+            for (int col=0; col<NUMCOLS; col++) {
+                fprintf(f, col < NUMCOLS-1 ? "%d, " : "%d", layout->matrix[layer][row][col]);
+            }
+            fprintf(f, row < NUMROWS-1 ? "],\n" : "]\n");
+        }
+        fprintf(f, layer < layout->nlayers-1 ? "    ],\n" : "    ]\n");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    return fclose(f) == 0 ? 0 : -1;
+}
@@ -0,0 +1,277 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "blusb.h"
+#include "libblusb.h"
+#include "bl_txn.h"
+
+/* TRUE between blusb_open() and blusb_close() */
+static int _blusb_is_open = FALSE;
+
+static const char *_blusb_errors[] = {
+    "ok",
+    "controller not found or could not be opened",
+    "usb transfer failed",
+    "invalid data from the controller",
+    "value out of range",
+    "could not read or parse the file",
+    "verify failed, the controller holds different data",
+    "out of memory",
+    "controller not opened",
+    "write failed, the previous settings were restored",
+    "write failed and the previous settings could not be restored",
+};
+
+const char *
+blusb_strerror(int err) {
+    int n = sizeof(_blusb_errors) / sizeof(_blusb_errors[0]);
+
+    if (err > 0 || -err >= n) {
+        return "unknown error";
+    }
+    return _blusb_errors[-err];
+}
+
+int
+blusb_api_version(void) {
+    return BLUSB_API_VERSION;
+}
+
+void
+blusb_set_error_handler(blusb_error_handler_t handler) {
+    bl_err_set_handler(handler, NULL);
+}
+
+int
+blusb_open(void) {
+    if (!_blusb_is_open) {
+        if (!bl_usb_openctrl()) {
+            return BLUSB_E_NODEV;
+        }
+        _blusb_is_open = TRUE;
+    }
+    return BLUSB_OK;
+}
+
+void
+blusb_close(void) {
+    if (_blusb_is_open) {
+        bl_usb_closectrl();
+        _blusb_is_open = FALSE;
+    }
+}
+
+int
+blusb_read_layout(bl_layout_t *layout) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+
+    bl_ctrl_state_t *state = (bl_ctrl_state_t *) malloc(sizeof(bl_ctrl_state_t));
+    if (state == NULL) {
+        return BLUSB_E_NOMEM;
+    }
+    int ret = BLUSB_E_DATA;
+    errno = 0;
+    if (bl_usb_read_state(state, BL_CTRL_LAYOUT, NULL, NULL) & BL_CTRL_LAYOUT) {
+        memcpy(layout, &state->layout, sizeof(bl_layout_t));
+        ret = BLUSB_OK;
+    } else if (errno == ENOMEM) {
+        ret = BLUSB_E_NOMEM;
+    }
+    free(state);
+
+    return ret;
+}
+
+int
+blusb_write_layout(bl_layout_t *layout, int verify) {
+    char errmsg[256];
+
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    if (!bl_layout_check(layout, errmsg, sizeof(errmsg))) {
+        bl_err(FALSE, "%s", errmsg);
+        return BLUSB_E_RANGE;
+    }
+    if (!bl_layout_write(layout)) {
+        return BLUSB_E_USB;
+    }
+    errno = 0;
+    if (verify && !bl_layout_verify(layout)) {
+        return errno == ENOMEM ? BLUSB_E_NOMEM : BLUSB_E_VERIFY;
+    }
+
+    return BLUSB_OK;
+}
+
+int
+blusb_read_macros(bl_macro_t *macros) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+
+    bl_macro_t *bm = bl_usb_macro_read();
+    if (bm == NULL) {
+        return BLUSB_E_DATA;
+    }
+    memcpy(macros, bm, sizeof(bl_macro_t));
+    free(bm);
+
+    return BLUSB_OK;
+}
+
+int
+blusb_write_macros(bl_macro_t *macros) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    return bl_usb_macro_write(macros) ? BLUSB_OK : BLUSB_E_USB;
+}
+
+int
+blusb_read_pwm(uint8_t *pwm_usb, uint8_t *pwm_bt) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    return bl_usb_pwm_read(pwm_usb, pwm_bt) ? BLUSB_OK : BLUSB_E_USB;
+}
+
+int
+blusb_write_pwm(uint8_t pwm_usb, uint8_t pwm_bt) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    return bl_usb_pwm_write(pwm_usb, pwm_bt) ? BLUSB_OK : BLUSB_E_USB;
+}
+
+int
+blusb_read_debounce(uint8_t *debounce) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    return bl_usb_debounce_read(debounce) ? BLUSB_OK : BLUSB_E_USB;
+}
+
+int
+blusb_write_debounce(uint8_t debounce) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    if (debounce < 1) {
+        return BLUSB_E_RANGE;
+    }
+    return bl_usb_debounce_write(debounce) ? BLUSB_OK : BLUSB_E_USB;
+}
+
+int
+blusb_write_all(bl_ctrl_state_t *state, int parts) {
+    char errmsg[256];
+
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    if ((parts & BL_CTRL_LAYOUT) && !bl_layout_check(&state->layout, errmsg, sizeof(errmsg))) {
+        bl_err(FALSE, "%s", errmsg);
+        return BLUSB_E_RANGE;
+    }
+    if ((parts & BL_CTRL_DEBOUNCE) && state->debounce < 1) {
+        return BLUSB_E_RANGE;
+    }
+
+    bl_txn_t *txn = (bl_txn_t *) malloc(sizeof(bl_txn_t));
+    if (txn == NULL) {
+        return BLUSB_E_NOMEM;
+    }
+    bl_txn_begin(txn);
+    bl_txn_set_state(txn, state, parts);
+    errno = 0;
+    int ret = bl_txn_commit(txn, errmsg, sizeof(errmsg));
+    int nomem = errno == ENOMEM;
+    free(txn);
+
+    if (ret != BL_TXN_OK) {
+        bl_err(FALSE, "%s", errmsg);
+    }
+    switch (ret) {
+        case BL_TXN_OK: return BLUSB_OK;
+        case BL_TXN_ABORTED: return nomem ? BLUSB_E_NOMEM : BLUSB_E_USB;
+        case BL_TXN_ROLLED_BACK: return BLUSB_E_ROLLBACK;
+        default: return BLUSB_E_PARTIAL;
+    }
+}
+
+int
+blusb_read_version(int *major, int *minor) {
+    if (!_blusb_is_open) {
+        return BLUSB_E_NOTOPEN;
+    }
+    return bl_usb_read_version(major, minor) ? BLUSB_OK : BLUSB_E_USB;
+}
+
+int
+blusb_load_layout(const char *fname, bl_layout_t *layout, char *errmsg, int errlen) {
+    char buf[256];
+
+    if (errmsg == NULL) {
+        errmsg = buf;
+        errlen = sizeof(buf);
+    }
+
+    bl_layout_t *parsed = bl_layout_parse_file((char *) fname, errmsg, errlen);
+    if (parsed == NULL) {
+        return BLUSB_E_PARSE;
+    }
+    memcpy(layout, parsed, sizeof(bl_layout_t));
+    bl_layout_destroy(parsed);
+
+    return BLUSB_OK;
+}
+
+int
+blusb_save_layout(bl_layout_t *layout, const char *fname) {
+    return bl_layout_save(layout, (char *) fname) == 0 ? BLUSB_OK : BLUSB_E_PARSE;
+}
+
+int
+blusb_load_macros(const char *fname, bl_macro_t *macros) {
+    bl_macro_t *bm = bl_macro_parse((char *) fname);
+    if (bm == NULL) {
+        return BLUSB_E_PARSE;
+    }
+    memcpy(macros, bm, sizeof(bl_macro_t));
+    free(bm);
+
+    return BLUSB_OK;
+}
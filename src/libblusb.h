@@ -0,0 +1,273 @@
+/*
+ *
+ * (c) 2019 Marc van Kempen (marc@vankempen.com)
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. *
+ */
+
+#ifndef __LIBBLUSB_H__
+#define __LIBBLUSB_H__ 1
+
+/*
+ * libblusb, the C API to the controller.
+ *
+ * Link with -lblusb (static or shared). Every function returns BLUSB_OK or
+ * one of the negative BLUSB_E_* codes, none of them exits the process, not
+ * even when memory runs out (BLUSB_E_NOMEM). Messages that explain an error in more detail are passed to the
+ * handler installed with blusb_set_error_handler(), by default they are
+ * printed on stderr.
+ *
+ * The controller is opened once with blusb_open() and stays open until
+ * blusb_close(), the functions are not thread safe.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && !defined(__CYGWIN__)
+#define BLUSB_API __attribute__((visibility("default")))
+#else
+#define BLUSB_API
+#endif
+
+/*
+ * Incremented when a function is added, existing functions and the
+ * error codes do not change.
+ */
+#define BLUSB_API_VERSION 3
+
+/*
+ * Size of the matrix and the macros, the same values as in layout.h
+ */
+#ifndef NUMLAYERS_MAX
+#define NUMLAYERS_MAX   6
+#define NUMLAYERS_MIN   1
+#define NUMKEYS         160
+#define NUMROWS         8
+#define NUMCOLS         20
+#define NUM_MACROKEYS   24
+#define LEN_MACRO       8
+#endif
+
+/*
+ * The types of the API, this header is the only one installed so it
+ * defines them, the rest of blusb gets them through usb.h
+ */
+typedef uint16_t bl_matrix_t[NUMLAYERS_MAX][NUMROWS][NUMCOLS];
+
+typedef struct bl_layout_t {
+    int nlayers;
+    bl_matrix_t matrix;
+} bl_layout_t;
+
+typedef uint8_t bl_macro_keylist_t[NUM_MACROKEYS][LEN_MACRO];
+
+typedef struct bl_macro_t {
+    int nmacros;
+    bl_macro_keylist_t macros;
+} bl_macro_t;
+
+/*
+ * Parts of the controller state
+ */
+#define BL_CTRL_LAYOUT      0x01
+#define BL_CTRL_MACROS      0x02
+#define BL_CTRL_PWM         0x04
+#define BL_CTRL_DEBOUNCE    0x08
+#define BL_CTRL_VERSION     0x10
+#define BL_CTRL_ALL         0x1f
+
+/*
+ * Everything that can be read from the controller
+ */
+typedef struct bl_ctrl_state_t {
+    bl_layout_t layout;
+    bl_macro_t macros;
+    uint8_t pwm_usb;
+    uint8_t pwm_bt;
+    uint8_t debounce;
+    int major;
+    int minor;
+} bl_ctrl_state_t;
+
+/*
+ * Receives the messages that explain an error, is_fatal is always FALSE
+ * for the library
+ */
+typedef void (*blusb_error_handler_t)(int is_fatal, char *msg, va_list args);
+
+/*
+ * Error codes
+ */
+#define BLUSB_OK            0
+#define BLUSB_E_NODEV      -1   /* controller not found or could not be opened */
+#define BLUSB_E_USB        -2   /* a transfer to or from the controller failed */
+#define BLUSB_E_DATA       -3   /* the controller returned invalid data, e.g. a bad EEPROM value */
+#define BLUSB_E_RANGE      -4   /* an argument is out of range */
+#define BLUSB_E_PARSE      -5   /* a file could not be read or parsed */
+#define BLUSB_E_VERIFY     -6   /* the data read back differs from what was written */
+#define BLUSB_E_NOMEM      -7   /* out of memory */
+#define BLUSB_E_NOTOPEN    -8   /* blusb_open() was not called */
+#define BLUSB_E_ROLLBACK   -9   /* a write failed, the previous settings were restored */
+#define BLUSB_E_PARTIAL   -10   /* a write failed and the previous settings could not be restored */
+
+/**
+ * @return A static description of the error code.
+ */
+BLUSB_API const char *blusb_strerror(int err);
+
+/**
+ * @return BLUSB_API_VERSION of the library that is linked.
+ */
+BLUSB_API int blusb_api_version(void);
+
+/**
+ * Install the handler for error messages, NULL restores the default that
+ * prints them on stderr.
+ *
+ * @since API version 3
+ */
+BLUSB_API void blusb_set_error_handler(blusb_error_handler_t handler);
+
+/**
+ * Locate and open the controller.
+ *
+ * @return BLUSB_OK or BLUSB_E_NODEV
+ */
+BLUSB_API int blusb_open(void);
+
+/**
+ * Close the controller, safe to call when it is not open.
+ */
+BLUSB_API void blusb_close(void);
+
+/**
+ * Read the layout from the controller.
+ *
+ * @param layout Filled with the number of layers and the key codes
+ * @return BLUSB_OK, BLUSB_E_USB, BLUSB_E_DATA or BLUSB_E_NOMEM
+ */
+BLUSB_API int blusb_read_layout(bl_layout_t *layout);
+
+/**
+ * Write the layout to the controller.
+ *
+ * @param layout Layout to write. Nothing is written if the number of layers
+ *               is out of range, a key code is unknown or a layer key
+ *               leads to a missing layer.
+ * @param verify If non-zero the layout is read back and compared
+ * @return BLUSB_OK, BLUSB_E_RANGE if the layout can't be written (the
+ * reason is passed to the error handler), BLUSB_E_USB, BLUSB_E_VERIFY or
+ * BLUSB_E_NOMEM
+ */
+BLUSB_API int blusb_write_layout(bl_layout_t *layout, int verify);
+
+/**
+ * Read the 24 macros from the controller.
+ *
+ * @return BLUSB_OK, BLUSB_E_USB or BLUSB_E_DATA
+ */
+BLUSB_API int blusb_read_macros(bl_macro_t *macros);
+
+/**
+ * Write the 24 macros to the controller.
+ *
+ * @return BLUSB_OK or BLUSB_E_USB
+ */
+BLUSB_API int blusb_write_macros(bl_macro_t *macros);
+
+/**
+ * Read the brightness of the LEDs, 0-255 for USB and BT.
+ *
+ * @return BLUSB_OK or BLUSB_E_USB
+ */
+BLUSB_API int blusb_read_pwm(uint8_t *pwm_usb, uint8_t *pwm_bt);
+
+/**
+ * Write the brightness of the LEDs, 0-255 for USB and BT.
+ *
+ * @return BLUSB_OK or BLUSB_E_USB
+ */
+BLUSB_API int blusb_write_pwm(uint8_t pwm_usb, uint8_t pwm_bt);
+
+/**
+ * Read the debounce time in ms.
+ *
+ * @return BLUSB_OK or BLUSB_E_USB
+ */
+BLUSB_API int blusb_read_debounce(uint8_t *debounce);
+
+/**
+ * Write the debounce time in ms, valid range is 1-255.
+ *
+ * @return BLUSB_OK, BLUSB_E_RANGE or BLUSB_E_USB
+ */
+BLUSB_API int blusb_write_debounce(uint8_t debounce);
+
+/**
+ * Write several parts of the configuration as one transaction. The current
+ * settings are saved, all parts are written in one batch and read back,
+ * and if any part fails the saved settings are written back.
+ *
+ * @param state The new settings
+ * @param parts Bitmask of BL_CTRL_LAYOUT, BL_CTRL_MACROS, BL_CTRL_PWM and
+ *              BL_CTRL_DEBOUNCE
+ * @return BLUSB_OK, BLUSB_E_RANGE if a value is invalid (nothing written),
+ * BLUSB_E_USB if the current settings could not be read (nothing written),
+ * BLUSB_E_NOMEM, BLUSB_E_ROLLBACK or BLUSB_E_PARTIAL
+ * @since API version 2
+ */
+BLUSB_API int blusb_write_all(bl_ctrl_state_t *state, int parts);
+
+/**
+ * Read the firmware version.
+ *
+ * @return BLUSB_OK or BLUSB_E_USB
+ */
+BLUSB_API int blusb_read_version(int *major, int *minor);
+
+/**
+ * Parse a layout file, no controller needed.
+ *
+ * @param errmsg Receives the reason if the file could not be parsed, may be NULL
+ * @return BLUSB_OK or BLUSB_E_PARSE
+ */
+BLUSB_API int blusb_load_layout(const char *fname, bl_layout_t *layout, char *errmsg, int errlen);
+
+/**
+ * Save the layout in the same format blusb_load_layout() reads.
+ *
+ * @return BLUSB_OK or BLUSB_E_PARSE if the file could not be written
+ */
+BLUSB_API int blusb_save_layout(bl_layout_t *layout, const char *fname);
+
+/**
+ * Parse a macro file, no controller needed.
+ *
+ * @return BLUSB_OK or BLUSB_E_PARSE
+ */
+BLUSB_API int blusb_load_macros(const char *fname, bl_macro_t *macros);
+
+#endif /* __LIBBLUSB_H__ */
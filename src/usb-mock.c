@@ -42,6 +42,12 @@
  * Windows.
  */
 
+/*
+ * What was written to the mock controller, the reads return it. Macros
+ * can only be read after they were written.
+ */
+static bl_ctrl_state_t _bl_mock_state = { .layout = { .nlayers = 1 }, .major = 1, .minor = 0 };
+
 
 /**
  * Try to locate the controller, if it's not found return FALSE,
@@ -122,17 +128,25 @@ bl_usb_read_matrix_pos(int *row, int *col)
 int
 bl_usb_read_layout(uint8_t **buffer, int *nlayers) {
     enum { buf_size = 2048 };
-    unsigned char uc_buffer[buf_size];
+    uint8_t *data = bl_layout_convert(&_bl_mock_state.layout);
 
-    *nlayers = 1;
+    *nlayers = _bl_mock_state.layout.nlayers;
     *buffer = (uint8_t *) malloc(buf_size-2);
     memset(*buffer, 0, buf_size-2);
+    memcpy(*buffer, data, 2 * *nlayers * NUMKEYS);
+    free(data);
 
     return TRUE;
 }
 
 int
 bl_usb_write_layout(uint8_t *layout, int nlayers) {
+    _bl_mock_state.layout.nlayers = nlayers;
+    for (int i=0; i<nlayers * NUMKEYS; i++) {
+        _bl_mock_state.layout.matrix[i / NUMKEYS][(i % NUMKEYS) / NUMCOLS][i % NUMCOLS] =
+            layout[2*i] | (layout[2*i+1] << 8);
+    }
+
     return TRUE;
 }
 
@@ -187,36 +201,114 @@ bl_usb_print_layout(uint8_t *buffer, int nlayers) {
     return;
 }
 
-void
+int
 bl_usb_read_version(int *major, int *minor) {
-    uint8_t buffer[8];
+    *major = _bl_mock_state.major;
+    *minor = _bl_mock_state.minor;
 
-    *major = 1;
-    *minor = 0;
+    return TRUE;
 }
 
-void
+int
 bl_usb_pwm_read(uint8_t *pwm_usb, uint8_t *pwm_bt) {
-    *pwm_usb = 0;
-    *pwm_bt = 0;
+    *pwm_usb = _bl_mock_state.pwm_usb;
+    *pwm_bt = _bl_mock_state.pwm_bt;
 
-    return;
+    return TRUE;
 }
 
-void
-bl_usb_pwm_write(uint8_t pwm_usb, uint8_t pwm_bt) { }
+int
+bl_usb_pwm_write(uint8_t pwm_usb, uint8_t pwm_bt) {
+    _bl_mock_state.pwm_usb = pwm_usb;
+    _bl_mock_state.pwm_bt = pwm_bt;
+
+    return TRUE;
+}
 
 
-uint8_t
-bl_usb_debounce_read() {
-    return 0;
+int
+bl_usb_debounce_read(uint8_t *debounce) {
+    *debounce = _bl_mock_state.debounce;
+
+    return TRUE;
 }
 
-void
-bl_usb_debounce_write(uint8_t debounce) { }
+int
+bl_usb_debounce_write(uint8_t debounce) {
+    if (debounce < 1) {
+        return FALSE;
+    }
+    _bl_mock_state.debounce = debounce;
+
+    return TRUE;
+}
 
 bl_macro_t*
 bl_usb_macro_read() {
-    return NULL;
+    if (_bl_mock_state.macros.nmacros == 0) {
+        return NULL;
+    }
+    bl_macro_t *bm = (bl_macro_t *) malloc(sizeof(bl_macro_t));
+    if (bm != NULL) {
+        memcpy(bm, &_bl_mock_state.macros, sizeof(bl_macro_t));
+    }
+
+    return bm;
+}
+
+int
+bl_usb_macro_write(bl_macro_t *macros) {
+    memcpy(&_bl_mock_state.macros, macros, sizeof(bl_macro_t));
+    _bl_mock_state.macros.nmacros = NUM_MACROKEYS;
+
+    return TRUE;
+}
+
+
+int
+bl_usb_read_state(bl_ctrl_state_t *state, int what, bl_usb_state_cb_t arrived, void *data) {
+    memcpy(state, &_bl_mock_state, sizeof(bl_ctrl_state_t));
+
+    /*
+     * Macros can't be read before they were written
+     */
+    int ok_mask = _bl_mock_state.macros.nmacros == 0 ? what & ~BL_CTRL_MACROS : what;
+    for (int bit=1; bit<=BL_CTRL_ALL; bit <<= 1) {
+        if ((what & bit) && arrived != NULL) {
+            arrived(state, bit, (ok_mask & bit) != 0, data);
+        }
+    }
+
+    return ok_mask;
 }
 
+int
+bl_usb_write_state(bl_ctrl_state_t *state, int what, bl_usb_state_cb_t written, void *data) {
+    int ok_mask = 0;
+
+    if (what & BL_CTRL_LAYOUT) {
+        _bl_mock_state.layout = state->layout;
+        ok_mask |= BL_CTRL_LAYOUT;
+    }
+    if (what & BL_CTRL_MACROS) {
+        _bl_mock_state.macros = state->macros;
+        _bl_mock_state.macros.nmacros = NUM_MACROKEYS;
+        ok_mask |= BL_CTRL_MACROS;
+    }
+    if (what & BL_CTRL_PWM) {
+        _bl_mock_state.pwm_usb = state->pwm_usb;
+        _bl_mock_state.pwm_bt = state->pwm_bt;
+        ok_mask |= BL_CTRL_PWM;
+    }
+    if ((what & BL_CTRL_DEBOUNCE) && state->debounce >= 1) {
+        _bl_mock_state.debounce = state->debounce;
+        ok_mask |= BL_CTRL_DEBOUNCE;
+    }
+    for (int bit=1; bit<BL_CTRL_VERSION; bit <<= 1) {
+        if ((what & bit) && written != NULL) {
+            written(state, bit, (ok_mask & bit) != 0, data);
+        }
+    }
+
+    return ok_mask;
+}
@@ -31,15 +31,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <libusb.h>
 
 #include "blusb.h"
 #include "layout.h"
 #include "usb.h"
+#include "bl_lock.h"
+#include "bl_devcache.h"
 
 // restrict direct access to handle
 static libusb_device_handle *handle = NULL;
 
+// held from opening until closing the controller
+static bl_lock_t _bl_usb_lock = { .ticket_fd = -1 };
+
+/*
+ * On Linux the controller is opened through its sysfs path, libusb only
+ * enumerates the bus if that fails
+ */
+#if defined(__linux__) && defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+#define BL_USB_SYSFS 1
+#if LIBUSB_API_VERSION < 0x01000108
+// the name in libusb 1.0.23
+#define LIBUSB_OPTION_NO_DEVICE_DISCOVERY LIBUSB_OPTION_WEAK_AUTHORITY
+#endif
+#endif
+
+// device node of the controller when it was opened through sysfs
+static int _bl_usb_sys_fd = -1;
+// TRUE once libusb device discovery was turned off for the sysfs path
+static int _bl_usb_no_discovery = FALSE;
+
 // IBM Enhanced Performance Keyboard identifiers
 const uint16_t vendor = 0x04b3;
 const uint16_t product = 0x301c;
@@ -49,6 +73,65 @@ const uint16_t product = 0x301c;
  */
 
 
+#ifdef BL_USB_SYSFS
+/*
+ * Open the controller at the cached sysfs path, or search sysfs for it,
+ * and wrap its device node. Returns FALSE if libusb should try, give_up is
+ * set if it must not: another process kept the controller for too long,
+ * or libusb was already initialised without device discovery.
+ */
+static int
+bl_usb_open_sysfs(int *give_up) {
+    bl_devpath_t path;
+
+    int cached = bl_devcache_lookup(vendor, product, &path);
+    if (!cached && !bl_devcache_scan(vendor, product, &path)) {
+        *give_up = _bl_usb_no_discovery;
+        return FALSE;
+    }
+
+    int holder = 0;
+    int wait_ms = bl_lock_wait_ms();
+    if (!bl_lock_acquire(&_bl_usb_lock, path.bus, path.ports, path.nports, wait_ms, &holder)) {
+        if (holder > 0) {
+            bl_err(FALSE, "The controller is in use by process %d, gave up after %d ms\n", holder, wait_ms);
+        }
+        *give_up = TRUE;
+        return FALSE;
+    }
+
+    int fd = bl_devcache_open(&path);
+    if (fd < 0) {
+        bl_lock_release(&_bl_usb_lock);
+        return FALSE;
+    }
+    /*
+     * Otherwise libusb_init() enumerates the whole bus anyway. The option
+     * holds for the rest of the process, so from here on libusb can't
+     * search for the controller itself.
+     */
+    libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+    _bl_usb_no_discovery = TRUE;
+    libusb_init(NULL);
+    if (libusb_wrap_sys_device(NULL, (intptr_t) fd, &handle) != 0) {
+        bl_err(FALSE, "Could not open the controller at %s\n", path.name);
+        handle = NULL;
+        libusb_exit(NULL);
+        close(fd);
+        bl_lock_release(&_bl_usb_lock);
+        *give_up = TRUE;
+        return FALSE;
+    }
+    _bl_usb_sys_fd = fd;
+
+    if (!cached) {
+        bl_devcache_store(&path);
+    }
+
+    return TRUE;
+}
+#endif
+
 /**
  * Try to locate the controller, if it's not found return FALSE,
  * else return TRUE.
@@ -63,43 +146,77 @@ int
 bl_usb_openctrl() {
     libusb_device **dev_list;
 
+#ifdef BL_USB_SYSFS
+    int give_up = FALSE;
+    if (bl_usb_open_sysfs(&give_up)) {
+        return TRUE;
+    } else if (give_up) {
+        return FALSE;
+    }
+#endif
+
     libusb_init(NULL);
 
     // locate device
     uint8_t cnt = libusb_get_device_list(NULL, &dev_list);
-    int err = FALSE;
+    int found = FALSE;
     for (uint8_t i = 0; i<cnt && handle == NULL; i++) {
         libusb_device *dev = dev_list[i];
         struct libusb_device_descriptor dev_descr;
 
         libusb_get_device_descriptor(dev, &dev_descr);
         if ((vendor == dev_descr.idVendor) && (product == dev_descr.idProduct)) {
-            if (libusb_open(dev, &handle)) {
-                printf("\n\n");
-                printf("LIBUSB error code: %s", libusb_error_name(err));
-                printf("\n\n");
+            found = TRUE;
+
+            /*
+             * Wait for other processes using this controller
+             */
+            uint8_t ports[8];
+            int nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+            int holder = 0;
+            int wait_ms = bl_lock_wait_ms();
+            if (!bl_lock_acquire(&_bl_usb_lock, libusb_get_bus_number(dev), ports, MAX(nports, 0), wait_ms, &holder)) {
+                if (holder > 0) {
+                    bl_err(FALSE, "The controller is in use by process %d, gave up after %d ms\n", holder, wait_ms);
+                }
+                continue;
+            }
+
+            int ret = libusb_open(dev, &handle);
+            if (ret) {
+                bl_lock_release(&_bl_usb_lock);
 #ifdef _WIN32
-                printf
-                    (
-                        "Don't panic! This is a simple driver issue. "
-                        "If you have not already, download Zadig at\n"
-                        "http://zadig.akeo.ie and install the WinUSB driver.\n"
-                        "You can also give the LibUSB-win32 driver a try, whatever is going to work for you.\n"
-                        "Quirky Windows(c) likes a little tinkering!\n"
-                        );
+                bl_err(FALSE,
+                       "LIBUSB error code: %s\n\n"
+                       "Don't panic! This is a simple driver issue. "
+                       "If you have not already, download Zadig at\n"
+                       "http://zadig.akeo.ie and install the WinUSB driver.\n"
+                       "You can also give the LibUSB-win32 driver a try, whatever is going to work for you.\n"
+                       "Quirky Windows(c) likes a little tinkering!\n", libusb_error_name(ret));
 #else
-                printf("Could not open the usb device, do you have the right permissions?\n");
-                printf("You could try running with sudo.\n");
+                bl_err(FALSE,
+                       "LIBUSB error code: %s\n"
+                       "Could not open the usb device, do you have the right permissions?\n"
+                       "You could try running with sudo.\n", libusb_error_name(ret));
 #endif
             } else {
-                err = TRUE;
+#ifdef BL_USB_SYSFS
+                bl_devpath_t path;
+                path.bus = libusb_get_bus_number(dev);
+                path.nports = MIN(MAX(nports, 0), (int) sizeof(path.ports));
+                memcpy(path.ports, ports, path.nports);
+                bl_devcache_path_name(&path);
+                bl_devcache_store(&path);
+#endif
             }
         }
     }
     libusb_free_device_list(dev_list, 1);
 
     if (handle == NULL) {
-        printf("Could not find keyboard\n");
+        if (!found) {
+            bl_err(FALSE, "Could not find keyboard\n");
+        }
         return FALSE;
     } else {
         return TRUE;
@@ -113,7 +230,12 @@ void
 bl_usb_closectrl() {
     libusb_close(handle);
     handle = NULL;
+    if (_bl_usb_sys_fd >= 0) {
+        close(_bl_usb_sys_fd);
+        _bl_usb_sys_fd = -1;
+    }
     libusb_exit(NULL);
+    bl_lock_release(&_bl_usb_lock);
 }
 
 /*
@@ -219,27 +341,41 @@ bl_usb_read_layout(uint8_t **buffer, int *nlayers) {
     unsigned char uc_buffer[buf_size];
 
     memset(uc_buffer, 0, buf_size);
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_IN |
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_IN |
         LIBUSB_REQUEST_TYPE_VENDOR, USB_READ_LAYOUT, 0, 0, uc_buffer, buf_size, BL_USB_TIMEOUT);
 
+    if (ret < 0) {
+        bl_err(FALSE, "libusb error: %s (%d)\n", libusb_strerror((enum libusb_error) ret), ret);
+        return FALSE;
+    }
+
     *nlayers = uc_buffer[0];
 
     if (*nlayers == 0){
-        printf("No layers configured.\n");
+        bl_err(FALSE, "No layers configured.\n");
         return FALSE;
     }
 
     if (*nlayers > 6) {
-        printf("More than 6 layers reported, bad flash value!\n");
+        bl_err(FALSE, "More than 6 layers reported, bad flash value!\n");
         return FALSE;
     }
 
     *buffer = (uint8_t *) malloc(buf_size-2);
-    *buffer = memcpy(*buffer, uc_buffer+2, buf_size-2);
+    if (*buffer == NULL) {
+        return FALSE;
+    }
+    memcpy(*buffer, uc_buffer+2, buf_size-2);
 
     return TRUE;
 }
 
+/**
+ * Write the layout to the controller, layout is the data as returned by
+ * bl_layout_convert().
+ *
+ * @return TRUE if all data was transferred, FALSE if not.
+ */
 int
 bl_usb_write_layout(uint8_t *layout, int nlayers) {
     enum { buf_size = 2048 };
@@ -248,10 +384,11 @@ bl_usb_write_layout(uint8_t *layout, int nlayers) {
     uc_buffer[0] = nlayers;
     memcpy(&uc_buffer[1], layout, 2 * nlayers * NUMCOLS * NUMROWS);
 
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_OUT | \
-        LIBUSB_REQUEST_TYPE_VENDOR, USB_WRITE_LAYOUT, 0, 0, uc_buffer, nlayers*2*NUMKEYS+1, 1000);
+    int length = nlayers*2*NUMKEYS+1;
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_OUT | \
+        LIBUSB_REQUEST_TYPE_VENDOR, USB_WRITE_LAYOUT, 0, 0, uc_buffer, length, 1000);
 
-    return TRUE;
+    return ret == length;
 }
 
 /**
@@ -305,115 +442,126 @@ bl_usb_print_layout(uint8_t *buffer, int nlayers) {
     return;
 }
 
-void
+/**
+ * Read the firmware version.
+ *
+ * @return TRUE if successful, FALSE if not.
+ */
+int
 bl_usb_read_version(int *major, int *minor) {
     uint8_t buffer[8];
 
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN |
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN |
         LIBUSB_REQUEST_TYPE_VENDOR, USB_READ_VERSION, 0, 0, buffer, sizeof(buffer), 1000);
+    if (ret < 2) {
+        return FALSE;
+    }
 
     *major = buffer[0];
     *minor = buffer[1];
+
+    return TRUE;
 }
 
-void
+/**
+ * Read the brightness of the LEDs for USB and BT.
+ *
+ * @return TRUE if successful, FALSE if not.
+ */
+int
 bl_usb_pwm_read(uint8_t *pwm_usb, uint8_t *pwm_bt) {
     uint8_t buffer[8];
 
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN |
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN |
         LIBUSB_REQUEST_TYPE_VENDOR, USB_READ_BR, 0, 0, buffer, sizeof(buffer), 1000);
+    if (ret < 2) {
+        return FALSE;
+    }
 
     *pwm_usb = buffer[0];
     *pwm_bt = buffer[1];
 
-    return;
+    return TRUE;
 }
 
-void
+/**
+ * Write the brightness of the LEDs, the full range 0-255 is valid.
+ *
+ * @return TRUE if all data was transferred, FALSE if not.
+ */
+int
 bl_usb_pwm_write(uint8_t pwm_usb, uint8_t pwm_bt) {
-    static uint8_t buffer[8] = { 0 };
-
-    if ((pwm_usb < 0 || pwm_usb > 255) || (pwm_bt < 0 || pwm_bt > 255))
-    {
-        printf("Value out of range, no changes applied. Valid range is between 0 and 255 (inclusive).\n");
-        exit(0);
-    }
+    uint8_t buffer[8] = { 0 };
 
-    buffer[0] = (uint8_t)pwm_usb;
-    buffer[1] = (uint8_t)pwm_bt;
+    buffer[0] = pwm_usb;
+    buffer[1] = pwm_bt;
 
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT |
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT |
         LIBUSB_REQUEST_TYPE_VENDOR, USB_WRITE_BR, 0, 0, buffer, sizeof(buffer), 1000);
-}
 
+    return ret == sizeof(buffer);
+}
 
-uint8_t
-bl_usb_debounce_read() {
+/**
+ * Read the debounce value.
+ *
+ * @return TRUE if successful, FALSE if not.
+ */
+int
+bl_usb_debounce_read(uint8_t *debounce) {
     uint8_t buffer[8] = { 0 };
 
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN |
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN |
         LIBUSB_REQUEST_TYPE_VENDOR, USB_READ_DEBOUNCE, 0, 0, buffer, sizeof(buffer), 1000);
+    if (ret < 1) {
+        return FALSE;
+    }
 
-    return buffer[0];
+    *debounce = buffer[0];
+
+    return TRUE;
 }
 
-void
+/**
+ * Write the debounce value, valid range is 1-255.
+ *
+ * @return TRUE if all data was transferred, FALSE if the value is out of
+ * range or the transfer failed.
+ */
+int
 bl_usb_debounce_write(uint8_t debounce) {
     uint8_t buffer[8] = { 0 };
 
-    if ((debounce < 1 || debounce > 255)) {
-        printf("Value out of range, no changes applied. Exiting.\n");
-        return;
+    if (debounce < 1) {
+        return FALSE;
     }
 
-    buffer[0] = (uint8_t)debounce;
+    buffer[0] = debounce;
 
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT |
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT |
         LIBUSB_REQUEST_TYPE_VENDOR, USB_WRITE_DEBOUNCE, 0, 0, buffer, sizeof(buffer), 1000);
-}
-
-void
-bl_usb_macro_print(bl_macro_t *bm) {
-    uint8_t macro_cnt = 0;
-/*
-    printf("Macro key table\n\n");
-    printf("            Mods%-3cRsvd%-3cKey1%-3cKey2%-3cKey3%-3cKey4%-3cKey5%-3cKey6\n\n", '\0', '\0', '\0', '\0', '\0', '\0', '\0');
-    printf("Macro %-6u", ++macro_cnt);
-
-    for (uint8_t i = 0; i < sizeof(char_ctr_buf); i++)
-    {
-        printf("%-7u", char_ctr_buf[i]);
-        if(i && i != sizeof(char_ctr_buf) - 1)
-            if ((i + 1) % 8 == 0)
-            {
-                printf("\n");
-                printf("Macro %-6u", ++macro_cnt);
-            }
-    }
-    printf("\n");
-*/
-
-    printf("Macro key table\n\n");
-    printf("            Mods%-3cRsvd%-3cKey1%-3cKey2%-3cKey3%-3cKey4%-3cKey5%-3cKey6\n\n", '\0', '\0', '\0', '\0', '\0', '\0', '\0');
-
-    for (int i=0; i<NUM_MACROKEYS; i++) {
-        printf("Marco %-6u", i);
-        for (int j=0; j<LEN_MACRO; j++) {
-            printf("%-7u", bm->macros[i][j]);
-        }
-        printf("\n");
-    }
 
+    return ret == sizeof(buffer);
 }
 
+/**
+ * Read the macros from the controller.
+ *
+ * @return The macros, must be freed after use, or NULL if the transfer
+ * failed or the EEPROM holds no valid macros.
+ */
 bl_macro_t*
 bl_usb_macro_read() {
     unsigned char char_ctr_buf[192];
     uint8_t bad_value1 = 0;
     uint8_t bad_value2 = 0;
 
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_IN |
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_IN |
         LIBUSB_REQUEST_TYPE_VENDOR, USB_READ_MACROS, 0, 0, char_ctr_buf, sizeof(char_ctr_buf), 1000);
+    if (ret != sizeof(char_ctr_buf)) {
+        bl_err(FALSE, "Could not read the macros\n");
+        return NULL;
+    }
 
     for (uint8_t i = 0; i < sizeof(char_ctr_buf); i++) {
         if (char_ctr_buf[i] == 0) bad_value1++;
@@ -421,22 +569,33 @@ bl_usb_macro_read() {
     }
 
     if (bad_value1 == sizeof(char_ctr_buf) || bad_value2 == sizeof(char_ctr_buf)) {
-        printf("Bad EEPROM value!\n");
-        exit(0);
+        bl_err(FALSE, "Bad EEPROM value!\n");
+        return NULL;
     }
 
     bl_macro_t *bm = (bl_macro_t *) malloc(sizeof(bl_macro_t));
+    if (bm == NULL) {
+        return NULL;
+    }
     bm->nmacros = 24;
     memcpy(bm->macros, char_ctr_buf, sizeof(char_ctr_buf));
 
     return bm;
 }
 
-void
+/**
+ * Write all macros to the controller.
+ *
+ * @return TRUE if all data was transferred, FALSE if not.
+ */
+int
 bl_usb_macro_write(bl_macro_t* macros)
 {
-    libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_OUT | \
-        LIBUSB_REQUEST_TYPE_VENDOR, USB_WRITE_MACROS, 0, 0, (unsigned char *) macros->macros, NUM_MACROKEYS*LEN_MACRO, 1000);
+    int length = NUM_MACROKEYS*LEN_MACRO;
+    int ret = libusb_control_transfer(handle, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_OUT | \
+        LIBUSB_REQUEST_TYPE_VENDOR, USB_WRITE_MACROS, 0, 0, (unsigned char *) macros->macros, length, 1000);
+
+    return ret == length;
 }
 
 void
@@ -452,7 +611,7 @@ bl_usb_get_mode(int mode) {
     int ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
                                       0x3, 0, 0, rcv_buf, 1, 1000);
     if (ret != 0) {
-        bl_tui_err(FALSE, "libusb error: %s (%d)\n", libusb_strerror((enum libusb_error) ret), ret);
+        bl_err(FALSE, "libusb error: %s (%d)\n", libusb_strerror((enum libusb_error) ret), ret);
         return -1;
     } else {
         return rcv_buf[0];
@@ -470,9 +629,359 @@ bl_usb_set_numlock(int is_on) {
     int ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
                                       LIBUSB_RECIPIENT_INTERFACE, 0x9,  0x201, 0, ctrl_buf, 2, 1000);
     if (ret != 0) {
-        bl_tui_err(FALSE, "libusb error: %s (%d)\n", libusb_strerror((enum libusb_error) ret), ret);
+        bl_err(FALSE, "libusb error: %s (%d)\n", libusb_strerror((enum libusb_error) ret), ret);
         return -1;
     } else {
         return 0;
     }
 }
+
+/*
+ * The control transfers used to read the controller state
+ */
+static const struct {
+    int what;
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t length;
+} _bl_usb_state_requests[] = {
+    { BL_CTRL_LAYOUT, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_READ_LAYOUT, 2048 },
+    { BL_CTRL_MACROS, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_READ_MACROS, NUM_MACROKEYS * LEN_MACRO },
+    { BL_CTRL_PWM, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_READ_BR, 8 },
+    { BL_CTRL_DEBOUNCE, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_READ_DEBOUNCE, 8 },
+    { BL_CTRL_VERSION, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_READ_VERSION, 8 }
+};
+#define BL_USB_STATE_REQUESTS (sizeof(_bl_usb_state_requests) / sizeof(_bl_usb_state_requests[0]))
+
+/*
+ * Bookkeeping for bl_usb_read_state(), shared by all its transfers
+ */
+typedef struct bl_usb_state_read_t {
+    bl_ctrl_state_t *state;
+    bl_usb_state_cb_t arrived;
+    void *data;
+    int pending;
+    int ok_mask;
+} bl_usb_state_read_t;
+
+/*
+ * User data of a single transfer
+ */
+typedef struct bl_usb_state_request_t {
+    bl_usb_state_read_t *read;
+    int what;
+} bl_usb_state_request_t;
+
+/*
+ * Copy the data of a finished transfer into the state, returns FALSE if
+ * the data is not valid.
+ */
+static int
+bl_usb_state_parse(bl_ctrl_state_t *state, int what, uint8_t *buffer, int length) {
+    switch (what) {
+        case BL_CTRL_LAYOUT: {
+            int nlayers = buffer[0];
+            if (nlayers < 1 || nlayers > NUMLAYERS_MAX || length < 2 + 2 * nlayers * NUMKEYS) {
+                return FALSE;
+            }
+            state->layout.nlayers = nlayers;
+            for (int layer=0; layer<nlayers; layer++) {
+                for (int row=0; row<NUMROWS; row++) {
+                    for (int col=0; col<NUMCOLS; col++) {
+                        int n = 2 + 2 * (layer * NUMROWS * NUMCOLS + row * NUMCOLS + col);
+                        state->layout.matrix[layer][row][col] = buffer[n] | (buffer[n+1] << 8);
+                    }
+                }
+            }
+            return TRUE;
+        }
+        case BL_CTRL_MACROS: {
+            int zeros = 0;
+            int ones = 0;
+            for (int i=0; i<length; i++) {
+                zeros += buffer[i] == 0;
+                ones += buffer[i] == 255;
+            }
+            if (length != NUM_MACROKEYS * LEN_MACRO || zeros == length || ones == length) {
+                // bad EEPROM value
+                return FALSE;
+            }
+            state->macros.nmacros = NUM_MACROKEYS;
+            memcpy(state->macros.macros, buffer, length);
+            return TRUE;
+        }
+        case BL_CTRL_PWM:
+            state->pwm_usb = buffer[0];
+            state->pwm_bt = buffer[1];
+            return length >= 2;
+        case BL_CTRL_DEBOUNCE:
+            state->debounce = buffer[0];
+            return length >= 1;
+        case BL_CTRL_VERSION:
+            state->major = buffer[0];
+            state->minor = buffer[1];
+            return length >= 2;
+        default:
+            return FALSE;
+    }
+}
+
+static void LIBUSB_CALL
+bl_usb_state_transfer_done(struct libusb_transfer *transfer) {
+    bl_usb_state_request_t *request = (bl_usb_state_request_t *) transfer->user_data;
+    bl_usb_state_read_t *read = request->read;
+    int what = request->what;
+    int ok = transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        bl_usb_state_parse(read->state, what, libusb_control_transfer_get_data(transfer),
+                           transfer->actual_length);
+
+    if (ok) {
+        read->ok_mask |= what;
+    }
+    if (read->arrived != NULL) {
+        read->arrived(read->state, what, ok, read->data);
+    }
+    read->pending--;
+}
+
+/*
+ * Handle events until none of the transfers is pending. If handling the
+ * events fails the transfers still in flight are cancelled, their callbacks
+ * run with a failed status before this returns, so the transfers (and the
+ * user data on the caller's stack) can be released afterwards.
+ */
+static void
+bl_usb_state_drain(struct libusb_transfer **transfers, int n, int *pending) {
+    int cancelled = FALSE;
+
+    while (*pending > 0) {
+        int ret = libusb_handle_events(NULL);
+        if (ret == 0 || ret == LIBUSB_ERROR_INTERRUPTED || cancelled) {
+            continue;
+        }
+        for (int i=0; i<n; i++) {
+            if (transfers[i] != NULL) {
+                // finished transfers return LIBUSB_ERROR_NOT_FOUND
+                libusb_cancel_transfer(transfers[i]);
+            }
+        }
+        cancelled = TRUE;
+    }
+}
+
+/**
+ * Read the parts of the controller state given by what. All control
+ * transfers are submitted at once, so the controller can answer them back
+ * to back, and every part is handed to arrived as soon as it is read.
+ * Returns when all transfers are finished.
+ *
+ * @param state State to fill in
+ * @param what Bitmask of BL_CTRL_* values
+ * @param arrived Called for every part that was read, may be NULL. It
+ *                is called from the thread that called this function.
+ * @param data Passed to arrived
+ *
+ * @return Bitmask of the parts that were read successfully, errno is
+ * ENOMEM if a part failed because memory ran out
+ */
+int
+bl_usb_read_state(bl_ctrl_state_t *state, int what, bl_usb_state_cb_t arrived, void *data) {
+    bl_usb_state_read_t read = { state, arrived, data, 0, 0 };
+    bl_usb_state_request_t requests[BL_USB_STATE_REQUESTS];
+    struct libusb_transfer *transfers[BL_USB_STATE_REQUESTS] = { NULL };
+
+    for (int i=0; i<BL_USB_STATE_REQUESTS; i++) {
+        if (!(what & _bl_usb_state_requests[i].what)) {
+            continue;
+        }
+        uint16_t length = _bl_usb_state_requests[i].length;
+        uint8_t *buffer = (uint8_t *) calloc(1, LIBUSB_CONTROL_SETUP_SIZE + length);
+        transfers[i] = libusb_alloc_transfer(0);
+        if (buffer == NULL || transfers[i] == NULL) {
+            free(buffer);
+            libusb_free_transfer(transfers[i]);
+            transfers[i] = NULL;
+            if (arrived != NULL) {
+                arrived(state, _bl_usb_state_requests[i].what, FALSE, data);
+            }
+            errno = ENOMEM;
+            continue;
+        }
+        libusb_fill_control_setup(buffer, _bl_usb_state_requests[i].request_type,
+                                  _bl_usb_state_requests[i].request, 0, 0, length);
+        requests[i].read = &read;
+        requests[i].what = _bl_usb_state_requests[i].what;
+        libusb_fill_control_transfer(transfers[i], handle, buffer, bl_usb_state_transfer_done,
+                                     &requests[i], BL_USB_TIMEOUT);
+        transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        if (libusb_submit_transfer(transfers[i]) == 0) {
+            read.pending++;
+        } else {
+            if (arrived != NULL) {
+                arrived(state, _bl_usb_state_requests[i].what, FALSE, data);
+            }
+            libusb_free_transfer(transfers[i]);
+            transfers[i] = NULL;
+        }
+    }
+
+    bl_usb_state_drain(transfers, BL_USB_STATE_REQUESTS, &read.pending);
+
+    for (int i=0; i<BL_USB_STATE_REQUESTS; i++) {
+        if (transfers[i] != NULL) {
+            libusb_free_transfer(transfers[i]);
+        }
+    }
+
+    return read.ok_mask;
+}
+
+/*
+ * The control transfers used to write the controller state
+ */
+static const struct {
+    int what;
+    uint8_t request_type;
+    uint8_t request;
+} _bl_usb_state_writes[] = {
+    { BL_CTRL_LAYOUT, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_WRITE_LAYOUT },
+    { BL_CTRL_MACROS, LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_WRITE_MACROS },
+    { BL_CTRL_PWM, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_WRITE_BR },
+    { BL_CTRL_DEBOUNCE, LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+      USB_WRITE_DEBOUNCE }
+};
+#define BL_USB_STATE_WRITES (sizeof(_bl_usb_state_writes) / sizeof(_bl_usb_state_writes[0]))
+
+/*
+ * Fill in the data of a write transfer in the same format as the single
+ * write functions, returns the length or 0 if the part is not valid.
+ */
+static int
+bl_usb_state_format(bl_ctrl_state_t *state, int what, uint8_t *buffer) {
+    switch (what) {
+        case BL_CTRL_LAYOUT: {
+            int nlayers = state->layout.nlayers;
+            if (nlayers < NUMLAYERS_MIN || nlayers > NUMLAYERS_MAX) {
+                return 0;
+            }
+            buffer[0] = nlayers;
+            for (int layer=0; layer<nlayers; layer++) {
+                for (int row=0; row<NUMROWS; row++) {
+                    for (int col=0; col<NUMCOLS; col++) {
+                        int n = 1 + 2 * (layer * NUMROWS * NUMCOLS + row * NUMCOLS + col);
+                        buffer[n] = state->layout.matrix[layer][row][col] & 0xff;
+                        buffer[n+1] = state->layout.matrix[layer][row][col] >> 8;
+                    }
+                }
+            }
+            return 1 + 2 * nlayers * NUMKEYS;
+        }
+        case BL_CTRL_MACROS:
+            memcpy(buffer, state->macros.macros, NUM_MACROKEYS * LEN_MACRO);
+            return NUM_MACROKEYS * LEN_MACRO;
+        case BL_CTRL_PWM:
+            buffer[0] = state->pwm_usb;
+            buffer[1] = state->pwm_bt;
+            return 8;
+        case BL_CTRL_DEBOUNCE:
+            buffer[0] = state->debounce;
+            return state->debounce < 1 ? 0 : 8;
+        default:
+            return 0;
+    }
+}
+
+static void LIBUSB_CALL
+bl_usb_state_write_done(struct libusb_transfer *transfer) {
+    bl_usb_state_request_t *request = (bl_usb_state_request_t *) transfer->user_data;
+    bl_usb_state_read_t *write = request->read;
+    int ok = transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        transfer->actual_length == transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+
+    if (ok) {
+        write->ok_mask |= request->what;
+    }
+    if (write->arrived != NULL) {
+        write->arrived(write->state, request->what, ok, write->data);
+    }
+    write->pending--;
+}
+
+/**
+ * Write the parts of the controller state given by what, the counterpart
+ * of bl_usb_read_state(). All control transfers are submitted at once and
+ * the function returns when they are finished. The version can't be
+ * written and is ignored.
+ *
+ * @param state State to write
+ * @param what Bitmask of BL_CTRL_* values
+ * @param written Called for every part that was written, may be NULL
+ * @param data Passed to written
+ *
+ * @return Bitmask of the parts that were written successfully, errno is
+ * ENOMEM if a part failed because memory ran out
+ */
+int
+bl_usb_write_state(bl_ctrl_state_t *state, int what, bl_usb_state_cb_t written, void *data) {
+    bl_usb_state_read_t write = { state, written, data, 0, 0 };
+    bl_usb_state_request_t requests[BL_USB_STATE_WRITES];
+    struct libusb_transfer *transfers[BL_USB_STATE_WRITES] = { NULL };
+
+    for (int i=0; i<BL_USB_STATE_WRITES; i++) {
+        if (!(what & _bl_usb_state_writes[i].what)) {
+            continue;
+        }
+        uint8_t *buffer = (uint8_t *) calloc(1, LIBUSB_CONTROL_SETUP_SIZE + 2048);
+        transfers[i] = libusb_alloc_transfer(0);
+        if (buffer == NULL || transfers[i] == NULL) {
+            free(buffer);
+            libusb_free_transfer(transfers[i]);
+            transfers[i] = NULL;
+            if (written != NULL) {
+                written(state, _bl_usb_state_writes[i].what, FALSE, data);
+            }
+            errno = ENOMEM;
+            continue;
+        }
+        int length = bl_usb_state_format(state, _bl_usb_state_writes[i].what,
+                                         buffer + LIBUSB_CONTROL_SETUP_SIZE);
+        libusb_fill_control_setup(buffer, _bl_usb_state_writes[i].request_type,
+                                  _bl_usb_state_writes[i].request, 0, 0, length);
+        requests[i].read = &write;
+        requests[i].what = _bl_usb_state_writes[i].what;
+        libusb_fill_control_transfer(transfers[i], handle, buffer, bl_usb_state_write_done,
+                                     &requests[i], BL_USB_TIMEOUT);
+        transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        if (length > 0 && libusb_submit_transfer(transfers[i]) == 0) {
+            write.pending++;
+        } else {
+            if (written != NULL) {
+                written(state, _bl_usb_state_writes[i].what, FALSE, data);
+            }
+            libusb_free_transfer(transfers[i]);
+            transfers[i] = NULL;
+        }
+    }
+
+    /*
+     * Cancelled parts are reported as failed by bl_usb_state_write_done(),
+     * the controller may hold some of them partly written
+     */
+    bl_usb_state_drain(transfers, BL_USB_STATE_WRITES, &write.pending);
+
+    for (int i=0; i<BL_USB_STATE_WRITES; i++) {
+        if (transfers[i] != NULL) {
+            libusb_free_transfer(transfers[i]);
+        }
+    }
+
+    return write.ok_mask;
+}
@@ -27,27 +27,44 @@
  * SUCH DAMAGE. *
  */
 
-#include "layout.h"
-
 #ifndef __USB_H__
 #define __USB_H__ 1
 
-typedef uint16_t bl_matrix_t[NUMLAYERS_MAX][NUMROWS][NUMCOLS];
+#include <stdio.h>
 
-typedef struct bl_layout_t {
-    int nlayers;
-    bl_matrix_t matrix;
-} bl_layout_t;
+#include "layout.h"
+#include "libblusb.h"
 
-typedef uint8_t bl_macro_keylist_t[NUM_MACROKEYS][LEN_MACRO];
+/*
+ * Binary layout files, see bl_layout_parse_binary()
+ */
+#define BL_LAYOUT_BINARY_MAGIC "BLLY"
+#define BL_LAYOUT_BINARY_VERSION 1
 
-typedef struct bl_macro_t {
-    int nmacros;
-    bl_macro_keylist_t macros;
-} bl_macro_t;
+/*
+ * Layout files larger than this are not read completely
+ */
+#define BL_LAYOUT_FILE_MAX (1024 * 1024)
+
+/*
+ * Called by bl_usb_read_state() for every part that was read, what is one
+ * of the BL_CTRL_* values and ok is FALSE if the read failed. Also used by
+ * bl_usb_write_state() for every part that was written.
+ */
+typedef void (*bl_usb_state_cb_t)(bl_ctrl_state_t *state, int what, int ok, void *data);
 
 int bl_usb_openctrl();
 void bl_usb_closectrl();
+
+/*
+ * Open a controller connection and execute the statement
+ */
+#define BL_EXEC(stmt) {\
+    if (bl_usb_openctrl()) {\
+        stmt;\
+        bl_usb_closectrl();\
+    }\
+}
 void bl_usb_enable_service_mode();
 void bl_usb_enable_service_mode_safe();
 void bl_usb_disable_service_mode();
@@ -57,25 +74,28 @@ int bl_usb_write_layout(uint8_t *, int);
 void bl_usb_raw_print_layout(uint16_t *, int, FILE *);
 void bl_usb_print_layout(uint8_t *, int);
 
-void bl_usb_read_version(int *, int *);
+int bl_usb_read_version(int *, int *);
 
-void bl_usb_pwm_read(uint8_t *, uint8_t *);
-void bl_usb_pwm_write(uint8_t, uint8_t);
+int bl_usb_pwm_read(uint8_t *, uint8_t *);
+int bl_usb_pwm_write(uint8_t, uint8_t);
 
-uint8_t bl_usb_debounce_read();
-void bl_usb_debounce_write(uint8_t debounce);
+int bl_usb_debounce_read(uint8_t *debounce);
+int bl_usb_debounce_write(uint8_t debounce);
 
 bl_macro_t* bl_usb_macro_read();
-void bl_usb_macro_write(bl_macro_t *macros);
+int bl_usb_macro_write(bl_macro_t *macros);
 void bl_usb_macro_print(bl_macro_t *bm);
 void bl_usb_set_mode(int mode);
 int bl_usb_get_mode();
 int bl_usb_set_numlock(int is_on);
+int bl_usb_read_state(bl_ctrl_state_t *state, int what, bl_usb_state_cb_t arrived, void *data);
+int bl_usb_write_state(bl_ctrl_state_t *state, int what, bl_usb_state_cb_t written, void *data);
 
 /*
  * Macros
  */
 bl_macro_t *bl_macro_parse(char *fname);
+int bl_macro_blank(uint8_t *data, int length);
 
 /*
  * Layout
@@ -83,13 +103,27 @@ bl_macro_t *bl_macro_parse(char *fname);
 void bl_layout_configure(bl_layout_t *);
 int bl_layout_write(bl_layout_t *);
 int bl_layout_write_from_file(char *);
+int bl_layout_verify(bl_layout_t *);
+int bl_layout_check(bl_layout_t *, char *, int);
+int bl_layout_equal(bl_layout_t *, bl_layout_t *);
 void bl_layout_print(bl_layout_t *);
 int bl_layout_save(bl_layout_t *, char *);
 uint8_t *bl_layout_convert(bl_layout_t *);
 bl_layout_t *bl_layout_load_file(char *);
+bl_layout_t *bl_layout_parse_file(char *, char *, int);
+bl_layout_t *bl_layout_parse_binary(char *, char *, int);
+bl_layout_t *bl_layout_parse_json(char *, char *, int);
+int bl_layout_save_binary(bl_layout_t *, char *);
+int bl_layout_save_json(bl_layout_t *, char *);
 bl_layout_t *bl_layout_create(int);
 void bl_layout_destroy(bl_layout_t *);
 void bl_layout_init_layout(bl_layout_t *);
+int bl_layout_copy_layer(bl_layout_t *, int, int);
+int bl_layout_swap_layers(bl_layout_t *, int, int);
+int bl_layout_fill_layer(bl_layout_t *, int, uint16_t);
+int bl_layout_copy_block(bl_layout_t *, int, int, int, int, int, int, int, int);
+int bl_layout_remap(bl_layout_t *, int, uint16_t, uint16_t, int *);
+int bl_layout_edit(bl_layout_t *, char **, int, char *, int);
 
 
 #endif /* __USB_H__ */